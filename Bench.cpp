@@ -0,0 +1,671 @@
+///////////////////////////////////////////////////////////////////////////
+//
+// NAME
+//  Bench.cpp -- micro-benchmarks of the ImageLib and pipeline kernels
+//
+// SYNOPSIS
+//  Bench [options] [name ...]
+//  Bench --scaling dir [scaling options]
+//
+// OPTIONS
+//  --size WxH          size of the synthetic images (default 1024x768)
+//  --time seconds      minimum time spent on each benchmark (default 0.5)
+//  --json file         save the results as JSON
+//  --baseline file     compare the results with ones saved by --json
+//  --tolerance percent slow-down that counts as a regression (default 10)
+//  --list              list the benchmarks and exit
+//  --isa name          use the SIMD kernels of at most the given instruction
+//                      set (scalar, sse2, ssse3, sse4.1, avx2 or avx512;
+//                      also taken from PANORAMA_ISA), to compare them
+//  --threads n         threads of the kernels' parallel loops (default 1,
+//                      so that the figures are for one core)
+//
+// SCALING OPTIONS
+//  --frames n,...      numbers of frames (default 2,8,32)
+//  --megapixels mp,... frame sizes in millions of pixels (default 1,4)
+//  --threads n,...     thread pool sizes (default 1 and one per processor;
+//                      the micro-benchmarks use the first)
+//  --csv file          write the results to file (default standard output)
+//  --keep              keep the generated data sets
+//
+// DESCRIPTION
+//  Each benchmark runs one kernel on synthetic images (a deterministic
+//  mix of gradients and noise, RGBA unless noted) over and over until the
+//  minimum time has passed, after one untimed warm-up run.  The report
+//  gives the best and median time of a single run and the throughput of
+//  the best run in millions of pixels (or, for countInliers, matches, and
+//  for MatchFeatures, descriptor pairs) per second.  The instruction set
+//  the SIMD kernels use and the number of threads their parallel loops
+//  run on are printed first (see CpuFeatures.h and ThreadPool.h).  Only the
+//  benchmarks whose names contain one of the given names are run, e.g.,
+//  "Bench WarpLocal Convolve".
+//
+//  With --baseline, each result is also printed as a change from the
+//  saved one, and Bench returns 1 if any benchmark is slower than its
+//  baseline by more than the tolerance, so it can gate a build.  The
+//  baseline should come from the same machine and --size.
+//
+//  With --scaling, Bench instead times the complete stitch (reading,
+//  warping, aligning and blending, as the stitch command runs it) over a
+//  sweep of data sets:  for each number of frames and frame size it
+//  writes a synthetic data set (see Synth.h) of 4:3 frames, half
+//  overlapping, in a directory of its own under dir, stitches it once for
+//  each thread pool size (throwing the mosaic away rather than writing
+//  it), and deletes it again.  The warp field cache is emptied before
+//  each run, so that every run starts cold.  Each run is one CSV row
+//  holding the wall time, the throughput in input megapixels per second,
+//  the high-water mark of the image memory (see Profile.h), the speed-up
+//  and parallel efficiency relative to the same data set with the fewest
+//  threads, and the time of each profiled stage (summed over the
+//  threads).  Data sets that can't be generated or stitched (e.g., out of
+//  memory) are reported and skipped.  A sweep up to 1000 frames or 50
+//  megapixels needs as much disk for the frames and as much memory for
+//  the warped images as those sizes imply.
+//
+//  The benchmarks call the student routines (countInliers,
+//  AccumulateBlend, WarpSphericalField) as they stand, so their figures
+//  are only meaningful once those have been filled in.
+//
+// SEE ALSO
+//  Makefile            "make bench" builds this program
+//  Profile.h           per-stage timing of complete runs (--profile)
+//  Synth.h             the synthetic data sets of the scaling runs
+//
+///////////////////////////////////////////////////////////////////////////
+
+#include "ImageLib/ImageLib.h"
+#include "WarpSpherical.h"
+#include "FeatureAlign.h"
+#include "BlendImages.h"
+#include "Stitch.h"
+#include "Synth.h"
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+#include <algorithm>
+#include <chrono>
+#include <functional>
+#include <map>
+#include <string>
+#include <thread>
+#include <vector>
+
+#ifdef WIN32
+#include <direct.h>
+#define MakeDir(dir)    _mkdir(dir)
+#else
+#include <sys/stat.h>
+#define MakeDir(dir)    mkdir(dir, 0777)
+#endif
+
+using namespace std;
+
+struct CBenchmark
+{
+    string name;                // e.g., "WarpLocal/linear"
+    const char *units;          // what is counted ("pix" or "match")
+    double count;               // units processed by one run
+    function<void()> run;       // one run of the kernel
+};
+
+struct CBenchResult
+{
+    double bestMs, medianMs;    // time of one run
+    double throughput;          // millions of units per second (best run)
+};
+
+static double Seconds(void)
+{
+    return chrono::duration<double>(
+        chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+static CBenchResult Time(const CBenchmark &b, double minTime)
+{
+    // Warm up (caches, lookup tables, lazily allocated outputs), then
+    //  run until the minimum time has passed (and at least three times)
+    b.run();
+    vector<double> times;
+    double start = Seconds();
+    while (times.size() < 3 || Seconds() - start < minTime)
+    {
+        double t0 = Seconds();
+        b.run();
+        times.push_back(Seconds() - t0);
+    }
+    sort(times.begin(), times.end());
+    CBenchResult r;
+    r.bestMs     = times[0] * 1e3;
+    r.medianMs   = times[times.size()/2] * 1e3;
+    r.throughput = b.count / max(times[0], 1e-9) * 1e-6;
+    return r;
+}
+
+//
+//  Synthetic inputs
+//
+
+static CByteImage SyntheticImage(int width, int height, int nBands)
+{
+    // Gradients plus a little noise, the same on every run
+    CByteImage img(CShape(width, height, nBands));
+    unsigned int seed = 12345;
+    for (int y = 0; y < height; y++)
+    {
+        uchar *p = &img.Pixel(0, y, 0);
+        for (int x = 0; x < width; x++, p += nBands)
+        {
+            seed = seed * 1103515245 + 12345;
+            int noise = (seed >> 16) & 31;
+            for (int b = 0; b < nBands; b++)
+                p[b] = (uchar) ((x * (b+1) + y * (3-b) + noise) & 255);
+            if (nBands == 4)
+                p[3] = 255;
+        }
+    }
+    return img;
+}
+
+static CFloatImage RotationField(CShape sh, float degrees)
+{
+    // Absolute source coordinates of a slight rotation about the centre
+    CFloatImage uv(CShape(sh.width, sh.height, 2));
+    float c = (float) cos(degrees * M_PI / 180), s = (float) sin(degrees * M_PI / 180);
+    float cx = 0.5f * sh.width, cy = 0.5f * sh.height;
+    for (int y = 0; y < sh.height; y++)
+    {
+        float *p = &uv.Pixel(0, y, 0);
+        for (int x = 0; x < sh.width; x++, p += 2)
+        {
+            p[0] = cx + c * (x - cx) - s * (y - cy);
+            p[1] = cy + s * (x - cx) + c * (y - cy);
+        }
+    }
+    return uv;
+}
+
+static void SyntheticMatches(int n, FeatureSet &f1, FeatureSet &f2,
+                             vector<FeatureMatch> &matches)
+{
+    // Features displaced by a translation, a fifth of the matches outliers
+    unsigned int seed = 54321;
+    f1.resize(n), f2.resize(n), matches.resize(n);
+    for (int i = 0; i < n; i++)
+    {
+        seed = seed * 1103515245 + 12345;
+        f1[i].id = f2[i].id = i+1;
+        f1[i].x = (seed >> 8) % 1000;
+        f1[i].y = (seed >> 18) % 1000;
+        f2[i].x = f1[i].x + ((i % 5) ? 40 : (int) (seed % 97));
+        f2[i].y = f1[i].y + ((i % 5) ? -3 : (int) (seed % 89));
+        matches[i].id1 = matches[i].id2 = i+1;
+        matches[i].score = 0;
+    }
+}
+
+static void SyntheticDescriptors(int n, int dim, unsigned int seed, FeatureSet &f)
+{
+    // Random descriptors (for MatchFeatures)
+    f.resize(n);
+    for (int i = 0; i < n; i++)
+    {
+        f[i].id = i+1;
+        f[i].data.resize(dim);
+        for (int k = 0; k < dim; k++)
+        {
+            seed = seed * 1103515245 + 12345;
+            f[i].data[k] = ((seed >> 8) & 1023) / 1024.0;
+        }
+    }
+}
+
+//
+//  The benchmarks
+//
+
+static vector<CBenchmark> Benchmarks(int width, int height)
+{
+    static CByteImage src, dst, byteDst, fileImg;
+    static CFloatImage uv, floatDst, acc;
+    static FeatureSet f1, f2, g1, g2;
+    static vector<FeatureMatch> matches, descriptorMatches;
+    static vector<int> inliers;
+    src = SyntheticImage(width, height, 4);
+    uv  = RotationField(src.Shape(), 3.0f);
+    SyntheticMatches(10000, f1, f2, matches);
+    SyntheticDescriptors(1000, 64, 1, g1);
+    SyntheticDescriptors(1000, 64, 2, g2);
+
+    CShape sh = src.Shape();
+    double nPix = (double) width * height;
+    CTransform3x3 M = CTransform3x3::Translation(0.5f * width, 0.5f * height) *
+                      CTransform3x3::Rotation(3.0f) *
+                      CTransform3x3::Translation(-0.5f * width, -0.5f * height);
+    static const char *interpNames[] = {"nearest", "linear", "cubic"};
+    static const EWarpInterpolationMode interps[] =
+        {eWarpInterpNearest, eWarpInterpLinear, eWarpInterpCubic};
+
+    vector<CBenchmark> b;
+    for (int k = 0; k < 3; k++)
+    {
+        EWarpInterpolationMode interp = interps[k];
+        b.push_back({string("WarpLocal/") + interpNames[k], "pix", nPix,
+                     [=]() { WarpLocal(src, dst, uv, false, interp); }});
+    }
+    for (int k = 0; k < 3; k++)
+    {
+        EWarpInterpolationMode interp = interps[k];
+        b.push_back({string("WarpGlobal/") + interpNames[k], "pix", nPix,
+                     [=]() { dst.ReAllocate(sh); WarpGlobal(src, dst, M, interp); }});
+    }
+    CTransform3x3 H = M;        // (the same rotation, with a perspective tilt)
+    H[2][0] = 0.2 / width;
+    H[2][1] = 0.1 / height;
+    b.push_back({"WarpGlobal/homography", "pix", nPix,
+                 [=]() { dst.ReAllocate(sh); WarpGlobal(src, dst, H, eWarpInterpLinear); }});
+    CTransform3x3 Q = M;        // (the same rotation, shrunk to a quarter)
+    for (int i = 0; i < 2; i++)
+        for (int j = 0; j < 2; j++)
+            Q[i][j] *= 4.0;
+    CShape shQ(width / 4, height / 4, sh.nBands);
+    b.push_back({"WarpGlobal/quarter-linear", "pix", nPix / 16,
+                 [=]() { dst.ReAllocate(shQ); WarpGlobal(src, dst, Q, eWarpInterpLinear); }});
+    b.push_back({"WarpGlobal/quarter-trilinear", "pix", nPix / 16,
+                 [=]() { dst.ReAllocate(shQ); WarpGlobal(src, dst, Q, eWarpInterpTrilinear); }});
+    b.push_back({"WarpSphericalField", "pix", nPix, [=]()
+        { WarpSphericalField(sh, sh, 0.8f * width, -0.1f, 0.01f, CTransform3x3()); }});
+    b.push_back({"Convolve/7x7", "pix", nPix,
+                 [=]() { Convolve(src, dst, ConvolveKernel_7x7); }});
+    b.push_back({"ConvolveSeparable/14641", "pix", nPix, [=]()
+        { ConvolveSeparable(src, dst, ConvolveKernel_14641, ConvolveKernel_14641, 1); }});
+    b.push_back({"ConvolveSeparable/decimate", "pix", nPix, [=]()
+        { ConvolveSeparable(src, dst, ConvolveKernel_14641, ConvolveKernel_14641, 2); }});
+    b.push_back({"Pyramid/build", "pix", nPix,
+                 [=]() { CBytePyramid p(src); p[5]; }});
+    b.push_back({"ScaleAndOffset/byte-float", "pix", nPix,
+                 [=]() { ScaleAndOffset(src, floatDst, 1.0f / 255, 0.0f); }});
+    b.push_back({"ScaleAndOffset/float-byte", "pix", nPix,
+                 [=]() { ScaleAndOffset(floatDst, byteDst, 255.0f, 0.0f); }});
+    b.push_back({"WriteFileTGA", "pix", nPix,
+                 [=]() { WriteFile(src, "Bench.tmp.tga"); }});
+    b.push_back({"ReadFileTGA", "pix", nPix,
+                 [=]() { fileImg = CByteImage(); ReadFile(fileImg, "Bench.tmp.tga"); }});
+    b.push_back({"countInliers", "match", (double) matches.size(), [=]()
+        { countInliers(f1, f2, matches, eTranslate, 0.0f,
+                       CTransform3x3::Translation(40, -3), 2.0, inliers); }});
+    b.push_back({"MatchFeatures", "match", (double) g1.size() * g2.size(),
+                 [=]() { MatchFeatures(g1, g2, descriptorMatches); }});
+    b.push_back({"AccumulateBlend", "pix", nPix, [=]()
+        {
+            acc.ReAllocate(CShape(width + width/2, height, 4));
+            acc.ClearPixels();
+            AccumulateBlend(src, acc, CTransform3x3::Translation(0.25f * width, 0), 50.0f);
+        }});
+    return b;
+}
+
+//
+//  End-to-end scaling runs
+//
+
+class CNullSink : public CImageSink
+{
+    // Throws the mosaic away, so that the runs time the pipeline, not the disk
+public:
+    void Begin(CShape sh) {}
+    void Write(CImage& region, int x, int y) {}
+    void End(void) {}
+};
+
+struct CScalingRun
+{
+    int nFrames;
+    double megapixels;              // of one frame
+    int width, height;
+    int nThreads;                   // threads in the pool
+    double wallSeconds;
+    double stageSeconds[eProfNumStages];    // summed over the threads
+    long long peakBytes;            // image memory high-water mark
+};
+
+static vector<double> ParseList(const char *option, const char *text)
+{
+    // Comma-separated positive numbers, e.g., "2,8,32"
+    vector<double> values;
+    const char *p = text;
+    while (true)
+    {
+        char *end;
+        double v = strtod(p, &end);
+        if (end == p || v <= 0 || (*end != ',' && *end != 0))
+            throw CError("Bench: bad %s list %s", option, text);
+        values.push_back(v);
+        if (*end == 0)
+            break;
+        p = end + 1;
+    }
+    sort(values.begin(), values.end());
+    return values;
+}
+
+static CSynthParams ScalingDataSet(int nFrames, double megapixels)
+{
+    // 4:3 frames of the given size, half overlapping, with a lens no wider
+    //  than 60 degrees and narrow enough for all the frames to fit once
+    //  around the panorama
+    CSynthParams p;
+    p.nFrames = nFrames;
+    p.width   = (int) (sqrt(megapixels * 1e6 * 4 / 3) + 0.5);
+    p.height  = (3 * p.width + 2) / 4;
+    double fov = min(M_PI / 3, 0.9 * 2 * M_PI / (1 + (nFrames - 1) * (1 - p.overlap)));
+    p.f = (float) (0.5 * p.width / tan(0.5 * fov));
+    return p;
+}
+
+static vector<CStitchImage> ReadImageList(const string &filename)
+{
+    // The image list written by Synthesize (see StitchImages in Project2)
+    FILE *stream = fopen(filename.c_str(), "r");
+    if (stream == 0)
+        throw CError("Bench: could not read %s", filename.c_str());
+    vector<CStitchImage> images;
+    char line[1024], name[3][1024];
+    while (fgets(line, sizeof(line), stream))
+    {
+        int n = sscanf(line, "%s %s %s", name[0], name[1], name[2]);
+        if (n < 2)
+            continue;
+        CStitchImage in;
+        in.imageFile = name[0], in.featureFile = name[1];
+        if (n > 2)
+            in.matchFile = name[2];
+        images.push_back(in);
+    }
+    fclose(stream);
+    return images;
+}
+
+static CScalingRun StitchRun(const vector<CStitchImage> &images,
+                             const CSynthParams &p, double megapixels, int nThreads)
+{
+    CStitchParams params;
+    params.f = p.f, params.k1 = p.k1, params.k2 = p.k2;
+    params.v1 = params.v2 = 0.0f;
+    params.cropWarps    = false;
+    params.nRANSAC      = 200;
+    params.RANSACthresh = 2;
+    params.blendWidth   = (float) (int) (0.25 * p.width * p.overlap) + 1;  // as in script.cmd
+    params.sift         = false;
+    params.gainCompensation = false;
+    params.loadImage    = 0;
+
+    // Start cold (no warp field left in the cache by the previous run),
+    //  with the default cache limits
+    SetCacheLimits(0, 0);
+    SetCacheLimits((size_t) 256 << 20, 0);
+
+    CThreadPool pool(nThreads);
+    CNullSink sink;
+    ProfileReset();
+    MemoryResetPeak();
+    double start = Seconds();
+    Stitch(images, params, sink, pool);
+
+    CScalingRun r;
+    r.wallSeconds = Seconds() - start;
+    r.nFrames = p.nFrames, r.megapixels = megapixels;
+    r.width = p.width, r.height = p.height;
+    r.nThreads = nThreads;
+    for (int s = 0; s < eProfNumStages; s++)
+        r.stageSeconds[s] = ProfileStageTime((EProfileStage) s) * 1e-9;
+    r.peakBytes = MemoryStats().peak;
+    return r;
+}
+
+static void WriteCSVHeader(FILE *stream)
+{
+    fprintf(stream, "frames,megapixels,width,height,threads,wall_s,mpix_per_s,"
+            "peak_mb,speedup,efficiency");
+    for (int s = 0; s < eProfNumStages; s++)
+        fprintf(stream, ",%s_s", ProfileStageName((EProfileStage) s));
+    fprintf(stream, "\n");
+}
+
+static void WriteCSVRow(FILE *stream, const CScalingRun &r, const CScalingRun &base)
+{
+    // Speed-up and parallel efficiency relative to the run of the same
+    //  data set with the fewest threads
+    double speedup = base.wallSeconds / r.wallSeconds;
+    double efficiency = speedup * base.nThreads / r.nThreads;
+    double mpix = r.nFrames * (double) r.width * r.height * 1e-6;
+    fprintf(stream, "%d,%g,%d,%d,%d,%.4f,%.3f,%.1f,%.3f,%.3f", r.nFrames, r.megapixels,
+            r.width, r.height, r.nThreads, r.wallSeconds, mpix / r.wallSeconds,
+            r.peakBytes / 1048576.0, speedup, efficiency);
+    for (int s = 0; s < eProfNumStages; s++)
+        fprintf(stream, ",%.4f", r.stageSeconds[s]);
+    fprintf(stream, "\n");
+    fflush(stream);
+}
+
+static void ScalingRuns(const char *dir, const vector<double> &frames,
+                        const vector<double> &megapixels, const vector<double> &threads,
+                        FILE *csv, bool keep)
+{
+    ProfileEnable(true);
+    MakeDir(dir);
+    WriteCSVHeader(csv);
+    CThreadPool synthPool;
+    for (size_t i = 0; i < frames.size(); i++)
+    {
+        for (size_t j = 0; j < megapixels.size(); j++)
+        {
+            int nFrames = (int) frames[i];
+            CSynthParams p = ScalingDataSet(nFrames, megapixels[j]);
+            char name[64];
+            sprintf(name, "/frames%d_%gmp", nFrames, megapixels[j]);
+            string dataSet = dir + string(name);
+            fprintf(stderr, "%s: %d frames of %d x %d\n", dataSet.c_str(),
+                    nFrames, p.width, p.height);
+            try
+            {
+                Synthesize(dataSet.c_str(), p, synthPool);
+                vector<CStitchImage> images = ReadImageList(dataSet + "/images.txt");
+                vector<CScalingRun> runs;
+                for (size_t k = 0; k < threads.size(); k++)
+                {
+                    runs.push_back(StitchRun(images, p, megapixels[j], (int) threads[k]));
+                    const CScalingRun &r = runs.back();
+                    WriteCSVRow(csv, r, runs[0]);
+                    fprintf(stderr, "  %3d threads %10.3f s %10.1f MB\n", r.nThreads,
+                            r.wallSeconds, r.peakBytes / 1048576.0);
+                }
+            }
+            catch (CError &err)
+            {
+                fprintf(stderr, "  skipped: %s\n", err.message);
+            }
+            catch (bad_alloc &)
+            {
+                fprintf(stderr, "  skipped: out of memory\n");
+            }
+            if (! keep)
+                RemoveSynthesized(dataSet.c_str(), nFrames);
+        }
+    }
+}
+
+//
+//  Baselines
+//
+
+static void WriteJSON(const char *filename, int width, int height,
+                      const vector<CBenchmark> &b, const vector<CBenchResult> &r)
+{
+    FILE *stream = fopen(filename, "w");
+    if (stream == 0)
+        throw CError("Bench: could not write %s", filename);
+    fprintf(stream, "{\n  \"width\": %d,\n  \"height\": %d,\n  \"results\": {", width, height);
+    for (size_t i = 0; i < b.size(); i++)
+        fprintf(stream, "%s\n    \"%s\": {\"throughput\": %.3f, \"units\": \"%s\", "
+                "\"bestMs\": %.4f, \"medianMs\": %.4f}", i ? "," : "", b[i].name.c_str(),
+                r[i].throughput, b[i].units, r[i].bestMs, r[i].medianMs);
+    fprintf(stream, "\n  }\n}\n");
+    fclose(stream);
+}
+
+static map<string, double> ReadBaseline(const char *filename)
+{
+    // Pick the throughputs out of a file written by WriteJSON
+    FILE *stream = fopen(filename, "r");
+    if (stream == 0)
+        throw CError("Bench: could not read %s", filename);
+    map<string, double> baseline;
+    char line[1024], name[256];
+    double throughput;
+    while (fgets(line, sizeof(line), stream))
+        if (sscanf(line, " \"%255[^\"]\": {\"throughput\": %lf", name, &throughput) == 2)
+            baseline[name] = throughput;
+    fclose(stream);
+    return baseline;
+}
+
+int main(int argc, const char *argv[])
+{
+    try
+    {
+        int width = 1024, height = 768;
+        double minTime = 0.5, tolerance = 10;
+        const char *jsonFile = 0, *baselineFile = 0;
+        bool list = false;
+        vector<string> filters;
+        const char *scalingDir = 0, *csvFile = 0;
+        vector<double> frames(1, 2), megapixels(1, 1), threads(1, 1);
+        frames.push_back(8), frames.push_back(32), megapixels.push_back(4);
+        int nCores = (int) thread::hardware_concurrency();
+        if (nCores > 1)
+            threads.push_back(nCores);
+        bool keep = false;
+        const char *isa = getenv("PANORAMA_ISA");
+        for (int i = 1; i < argc; i++)
+        {
+            if (strcmp(argv[i], "--size") == 0 && i+1 < argc)
+            {
+                if (sscanf(argv[++i], "%dx%d", &width, &height) != 2 || width < 8 || height < 8)
+                    throw CError("Bench: bad size %s", argv[i]);
+            }
+            else if (strcmp(argv[i], "--time") == 0 && i+1 < argc)
+                minTime = atof(argv[++i]);
+            else if (strcmp(argv[i], "--json") == 0 && i+1 < argc)
+                jsonFile = argv[++i];
+            else if (strcmp(argv[i], "--baseline") == 0 && i+1 < argc)
+                baselineFile = argv[++i];
+            else if (strcmp(argv[i], "--tolerance") == 0 && i+1 < argc)
+                tolerance = atof(argv[++i]);
+            else if (strcmp(argv[i], "--list") == 0)
+                list = true;
+            else if (strcmp(argv[i], "--isa") == 0 && i+1 < argc)
+                isa = argv[++i];
+            else if (strcmp(argv[i], "--scaling") == 0 && i+1 < argc)
+                scalingDir = argv[++i];
+            else if (strcmp(argv[i], "--frames") == 0 && i+1 < argc)
+                frames = ParseList("frames", argv[++i]);
+            else if (strcmp(argv[i], "--megapixels") == 0 && i+1 < argc)
+                megapixels = ParseList("megapixels", argv[++i]);
+            else if (strcmp(argv[i], "--threads") == 0 && i+1 < argc)
+                threads = ParseList("threads", argv[++i]);
+            else if (strcmp(argv[i], "--csv") == 0 && i+1 < argc)
+                csvFile = argv[++i];
+            else if (strcmp(argv[i], "--keep") == 0)
+                keep = true;
+            else if (strncmp(argv[i], "--", 2) == 0)
+            {
+                printf("usage: %s [--size WxH] [--time seconds] [--json file]\n"
+                       "       [--baseline file] [--tolerance percent] [--list] [--isa name] [name ...]\n"
+                       "   or: %s --scaling dir [--frames n,...] [--megapixels mp,...]\n"
+                       "       [--threads n,...] [--csv file] [--keep]\n", argv[0], argv[0]);
+                return -1;
+            }
+            else
+                filters.push_back(argv[i]);
+        }
+
+        if (isa && *isa)
+        {
+            if (CpuISAFeatures(isa) < 0)
+                throw CError("Bench: unknown instruction set %s", isa);
+            CpuLimitFeatures(CpuISAFeatures(isa));
+        }
+
+        if (scalingDir)
+        {
+            FILE *csv = csvFile ? fopen(csvFile, "w") : stdout;
+            if (csv == 0)
+                throw CError("Bench: could not write %s", csvFile);
+            ScalingRuns(scalingDir, frames, megapixels, threads, csv, keep);
+            if (csvFile)
+                fclose(csv);
+            return 0;
+        }
+
+        // Select the benchmarks
+        SetParallelThreads((int) threads[0]);
+        vector<CBenchmark> all = Benchmarks(width, height), b;
+        for (size_t i = 0; i < all.size(); i++)
+        {
+            bool selected = filters.empty();
+            for (size_t j = 0; j < filters.size(); j++)
+                selected = selected || all[i].name.find(filters[j]) != string::npos;
+            if (selected)
+                b.push_back(all[i]);
+        }
+        if (list)
+        {
+            for (size_t i = 0; i < b.size(); i++)
+                printf("%s\n", b[i].name.c_str());
+            return 0;
+        }
+        map<string, double> baseline;
+        if (baselineFile)
+            baseline = ReadBaseline(baselineFile);
+
+        // Run them
+        printf("%d x %d, %s, %d thread%s\n", width, height, CpuISAName(CpuFeatures()),
+               ParallelThreads(), ParallelThreads() == 1 ? "" : "s");
+        printf("%-28s %10s %10s %12s", "benchmark", "best ms", "median ms", "M/s");
+        printf(baselineFile ? " %12s %8s\n" : "\n", "baseline", "change");
+        vector<CBenchResult> r;
+        int regressions = 0;
+        for (size_t i = 0; i < b.size(); i++)
+        {
+            r.push_back(Time(b[i], minTime));
+            printf("%-28s %10.3f %10.3f %8.1f %-5s", b[i].name.c_str(),
+                   r[i].bestMs, r[i].medianMs, r[i].throughput, b[i].units);
+            map<string, double>::iterator base = baseline.find(b[i].name);
+            if (base != baseline.end() && base->second > 0)
+            {
+                double change = 100 * (r[i].throughput / base->second - 1);
+                bool slower = change < -tolerance;
+                regressions += slower;
+                printf(" %8.1f %-5s %+7.1f%%%s", base->second, b[i].units, change,
+                       slower ? "  SLOWER" : "");
+            }
+            printf("\n");
+            fflush(stdout);
+        }
+        remove("Bench.tmp.tga");
+
+        if (jsonFile)
+            WriteJSON(jsonFile, width, height, b, r);
+        if (regressions)
+        {
+            printf("%d benchmark(s) slower than the baseline by more than %g%%\n",
+                   regressions, tolerance);
+            return 1;
+        }
+    }
+    catch (CError &err) {
+        fprintf(stderr, "%s\n", err.message);
+        return -1;
+    }
+    return 0;
+}
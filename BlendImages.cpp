@@ -127,8 +127,10 @@ void ImageBoundingBox(CImage &image, CTransform3x3 &M,
  *		the first 3 band of acc records the weighted sum of pixel colors
  *		the fourth band of acc records the sum of weight
  */
-static void AccumulateBlend(CByteImage& img, CFloatImage& acc, CTransform3x3 M, float blendWidth)
+void AccumulateBlend(CByteImage& img, CFloatImage& acc, CTransform3x3 M, float blendWidth,
+                     const float *gain, const CRowExtents *extents)
 {
+    CProfileScope scope(eProfAccumulateBlend);
 
 	
     /* Compute the bounding box of the image of the image */
@@ -137,8 +139,46 @@ static void AccumulateBlend(CByteImage& img, CFloatImage& acc, CTransform3x3 M,
 
     CTransform3x3 Minv = M.Inverse();
 
-    for (int y = bb_min_y; y <= bb_max_y; y++) {
-        for (int x = bb_min_x; x < bb_max_x; x++) {
+    /* Only visit the rows and columns that fall inside acc */
+    bb_min_x = MAX(bb_min_x, 0);
+    bb_min_y = MAX(bb_min_y, 0);
+    bb_max_x = MIN(bb_max_x, acc.Shape().width);
+    bb_max_y = MIN(bb_max_y, acc.Shape().height - 1);
+    if (bb_min_x < bb_max_x && bb_min_y <= bb_max_y)
+        ProfileCount(eProfBlendPixels,
+                     (long long) (bb_max_x - bb_min_x) * (bb_max_y - bb_min_y + 1));
+
+    /* The image's gains are applied as it is accumulated */
+    float g[3] = {1.0f, 1.0f, 1.0f};
+    if (gain != 0)
+        g[0] = gain[0], g[1] = gain[1], g[2] = gain[2];
+
+    /* With the spans of img's rows and a translation, a row of acc need
+       only visit the columns over the spans of the rows it samples */
+    bool spans = extents != 0 && ! extents->Empty() &&
+        M[0][0] == 1.0 && M[0][1] == 0.0 && M[1][0] == 0.0 && M[1][1] == 1.0 &&
+        M[2][0] == 0.0 && M[2][1] == 0.0 && M[2][2] == 1.0;
+
+    /* Rows are independent, so ranges of them are accumulated in parallel */
+    ParallelFor(bb_min_y, bb_max_y + 1, 0, [&](int y0, int y1) {
+    for (int y = y0; y < y1; y++) {
+        int x0 = bb_min_x, x1 = bb_max_x;
+        if (spans) {
+            /* (a row either side and a column either side, for rounding) */
+            int ys = (int) floor(y - M[1][2]);
+            int s0 = img.Shape().width, s1 = 0;
+            for (int k = ys - 1; k <= ys + 2; k++) {
+                int a, b;
+                RowSpan(*extents, k, img.Shape().width, a, b);
+                if (a < b)
+                    s0 = MIN(s0, a), s1 = MAX(s1, b);
+            }
+            if (s0 >= s1)
+                continue;
+            x0 = MAX(x0, (int) floor(s0 + M[0][2]) - 1);
+            x1 = MIN(x1, (int) ceil(s1 + M[0][2]) + 1);
+        }
+        for (int x = x0; x < x1; x++) {
             /* Check bounds in destination */
             if (x < 0 || x >= acc.Shape().width || 
                 y < 0 || y >= acc.Shape().height)
@@ -197,14 +237,19 @@ static void AccumulateBlend(CByteImage& img, CFloatImage& acc, CTransform3x3 M,
             
 			// *** END TODO ***	
 
-			acc.Pixel(x, y, 0) += (float) (weight * img.PixelLerp(x_src, y_src, 0));
-            acc.Pixel(x, y, 1) += (float) (weight * img.PixelLerp(x_src, y_src, 1));
-            acc.Pixel(x, y, 2) += (float) (weight * img.PixelLerp(x_src, y_src, 2));
+            double red   = g[0] * img.PixelLerp(x_src, y_src, 0);
+            double green = g[1] * img.PixelLerp(x_src, y_src, 1);
+            double blue  = g[2] * img.PixelLerp(x_src, y_src, 2);
+
+			acc.Pixel(x, y, 0) += (float) (weight * MIN(red, 255.0));
+            acc.Pixel(x, y, 1) += (float) (weight * MIN(green, 255.0));
+            acc.Pixel(x, y, 2) += (float) (weight * MIN(blue, 255.0));
             acc.Pixel(x, y, 3) += (float) weight;
 
 			
         }
     }
+    });
 }
 
 
@@ -224,6 +269,8 @@ static void AccumulateBlend(CByteImage& img, CFloatImage& acc, CTransform3x3 M,
  */
 static void NormalizeBlend(CFloatImage& acc, CByteImage& img)
 {
+    CProfileScope scope(eProfNormalizeBlend);
+
 	// *** BEGIN TODO ***
 	// fill in this routine..
 	
@@ -231,16 +278,42 @@ static void NormalizeBlend(CFloatImage& acc, CByteImage& img)
 	// *** END TODO ***
 }
 
+/* Find the rows [sy0, sy1) of the composite that output rows [y0, y1)
+ * are bilinearly resampled from under the affine deformation A */
+static void CompositeRows(CTransform3x3 &A, int width, int y0, int y1,
+                          int compHeight, int &sy0, int &sy1)
+{
+    double min_yf = DBL_MAX, max_yf = -DBL_MAX;
+    for (int k = 0; k < 4; k++) {
+        CVector3 p;
+        p[0] = (k & 1) ? width - 1 : 0;
+        p[1] = (k & 2) ? y1 - 1 : y0;
+        p[2] = 1.0;
+        p = A * p;
+        min_yf = MIN(min_yf, p[1] / p[2]);
+        max_yf = MAX(max_yf, p[1] / p[2]);
+    }
+    sy0 = MAX(0, (int) floor(min_yf));
+    sy1 = MIN(compHeight, (int) floor(max_yf) + 2);
+}
+
 /******************* TO DO 5 *********************
  * BlendImages:
  *	INPUT:
  *		ipv: list of input images and their relative positions in the mosaic
  *		blendWidth: width of the blending function
+ *		sink: where the rows of the final mosaic are written
+ *		bandHeight: number of output rows produced at a time
  *	OUTPUT:
- *		create & return final mosaic by blending all images
+ *		create final mosaic by blending all images
  *		and correcting for any vertical drift
+ *
+ *	The mosaic is produced one band of rows at a time, and only the rows
+ *	of the accumulator that a band is warped from are ever allocated, so
+ *	memory for the output does not grow with the size of the mosaic.
  */
-CByteImage BlendImages(CImagePositionV& ipv, float blendWidth)
+void BlendImages(CImagePositionV& ipv, float blendWidth,
+                 CImageSink& sink, int bandHeight)
 {
     // Assume all the images are of the same shape (for now)
     CByteImage& img0 = ipv[0].img;
@@ -301,26 +374,20 @@ CByteImage BlendImages(CImagePositionV& ipv, float blendWidth)
 		// *** END TODO #1 ***
     }
 
-    // Create a floating point accumulation image
+    // Shape of the floating point accumulation image
     CShape mShape((int)(ceil(max_x) - floor(min_x)),
                   (int)(ceil(max_y) - floor(min_y)), nBands);
-    CFloatImage accumulator(mShape);
-    accumulator.ClearPixels();
 
 	double x_init, x_final;
     double y_init, y_final;
 
-	// Add in all of the images
+	// Position all of the images in the accumulator
+    std::vector<CTransform3x3> M_t(n);
     for (i = 0; i < n; i++) {
         
         CTransform3x3 &M = ipv[i].position;
 
-        CTransform3x3 M_t = CTransform3x3::Translation(-min_x, -min_y) * M;
-
-        CByteImage& img = ipv[i].img;
-
-        // Perform the accumulation
-		AccumulateBlend(img, accumulator, M_t, blendWidth);
+        M_t[i] = CTransform3x3::Translation(-min_x, -min_y) * M;
 
         if (i == 0) {
             CVector3 p;
@@ -328,7 +395,7 @@ CByteImage BlendImages(CImagePositionV& ipv, float blendWidth)
             p[1] = 0.0;
             p[2] = 1.0;
 
-            p = M_t * p;
+            p = M_t[i] * p;
             x_init = p[0];
             y_init = p[1];
         } else if (i == n - 1) {
@@ -337,24 +404,14 @@ CByteImage BlendImages(CImagePositionV& ipv, float blendWidth)
             p[1] = 0.0;
             p[2] = 1.0;
 
-            p = M_t * p;
+            p = M_t[i] * p;
             x_final = p[0];
             y_final = p[1];
         }
     }
 
-
-
-    // Normalize the results
-    CByteImage compImage(mShape);
-    NormalizeBlend(accumulator, compImage);
-    bool debug_comp = false;
-    if (debug_comp)
-        WriteFile(compImage, "tmp_comp.tga");
-
     // Allocate the final image shape
     CShape cShape(mShape.width - width, height, nBands);
-    CByteImage croppedImage(cShape);
 
     // Compute the affine deformation
     CTransform3x3 A;
@@ -366,8 +423,96 @@ CByteImage BlendImages(CImagePositionV& ipv, float blendWidth)
 
 	// *** END TODO #2 ***
 
-    // Warp and crop the composite
-    WarpGlobal(compImage, croppedImage, A, eWarpInterpLinear);
+    sink.Begin(cShape);
+    for (int y0 = 0; y0 < cShape.height; y0 += bandHeight)
+    {
+        CTraceScope trace("blend band", "y", y0);
+        int y1 = MIN(y0 + bandHeight, cShape.height);
+        CMemoryTag mosaicTag(eMemMosaic);
+        CByteImage croppedImage(CShape(cShape.width, y1 - y0, nBands));
+        croppedImage.ClearPixels();
+
+        // Accumulate just the composite rows this band is resampled from
+        int sy0, sy1;
+        CompositeRows(A, cShape.width, y0, y1, mShape.height, sy0, sy1);
+        if (sy0 < sy1) {
+            CShape bShape(mShape.width, sy1 - sy0, nBands);
+            CMemoryTag accumulatorTag(eMemAccumulator);
+            CFloatImage accumulator(bShape);
+            accumulator.ClearPixels();
+
+            CTransform3x3 T = CTransform3x3::Translation(0.0, (float) -sy0);
+            for (i = 0; i < n; i++) {
+                CTransform3x3 M_b = T * M_t[i];
+                AccumulateBlend(ipv[i].img, accumulator, M_b, blendWidth, ipv[i].gain,
+                                &ipv[i].extents);
+            }
+
+            // Normalize the results
+            CMemoryTag compositeTag(eMemComposite);
+            CByteImage compImage(bShape);
+            NormalizeBlend(accumulator, compImage);
+
+            // Warp and crop the composite
+            WarpGlobal(compImage, croppedImage, A, eWarpInterpLinear, 1.0f, y0, sy0);
+        }
+
+        sink.Write(croppedImage, 0, y0);
+    }
+    sink.End();
+}
+
+CByteImage BlendImages(CImagePositionV& ipv, float blendWidth)
+{
+    // Blend into an in-memory image
+    CImageBufferSink sink;
+    BlendImages(ipv, blendWidth, sink);
+    return sink.image;
+}
 
-    return croppedImage;
+CBlendMemory EstimateBlendMemory(const std::vector<CShape>& shapes,
+                                 const std::vector<CTransform3x3>& positions,
+                                 int bandHeight)
+{
+    // Same layout as BlendImages, from the shapes and positions alone
+    CBlendMemory mem;
+    int n = (int) shapes.size();
+    int width = shapes[0].width, height = shapes[0].height;
+    int nBands = shapes[0].nBands;
+    double min_x = DBL_MAX, min_y = DBL_MAX, max_x = -DBL_MAX, max_y = -DBL_MAX;
+    mem.images = 0;
+    for (int i = 0; i < n; i++)
+    {
+        mem.images += (long long) shapes[i].width * shapes[i].height * shapes[i].nBands;
+        for (int k = 0; k < 4; k++) {
+            CVector3 p;
+            p[0] = (k & 1) ? width - 1 : 0;
+            p[1] = (k & 2) ? height - 1 : 0;
+            p[2] = 1.0;
+            p = positions[i] * p;
+            min_x = MIN(min_x, p[0] / p[2]);
+            min_y = MIN(min_y, p[1] / p[2]);
+            max_x = MAX(max_x, p[0] / p[2]);
+            max_y = MAX(max_y, p[1] / p[2]);
+        }
+    }
+    int mWidth  = (int) (ceil(max_x) - floor(min_x));
+    int mHeight = (int) (ceil(max_y) - floor(min_y));
+    mem.mosaic = CShape(MAX(mWidth - width, 0), height, nBands);
+
+    // A band of output rows is resampled from the band of composite rows
+    //  it covers, plus the vertical drift taken out across the mosaic
+    CVector3 first, last;
+    first[0] = last[0] = 0.5 * width;
+    first[1] = last[1] = 0.0;
+    first[2] = last[2] = 1.0;
+    first = positions[0] * first;
+    last  = positions[n-1] * last;
+    double drift = fabs(last[1] / last[2] - first[1] / first[2]);
+    int bandRows  = MIN(bandHeight, height);
+    int compRows  = MIN(mHeight, bandRows + (int) ceil(drift) + 2);
+    mem.accumulator = (long long) mWidth * compRows * nBands * sizeof(float);
+    mem.composite   = (long long) mWidth * compRows * nBands;
+    mem.band        = (long long) mem.mosaic.width * bandRows * nBands;
+    return mem;
 }
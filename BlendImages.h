@@ -5,10 +5,23 @@
 //
 // SPECIFICATION
 //  CByteImage BlendImages(CImagePositionV ipv, float blendWidth);
+//  void BlendImages(CImagePositionV ipv, float blendWidth,
+//                   CImageSink& sink, int bandHeight);
+//  CBlendMemory EstimateBlendMemory(vector<CShape> shapes,
+//                   vector<CTransform3x3> positions, int bandHeight);
+//  void AccumulateBlend(CByteImage& img, CFloatImage& acc,
+//                   CTransform3x3 M, float blendWidth,
+//                   const float *gain = 0,
+//                   const CRowExtents *extents = 0);
 //
 // PARAMETERS
 //  ipv                 list (vector) of images and their locations
 //  blendWidth          half-width of transition region (in pixels)
+//  sink                destination for the rows of the mosaic
+//  bandHeight          number of mosaic rows produced at a time
+//  gain                per-band (B, G, R) gains of img (0 = none)
+//  extents             span of the valid pixels of each row of img
+//                      (0 = unknown)
 //
 // DESCRIPTION
 //  This routine takes a collection of images aligned more or less horizontally
@@ -22,6 +35,24 @@
 //  take out any accumulated vertical drift using an affine warp.
 //  Lucas-Kanade Taylor series expansion of the registration error.
 //
+//  The second form streams the mosaic into sink one band of rows at a
+//  time, so that its memory use is proportional to the band rather than
+//  the whole mosaic (see FileIO.h for the available sinks).
+//
+//  AccumulateBlend() adds one image into a (band of the) accumulator;  it
+//  is exported for the benchmarks (see Bench.cpp).  Each image is scaled
+//  by its gain as it is added (saturating at 255), so exposure
+//  compensation (see GainCompensation.h) needs no pass of its own.  When
+//  the image is only translated and the spans of its rows are known (see
+//  RowExtents.h;  the stitcher keeps them in CImagePosition), each row of
+//  the accumulator visits only the columns over those spans rather than
+//  the whole bounding box.
+//
+//  EstimateBlendMemory() works out, from the shapes and positions of the
+//  images alone, the shape of the mosaic and the size of each of the
+//  buffers BlendImages allocates, so that the memory needed for a large
+//  mosaic can be checked before any image is read.
+//
 // SEE ALSO
 //  BlendImages.cpp     implementation
 //
@@ -35,8 +66,32 @@ struct CImagePosition
     CByteImage img;         // image
     //float position[2];      // position relative to first image
 	CTransform3x3 position;
+    float gain[3];          // per-band (B, G, R) gains (see GainCompensation.h)
+    CRowExtents extents;    // span of the valid pixels of each row of img
+
+    CImagePosition() { gain[0] = gain[1] = gain[2] = 1.0f; }
 };
 
 typedef std::vector<CImagePosition> CImagePositionV;
 
 CByteImage BlendImages(CImagePositionV& ipv, float blendWidth);
+
+void BlendImages(CImagePositionV& ipv, float blendWidth,
+                 CImageSink& sink, int bandHeight = 256);
+
+void AccumulateBlend(CByteImage& img, CFloatImage& acc, CTransform3x3 M,
+                     float blendWidth, const float *gain = 0,
+                     const CRowExtents *extents = 0);
+
+struct CBlendMemory
+{
+    CShape mosaic;          // shape of the final mosaic
+    long long images;       // bytes of the input images
+    long long accumulator;  // bytes of the accumulator for one band
+    long long composite;    // bytes of the normalized composite for one band
+    long long band;         // bytes of one band of the mosaic
+};
+
+CBlendMemory EstimateBlendMemory(const std::vector<CShape>& shapes,
+                                 const std::vector<CTransform3x3>& positions,
+                                 int bandHeight = 256);
@@ -41,6 +41,9 @@ int alignPair(const FeatureSet &f1, const FeatureSet &f2,
               const vector<FeatureMatch> &matches, MotionModel m, float f,
               int nRANSAC, double RANSACthresh, CTransform3x3& M)
 {
+    CProfileScope scope(eProfAlignPair);
+    ProfileCount(eProfRANSACIterations, nRANSAC);
+
     // BEGIN TODO
     // write this entire method
 
@@ -78,6 +81,9 @@ int countInliers(const FeatureSet &f1, const FeatureSet &f2,
                  const vector<FeatureMatch> &matches, MotionModel m, float f,
                  CTransform3x3 M, double RANSACthresh, vector<int> &inliers)
 {
+    CProfileScope scope(eProfCountInliers);
+    ProfileCount(eProfInlierEvaluations, matches.size());
+
     inliers.clear();
     int count = 0;
 
@@ -0,0 +1,207 @@
+///////////////////////////////////////////////////////////////////////////
+//
+// NAME
+//  GainCompensation.cpp -- balance the exposures of overlapping images
+//
+// SEE ALSO
+//  GainCompensation.h      longer description
+//
+///////////////////////////////////////////////////////////////////////////
+
+#include "ImageLib/ImageLib.h"
+#include "BlendImages.h"
+#include "GainCompensation.h"
+#include <float.h>
+#include <math.h>
+#include <vector>
+
+using namespace std;
+
+static const double sigmaN = 10.0;      // std. dev. of the intensity error
+static const double sigmaG = 0.1;       // std. dev. of the gains about 1
+
+// Sums of an image's valid pixels (and their number) over cells of
+//  step x step pixels, as summed-area tables of (width+1) x (height+1)
+//  entries, so that the total over any block of cells is four lookups
+
+struct CCellSums
+{
+    int step;                   // cell size
+    int width, height;          // number of cells across and down
+    vector<double> table[4];    // per-band (B, G, R) sums, and counts
+
+    double Sum(int b, int x0, int y0, int x1, int y1) const
+    {
+        const vector<double>& t = table[b];
+        int w = width + 1;
+        return t[y1*w + x1] - t[y0*w + x1] - t[y1*w + x0] + t[y0*w + x0];
+    }
+};
+
+static void CellSums(CByteImage& img, const CRowExtents& extents, int step,
+                     CCellSums& cells)
+{
+    CShape sh = img.Shape();
+    int nBands = sh.nBands;
+    cells.step   = step;
+    cells.width  = (sh.width  + step - 1) / step;
+    cells.height = (sh.height + step - 1) / step;
+    int w = cells.width + 1;
+    for (int b = 0; b < 4; b++)
+        cells.table[b].assign(w * (cells.height + 1), 0.0);
+
+    // Totals of each cell (black pixels are skipped, as by AccumulateBlend,
+    // and so are the parts of the rows outside their spans)
+    for (int y = 0; y < sh.height; y++)
+    {
+        int x0, x1;
+        RowSpan(extents, y, sh.width, x0, x1);
+        uchar* p = &img.Pixel(x0, y, 0);
+        int row = (y / step + 1) * w + 1;
+        for (int x = x0; x < x1; x++, p += nBands)
+        {
+            if (p[0] == 0 && p[1] == 0 && p[2] == 0)
+                continue;
+            int c = row + x / step;
+            cells.table[0][c] += p[0];
+            cells.table[1][c] += p[1];
+            cells.table[2][c] += p[2];
+            cells.table[3][c] += 1.0;
+        }
+    }
+
+    // Running sums down and across
+    for (int b = 0; b < 4; b++)
+    {
+        vector<double>& t = cells.table[b];
+        for (int y = 1; y <= cells.height; y++)
+            for (int x = 1; x <= cells.width; x++)
+                t[y*w + x] += t[(y-1)*w + x] + t[y*w + x-1] - t[(y-1)*w + x-1];
+    }
+}
+
+// The cells of image i that image j (under Mij) covers
+
+static bool OverlapCells(const CCellSums& cells, CShape shj, CTransform3x3 Mij,
+                         int& x0, int& y0, int& x1, int& y1)
+{
+    double min_x = DBL_MAX, min_y = DBL_MAX, max_x = -DBL_MAX, max_y = -DBL_MAX;
+    for (int k = 0; k < 4; k++)
+    {
+        CVector3 p;
+        p[0] = (k & 1) ? shj.width - 1 : 0;
+        p[1] = (k & 2) ? shj.height - 1 : 0;
+        p[2] = 1.0;
+        p = Mij * p;
+        min_x = __min(min_x, p[0] / p[2]);
+        min_y = __min(min_y, p[1] / p[2]);
+        max_x = __max(max_x, p[0] / p[2]);
+        max_y = __max(max_y, p[1] / p[2]);
+    }
+
+    // Only the cells that lie wholly inside the overlap
+    x0 = __max(0, (int) ceil(min_x / cells.step));
+    y0 = __max(0, (int) ceil(min_y / cells.step));
+    x1 = __min(cells.width,  (int) floor((max_x + 1) / cells.step));
+    y1 = __min(cells.height, (int) floor((max_y + 1) / cells.step));
+    return x0 < x1 && y0 < y1;
+}
+
+// Solve A x = b (n x n, row major) by Gaussian elimination with partial
+//  pivoting;  A and b are overwritten
+
+static void SolveLinear(vector<double>& A, vector<double>& b, int n)
+{
+    for (int k = 0; k < n; k++)
+    {
+        int pivot = k;
+        for (int i = k+1; i < n; i++)
+            if (fabs(A[i*n + k]) > fabs(A[pivot*n + k]))
+                pivot = i;
+        if (A[pivot*n + k] == 0.0)
+            throw CError("CompensateGains: singular system");
+        if (pivot != k)
+        {
+            for (int j = 0; j < n; j++)
+                swap(A[k*n + j], A[pivot*n + j]);
+            swap(b[k], b[pivot]);
+        }
+        for (int i = k+1; i < n; i++)
+        {
+            double s = A[i*n + k] / A[k*n + k];
+            for (int j = k; j < n; j++)
+                A[i*n + j] -= s * A[k*n + j];
+            b[i] -= s * b[k];
+        }
+    }
+    for (int k = n-1; k >= 0; k--)
+    {
+        for (int j = k+1; j < n; j++)
+            b[k] -= A[k*n + j] * b[j];
+        b[k] /= A[k*n + k];
+    }
+}
+
+void CompensateGains(CImagePositionV& ipv, int cellSize)
+{
+    CTraceScope trace("gain compensation");
+    int n = (int) ipv.size();
+    if (n == 0)
+        return;
+
+    // Reduce the images to their cell sums
+    vector<CCellSums> cells(n);
+    ParallelFor(0, n, 1, [&](int i0, int i1) {
+        for (int i = i0; i < i1; i++)
+            CellSums(ipv[i].img, ipv[i].extents, __max(1, cellSize), cells[i]);
+    });
+
+    // Normal equations of e (see GainCompensation.h), one system per
+    //  channel;  every image starts with the prior of one pixel, which
+    //  leaves an image that overlaps no other with a gain of 1
+    vector<double> A[3], b[3];
+    for (int c = 0; c < 3; c++)
+    {
+        A[c].assign(n * n, 0.0);
+        b[c].assign(n, 1.0 / (sigmaG * sigmaG));
+        for (int i = 0; i < n; i++)
+            A[c][i*n + i] = 1.0 / (sigmaG * sigmaG);
+    }
+    for (int i = 0; i < n; i++)
+    {
+        for (int j = i+1; j < n; j++)
+        {
+            CTransform3x3 Mi = ipv[i].position, Mj = ipv[j].position;
+            int ix0, iy0, ix1, iy1, jx0, jy0, jx1, jy1;
+            if (! OverlapCells(cells[i], ipv[j].img.Shape(), Mi.Inverse() * Mj,
+                               ix0, iy0, ix1, iy1) ||
+                ! OverlapCells(cells[j], ipv[i].img.Shape(), Mj.Inverse() * Mi,
+                               jx0, jy0, jx1, jy1))
+                continue;
+            double Ni = cells[i].Sum(3, ix0, iy0, ix1, iy1);
+            double Nj = cells[j].Sum(3, jx0, jy0, jx1, jy1);
+            double N  = __min(Ni, Nj);
+            if (N <= 0.0)
+                continue;
+            for (int c = 0; c < 3; c++)
+            {
+                double Iij = cells[i].Sum(c, ix0, iy0, ix1, iy1) / Ni;
+                double Iji = cells[j].Sum(c, jx0, jy0, jx1, jy1) / Nj;
+                double prior = N / (sigmaG * sigmaG);
+                A[c][i*n + i] += N * 2.0 * Iij * Iij / (sigmaN * sigmaN) + prior;
+                A[c][j*n + j] += N * 2.0 * Iji * Iji / (sigmaN * sigmaN) + prior;
+                A[c][i*n + j] -= N * 2.0 * Iij * Iji / (sigmaN * sigmaN);
+                A[c][j*n + i] -= N * 2.0 * Iij * Iji / (sigmaN * sigmaN);
+                b[c][i] += prior;
+                b[c][j] += prior;
+            }
+        }
+    }
+
+    for (int c = 0; c < 3; c++)
+    {
+        SolveLinear(A[c], b[c], n);
+        for (int i = 0; i < n; i++)
+            ipv[i].gain[c] = (float) b[c][i];
+    }
+}
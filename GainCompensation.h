@@ -0,0 +1,49 @@
+///////////////////////////////////////////////////////////////////////////
+//
+// NAME
+//  GainCompensation.h -- balance the exposures of overlapping images
+//
+// SPECIFICATION
+//  void CompensateGains(CImagePositionV& ipv, int cellSize = 8);
+//
+// PARAMETERS
+//  ipv                 list (vector) of images and their locations;  the
+//                      gain of each image is set
+//  cellSize            side of the cells (in pixels) the images are
+//                      reduced to before their overlaps are measured
+//
+// DESCRIPTION
+//  Frames shot with automatic exposure differ in brightness, and a
+//  feathered blend only hides the step between two of them if the
+//  transition is wide, which makes BlendImages slower and still leaves
+//  bands.  CompensateGains works out a gain per image and colour channel
+//  such that the mean intensities of the images agree where they
+//  overlap, and BlendImages applies the gains as it accumulates each
+//  image (see AccumulateBlend), so they cost no extra pass over the
+//  mosaic and a narrow blendWidth gives a seamless result.
+//
+//  Each image is first reduced to the sums (and counts) of its valid,
+//  i.e., non-black, pixels over cellSize x cellSize cells, kept as
+//  summed-area tables, so the mean of an image over any overlap is four
+//  lookups.  The overlap of two images is taken as the bounding box of
+//  the one in the coordinates of the other, which is exact for the
+//  translations blendPairs and stitch produce.
+//
+//  The gains minimize (Brown and Lowe, "Automatic panoramic image
+//  stitching using invariant features", IJCV 2007)
+//
+//      e = sum_ij N_ij ((g_i I_ij - g_j I_ji)^2 / sigmaN^2
+//                       + (1 - g_i)^2 / sigmaG^2)
+//
+//  where I_ij is the mean of image i over its overlap with image j and
+//  N_ij the number of pixels in the overlap;  the second term keeps the
+//  gains near 1 (sigmaN = 10 grey levels, sigmaG = 0.1).  Setting the
+//  derivatives to zero gives one small linear system per channel.
+//
+// SEE ALSO
+//  GainCompensation.cpp    implementation
+//  BlendImages.h           blending the images with their gains
+//
+///////////////////////////////////////////////////////////////////////////
+
+void CompensateGains(CImagePositionV& ipv, int cellSize = 8);
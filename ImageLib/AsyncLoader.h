@@ -0,0 +1,261 @@
+///////////////////////////////////////////////////////////////////////////
+//
+// NAME
+//  AsyncLoader.h -- read files ahead of their use on background threads
+//
+// DESCRIPTION
+//  CAsyncLoaderOf<T> overlaps file reading and decoding with computation.
+//  A client announces the files it is about to need with Prefetch(), and
+//  later collects each one with Take(), which waits for the decode to
+//  finish (or rethrows the CError it raised):
+//
+//      CImageLoader loader(ReadImageFile, 2);
+//      for (i = 0; i < n; i++)
+//          loader.Prefetch(names[i]);
+//      for (i = 0; i < n; i++)
+//          if (! loader.Take(names[i], images[i]))
+//              ReadFile(images[i], names[i]);  // was never prefetched
+//
+//  The requests are decoded in the order they were made by nThreads
+//  worker threads.  At most maxReady items are decoded but not yet taken
+//  at any one time;  the remaining requests stay queued (as names only)
+//  until an item is taken, which bounds the memory used by read-ahead.
+//  A Take() for a request whose decode has not started yet removes it
+//  from the queue and decodes it on the calling thread, so clients may
+//  take items in any order without deadlocking.
+//
+//  A second Prefetch() of a name that is already pending is ignored.
+//  A client that stops before taking everything it asked for (e.g., a
+//  script that fails) withdraws the rest with Cancel(), so that they
+//  neither hold read-ahead slots nor get handed to a later client:  a
+//  queued or decoded item is dropped at once, and one being decoded
+//  when its decode finishes.  (A request that a Take() is already
+//  waiting for is left to it.)  Items that are never taken are also
+//  discarded by the destructor.
+//
+//  The decode function is called concurrently from several threads, so
+//  it must not touch unprotected global state (ReadFile is fine, the
+//  FLTK image readers are not).
+//
+// SEE ALSO
+//  FileIO.h            ReadFile
+//
+///////////////////////////////////////////////////////////////////////////
+
+#include <list>
+#include <string>
+#include <vector>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+
+template <class T>
+class CAsyncLoaderOf
+{
+public:
+    typedef void (*DecodeFn)(T& item, const char* filename);
+
+    CAsyncLoaderOf(DecodeFn decode, int nThreads = 2, int maxReady = 4);
+    ~CAsyncLoaderOf();
+
+    void Prefetch(const char* filename);        // queue a read-ahead
+    bool Take(const char* filename, T& item);   // false if not prefetched
+    bool Pending(const char* filename);         // prefetched, not taken
+    void Cancel(const char* filename);          // withdraw a read-ahead
+
+private:
+    enum EState { eQueued, eLoading, eReady, eFailed };
+    struct CRequest
+    {
+        std::string filename;
+        EState state;
+        bool waited;        // a Take() is waiting for it
+        bool cancelled;     // withdrawn while loading (dropped when done)
+        T item;
+        std::string error;
+    };
+    typedef typename std::list<CRequest>::iterator CRequestIter;
+
+    CRequestIter Find(const char* filename);
+    void Worker(void);
+
+    DecodeFn m_decode;          // reads one file
+    int m_maxReady;             // limit on loading + ready requests
+    int m_nActive;              // number of loading + ready requests
+    bool m_stop;                // shut the workers down
+    std::list<CRequest> m_requests;     // pending requests, oldest first
+    std::mutex m_mutex;                 // guards all of the above
+    std::condition_variable m_work;     // a request may be startable
+    std::condition_variable m_done;     // a request has finished
+    std::vector<std::thread> m_threads;
+};
+
+template <class T>
+CAsyncLoaderOf<T>::CAsyncLoaderOf(DecodeFn decode, int nThreads, int maxReady)
+    : m_decode(decode), m_maxReady(maxReady < 1 ? 1 : maxReady),
+      m_nActive(0), m_stop(false)
+{
+    for (int i = 0; i < nThreads; i++)
+        m_threads.push_back(std::thread(&CAsyncLoaderOf<T>::Worker, this));
+}
+
+template <class T>
+CAsyncLoaderOf<T>::~CAsyncLoaderOf()
+{
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_stop = true;
+    }
+    m_work.notify_all();
+    for (size_t i = 0; i < m_threads.size(); i++)
+        m_threads[i].join();
+}
+
+template <class T>
+typename CAsyncLoaderOf<T>::CRequestIter CAsyncLoaderOf<T>::Find(const char* filename)
+{
+    for (CRequestIter r = m_requests.begin(); r != m_requests.end(); r++)
+        if (r->filename == filename && ! r->cancelled)
+            return r;
+    return m_requests.end();
+}
+
+template <class T>
+void CAsyncLoaderOf<T>::Prefetch(const char* filename)
+{
+    if (m_threads.size() == 0)
+        return;     // no workers:  everything is read on demand
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        if (Find(filename) != m_requests.end())
+            return;
+        m_requests.push_back(CRequest());
+        m_requests.back().filename = filename;
+        m_requests.back().state = eQueued;
+        m_requests.back().waited = false;
+        m_requests.back().cancelled = false;
+    }
+    m_work.notify_one();
+}
+
+template <class T>
+bool CAsyncLoaderOf<T>::Pending(const char* filename)
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    return Find(filename) != m_requests.end();
+}
+
+template <class T>
+bool CAsyncLoaderOf<T>::Take(const char* filename, T& item)
+{
+    std::unique_lock<std::mutex> lock(m_mutex);
+    CRequestIter r = Find(filename);
+    if (r == m_requests.end())
+        return false;
+
+    if (r->state == eQueued)
+    {
+        // Not started yet:  cheaper to read it here than to wait
+        m_requests.erase(r);
+        lock.unlock();
+        m_decode(item, filename);
+        return true;
+    }
+
+    r->waited = true;
+    while (r->state == eLoading)
+        m_done.wait(lock);
+
+    item = r->item;
+    std::string error = r->error;
+    bool failed = (r->state == eFailed);
+    m_requests.erase(r);
+    m_nActive -= 1;
+    lock.unlock();
+    m_work.notify_one();
+
+    if (failed)
+        throw CError(error.c_str());
+    return true;
+}
+
+template <class T>
+void CAsyncLoaderOf<T>::Cancel(const char* filename)
+{
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        CRequestIter r = Find(filename);
+        if (r == m_requests.end() || r->waited)
+            return;
+        if (r->state == eLoading)
+        {
+            r->cancelled = true;    // (the worker drops it)
+            return;
+        }
+        if (r->state != eQueued)
+            m_nActive -= 1;
+        m_requests.erase(r);
+    }
+    m_work.notify_one();
+}
+
+template <class T>
+void CAsyncLoaderOf<T>::Worker(void)
+{
+    std::unique_lock<std::mutex> lock(m_mutex);
+    while (true)
+    {
+        // Find the oldest request that has not been started
+        CRequestIter r = m_requests.end();
+        if (m_nActive < m_maxReady)
+        {
+            for (r = m_requests.begin(); r != m_requests.end(); r++)
+                if (r->state == eQueued)
+                    break;
+        }
+        if (m_stop)
+            return;
+        if (r == m_requests.end())
+        {
+            m_work.wait(lock);
+            continue;
+        }
+
+        // Decode it outside the lock (list iterators stay valid, and
+        //  Take() waits rather than erasing a request that is loading)
+        r->state = eLoading;
+        m_nActive += 1;
+        std::string filename = r->filename;
+        lock.unlock();
+        T item;
+        std::string error;
+        try
+        {
+            m_decode(item, filename.c_str());
+        }
+        catch (CError &err)
+        {
+            error = err.message;
+        }
+        lock.lock();
+        if (r->cancelled)
+        {
+            m_requests.erase(r);
+            m_nActive -= 1;
+            continue;
+        }
+        r->item = item;
+        r->error = error;
+        r->state = (error.size() > 0) ? eFailed : eReady;
+        m_done.notify_all();
+    }
+}
+
+// Byte images read with ReadFile (Targa files)
+
+inline void ReadImageFile(CByteImage& img, const char* filename)
+{
+    ReadFile(img, filename);
+}
+
+typedef CAsyncLoaderOf<CByteImage> CImageLoader;
@@ -15,11 +15,18 @@
 
 #include "Image.h"
 #include "Convert.h"
+#include "CpuFeatures.h"
+#include <math.h>
+
+#ifdef IMAGELIB_X86
+#include <emmintrin.h>
+#include <immintrin.h>
+#endif
 
 template <class T1, class T2>
-void ScaleAndOffsetLine(T1* src, T2* dst, int n,
-                        float scale, float offset,
-                        T2 minVal, T2 maxVal)
+static void ScaleAndOffsetScalar(T1* src, T2* dst, int n,
+                                 float scale, float offset,
+                                 T2 minVal, T2 maxVal)
 {
     // This routine does NOT round values when converting from float to int
     const bool scaleOffset = (scale != 1.0f) || (offset != 0.0f);
@@ -46,6 +53,240 @@ void ScaleAndOffsetLine(T1* src, T2* dst, int n,
         }
 }
 
+#ifdef IMAGELIB_X86
+
+//
+// SIMD versions of ScaleAndOffsetScalar.
+//
+//  Every source value is converted to float, scaled and offset, clipped
+//  with max/min (which return their second argument for NaNs, exactly
+//  like __max/__min), and truncated, so the results are bit-identical
+//  to the scalar loop.  (Multiplying by 1 and adding 0 is exact, so the
+//  same pipeline also covers plain type conversion.)  The two cases this
+//  does not reproduce are left to the scalar code:  unclipped conversion
+//  to uchar (which wraps around), and clipped conversion to int (which
+//  the scalar code does in integer arithmetic).
+//
+//  The kernels return the number of leading values they converted.
+//
+
+static IMAGELIB_TARGET_SSE2 inline __m128 Load4(const uchar* p)
+{
+    int w;
+    memcpy(&w, p, 4);
+    __m128i zero = _mm_setzero_si128();
+    __m128i v = _mm_unpacklo_epi8(_mm_cvtsi32_si128(w), zero);
+    return _mm_cvtepi32_ps(_mm_unpacklo_epi16(v, zero));
+}
+
+static IMAGELIB_TARGET_SSE2 inline __m128 Load4(const int* p)
+{
+    return _mm_cvtepi32_ps(_mm_loadu_si128((const __m128i *) p));
+}
+
+static IMAGELIB_TARGET_SSE2 inline __m128 Load4(const float* p)
+{
+    return _mm_loadu_ps(p);
+}
+
+static IMAGELIB_TARGET_SSE2 inline void Store4(uchar* p, __m128 v)
+{
+    __m128i i = _mm_cvttps_epi32(v);
+    i = _mm_packus_epi16(_mm_packs_epi32(i, i), i);
+    int w = _mm_cvtsi128_si32(i);
+    memcpy(p, &w, 4);
+}
+
+static IMAGELIB_TARGET_SSE2 inline void Store4(int* p, __m128 v)
+{
+    _mm_storeu_si128((__m128i *) p, _mm_cvttps_epi32(v));
+}
+
+static IMAGELIB_TARGET_SSE2 inline void Store4(float* p, __m128 v)
+{
+    _mm_storeu_ps(p, v);
+}
+
+template <bool clip, class T1, class T2>
+static IMAGELIB_TARGET_SSE2 int ScaleAndOffsetSSE2(const T1* src, T2* dst, int n,
+                                                   float scale, float offset,
+                                                   float minVal, float maxVal)
+{
+    __m128 s = _mm_set1_ps(scale), o = _mm_set1_ps(offset);
+    __m128 lo = _mm_set1_ps(minVal), hi = _mm_set1_ps(maxVal);
+    int i;
+    for (i = 0; i + 4 <= n; i += 4)
+    {
+        __m128 v = _mm_add_ps(_mm_mul_ps(Load4(&src[i]), s), o);
+        if (clip)
+            v = _mm_min_ps(_mm_max_ps(v, lo), hi);
+        Store4(&dst[i], v);
+    }
+    return i;
+}
+
+static IMAGELIB_TARGET_AVX2 inline __m256 Load8(const uchar* p)
+{
+    __m128i v = _mm_loadl_epi64((const __m128i *) p);
+    return _mm256_cvtepi32_ps(_mm256_cvtepu8_epi32(v));
+}
+
+static IMAGELIB_TARGET_AVX2 inline __m256 Load8(const int* p)
+{
+    return _mm256_cvtepi32_ps(_mm256_loadu_si256((const __m256i *) p));
+}
+
+static IMAGELIB_TARGET_AVX2 inline __m256 Load8(const float* p)
+{
+    return _mm256_loadu_ps(p);
+}
+
+static IMAGELIB_TARGET_AVX2 inline void Store8(uchar* p, __m256 v)
+{
+    __m256i i = _mm256_cvttps_epi32(v);
+    __m128i w = _mm_packs_epi32(_mm256_castsi256_si128(i),
+                                _mm256_extracti128_si256(i, 1));
+    _mm_storel_epi64((__m128i *) p, _mm_packus_epi16(w, w));
+}
+
+static IMAGELIB_TARGET_AVX2 inline void Store8(int* p, __m256 v)
+{
+    _mm256_storeu_si256((__m256i *) p, _mm256_cvttps_epi32(v));
+}
+
+static IMAGELIB_TARGET_AVX2 inline void Store8(float* p, __m256 v)
+{
+    _mm256_storeu_ps(p, v);
+}
+
+template <bool clip, class T1, class T2>
+static IMAGELIB_TARGET_AVX2 int ScaleAndOffsetAVX2(const T1* src, T2* dst, int n,
+                                                   float scale, float offset,
+                                                   float minVal, float maxVal)
+{
+    // (mul and add are kept separate:  a fused multiply-add would round
+    //  differently from the scalar code)
+    __m256 s = _mm256_set1_ps(scale), o = _mm256_set1_ps(offset);
+    __m256 lo = _mm256_set1_ps(minVal), hi = _mm256_set1_ps(maxVal);
+    int i;
+    for (i = 0; i + 8 <= n; i += 8)
+    {
+        __m256 v = _mm256_add_ps(_mm256_mul_ps(Load8(&src[i]), s), o);
+        if (clip)
+            v = _mm256_min_ps(_mm256_max_ps(v, lo), hi);
+        Store8(&dst[i], v);
+    }
+    return i;
+}
+
+IMAGELIB_AVX512_BEGIN
+
+static IMAGELIB_TARGET_AVX512 inline __m512 Load16(const uchar* p)
+{
+    __m128i v = _mm_loadu_si128((const __m128i *) p);
+    return _mm512_cvtepi32_ps(_mm512_cvtepu8_epi32(v));
+}
+
+static IMAGELIB_TARGET_AVX512 inline __m512 Load16(const int* p)
+{
+    return _mm512_cvtepi32_ps(_mm512_loadu_si512(p));
+}
+
+static IMAGELIB_TARGET_AVX512 inline __m512 Load16(const float* p)
+{
+    return _mm512_loadu_ps(p);
+}
+
+static IMAGELIB_TARGET_AVX512 inline void Store16(uchar* p, __m512 v)
+{
+    // (conversion to uchar is always clipped, so the values fit)
+    _mm_storeu_si128((__m128i *) p, _mm512_cvtepi32_epi8(_mm512_cvttps_epi32(v)));
+}
+
+static IMAGELIB_TARGET_AVX512 inline void Store16(int* p, __m512 v)
+{
+    _mm512_storeu_si512(p, _mm512_cvttps_epi32(v));
+}
+
+static IMAGELIB_TARGET_AVX512 inline void Store16(float* p, __m512 v)
+{
+    _mm512_storeu_ps(p, v);
+}
+
+template <bool clip, class T1, class T2>
+static IMAGELIB_TARGET_AVX512 int ScaleAndOffsetAVX512(const T1* src, T2* dst, int n,
+                                                       float scale, float offset,
+                                                       float minVal, float maxVal)
+{
+    // (AVX-512 includes fused multiply-add, which the compiler would use
+    //  for a plain mul and add;  the _round forms keep them separate)
+    __m512 s = _mm512_set1_ps(scale), o = _mm512_set1_ps(offset);
+    __m512 lo = _mm512_set1_ps(minVal), hi = _mm512_set1_ps(maxVal);
+    int i;
+    for (i = 0; i + 16 <= n; i += 16)
+    {
+        __m512 v = _mm512_add_round_ps(_mm512_mul_round_ps(Load16(&src[i]), s,
+                                                           _MM_FROUND_CUR_DIRECTION),
+                                       o, _MM_FROUND_CUR_DIRECTION);
+        if (clip)
+            v = _mm512_min_ps(_mm512_max_ps(v, lo), hi);
+        Store16(&dst[i], v);
+    }
+    return i;
+}
+
+IMAGELIB_AVX512_END
+
+template <class T1, class T2>
+static int ScaleAndOffsetSIMD(T1* src, T2* dst, int n,
+                              float scale, float offset,
+                              T2 minVal, T2 maxVal)
+{
+    const bool scaleOffset = (scale != 1.0f) || (offset != 0.0f);
+    const bool clip = (minVal < maxVal);
+    if (! scaleOffset && ! clip && typeid(T1) == typeid(T2))
+        return 0;   // memcpy
+    if (clip ? typeid(T2) == typeid(int) : typeid(T2) == typeid(uchar))
+        return 0;   // not bit-identical (see above)
+
+    if (CpuHas(eCpuAVX512))
+        return (clip) ?
+            ScaleAndOffsetAVX512<true>(src, dst, n, scale, offset, minVal, maxVal) :
+            ScaleAndOffsetAVX512<false>(src, dst, n, scale, offset, minVal, maxVal);
+    if (CpuHas(eCpuAVX2))
+        return (clip) ?
+            ScaleAndOffsetAVX2<true>(src, dst, n, scale, offset, minVal, maxVal) :
+            ScaleAndOffsetAVX2<false>(src, dst, n, scale, offset, minVal, maxVal);
+    if (CpuHas(eCpuSSE2))
+        return (clip) ?
+            ScaleAndOffsetSSE2<true>(src, dst, n, scale, offset, minVal, maxVal) :
+            ScaleAndOffsetSSE2<false>(src, dst, n, scale, offset, minVal, maxVal);
+    return 0;
+}
+
+#else
+
+template <class T1, class T2>
+static int ScaleAndOffsetSIMD(T1* src, T2* dst, int n,
+                              float scale, float offset,
+                              T2 minVal, T2 maxVal)
+{
+    return 0;
+}
+
+#endif
+
+template <class T1, class T2>
+void ScaleAndOffsetLine(T1* src, T2* dst, int n,
+                        float scale, float offset,
+                        T2 minVal, T2 maxVal)
+{
+    // Convert as much as possible with SIMD code, then finish the line
+    int done = ScaleAndOffsetSIMD(src, dst, n, scale, offset, minVal, maxVal);
+    ScaleAndOffsetScalar(src + done, dst + done, n - done,
+                         scale, offset, minVal, maxVal);
+}
+
 template <class T1, class T2>
 void ScaleAndOffset(CImageOf<T1>& src, CImageOf<T2>& dst, float scale, float offset)
 {
@@ -72,6 +313,490 @@ void ScaleAndOffset(CImageOf<T1>& src, CImageOf<T2>& dst, float scale, float off
     }
 }
 
+//
+// Line kernels for colour and band layout conversion (see Convert.h).
+//
+//  The SIMD versions convert 4 pixels at a time, held either as one
+//  pixel per 32-bit lane (uchar pixels of up to 4 bands) or as one float
+//  vector per band.  3-band pixels are read 16 bytes at a time (and
+//  3-band float pixels written so), overlapping the next pixel, so the
+//  last few pixels of each line are always left to the scalar code.  The arithmetic is done in the
+//  same order as in the scalar code, so the results are identical.
+//
+
+template <class T>
+static void RGBToGrayScalar(T* src, int sBands, T* dst, int n,
+                            T minVal, T maxVal)
+{
+    for (int x = 0; x < n; x++, src += sBands, dst++)
+    {
+        RGBA<T>& p = *(RGBA<T> *) src;
+        float Y = 0.212671f * p.R + 0.715160f * p.G + 0.072169f * p.B;
+        *dst = (T) __min(maxVal, __max(minVal, Y));
+    }
+}
+
+template <class T>
+static void GrayToRGBAScalar(T* src, T* dst, int n, T alpha)
+{
+    for (int x = 0; x < n; x++, src++, dst += 4)
+        dst[0] = dst[1] = dst[2] = *src, dst[3] = alpha;
+}
+
+template <class T>
+static void ExtractBandScalar(T* src, int sBands, int sBand, T* dst, int n)
+{
+    for (int x = 0; x < n; x++, src += sBands)
+        dst[x] = src[sBand];
+}
+
+static void SwapRBScalar(uchar* src, int sBands, uchar* dst, int dBands,
+                         int n, uchar alpha)
+{
+    for (int x = 0; x < n; x++, src += sBands, dst += dBands)
+    {
+        uchar a = (sBands == 4) ? src[3] : alpha;
+        dst[0] = src[2], dst[1] = src[1], dst[2] = src[0];
+        if (dBands == 4)
+            dst[3] = a;
+    }
+}
+
+static void ByteToFloatScalar(uchar* src, int sBands, float* dst, int dBands,
+                              int n, bool reverseBands)
+{
+    int nB = __min(sBands, dBands);
+    for (int x = 0; x < n; x++, src += sBands, dst += dBands)
+        for (int b = 0; b < nB; b++)
+            dst[reverseBands ? nB-1-b : b] = src[b] / 255.0f;
+}
+
+static void FloatToByteScalar(float* src, int sBands, uchar* dst, int dBands,
+                              int n, bool reverseBands)
+{
+    int nB = __min(sBands, dBands);
+    for (int x = 0; x < n; x++, src += sBands, dst += dBands)
+        for (int b = 0; b < nB; b++)
+        {
+            float value = floor(255 * src[b] + 0.5f);
+            if (value < 0)
+                value = 0;
+            else if (value > 255)
+                value = 255;
+            dst[reverseBands ? nB-1-b : b] = (uchar) value;
+        }
+}
+
+#ifdef IMAGELIB_X86
+
+static IMAGELIB_TARGET_SSSE3 inline __m128i LoadBytePixels(const uchar* p, int nBands)
+{
+    // 4 pixels of 1, 3, or 4 bands -> one pixel per 32-bit lane
+    if (nBands == 1)
+    {
+        int w;
+        memcpy(&w, p, 4);
+        __m128i zero = _mm_setzero_si128();
+        __m128i v = _mm_unpacklo_epi8(_mm_cvtsi32_si128(w), zero);
+        return _mm_unpacklo_epi16(v, zero);
+    }
+    __m128i v = _mm_loadu_si128((const __m128i *) p);
+    if (nBands == 3)
+        v = _mm_shuffle_epi8(v, _mm_setr_epi8(0, 1, 2, -1, 3, 4, 5, -1,
+                                              6, 7, 8, -1, 9, 10, 11, -1));
+    return v;
+}
+
+static IMAGELIB_TARGET_SSSE3 inline void StoreBytePixels(uchar* p, int nBands, __m128i v)
+{
+    // One pixel per 32-bit lane -> 4 pixels of 1 (lanes < 256), 3, or 4 bands
+    if (nBands == 1)
+    {
+        v = _mm_packus_epi16(_mm_packs_epi32(v, v), v);
+        int w = _mm_cvtsi128_si32(v);
+        memcpy(p, &w, 4);
+        return;
+    }
+    if (nBands == 3)
+    {
+        // (exactly 12 bytes, so the bands a caller keeps are not touched)
+        v = _mm_shuffle_epi8(v, _mm_setr_epi8(0, 1, 2, 4, 5, 6, 8, 9,
+                                              10, 12, 13, 14, -1, -1, -1, -1));
+        _mm_storel_epi64((__m128i *) p, v);
+        int w = _mm_cvtsi128_si32(_mm_srli_si128(v, 8));
+        memcpy(p + 8, &w, 4);
+        return;
+    }
+    _mm_storeu_si128((__m128i *) p, v);
+}
+
+static IMAGELIB_TARGET_SSSE3 inline __m128i ByteBand(__m128i v, int band)
+{
+    return _mm_and_si128(_mm_srl_epi32(v, _mm_cvtsi32_si128(8*band)),
+                         _mm_set1_epi32(0xff));
+}
+
+static IMAGELIB_TARGET_SSSE3 inline __m128i ToByteBand(__m128i v, int band)
+{
+    return _mm_sll_epi32(v, _mm_cvtsi32_si128(8*band));
+}
+
+static IMAGELIB_TARGET_SSSE3 inline void LoadFloatBands(const float* p, int nBands, __m128 band[4])
+{
+    // 4 pixels of 1, 3, or 4 bands -> one vector per band
+    //  (band[3] of 3-band pixels is garbage)
+    band[0] = _mm_loadu_ps(p);
+    if (nBands == 1)
+    {
+        band[1] = band[2] = band[3] = _mm_setzero_ps();
+        return;
+    }
+    band[1] = _mm_loadu_ps(p + nBands);
+    band[2] = _mm_loadu_ps(p + 2*nBands);
+    band[3] = _mm_loadu_ps(p + 3*nBands);
+    _MM_TRANSPOSE4_PS(band[0], band[1], band[2], band[3]);
+}
+
+static IMAGELIB_TARGET_SSSE3 inline void StoreFloatBands(float* p, int nBands, __m128 band[4])
+{
+    // One vector per band -> 4 pixels of 1, 3, or 4 bands  (for 3 bands,
+    //  the 4th value of each store is overwritten by the next one)
+    if (nBands == 1)
+    {
+        _mm_storeu_ps(p, band[0]);
+        return;
+    }
+    _MM_TRANSPOSE4_PS(band[0], band[1], band[2], band[3]);
+    _mm_storeu_ps(p, band[0]);
+    _mm_storeu_ps(p + nBands, band[1]);
+    _mm_storeu_ps(p + 2*nBands, band[2]);
+    _mm_storeu_ps(p + 3*nBands, band[3]);
+}
+
+static inline bool LineSIMD(int nBands1, int nBands2 = 1)
+{
+    return CpuHas(eCpuSSSE3) &&
+        (nBands1 == 1 || nBands1 == 3 || nBands1 == 4) &&
+        (nBands2 == 1 || nBands2 == 3 || nBands2 == 4);
+}
+
+static inline int LineReach(int nBands1, int nBands2 = 1)
+{
+    // Pixels that must remain for a 4-pixel step (16-byte 3-band access)
+    return (nBands1 == 3 || nBands2 == 3) ? 6 : 4;
+}
+
+static IMAGELIB_TARGET_SSSE3 int RGBToGrayByte(uchar* src, int sBands, uchar* dst, int n,
+                                               float minVal, float maxVal)
+{
+    __m128 cR = _mm_set1_ps(0.212671f), cG = _mm_set1_ps(0.715160f);
+    __m128 cB = _mm_set1_ps(0.072169f);
+    __m128 lo = _mm_set1_ps(minVal), hi = _mm_set1_ps(maxVal);
+    int i, reach = LineReach(sBands);
+    for (i = 0; i + reach <= n; i += 4)
+    {
+        __m128i v = LoadBytePixels(&src[sBands*i], sBands);
+        __m128 B = _mm_cvtepi32_ps(ByteBand(v, 0));
+        __m128 G = _mm_cvtepi32_ps(ByteBand(v, 1));
+        __m128 R = _mm_cvtepi32_ps(ByteBand(v, 2));
+        __m128 Y = _mm_add_ps(_mm_add_ps(_mm_mul_ps(cR, R), _mm_mul_ps(cG, G)),
+                              _mm_mul_ps(cB, B));
+        Y = _mm_min_ps(hi, _mm_max_ps(lo, Y));
+        StoreBytePixels(&dst[i], 1, _mm_cvttps_epi32(Y));
+    }
+    return i;
+}
+
+static IMAGELIB_TARGET_SSSE3 int RGBToGrayFloat(float* src, int sBands, float* dst, int n,
+                                                float minVal, float maxVal)
+{
+    __m128 cR = _mm_set1_ps(0.212671f), cG = _mm_set1_ps(0.715160f);
+    __m128 cB = _mm_set1_ps(0.072169f);
+    __m128 lo = _mm_set1_ps(minVal), hi = _mm_set1_ps(maxVal);
+    int i, reach = LineReach(sBands);
+    for (i = 0; i + reach <= n; i += 4)
+    {
+        __m128 band[4];
+        LoadFloatBands(&src[sBands*i], sBands, band);
+        __m128 Y = _mm_add_ps(_mm_add_ps(_mm_mul_ps(cR, band[2]), _mm_mul_ps(cG, band[1])),
+                              _mm_mul_ps(cB, band[0]));
+        Y = _mm_min_ps(hi, _mm_max_ps(lo, Y));
+        _mm_storeu_ps(&dst[i], Y);
+    }
+    return i;
+}
+
+static IMAGELIB_TARGET_SSSE3 int GrayToRGBAByte(uchar* src, uchar* dst, int n, uchar alpha)
+{
+    __m128i a = _mm_set1_epi32(alpha << 24);
+    int i;
+    for (i = 0; i + 4 <= n; i += 4)
+    {
+        __m128i g = LoadBytePixels(&src[i], 1);
+        __m128i v = _mm_or_si128(_mm_or_si128(g, ToByteBand(g, 1)),
+                                 _mm_or_si128(ToByteBand(g, 2), a));
+        StoreBytePixels(&dst[4*i], 4, v);
+    }
+    return i;
+}
+
+static IMAGELIB_TARGET_SSSE3 int GrayToRGBAWord(float* src, float* dst, int n, float alpha)
+{
+    // (4-byte pixels are only moved, so int pixels can be treated as floats)
+    int i;
+    for (i = 0; i + 4 <= n; i += 4)
+    {
+        __m128 band[4];
+        band[0] = band[1] = band[2] = _mm_loadu_ps(&src[i]);
+        band[3] = _mm_set1_ps(alpha);
+        StoreFloatBands(&dst[4*i], 4, band);
+    }
+    return i;
+}
+
+static IMAGELIB_TARGET_SSSE3 int ExtractBandByte(uchar* src, int sBands, int sBand,
+                                                 uchar* dst, int n)
+{
+    int i, reach = LineReach(sBands);
+    for (i = 0; i + reach <= n; i += 4)
+    {
+        __m128i v = LoadBytePixels(&src[sBands*i], sBands);
+        StoreBytePixels(&dst[i], 1, ByteBand(v, sBand));
+    }
+    return i;
+}
+
+static IMAGELIB_TARGET_SSSE3 int ExtractBandWord(float* src, int sBands, int sBand,
+                                                 float* dst, int n)
+{
+    int i, reach = LineReach(sBands);
+    for (i = 0; i + reach <= n; i += 4)
+    {
+        __m128 band[4];
+        LoadFloatBands(&src[sBands*i], sBands, band);
+        _mm_storeu_ps(&dst[i], band[sBand]);
+    }
+    return i;
+}
+
+static IMAGELIB_TARGET_SSSE3 int SwapRBByte(uchar* src, int sBands, uchar* dst, int dBands,
+                                            int n, uchar alpha)
+{
+    __m128i swap = _mm_setr_epi8(2, 1, 0, 3, 6, 5, 4, 7, 10, 9, 8, 11, 14, 13, 12, 15);
+    __m128i a = _mm_set1_epi32((sBands == 4) ? 0 : alpha << 24);
+    int i, reach = LineReach(sBands, dBands);
+    for (i = 0; i + reach <= n; i += 4)
+    {
+        __m128i v = LoadBytePixels(&src[sBands*i], sBands);
+        v = _mm_or_si128(_mm_shuffle_epi8(v, swap), a);
+        StoreBytePixels(&dst[dBands*i], dBands, v);
+    }
+    return i;
+}
+
+static IMAGELIB_TARGET_SSSE3 int ByteToFloatSIMD(uchar* src, int sBands, float* dst, int dBands,
+                                                 int n, bool reverseBands)
+{
+    int nB = __min(sBands, dBands);
+    __m128 scale = _mm_set1_ps(255.0f);
+    int i, reach = LineReach(sBands, dBands);
+    for (i = 0; i + reach <= n; i += 4)
+    {
+        __m128i v = LoadBytePixels(&src[sBands*i], sBands);
+        __m128 band[4];
+        band[0] = band[1] = band[2] = band[3] = _mm_setzero_ps();
+        if (nB < dBands)
+            LoadFloatBands(&dst[dBands*i], dBands, band);   // keep the others
+        for (int b = 0; b < nB; b++)
+            band[reverseBands ? nB-1-b : b] =
+                _mm_div_ps(_mm_cvtepi32_ps(ByteBand(v, b)), scale);
+        StoreFloatBands(&dst[dBands*i], dBands, band);
+    }
+    return i;
+}
+
+static IMAGELIB_TARGET_SSSE3 int FloatToByteSIMD(float* src, int sBands, uchar* dst, int dBands,
+                                                 int n, bool reverseBands)
+{
+    // floor(v) clipped to [0, 255] == truncate(v clipped to [0, 255]),
+    //  and max() maps NaN to 0 as the scalar (uchar) cast does
+    int nB = __min(sBands, dBands);
+    __m128 scale = _mm_set1_ps(255.0f), half = _mm_set1_ps(0.5f);
+    __m128 lo = _mm_setzero_ps(), hi = _mm_set1_ps(255.0f);
+    __m128i keep = _mm_set1_epi32((nB == 4) ? 0 : (int) (0xffffffffu << (8*nB)));
+    int i, reach = LineReach(sBands, dBands);
+    for (i = 0; i + reach <= n; i += 4)
+    {
+        __m128 band[4];
+        LoadFloatBands(&src[sBands*i], sBands, band);
+        __m128i v = _mm_setzero_si128();
+        if (nB < dBands)
+            v = _mm_and_si128(LoadBytePixels(&dst[dBands*i], dBands), keep);
+        for (int b = 0; b < nB; b++)
+        {
+            __m128 value = _mm_add_ps(_mm_mul_ps(scale, band[b]), half);
+            value = _mm_min_ps(_mm_max_ps(value, lo), hi);
+            v = _mm_or_si128(v, ToByteBand(_mm_cvttps_epi32(value),
+                                           reverseBands ? nB-1-b : b));
+        }
+        StoreBytePixels(&dst[dBands*i], dBands, v);
+    }
+    return i;
+}
+
+// Dispatch:  the number of leading pixels converted with SIMD code
+
+template <class T>
+static int RGBToGraySIMD(T* src, int sBands, T* dst, int n, T minVal, T maxVal)
+{
+    return 0;
+}
+
+static int RGBToGraySIMD(uchar* src, int sBands, uchar* dst, int n,
+                         uchar minVal, uchar maxVal)
+{
+    return (sBands >= 3 && LineSIMD(sBands)) ?
+        RGBToGrayByte(src, sBands, dst, n, minVal, maxVal) : 0;
+}
+
+static int RGBToGraySIMD(float* src, int sBands, float* dst, int n,
+                         float minVal, float maxVal)
+{
+    return (sBands >= 3 && LineSIMD(sBands)) ?
+        RGBToGrayFloat(src, sBands, dst, n, minVal, maxVal) : 0;
+}
+
+static int GrayToRGBASIMD(uchar* src, uchar* dst, int n, uchar alpha)
+{
+    return LineSIMD(1) ? GrayToRGBAByte(src, dst, n, alpha) : 0;
+}
+
+template <class T>
+static int GrayToRGBASIMD(T* src, T* dst, int n, T alpha)
+{
+    float a;
+    memcpy(&a, &alpha, sizeof(a));
+    return (sizeof(T) == sizeof(float) && LineSIMD(1)) ?
+        GrayToRGBAWord((float *) src, (float *) dst, n, a) : 0;
+}
+
+static int ExtractBandSIMD(uchar* src, int sBands, int sBand, uchar* dst, int n)
+{
+    return LineSIMD(sBands) ? ExtractBandByte(src, sBands, sBand, dst, n) : 0;
+}
+
+template <class T>
+static int ExtractBandSIMD(T* src, int sBands, int sBand, T* dst, int n)
+{
+    return (sizeof(T) == sizeof(float) && LineSIMD(sBands)) ?
+        ExtractBandWord((float *) src, sBands, sBand, (float *) dst, n) : 0;
+}
+
+static int SwapRBSIMD(uchar* src, int sBands, uchar* dst, int dBands,
+                      int n, uchar alpha)
+{
+    return (__min(sBands, dBands) >= 3 && LineSIMD(sBands, dBands)) ?
+        SwapRBByte(src, sBands, dst, dBands, n, alpha) : 0;
+}
+
+static int ByteToFloatLineSIMD(uchar* src, int sBands, float* dst, int dBands,
+                               int n, bool reverseBands)
+{
+    return LineSIMD(sBands, dBands) ?
+        ByteToFloatSIMD(src, sBands, dst, dBands, n, reverseBands) : 0;
+}
+
+static int FloatToByteLineSIMD(float* src, int sBands, uchar* dst, int dBands,
+                               int n, bool reverseBands)
+{
+    return LineSIMD(sBands, dBands) ?
+        FloatToByteSIMD(src, sBands, dst, dBands, n, reverseBands) : 0;
+}
+
+#else
+
+template <class T>
+static int RGBToGraySIMD(T* src, int sBands, T* dst, int n, T minVal, T maxVal)
+{
+    return 0;
+}
+
+template <class T>
+static int GrayToRGBASIMD(T* src, T* dst, int n, T alpha)
+{
+    return 0;
+}
+
+template <class T>
+static int ExtractBandSIMD(T* src, int sBands, int sBand, T* dst, int n)
+{
+    return 0;
+}
+
+static int SwapRBSIMD(uchar* src, int sBands, uchar* dst, int dBands,
+                      int n, uchar alpha)
+{
+    return 0;
+}
+
+static int ByteToFloatLineSIMD(uchar* src, int sBands, float* dst, int dBands,
+                               int n, bool reverseBands)
+{
+    return 0;
+}
+
+static int FloatToByteLineSIMD(float* src, int sBands, uchar* dst, int dBands,
+                               int n, bool reverseBands)
+{
+    return 0;
+}
+
+#endif
+
+template <class T>
+void RGBToGrayLine(T* src, int sBands, T* dst, int n, T minVal, T maxVal)
+{
+    int i = RGBToGraySIMD(src, sBands, dst, n, minVal, maxVal);
+    RGBToGrayScalar(src + sBands*i, sBands, dst + i, n - i, minVal, maxVal);
+}
+
+template <class T>
+void GrayToRGBALine(T* src, T* dst, int n, T alpha)
+{
+    int i = GrayToRGBASIMD(src, dst, n, alpha);
+    GrayToRGBAScalar(src + i, dst + 4*i, n - i, alpha);
+}
+
+template <class T>
+void ExtractBandLine(T* src, int sBands, int sBand, T* dst, int n)
+{
+    int i = ExtractBandSIMD(src, sBands, sBand, dst, n);
+    ExtractBandScalar(src + sBands*i, sBands, sBand, dst + i, n - i);
+}
+
+void SwapRBLine(uchar* src, int sBands, uchar* dst, int dBands,
+                int n, uchar alpha)
+{
+    int i = SwapRBSIMD(src, sBands, dst, dBands, n, alpha);
+    SwapRBScalar(src + sBands*i, sBands, dst + dBands*i, dBands, n - i, alpha);
+}
+
+void ByteToFloatLine(uchar* src, int sBands, float* dst, int dBands,
+                     int n, bool reverseBands)
+{
+    int i = ByteToFloatLineSIMD(src, sBands, dst, dBands, n, reverseBands);
+    ByteToFloatScalar(src + sBands*i, sBands, dst + dBands*i, dBands,
+                      n - i, reverseBands);
+}
+
+void FloatToByteLine(float* src, int sBands, uchar* dst, int dBands,
+                     int n, bool reverseBands)
+{
+    int i = FloatToByteLineSIMD(src, sBands, dst, dBands, n, reverseBands);
+    FloatToByteScalar(src + sBands*i, sBands, dst + dBands*i, dBands,
+                      n - i, reverseBands);
+}
+
 template <class T>
 CImageOf<T> ConvertToRGBA(CImageOf<T> src)
 {
@@ -94,6 +819,11 @@ CImageOf<T> ConvertToRGBA(CImageOf<T> src)
     {
         T* srcP = &src.Pixel(0, y, 0);
         T* dstP = &dst.Pixel(0, y, 0);
+        if (aC == 3)
+        {
+            GrayToRGBALine(srcP, dstP, sShape.width, (T) 255);
+            continue;
+        }
         for (int x = 0; x < sShape.width; x++, srcP++)
             for (int b = 0; b < dShape.nBands; b++, dstP++)
                 *dstP = (b == aC) ? 255 : *srcP;
@@ -128,14 +858,8 @@ CImageOf<T> ConvertToGray(CImageOf<T> src)
     T maxVal = dst.MaxVal();
     for (int y = 0; y < sShape.height; y++)
     {
-        T* srcP = &src.Pixel(0, y, 0);
-        T* dstP = &dst.Pixel(0, y, 0);
-        for (int x = 0; x < sShape.width; x++, srcP += 3/*4*/, dstP++)
-        {
-            RGBA<T>& p = *(RGBA<T> *) srcP;
-            float Y = 0.212671f * p.R + 0.715160f * p.G + 0.072169f * p.B;
-            *dstP = (T) __min(maxVal, __max(minVal, Y));
-        }
+        RGBToGrayLine(&src.Pixel(0, y, 0), 3/*4*/, &dst.Pixel(0, y, 0),
+                      sShape.width, minVal, maxVal);
     }
     return dst;
 }
@@ -169,6 +893,11 @@ void BandSelect(CImageOf<T>& src, CImageOf<T>& dst, int sBand, int dBand)
     {
         T* srcP = &src.Pixel(0, y, 0);
         T* dstP = &dst.Pixel(0, y, 0);
+        if (dB == 1)
+        {
+            ExtractBandLine(srcP, sB, sBand, dstP, sShape.width);
+            continue;
+        }
         for (int x = 0; x < sShape.width; x++, srcP += sB, dstP += dB)
             dstP[dBand] = srcP[sBand];
     }
@@ -198,6 +927,31 @@ void InstantiateConvert(CImageOf<T> src)
     BandSelect(r1, r2, 0, 0);
 }
 
+#define INSTANTIATE_LINE(T1, T2) \
+    template void ScaleAndOffsetLine(T1* src, T2* dst, int n, \
+                                     float scale, float offset, \
+                                     T2 minVal, T2 maxVal);
+
+INSTANTIATE_LINE(uchar, uchar)
+INSTANTIATE_LINE(uchar, int)
+INSTANTIATE_LINE(uchar, float)
+INSTANTIATE_LINE(int, uchar)
+INSTANTIATE_LINE(int, int)
+INSTANTIATE_LINE(int, float)
+INSTANTIATE_LINE(float, uchar)
+INSTANTIATE_LINE(float, int)
+INSTANTIATE_LINE(float, float)
+
+#define INSTANTIATE_BAND_LINES(T) \
+    template void RGBToGrayLine(T* src, int sBands, T* dst, int n, \
+                                T minVal, T maxVal); \
+    template void GrayToRGBALine(T* src, T* dst, int n, T alpha); \
+    template void ExtractBandLine(T* src, int sBands, int sBand, T* dst, int n);
+
+INSTANTIATE_BAND_LINES(uchar)
+INSTANTIATE_BAND_LINES(int)
+INSTANTIATE_BAND_LINES(float)
+
 void InstantiateAllConverts(void)
 {
     InstantiateConvert(CByteImage());
@@ -10,6 +10,12 @@
 //                       float scale, float offset);
 //      -- scale and offset one image into another (optionally convert type)
 //
+//  void ScaleAndOffsetLine(T1* src, T2* dst, int n, float scale,
+//                          float offset, T2 minVal, T2 maxVal);
+//      -- the same for n values, clipping to [minVal, maxVal] if
+//          minVal < maxVal;  SIMD code (chosen at run time, see
+//          CpuFeatures.h) is used for the uchar, int and float pairs
+//
 //  void CopyPixels(CImageOf<T1>& src, CImageOf<T2>& dst);
 //      -- convert pixel types or just copy pixels from src to dst
 //
@@ -23,6 +29,33 @@
 //  void BandSelect(CImageOf<T>& src, CImageOf<T>& dst, int sBand, int dBand);
 //      -- copy the sBand from src into the dBand in dst
 //
+//  The following line kernels do the per-row work of the routines above
+//  (and of the FLTK / OpenGL conversions in Project2.cpp).  n is the
+//  number of pixels, and sBands, dBands the number of bands per pixel.
+//  All of them have SIMD versions for the common band counts (1, 3, 4),
+//  chosen at run time, that give exactly the same results:
+//
+//  void RGBToGrayLine(T* src, int sBands, T* dst, int n, T minVal, T maxVal);
+//      -- Y formula above, from 3 or 4-band (B, G, R[, A]) pixels
+//
+//  void GrayToRGBALine(T* src, T* dst, int n, T alpha);
+//      -- gray to 4-band pixels (alpha in band 3)
+//
+//  void ExtractBandLine(T* src, int sBands, int sBand, T* dst, int n);
+//      -- copy band sBand into a 1-band line
+//
+//  void SwapRBLine(uchar* src, int sBands, uchar* dst, int dBands,
+//                  int n, uchar alpha);
+//      -- RGB[A] <-> BGR[A], setting band 3 to alpha if src has 3 bands
+//
+//  void ByteToFloatLine(uchar* src, int sBands, float* dst, int dBands,
+//                       int n, bool reverseBands);
+//  void FloatToByteLine(float* src, int sBands, uchar* dst, int dBands,
+//                       int n, bool reverseBands);
+//      -- convert the first min(sBands, dBands) bands between [0, 255]
+//          and [0, 1] (v / 255, and floor(255 v + 0.5) clipped to [0, 255]),
+//          optionally reversing their order;  other bands are untouched
+//
 //  The ScaleAndOffset and CopyPixels routines will reallocate dst if it
 //  doesn't conform in shape to src.  So will BandSelect, except that the
 //  number of bands in src and dst is allowed to differ (if dst is
@@ -48,6 +81,11 @@ template <class T1, class T2>
 void ScaleAndOffset(CImageOf<T1>& src, CImageOf<T2>& dst,
                     float scale, float offset);
 
+template <class T1, class T2>
+void ScaleAndOffsetLine(T1* src, T2* dst, int n,
+                        float scale, float offset,
+                        T2 minVal, T2 maxVal);
+
 template <class T1, class T2>
 void CopyPixels(CImageOf<T1>& src, CImageOf<T2>& dst)
 {
@@ -63,3 +101,21 @@ CImageOf<T> ConvertToGray(CImageOf<T> src);
 template <class T>
 void BandSelect(CImageOf<T>& src, CImageOf<T>& dst, int sBand, int dBand);
 
+template <class T>
+void RGBToGrayLine(T* src, int sBands, T* dst, int n, T minVal, T maxVal);
+
+template <class T>
+void GrayToRGBALine(T* src, T* dst, int n, T alpha);
+
+template <class T>
+void ExtractBandLine(T* src, int sBands, int sBand, T* dst, int n);
+
+void SwapRBLine(uchar* src, int sBands, uchar* dst, int dBands,
+                int n, uchar alpha);
+
+void ByteToFloatLine(uchar* src, int sBands, float* dst, int dBands,
+                     int n, bool reverseBands);
+
+void FloatToByteLine(float* src, int sBands, uchar* dst, int dBands,
+                     int n, bool reverseBands);
+
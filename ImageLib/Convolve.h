@@ -25,6 +25,9 @@
 //  by the kernel.origin[] parameters, which specify the offset (coordinate,
 //  usually negative) of the first (top-left) pixel in the kernel.
 //
+//  Ranges of rows are convolved in parallel (see ParallelFor in
+//  ThreadPool.h), with the same results as on one thread.
+//
 // SEE ALSO
 //  Convolve.cpp        implementation
 //  Image.h             image class definition
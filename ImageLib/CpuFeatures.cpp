@@ -0,0 +1,117 @@
+///////////////////////////////////////////////////////////////////////////
+//
+// NAME
+//  CpuFeatures.cpp -- run-time detection of the processor's SIMD extensions
+//
+// SEE ALSO
+//  CpuFeatures.h       longer description
+//
+///////////////////////////////////////////////////////////////////////////
+
+#include "CpuFeatures.h"
+#include <string.h>
+#include <atomic>
+
+#if defined(IMAGELIB_X86) && defined(_MSC_VER)
+#include <intrin.h>
+
+static int DetectCpuFeatures(void)
+{
+    int info[4], features = 0;
+    __cpuid(info, 0);
+    int maxLeaf = info[0];
+    __cpuid(info, 1);
+    if (info[3] & (1 << 26)) features |= eCpuSSE2;
+    if (info[2] & (1 <<  9)) features |= eCpuSSSE3;
+    if (info[2] & (1 << 19)) features |= eCpuSSE41;
+
+    // AVX also needs the OS to save the YMM registers (OSXSAVE + XCR0)
+    bool osAVX = (info[2] & (1 << 27)) && (_xgetbv(0) & 6) == 6;
+    if (osAVX && (info[2] & (1 << 28))) features |= eCpuAVX;
+    if (osAVX && (info[2] & (1 << 12))) features |= eCpuFMA;
+    if (osAVX && maxLeaf >= 7)
+    {
+        // (AVX-512 also needs the OS to save the opmask and ZMM registers)
+        bool osAVX512 = (_xgetbv(0) & 0xe6) == 0xe6;
+        __cpuidex(info, 7, 0);
+        if (info[1] & (1 << 5)) features |= eCpuAVX2;
+        if (osAVX512 && (info[1] & (1 << 16)) && (info[1] & (1 << 30)))
+            features |= eCpuAVX512;
+    }
+    return features;
+}
+
+#elif defined(IMAGELIB_X86) && defined(__GNUC__)
+
+static int DetectCpuFeatures(void)
+{
+    // (these also check that the OS saves the AVX state)
+    __builtin_cpu_init();
+    int features = 0;
+    if (__builtin_cpu_supports("sse2"))   features |= eCpuSSE2;
+    if (__builtin_cpu_supports("ssse3"))  features |= eCpuSSSE3;
+    if (__builtin_cpu_supports("sse4.1")) features |= eCpuSSE41;
+    if (__builtin_cpu_supports("avx"))    features |= eCpuAVX;
+    if (__builtin_cpu_supports("avx2"))   features |= eCpuAVX2;
+    if (__builtin_cpu_supports("fma"))    features |= eCpuFMA;
+    if (__builtin_cpu_supports("avx512f") && __builtin_cpu_supports("avx512bw"))
+        features |= eCpuAVX512;
+    return features;
+}
+
+#else
+
+static int DetectCpuFeatures(void)
+{
+    return 0;
+}
+
+#endif
+
+static std::atomic<int> featureLimit(-1);
+
+int CpuFeatures(void)
+{
+    static int features = DetectCpuFeatures();
+    return features & featureLimit.load(std::memory_order_relaxed);
+}
+
+void CpuLimitFeatures(int features)
+{
+    featureLimit.store(features);
+}
+
+// Instruction set levels, each including the ones before it
+
+static const struct
+{
+    const char *name;
+    int features;
+} isaLevels[] =
+{
+    {"scalar",  0},
+    {"sse2",    eCpuSSE2},
+    {"ssse3",   eCpuSSE2 | eCpuSSSE3},
+    {"sse4.1",  eCpuSSE2 | eCpuSSSE3 | eCpuSSE41},
+    {"avx2",    eCpuSSE2 | eCpuSSSE3 | eCpuSSE41 | eCpuAVX | eCpuAVX2 | eCpuFMA},
+    {"avx512",  eCpuSSE2 | eCpuSSSE3 | eCpuSSE41 | eCpuAVX | eCpuAVX2 | eCpuFMA | eCpuAVX512}
+};
+
+static const int nISALevels = sizeof(isaLevels) / sizeof(isaLevels[0]);
+
+int CpuISAFeatures(const char *name)
+{
+    for (int i = 0; i < nISALevels; i++)
+        if (strcmp(name, isaLevels[i].name) == 0)
+            return isaLevels[i].features;
+    return -1;
+}
+
+const char *CpuISAName(int features)
+{
+    const char *name = isaLevels[0].name;
+    for (int i = 1; i < nISALevels; i++)
+        if ((features & isaLevels[i].features) == isaLevels[i].features)
+            name = isaLevels[i].name;
+    return name;
+}
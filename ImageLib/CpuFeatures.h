@@ -0,0 +1,95 @@
+///////////////////////////////////////////////////////////////////////////
+//
+// NAME
+//  CpuFeatures.h -- run-time detection of the processor's SIMD extensions
+//
+// DESCRIPTION
+//  int CpuFeatures(void);
+//      -- bit mask of the ECpuFeature extensions that both the processor
+//          and the operating system support (detected on the first call)
+//
+//  bool CpuHas(int features);
+//      -- true if all of the given features are available
+//
+//  void CpuLimitFeatures(int features);
+//      -- make CpuFeatures() report at most the given features, so that
+//          the kernels fall back to an older instruction set (for A/B
+//          benchmarking and for reproducing results from older machines)
+//
+//  int CpuISAFeatures(const char *name);
+//  const char *CpuISAName(int features);
+//      -- the features of an instruction set level ("scalar", "sse2",
+//          "ssse3", "sse4.1", "avx2" or "avx512"; -1 if the name is not
+//          known), and the name of the highest level included in features
+//
+//  Kernels with SIMD variants are compiled for several instruction sets
+//  in the same translation unit (each variant is marked with one of the
+//  IMAGELIB_TARGET_* attributes, so no special compiler flags are needed)
+//  and pick a variant at run time with CpuHas().  Everything SIMD is
+//  guarded by IMAGELIB_X86;  on other processors only the scalar code is
+//  compiled and CpuFeatures() returns 0.  The variants of a kernel give
+//  the same results as its scalar code (bit for bit), so the instruction
+//  set only changes the speed.
+//
+//  The limit should be set at startup, before any kernels run (Project2
+//  and Bench take it from --isa or the PANORAMA_ISA environment variable).
+//
+// SEE ALSO
+//  CpuFeatures.cpp     implementation
+//  Convert.cpp         SIMD pixel type conversion
+//  Convolve.cpp        SIMD convolution
+//  WarpImage.cpp       SIMD bilinear resampling
+//
+///////////////////////////////////////////////////////////////////////////
+
+enum ECpuFeature
+{
+    eCpuSSE2    = 1 << 0,
+    eCpuSSSE3   = 1 << 1,
+    eCpuSSE41   = 1 << 2,
+    eCpuAVX     = 1 << 3,
+    eCpuAVX2    = 1 << 4,
+    eCpuFMA     = 1 << 5,
+    eCpuAVX512  = 1 << 6        // AVX-512 F and BW
+};
+
+int CpuFeatures(void);
+
+inline bool CpuHas(int features)
+{
+    return (CpuFeatures() & features) == features;
+}
+
+void CpuLimitFeatures(int features);
+int CpuISAFeatures(const char *name);
+const char *CpuISAName(int features);
+
+#if defined(__x86_64__) || defined(__i386__) || defined(_M_X64) || defined(_M_IX86)
+#define IMAGELIB_X86 1
+#endif
+
+#if defined(IMAGELIB_X86) && defined(__GNUC__)
+#define IMAGELIB_TARGET_SSE2    __attribute__((target("sse2")))
+#define IMAGELIB_TARGET_SSSE3   __attribute__((target("ssse3")))
+#define IMAGELIB_TARGET_SSE41   __attribute__((target("sse4.1")))
+#define IMAGELIB_TARGET_AVX2    __attribute__((target("avx2")))
+#define IMAGELIB_TARGET_AVX512  __attribute__((target("avx512f,avx512bw")))
+#else
+#define IMAGELIB_TARGET_SSE2
+#define IMAGELIB_TARGET_SSSE3
+#define IMAGELIB_TARGET_SSE41
+#define IMAGELIB_TARGET_AVX2
+#define IMAGELIB_TARGET_AVX512
+#endif
+
+// GCC 12 warns that its own AVX-512 intrinsics read uninitialized values
+//  (GCC bug 105593), so the AVX-512 kernels are bracketed by these
+#if defined(__GNUC__) && ! defined(__clang__)
+#define IMAGELIB_AVX512_BEGIN   _Pragma("GCC diagnostic push") \
+    _Pragma("GCC diagnostic ignored \"-Wuninitialized\"") \
+    _Pragma("GCC diagnostic ignored \"-Wmaybe-uninitialized\"")
+#define IMAGELIB_AVX512_END     _Pragma("GCC diagnostic pop")
+#else
+#define IMAGELIB_AVX512_BEGIN
+#define IMAGELIB_AVX512_END
+#endif
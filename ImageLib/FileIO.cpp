@@ -18,7 +18,13 @@
 ///////////////////////////////////////////////////////////////////////////
 
 #include "Image.h"
+#include <stddef.h>
+#include <vector>
 #include "FileIO.h"
+#include "Convolve.h"
+#include "Pyramid.h"
+#include "TilePyramid.h"
+#include "Profile.h"
 
 //
 //  Truevision Targa (TGA):  support 24 bit RGB and 32-bit RGBA files
@@ -50,6 +56,10 @@ const int TargaRunColormap	= 9;
 const int TargaRunRGB		= 10;
 const int TargaRunBW		= 11;
 
+// Identification field marking a header origin written by WriteFileTGA
+//  (other programs use the origin fields for other things)
+static const char TargaOriginTag[] = "ImageLib origin";
+
 // Descriptor fields
 const int TargaAttrBits     = 15;
 const int TargaScreenOrigin = (1<<5);
@@ -119,15 +129,16 @@ void ReadFileTGA(CByteImage& img, const char* filename)
     if (fread(&h, sizeof(CTargaHead), 1, stream) != 1)
 	    throw CError("ReadFileTGA(%s): file is too short", filename);
 
-    // Throw away the image descriptor
+    // Read the image identification (only checked for the origin tag)
+    char id[256];
     if (h.idLength > 0)
     {
-        char* tmp = new char[h.idLength];
-        int nread = fread(tmp, sizeof(uchar), h.idLength, stream);
-        delete tmp;   // throw away this data
+        int nread = fread(id, sizeof(uchar), h.idLength, stream);
         if (nread != h.idLength)
 	        throw CError("ReadFileTGA(%s): file is too short", filename);
     }
+    bool hasOrigin = h.idLength == sizeof(TargaOriginTag) - 1 &&
+        memcmp(id, TargaOriginTag, h.idLength) == 0;
     bool isRun = (h.imageType & 8) != 0;
     bool reverseRows = (h.descriptor & TargaScreenOrigin) != 0;
     int fileBytes = (h.pixelSize + 7) / 8;
@@ -166,8 +177,11 @@ void ReadFileTGA(CByteImage& img, const char* filename)
     // Determine the image shape
     CShape sh(h.width, h.height, (isGray) ? 1 : 4);
     
-    // Allocate the image if necessary
+    // Allocate the image if necessary (the header's origin, in files that
+    //  WriteFileTGA tagged, is where the image was cropped from)
     img.ReAllocate(sh, false);
+    img.origin[0] = hasOrigin ? h.x0 : 0;
+    img.origin[1] = hasOrigin ? h.y0 : 0;
 
     // Construct a run-length code reader
     CTargaRLC rlc(! isRaw);
@@ -225,6 +239,11 @@ void WriteFileTGA(CImage img, const char* filename)
     int nBands = sh.nBands;
     if (nBands != 1 && nBands != 3 && nBands != 4)
         throw CError("WriteFileTGA(%s): can only write 1, 3, or 4 bands", filename);
+    if (sh.width > 32767 || sh.height > 32767)
+        throw CError("WriteFileTGA(%s): image is too large for Targa, use .ptl", filename);
+    for (int i = 0; i < 2; i++)
+        if (img.origin[i] < -32768 || img.origin[i] > 32767)
+            throw CError("WriteFileTGA(%s): origin is out of range for Targa", filename);
 
     // Only unsigned_8 supported directly
 #if 0   // broken for now
@@ -241,6 +260,11 @@ void WriteFileTGA(CImage img, const char* filename)
     memset(&h, 0, sizeof(h));
     h.imageType = (nBands == 1) ? TargaRawBW : TargaRawRGB;
         // TODO:  is TargaRawBW the right thing, or only binary?
+    h.x0        = img.origin[0];    // (e.g., the offset of a cropped warp)
+    h.y0        = img.origin[1];
+    bool hasOrigin = (h.x0 != 0 || h.y0 != 0);
+    if (hasOrigin)
+        h.idLength = sizeof(TargaOriginTag) - 1;
     h.width     = sh.width;
     h.height    = sh.height;
     h.pixelSize = 8 * nBands;
@@ -252,6 +276,8 @@ void WriteFileTGA(CImage img, const char* filename)
         throw CError("WriteFileTGA: could not open %s", filename);
     if (fwrite(&h, sizeof(CTargaHead), 1, stream) != 1)
 	    throw CError("WriteFileTGA(%s): file is too short", filename);
+    if (hasOrigin && fwrite(TargaOriginTag, 1, h.idLength, stream) != h.idLength)
+	    throw CError("WriteFileTGA(%s): file is too short", filename);
 
     // Write out the rows
     for (int y = 0; y < sh.height; y++)
@@ -267,8 +293,17 @@ void WriteFileTGA(CImage img, const char* filename)
         throw CError("WriteFileTGA(%s): error closing file", filename);
 }
 
+static long long ImageBytes(CImage& img)
+{
+    CShape sh = img.Shape();
+    return (long long) sh.width * sh.height * sh.nBands * img.BandSize();
+}
+
 void ReadFile (CImage& img, const char* filename)
 {
+    CProfileScope scope(eProfReadFile);
+    CMemoryTag tag(eMemImage);
+
     // Determine the file extension
     const char *dot = strrchr(filename, '.');
     if (strcmp(dot, ".tga") == 0 || strcmp(dot, ".tga") == 0)
@@ -280,12 +315,23 @@ void ReadFile (CImage& img, const char* filename)
         else
            throw CError("ReadFile(%s): haven't implemented conversions yet", filename);
     }
+    else if (strcmp(dot, ".ptl") == 0)
+    {
+        if ((&img.PixType()) == 0)
+            img.ReAllocate(CShape(), typeid(uchar), sizeof(uchar), true);
+        if (img.PixType() != typeid(uchar))
+           throw CError("ReadFile(%s): haven't implemented conversions yet", filename);
+        ReadTiledRegion(*(CByteImage *) &img, filename, 0, 0, -1, -1);
+    }
     else
         throw CError("ReadFile(%s): file type not supported", filename);
+    ProfileCount(eProfBytesRead, ImageBytes(img));
 }
 
 void WriteFile(CImage& img, const char* filename)
 {
+    CProfileScope scope(eProfWriteFile);
+
     // Determine the file extension
     const char *dot = strrchr(filename, '.');
     if (strcmp(dot, ".tga") == 0 || strcmp(dot, ".tga") == 0)
@@ -297,4 +343,396 @@ void WriteFile(CImage& img, const char* filename)
     }
     else
         throw CError("WriteFile(%s): file type not supported", filename);
+    ProfileCount(eProfBytesWritten, ImageBytes(img));
+}
+
+//
+//  Streaming output:  write an image a region at a time
+//
+
+void CImageBufferSink::Begin(CShape sh)
+{
+    CMemoryTag tag(eMemMosaic);
+    image.ReAllocate(sh);
+}
+
+void CImageBufferSink::Write(CImage& region, int x, int y)
+{
+    CShape sh = region.Shape();
+    for (int r = 0; r < sh.height; r++)
+        memcpy(image.PixelAddress(x, y + r, 0), region.PixelAddress(0, r, 0),
+               sh.width * sh.nBands);
+}
+
+#ifdef WIN32
+#define FileSeek  _fseeki64
+#define FileTell  _ftelli64
+#else
+#define FileSeek  fseeko
+#define FileTell  ftello
+#endif
+
+class CTargaStripSink : public CImageSink
+{
+    // Write a Targa file one row band at a time
+public:
+    CTargaStripSink(const char* filename);
+    ~CTargaStripSink();
+    void Begin(CShape sh);
+    void Write(CImage& region, int x, int y);
+    void End(void);
+private:
+    std::string m_filename; // output file name
+    FILE* m_stream;         // output file
+    CShape m_shape;         // shape of complete image
+    int m_nextRow;          // next row expected
+};
+
+CTargaStripSink::CTargaStripSink(const char* filename) :
+    m_filename(filename), m_stream(0), m_nextRow(0)
+{
+}
+
+CTargaStripSink::~CTargaStripSink()
+{
+    if (m_stream)
+        fclose(m_stream);
+}
+
+void CTargaStripSink::Begin(CShape sh)
+{
+    const char* filename = m_filename.c_str();
+    if (sh.nBands != 1 && sh.nBands != 3 && sh.nBands != 4)
+        throw CError("WriteFileTGA(%s): can only write 1, 3, or 4 bands", filename);
+    if (sh.width > 32767 || sh.height > 32767)
+        throw CError("WriteFileTGA(%s): image is too large for Targa, use .ptl", filename);
+    m_shape = sh;
+    m_nextRow = 0;
+
+    // Fill in the header structure
+    CTargaHead h;
+    memset(&h, 0, sizeof(h));
+    h.imageType = (sh.nBands == 1) ? TargaRawBW : TargaRawRGB;
+    h.width     = sh.width;
+    h.height    = sh.height;
+    h.pixelSize = 8 * sh.nBands;
+
+    // Open the file and write the header
+    m_stream = fopen(filename, "wb");
+    if (m_stream == 0)
+        throw CError("WriteFileTGA: could not open %s", filename);
+    if (fwrite(&h, sizeof(CTargaHead), 1, m_stream) != 1)
+        throw CError("WriteFileTGA(%s): file is too short", filename);
+}
+
+void CTargaStripSink::Write(CImage& region, int x, int y)
+{
+    // Only complete rows, in order, can be streamed into a Targa file
+    const char* filename = m_filename.c_str();
+    CShape sh = region.Shape();
+    if (x != 0 || sh.width != m_shape.width || sh.nBands != m_shape.nBands)
+        throw CError("WriteFileTGA(%s): can only stream full-width row bands", filename);
+    if (y != m_nextRow || y + sh.height > m_shape.height)
+        throw CError("WriteFileTGA(%s): row bands must be written in order", filename);
+
+    int n = sh.width*sh.nBands;
+    for (int r = 0; r < sh.height; r++)
+    {
+        char* ptr = (char *) region.PixelAddress(0, r, 0);
+        if (fwrite(ptr, sizeof(uchar), n, m_stream) != (size_t) n)
+            throw CError("WriteFileTGA(%s): file is too short", filename);
+    }
+    m_nextRow += sh.height;
+}
+
+void CTargaStripSink::End(void)
+{
+    const char* filename = m_filename.c_str();
+    if (m_nextRow != m_shape.height)
+        throw CError("WriteFileTGA(%s): image is incomplete", filename);
+    FILE* stream = m_stream;
+    m_stream = 0;
+    if (fclose(stream))
+        throw CError("WriteFileTGA(%s): error closing file", filename);
+}
+
+//
+//  Tiled container (.ptl):  a header, the tile data (in the order the tiles
+//  were completed), and an index giving the file offset of every tile.
+//  Tiles are tileSize x tileSize (smaller along the right and bottom edges),
+//  and each tile is stored as raw interleaved rows.
+//
+
+struct CTiledHead
+{
+    char magic[4];          // "PTL1"
+    int width, height;      // image shape
+    int nBands;             // number of bands
+    int tileSize;           // width and height of a tile
+    int pad;                // keep indexOffset 8-byte aligned
+    long long indexOffset;  // offset of the tile index (0 while writing)
+};
+
+static const char TiledMagic[4] = {'P', 'T', 'L', '1'};
+
+class CTiledSink : public CImageSink
+{
+    // Write a tiled container, buffering at most one row of tiles
+public:
+    CTiledSink(const char* filename, int tileSize);
+    ~CTiledSink();
+    void Begin(CShape sh);
+    void Write(CImage& region, int x, int y);
+    void End(void);
+private:
+    void WriteTile(CImage& img, int x0, int y0, int tx, int ty);
+    void FlushTileRow(void);
+
+    std::string m_filename; // output file name
+    FILE* m_stream;         // output file
+    CShape m_shape;         // shape of complete image
+    int m_tileSize;         // width and height of a tile
+    int m_nTilesX;          // tiles per row
+    int m_nTilesY;          // rows of tiles
+    std::vector<long long> m_index; // file offset of each tile (-1 = missing)
+    CByteImage m_rowBuf;    // current row of tiles
+    int m_bufTileRow;       // tile row held in m_rowBuf
+    int m_bufRows;          // number of rows filled in m_rowBuf
+};
+
+CTiledSink::CTiledSink(const char* filename, int tileSize) :
+    m_filename(filename), m_stream(0), m_tileSize(tileSize),
+    m_nTilesX(0), m_nTilesY(0), m_bufTileRow(0), m_bufRows(0)
+{
+    if (tileSize <= 0)
+        throw CError("WriteFileTiled(%s): invalid tile size", filename);
+}
+
+CTiledSink::~CTiledSink()
+{
+    if (m_stream)
+        fclose(m_stream);
+}
+
+void CTiledSink::Begin(CShape sh)
+{
+    const char* filename = m_filename.c_str();
+    m_shape = sh;
+    m_nTilesX = (sh.width  + m_tileSize-1) / m_tileSize;
+    m_nTilesY = (sh.height + m_tileSize-1) / m_tileSize;
+    m_index.assign(m_nTilesX * m_nTilesY, -1);
+    CMemoryTag tag(eMemMosaic);
+    m_rowBuf.ReAllocate(CShape(sh.width, __min(m_tileSize, sh.height), sh.nBands));
+    m_bufTileRow = 0;
+    m_bufRows = 0;
+
+    CTiledHead h;
+    memset(&h, 0, sizeof(h));
+    memcpy(h.magic, TiledMagic, sizeof(h.magic));
+    h.width    = sh.width;
+    h.height   = sh.height;
+    h.nBands   = sh.nBands;
+    h.tileSize = m_tileSize;
+
+    m_stream = fopen(filename, "wb");
+    if (m_stream == 0)
+        throw CError("WriteFileTiled: could not open %s", filename);
+    if (fwrite(&h, sizeof(CTiledHead), 1, m_stream) != 1)
+        throw CError("WriteFileTiled(%s): file is too short", filename);
+}
+
+void CTiledSink::WriteTile(CImage& img, int x0, int y0, int tx, int ty)
+{
+    // Append tile (tx, ty), whose top-left pixel is at (x0, y0) in img
+    const char* filename = m_filename.c_str();
+    int w = __min(m_tileSize, m_shape.width  - tx*m_tileSize);
+    int h = __min(m_tileSize, m_shape.height - ty*m_tileSize);
+    int n = w * m_shape.nBands;
+    m_index[ty*m_nTilesX + tx] = FileTell(m_stream);
+    for (int r = 0; r < h; r++)
+    {
+        char* ptr = (char *) img.PixelAddress(x0, y0 + r, 0);
+        if (fwrite(ptr, sizeof(uchar), n, m_stream) != (size_t) n)
+            throw CError("WriteFileTiled(%s): file is too short", filename);
+    }
+}
+
+void CTiledSink::FlushTileRow(void)
+{
+    // Write out the (complete) buffered row of tiles
+    for (int tx = 0; tx < m_nTilesX; tx++)
+        WriteTile(m_rowBuf, tx*m_tileSize, 0, tx, m_bufTileRow);
+    m_bufTileRow += 1;
+    m_bufRows = 0;
+}
+
+void CTiledSink::Write(CImage& region, int x, int y)
+{
+    const char* filename = m_filename.c_str();
+    CShape sh = region.Shape();
+    if (sh.nBands != m_shape.nBands || x < 0 || y < 0 ||
+        x + sh.width > m_shape.width || y + sh.height > m_shape.height)
+        throw CError("WriteFileTiled(%s): region does not fit in the image", filename);
+
+    // A partial-width region has to be a complete tile:  write it straight through
+    if (sh.width != m_shape.width)
+    {
+        int tx = x / m_tileSize, ty = y / m_tileSize;
+        if (x != tx*m_tileSize || y != ty*m_tileSize ||
+            sh.width  != __min(m_tileSize, m_shape.width  - x) ||
+            sh.height != __min(m_tileSize, m_shape.height - y))
+            throw CError("WriteFileTiled(%s): regions must be tiles or full-width row bands", filename);
+        WriteTile(region, 0, 0, tx, ty);
+        return;
+    }
+
+    // Otherwise, it has to be the next full-width row band
+    if (y != m_bufTileRow*m_tileSize + m_bufRows)
+        throw CError("WriteFileTiled(%s): row bands must be written in order", filename);
+    int n = sh.width * sh.nBands;
+    for (int r = 0; r < sh.height; r++)
+    {
+        memcpy(m_rowBuf.PixelAddress(0, m_bufRows, 0), region.PixelAddress(0, r, 0), n);
+        m_bufRows += 1;
+        int rowsInTile = __min(m_tileSize, m_shape.height - m_bufTileRow*m_tileSize);
+        if (m_bufRows == rowsInTile)
+            FlushTileRow();
+    }
+}
+
+void CTiledSink::End(void)
+{
+    const char* filename = m_filename.c_str();
+    for (unsigned int i = 0; i < m_index.size(); i++)
+        if (m_index[i] < 0)
+            throw CError("WriteFileTiled(%s): image is incomplete", filename);
+
+    // Append the index and point the header at it
+    long long indexOffset = FileTell(m_stream);
+    if (m_index.size() > 0 &&
+        fwrite(&m_index[0], sizeof(long long), m_index.size(), m_stream) != m_index.size())
+        throw CError("WriteFileTiled(%s): file is too short", filename);
+    if (FileSeek(m_stream, offsetof(CTiledHead, indexOffset), SEEK_SET) ||
+        fwrite(&indexOffset, sizeof(long long), 1, m_stream) != 1)
+        throw CError("WriteFileTiled(%s): could not write the index", filename);
+
+    FILE* stream = m_stream;
+    m_stream = 0;
+    if (fclose(stream))
+        throw CError("WriteFileTiled(%s): error closing file", filename);
+}
+
+CImageSink* NewImageSink(const char* filename, int tileSize)
+{
+    // Determine the file extension
+    const char *dot = strrchr(filename, '.');
+    if (dot && strcmp(dot, ".tga") == 0)
+        return new CTargaStripSink(filename);
+    else if (dot && strcmp(dot, ".ptl") == 0)
+        return new CTiledSink(filename, tileSize);
+    else if (dot && strcmp(dot, ".tiles") == 0)
+        return new CTilePyramidSink(filename, tileSize);
+    else
+        throw CError("NewImageSink(%s): file type not supported", filename);
+}
+
+void ReadTiledRegion(CByteImage& img, const char* filename,
+                     int x, int y, int width, int height)
+{
+    // Read a rectangle of a tiled container, touching only the tiles it covers
+    FILE *stream = fopen(filename, "rb");
+    if (stream == 0)
+        throw CError("ReadFileTiled: could not open %s", filename);
+    CTiledHead h;
+    if (fread(&h, sizeof(CTiledHead), 1, stream) != 1 ||
+        memcmp(h.magic, TiledMagic, sizeof(h.magic)) != 0 || h.indexOffset == 0)
+        throw CError("ReadFileTiled(%s): not a complete tiled image", filename);
+    if (width < 0)
+        width = h.width - x;
+    if (height < 0)
+        height = h.height - y;
+    if (x < 0 || y < 0 || width < 0 || height < 0 ||
+        x + width > h.width || y + height > h.height)
+        throw CError("ReadFileTiled(%s): region is outside the image", filename);
+
+    int T = h.tileSize;
+    int nTilesX = (h.width + T-1) / T;
+    int nTilesY = (h.height + T-1) / T;
+    std::vector<long long> index(nTilesX * nTilesY);
+    if (FileSeek(stream, h.indexOffset, SEEK_SET) ||
+        fread(&index[0], sizeof(long long), index.size(), stream) != index.size())
+        throw CError("ReadFileTiled(%s): could not read the index", filename);
+
+    img.ReAllocate(CShape(width, height, h.nBands));
+    std::vector<uchar> row(T * h.nBands);
+    for (int ty = y / T; ty * T < y + height; ty++)
+    {
+        for (int tx = x / T; tx * T < x + width; tx++)
+        {
+            // Extent of this tile, and of its overlap with the region
+            int tw = __min(T, h.width  - tx*T);
+            int th = __min(T, h.height - ty*T);
+            int x0 = __max(x, tx*T), x1 = __min(x + width,  tx*T + tw);
+            int y0 = __max(y, ty*T), y1 = __min(y + height, ty*T + th);
+            for (int yy = y0; yy < y1; yy++)
+            {
+                long long offset = index[ty*nTilesX + tx] +
+                    (long long) (yy - ty*T) * tw * h.nBands;
+                if (FileSeek(stream, offset, SEEK_SET) ||
+                    fread(&row[0], sizeof(uchar), tw * h.nBands, stream) != (size_t) (tw * h.nBands))
+                    throw CError("ReadFileTiled(%s): file is too short", filename);
+                memcpy(img.PixelAddress(x0 - x, yy - y, 0), &row[(x0 - tx*T) * h.nBands],
+                       (x1 - x0) * h.nBands);
+            }
+        }
+    }
+
+    if (fclose(stream))
+        throw CError("ReadFileTiled(%s): error closing file", filename);
+}
+
+CShape ReadFileShape(const char* filename)
+{
+    // Read just the header of the file
+    const char *dot = strrchr(filename, '.');
+    bool tga = dot && strcmp(dot, ".tga") == 0;
+    if (! tga && ! (dot && strcmp(dot, ".ptl") == 0))
+        throw CError("ReadFileShape(%s): file type not supported", filename);
+    FILE *stream = fopen(filename, "rb");
+    if (stream == 0)
+        throw CError("ReadFileShape: could not open %s", filename);
+    CShape sh;
+    bool ok;
+    if (tga)
+    {
+        // (a colormapped gray ramp is read as one band, but counted as four)
+        CTargaHead h;
+        ok = fread(&h, sizeof(CTargaHead), 1, stream) == 1;
+        bool isGray = h.imageType == TargaRawBW || h.imageType == TargaRunBW;
+        sh = CShape(h.width, h.height, (isGray) ? 1 : 4);
+    }
+    else
+    {
+        CTiledHead h;
+        ok = fread(&h, sizeof(CTiledHead), 1, stream) == 1 &&
+             memcmp(h.magic, TiledMagic, sizeof(h.magic)) == 0;
+        sh = CShape(h.width, h.height, h.nBands);
+    }
+    fclose(stream);
+    if (! ok)
+        throw CError("ReadFileShape(%s): not an image file", filename);
+    return sh;
+}
+
+long long ImageSinkMemory(const char* filename, CShape sh, int tileSize)
+{
+    // Bytes buffered by the sink NewImageSink(filename, tileSize) would make
+    const char *dot = strrchr(filename, '.');
+    long long rowBytes = (long long) sh.width * sh.nBands;
+    if (dot && strcmp(dot, ".ptl") == 0)
+        return rowBytes * __min(tileSize, sh.height);   // one row of tiles
+    if (dot && strcmp(dot, ".tiles") == 0)
+        return 2 * rowBytes * 2 * tileSize;     // about two rows of tiles per
+                                                //  level, halving each level
+    return 0;                                   // .tga rows go straight out
 }
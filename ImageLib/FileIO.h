@@ -15,6 +15,37 @@
 //  If you do initialize the image, it will be re-allocated if necessary,
 //  and the data will be coerced into the type you specified.
 //
+//  Targa files keep the image's origin (see CImageAttributes) in their
+//  header, so a cropped image remembers where it was cut from.  A
+//  non-zero origin is marked by an identification field that only
+//  WriteFileTGA writes, and ReadFileTGA ignores the origin fields of
+//  other files (where they mean something else).
+//
+//  Images too large to hold in memory can be written incrementally
+//  through a CImageSink.  The producer calls Begin() once the final
+//  shape is known, pushes finished regions with Write(), and calls End()
+//  to flush the file.  Two file formats are supported:
+//
+//  .tga    Targa strip writer: regions must be full-width row bands
+//          delivered top to bottom.  Limited to 32767 x 32767 pixels.
+//  .ptl    tiled container: fixed-size square tiles followed by an index
+//          of tile offsets.  Accepts row bands (in order) or tile-aligned
+//          tiles; only one row of tiles is ever buffered.
+//
+//  .tiles  a directory holding a multi-resolution tile pyramid
+//          (see TilePyramid.h).
+//
+//  NewImageSink() picks the writer from the file extension, and
+//  CImageBufferSink collects the regions into an ordinary in-memory image.
+//  ReadTiledRegion() reads back an arbitrary rectangle of a .ptl file
+//  (a negative width or height extends to the edge of the image).
+//
+//  ReadFileShape() reads just the header of a .tga or .ptl file, and
+//  returns the shape ReadFile would give the image, and ImageSinkMemory()
+//  is the number of bytes the sink for a file would buffer while writing
+//  an image of the given shape;  together they let the memory needed for
+//  a mosaic be estimated before anything is read (see Profile.h).
+//
 // SEE ALSO
 //  FileIO.cpp          implementation
 //
@@ -24,3 +55,29 @@
 
 void ReadFile (CImage& img, const char* filename);
 void WriteFile(CImage& img, const char* filename);
+
+class CImageSink
+{
+public:
+    virtual ~CImageSink() {}
+    virtual void Begin(CShape sh) = 0;                  // shape of the complete image
+    virtual void Write(CImage& region, int x, int y) = 0;   // region at (x, y)
+    virtual void End(void) = 0;                         // flush and close
+};
+
+class CImageBufferSink : public CImageSink
+{
+public:
+    void Begin(CShape sh);
+    void Write(CImage& region, int x, int y);
+    void End(void) {}
+    CByteImage image;       // the assembled image
+};
+
+CImageSink* NewImageSink(const char* filename, int tileSize = 256);
+
+void ReadTiledRegion(CByteImage& img, const char* filename,
+                     int x, int y, int width, int height);
+
+CShape ReadFileShape(const char* filename);
+long long ImageSinkMemory(const char* filename, CShape sh, int tileSize = 256);
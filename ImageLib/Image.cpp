@@ -79,7 +79,8 @@ void CImage::ReAllocate(CShape s, const type_info& ti, int bandSize,
 }
 
 void CImage::ReAllocate(CShape s, const type_info& ti, int bandSize,
-                        void *memory, bool deleteWhenDone, int rowSize)
+                        void *memory, bool deleteWhenDone, int rowSize,
+                        void (*deleteFunction)(void *ptr))
 {
     // Set up the type_id, shape, and size info
     m_shape     = s;                        // image shape (dimensions)
@@ -98,7 +99,7 @@ void CImage::ReAllocate(CShape s, const type_info& ti, int bandSize,
             throw CError("CImage::Reallocate: could not allocate %d bytes", nBytes);
     }
     m_memStart = (char *) memory;           // start of addressable memory
-    m_memory.ReAllocate(nBytes, memory, deleteWhenDone);
+    m_memory.ReAllocate(nBytes, memory, deleteWhenDone, deleteFunction);
 }
 
 void CImage::DeAllocate()
@@ -126,8 +127,8 @@ void CImage::SetSubImage(int xO, int yO, int width, int height)
     y = __max(0, __min(y, m_shape.height));     // clip to original shape
     m_shape.width  = x1 - x;                    // actual width
     m_shape.height = y1 - y;                    // actual height
-    origin[0] += x1;                            // adjust the origin
-    origin[1] += y1;                            // adjust the origin
+    origin[0] += x;                             // adjust the origin
+    origin[1] += y;                             // adjust the origin
 }
 
 void CImage::ClearPixels(void)
@@ -80,7 +80,9 @@ enum EBorderMode
 struct CImageAttributes
 {
     int alphaChannel;       // which channel contains alpha (for compositing)
-    int origin[2];          // x and y coordinate origin (for some operations)
+    int origin[2];          // x and y coordinate origin (for some operations):
+                            //  where pixel (0,0) lies in the image it was cut
+                            //  from (see SubImage, and WarpLocal's cropped output)
     EBorderMode borderMode; // border behavior for neighborhood operations...
     // char colorSpace[4];     // RGBA, YUVA, etc.: not currently used
 };
@@ -96,7 +98,10 @@ public:
     // uses system-supplied copy constructor, assignment operator, and destructor
 
     void ReAllocate(CShape s, const type_info& ti, int bandSize,
-                    void *memory, bool deleteWhenDone, int rowSize);
+                    void *memory, bool deleteWhenDone, int rowSize,
+                    void (*deleteFunction)(void *ptr) = 0);
+        // (deleteFunction releases memory that wasn't allocated by new,
+        //  e.g., a memory-mapped file)
     void ReAllocate(CShape s, const type_info& ti, int bandSize,
                     bool evenIfShapeDiffers = false);
     void DeAllocate(void);      // release the memory & set to default values
@@ -134,7 +139,8 @@ public:
     // uses system-supplied copy constructor, assignment operator, and destructor
 
     void ReAllocate(CShape s, bool evenIfShapeDiffers = false);
-    void ReAllocate(CShape s, T *memory, bool deleteWhenDone, int rowSize);
+    void ReAllocate(CShape s, T *memory, bool deleteWhenDone, int rowSize,
+                    void (*deleteFunction)(void *ptr) = 0);
 
     T& Pixel(int x, int y, int band);
 
@@ -65,9 +65,11 @@ inline void CImageOf<T>::ReAllocate(CShape s, bool evenIfShapeDiffers)
 
 template <class T>
 inline void CImageOf<T>::ReAllocate(CShape s, T *memory,
-                                    bool deleteWhenDone, int rowSize)
+                                    bool deleteWhenDone, int rowSize,
+                                    void (*deleteFunction)(void *ptr))
 {
-    CImage::ReAllocate(s, typeid(T), sizeof(T), memory, deleteWhenDone, rowSize);
+    CImage::ReAllocate(s, typeid(T), sizeof(T), memory, deleteWhenDone, rowSize,
+                       deleteFunction);
 }
     
 template <class T>
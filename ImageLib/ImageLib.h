@@ -9,9 +9,16 @@
 
 #include <vector>
 #include "Image.h"
+#include "CpuFeatures.h"
 #include "FileIO.h"
 #include "Convert.h"
 #include "Transform.h"
+#include "RowExtents.h"
 #include "WarpImage.h"
 #include "Convolve.h"
 #include "Pyramid.h"
+#include "TilePyramid.h"
+#include "AsyncLoader.h"
+#include "ThreadPool.h"
+#include "Pipeline.h"
+#include "Profile.h"
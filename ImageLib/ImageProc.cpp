@@ -1,4 +1,14 @@
 #include "ImageProc.h"
+#include "Convert.h"
+#include "CpuFeatures.h"
+#include "ThreadPool.h"
+#include <string.h>
+#include <vector>
+
+#ifdef IMAGELIB_X86
+#include <emmintrin.h>
+#include <immintrin.h>
+#endif
 
 //
 // Type conversion utilities
@@ -10,28 +20,8 @@ void TypeConvertTyped(T1* src, T2* dst, int n,
                       T2 minVal, T2 maxVal)
 {
     // This routine does NOT round values when converting from float to int
-    const bool scaleOffset = (scale != 1.0f) || (offset != 0.0f);
-    const bool clip = (minVal < maxVal);
-    if (scaleOffset)
-        for (int i = 0; i < n; i++)
-        {
-            float val = src[i] * scale + offset;
-            if (clip)
-                val = __min(__max(val, minVal), maxVal);
-            dst[i] = (T2) val;
-        }
-    else if (clip)
-        for (int i = 0; i < n; i++)
-        {
-            dst[i] = (T2) __min(__max(src[i], minVal), maxVal);
-        }
-    else if (typeid(T1) == typeid(T2))
-        memcpy(dst, src, n*sizeof(T2));
-    else
-        for (int i = 0; i < n; i++)
-        {
-            dst[i] = (T2) src[i];
-        }
+    //  (same code as ScaleAndOffset, which has SIMD versions)
+    ScaleAndOffsetLine(src, dst, n, scale, offset, minVal, maxVal);
 }
 
 #if 0
@@ -59,11 +49,25 @@ void TypeConvert(CImageOf<T1>& src, CImageOf<T2>& dst, float scale, float offset
     // Process each row
     for (int y = 0; y < sShape.height; y++)
     {
-        TypeConvertLine(&src.Pixel(0, y, 0), &dst.Pixel(0, y, 0),
-                        sShape.width, scale, offset, minVal, maxVal);
+        TypeConvertTyped(&src.Pixel(0, y, 0), &dst.Pixel(0, y, 0),
+                         sShape.width*sShape.nBands, scale, offset, minVal, maxVal);
     }
 }
 
+#define INSTANTIATE_TYPE_CONVERT(T1, T2) \
+    template void TypeConvert(CImageOf<T1>& src, CImageOf<T2>& dst, \
+                              float scale, float offset);
+
+INSTANTIATE_TYPE_CONVERT(uchar, uchar)
+INSTANTIATE_TYPE_CONVERT(uchar, int)
+INSTANTIATE_TYPE_CONVERT(uchar, float)
+INSTANTIATE_TYPE_CONVERT(int, uchar)
+INSTANTIATE_TYPE_CONVERT(int, int)
+INSTANTIATE_TYPE_CONVERT(int, float)
+INSTANTIATE_TYPE_CONVERT(float, uchar)
+INSTANTIATE_TYPE_CONVERT(float, int)
+INSTANTIATE_TYPE_CONVERT(float, float)
+
 template <class T>
 void GrayToRGBA(CImageOf<T>& src, CImageOf<T>& dst)
 {
@@ -84,6 +88,11 @@ void GrayToRGBA(CImageOf<T>& src, CImageOf<T>& dst)
     {
         T* srcP = &src.Pixel(0, y, 0);
         T* dstP = &dst.Pixel(0, y, 0);
+        if (aC == 3 && dShape.nBands == 4)
+        {
+            GrayToRGBALine(srcP, dstP, sShape.width, (T) 255);
+            continue;
+        }
         for (int x = 0; x < sShape.width; x++, srcP++)
             for (int b = 0; b < dShape.nBands; b++, dstP++)
                 *dstP = (b == aC) ? 255 : *srcP;
@@ -98,10 +107,8 @@ void RGBAToGray(CImageOf<T>& src, CImageOf<T>& dst)
     CShape dShape = dst.Shape();
     if (sShape.nBands != 4)
         throw CError("RGBAToGray: source image is not 4-banded");
-    if (! sShape.SameIgnoringNBands(dShape))
-        dst.ReAllocate(CShape(sShape.width, sShape.height, 4));
-    if (dShape.nBands != 4)
-        throw CError("RGBAToGray: source image is not 4-banded");
+    if (! sShape.SameIgnoringNBands(dShape) || dShape.nBands != 1)
+        dst.ReAllocate(CShape(sShape.width, sShape.height, 1));
     if (src.alphaChannel != 3)
         throw CError("RGBAToGray: source A is not in the 4th band");
 
@@ -110,14 +117,8 @@ void RGBAToGray(CImageOf<T>& src, CImageOf<T>& dst)
     T maxVal = dst.MaxVal();
     for (int y = 0; y < sShape.height; y++)
     {
-        T* srcP = &src.Pixel(0, y, 0);
-        T* dstP = &dst.Pixel(0, y, 0);
-        for (int x = 0; x < sShape.width; x++, srcP += 4, dstP++)
-        {
-            RGBA<T>& p = *(RGBA<T> *) srcP;
-            float Y = 0.212671 * p.R + 0.715160 * p.G + 0.072169 * p.B;
-            dstP = (T) __min(maxVal, __max(minVal, Y));
-        }
+        RGBToGrayLine(&src.Pixel(0, y, 0), 4, &dst.Pixel(0, y, 0),
+                      sShape.width, minVal, maxVal);
     }
 }
 
@@ -150,6 +151,11 @@ void BandSelect(CImageOf<T>& src, CImageOf<T>& dst, int sBand, int dBand)
     {
         T* srcP = &src.Pixel(0, y, 0);
         T* dstP = &dst.Pixel(0, y, 0);
+        if (dB == 1)
+        {
+            ExtractBandLine(srcP, sB, sBand, dstP, sShape.width);
+            continue;
+        }
         for (int x = 0; x < sShape.width; x++, srcP += sB, dstP += dB)
             dstP[dBand] = srcP[sBand];
     }
@@ -178,24 +184,240 @@ void PointProcess1(CImage& img1,
 // Miscellaneous utility routines
 //
 
-template <class PixType>
-static void CopyPixels(PixType* p1, int s1, PixType* p2, int s2, int w)
+//  Rotate90 works on raw pixels of any size.  A quarter turn is a
+//  transpose (with one of the two axes reversed, which is done by walking
+//  the source or destination rows backwards), carried out tile by tile
+//  so that both images are accessed in cache-sized pieces (the tiles of
+//  Rotate90 are transposed in parallel, see ThreadPool.h).  Inside a
+//  tile, blocks of pixels are transposed in registers:  8x8 for 1-byte
+//  pixels, and 4x4 for 3 and 4-byte pixels (1, 3 and 4-band uchar images,
+//  1-band float and int images).  Larger pixels are simply moved one at
+//  a time in tile order.
+
+typedef void (*TransposeBlockFn)(const uchar* src, ptrdiff_t sStride,
+                                 uchar* dst, ptrdiff_t dStride, int pixSize);
+
+template <int P>
+static void TransposeBlockP(const uchar* src, ptrdiff_t sStride,
+                            uchar* dst, ptrdiff_t dStride, int)
+{
+    // 4x4 block:  dst row i, pixel j = src row j, pixel i
+    for (int i = 0; i < 4; i++)
+        for (int j = 0; j < 4; j++)
+            memcpy(&dst[i*dStride + j*P], &src[j*sStride + i*P], P);
+}
+
+static void TransposeBlockAny(const uchar* src, ptrdiff_t sStride,
+                              uchar* dst, ptrdiff_t dStride, int pixSize)
+{
+    for (int i = 0; i < 4; i++)
+        for (int j = 0; j < 4; j++)
+            memcpy(&dst[i*dStride + j*pixSize], &src[j*sStride + i*pixSize], pixSize);
+}
+
+#ifdef IMAGELIB_X86
+
+static IMAGELIB_TARGET_SSE2 void Transpose8x8Byte(const uchar* src, ptrdiff_t sStride,
+                                                  uchar* dst, ptrdiff_t dStride, int)
+{
+    __m128i a0 = _mm_loadl_epi64((const __m128i *) &src[0*sStride]);
+    __m128i a1 = _mm_loadl_epi64((const __m128i *) &src[1*sStride]);
+    __m128i a2 = _mm_loadl_epi64((const __m128i *) &src[2*sStride]);
+    __m128i a3 = _mm_loadl_epi64((const __m128i *) &src[3*sStride]);
+    __m128i a4 = _mm_loadl_epi64((const __m128i *) &src[4*sStride]);
+    __m128i a5 = _mm_loadl_epi64((const __m128i *) &src[5*sStride]);
+    __m128i a6 = _mm_loadl_epi64((const __m128i *) &src[6*sStride]);
+    __m128i a7 = _mm_loadl_epi64((const __m128i *) &src[7*sStride]);
+
+    // Interleave bytes, then pairs, then quads of rows
+    __m128i b0 = _mm_unpacklo_epi8(a0, a1), b1 = _mm_unpacklo_epi8(a2, a3);
+    __m128i b2 = _mm_unpacklo_epi8(a4, a5), b3 = _mm_unpacklo_epi8(a6, a7);
+    __m128i c0 = _mm_unpacklo_epi16(b0, b1), c1 = _mm_unpackhi_epi16(b0, b1);
+    __m128i c2 = _mm_unpacklo_epi16(b2, b3), c3 = _mm_unpackhi_epi16(b2, b3);
+    __m128i d0 = _mm_unpacklo_epi32(c0, c2), d1 = _mm_unpackhi_epi32(c0, c2);
+    __m128i d2 = _mm_unpacklo_epi32(c1, c3), d3 = _mm_unpackhi_epi32(c1, c3);
+
+    _mm_storel_epi64((__m128i *) &dst[0*dStride], d0);
+    _mm_storel_epi64((__m128i *) &dst[1*dStride], _mm_unpackhi_epi64(d0, d0));
+    _mm_storel_epi64((__m128i *) &dst[2*dStride], d1);
+    _mm_storel_epi64((__m128i *) &dst[3*dStride], _mm_unpackhi_epi64(d1, d1));
+    _mm_storel_epi64((__m128i *) &dst[4*dStride], d2);
+    _mm_storel_epi64((__m128i *) &dst[5*dStride], _mm_unpackhi_epi64(d2, d2));
+    _mm_storel_epi64((__m128i *) &dst[6*dStride], d3);
+    _mm_storel_epi64((__m128i *) &dst[7*dStride], _mm_unpackhi_epi64(d3, d3));
+}
+
+static IMAGELIB_TARGET_SSE2 void Transpose4x4Word(const uchar* src, ptrdiff_t sStride,
+                                                  uchar* dst, ptrdiff_t dStride, int)
+{
+    // (the pixels are only moved, so any 4-byte pixel can go through floats)
+    __m128 r0 = _mm_loadu_ps((const float *) &src[0*sStride]);
+    __m128 r1 = _mm_loadu_ps((const float *) &src[1*sStride]);
+    __m128 r2 = _mm_loadu_ps((const float *) &src[2*sStride]);
+    __m128 r3 = _mm_loadu_ps((const float *) &src[3*sStride]);
+    _MM_TRANSPOSE4_PS(r0, r1, r2, r3);
+    _mm_storeu_ps((float *) &dst[0*dStride], r0);
+    _mm_storeu_ps((float *) &dst[1*dStride], r1);
+    _mm_storeu_ps((float *) &dst[2*dStride], r2);
+    _mm_storeu_ps((float *) &dst[3*dStride], r3);
+}
+
+static IMAGELIB_TARGET_SSSE3 inline __m128 LoadRGB4(const uchar* p)
+{
+    // 4 3-byte pixels (exactly 12 bytes) -> one pixel per 32-bit lane
+    int w;
+    memcpy(&w, p + 8, 4);
+    __m128i v = _mm_or_si128(_mm_loadl_epi64((const __m128i *) p),
+                             _mm_slli_si128(_mm_cvtsi32_si128(w), 8));
+    v = _mm_shuffle_epi8(v, _mm_setr_epi8(0, 1, 2, -1, 3, 4, 5, -1,
+                                          6, 7, 8, -1, 9, 10, 11, -1));
+    return _mm_castsi128_ps(v);
+}
+
+static IMAGELIB_TARGET_SSSE3 inline void StoreRGB4(uchar* p, __m128 v)
+{
+    __m128i w = _mm_shuffle_epi8(_mm_castps_si128(v),
+                                 _mm_setr_epi8(0, 1, 2, 4, 5, 6, 8, 9,
+                                               10, 12, 13, 14, -1, -1, -1, -1));
+    _mm_storel_epi64((__m128i *) p, w);
+    int last = _mm_cvtsi128_si32(_mm_srli_si128(w, 8));
+    memcpy(p + 8, &last, 4);
+}
+
+static IMAGELIB_TARGET_SSSE3 void Transpose4x4RGB(const uchar* src, ptrdiff_t sStride,
+                                                  uchar* dst, ptrdiff_t dStride, int)
+{
+    __m128 r0 = LoadRGB4(&src[0*sStride]);
+    __m128 r1 = LoadRGB4(&src[1*sStride]);
+    __m128 r2 = LoadRGB4(&src[2*sStride]);
+    __m128 r3 = LoadRGB4(&src[3*sStride]);
+    _MM_TRANSPOSE4_PS(r0, r1, r2, r3);
+    StoreRGB4(&dst[0*dStride], r0);
+    StoreRGB4(&dst[1*dStride], r1);
+    StoreRGB4(&dst[2*dStride], r2);
+    StoreRGB4(&dst[3*dStride], r3);
+}
+
+static IMAGELIB_TARGET_SSE2 int ReverseRowWord(const uchar* src, uchar* dst, int w)
+{
+    // dst pixel x = src pixel w-1-x, 4 pixels at a time
+    int x;
+    for (x = 0; x + 4 <= w; x += 4)
+    {
+        __m128i v = _mm_loadu_si128((const __m128i *) &src[4*(w-4-x)]);
+        _mm_storeu_si128((__m128i *) &dst[4*x], _mm_shuffle_epi32(v, 0x1b));
+    }
+    return x;
+}
+
+static IMAGELIB_TARGET_SSSE3 int ReverseRowByte(const uchar* src, uchar* dst, int w)
 {
-    s1 /= sizeof(PixType);
-    s2 /= sizeof(PixType);
-    if (s2 == 1)
+    __m128i reverse = _mm_setr_epi8(15, 14, 13, 12, 11, 10, 9, 8,
+                                    7, 6, 5, 4, 3, 2, 1, 0);
+    int x;
+    for (x = 0; x + 16 <= w; x += 16)
     {
-        for (int x = 0; x < w; x++, p1 += s1, p2 += s2)
-            *p2 = *p1;
+        __m128i v = _mm_loadu_si128((const __m128i *) &src[w-16-x]);
+        _mm_storeu_si128((__m128i *) &dst[x], _mm_shuffle_epi8(v, reverse));
     }
+    return x;
+}
+
+#endif
+
+struct CTransposer
+{
+    int block;              // block size (pixels)
+    TransposeBlockFn fn;    // block transposer
+};
+
+static CTransposer ChooseTransposer(int pixSize)
+{
+    CTransposer t = {4, TransposeBlockAny};
+#ifdef IMAGELIB_X86
+    if (pixSize == 1 && CpuHas(eCpuSSE2))
+        t.block = 8, t.fn = Transpose8x8Byte;
+    else if (pixSize == 4 && CpuHas(eCpuSSE2))
+        t.fn = Transpose4x4Word;
+    else if (pixSize == 3 && CpuHas(eCpuSSSE3))
+        t.fn = Transpose4x4RGB;
     else
+#endif
+    if (pixSize == 1)
+        t.fn = TransposeBlockP<1>;
+    else if (pixSize == 3)
+        t.fn = TransposeBlockP<3>;
+    else if (pixSize == 4)
+        t.fn = TransposeBlockP<4>;
+    else if (pixSize == 12)
+        t.fn = TransposeBlockP<12>;
+    else if (pixSize == 16)
+        t.fn = TransposeBlockP<16>;
+    return t;
+}
+
+static void TransposeRegion(const uchar* src, ptrdiff_t sStride,
+                            uchar* dst, ptrdiff_t dStride,
+                            int width, int height, int pixSize)
+{
+    // dst has height rows of width pixels;
+    //  dst row i, pixel j = src row j, pixel i
+    CTransposer t = ChooseTransposer(pixSize);
+    const int B = t.block;
+    const int tile = (pixSize == 1) ? 128 : (pixSize <= 4) ? 64 : 32;
+    ParallelForTiles(width, height, tile, tile, [&](int j0, int i0, int j1, int i1)
+    {
+        int ib = i0 + (i1 - i0) / B * B, jb = j0 + (j1 - j0) / B * B;
+        for (int i = i0; i < ib; i += B)
+            for (int j = j0; j < jb; j += B)
+                t.fn(&src[j*sStride + i*pixSize], sStride,
+                     &dst[i*dStride + j*pixSize], dStride, pixSize);
+
+        // Left-over pixels along the right and bottom of the tile
+        for (int i = i0; i < i1; i++)
+            for (int j = (i < ib) ? jb : j0; j < j1; j++)
+                memcpy(&dst[i*dStride + j*pixSize],
+                       &src[j*sStride + i*pixSize], pixSize);
+    });
+}
+
+template <int P>
+static void ReverseRowP(const uchar* src, uchar* dst, int w)
+{
+    for (int x = 0; x < w; x++)
+        memcpy(&dst[x*P], &src[(w-1-x)*P], P);
+}
+
+static void ReverseRow(const uchar* src, uchar* dst, int w, int pixSize)
+{
+    // dst pixel x = src pixel w-1-x  (src and dst must not overlap)
+    int x = 0;
+#ifdef IMAGELIB_X86
+    if (pixSize == 1 && CpuHas(eCpuSSSE3))
+        x = ReverseRowByte(src, dst, w);
+    else if (pixSize == 4 && CpuHas(eCpuSSE2))
+        x = ReverseRowWord(src, dst, w);
+#endif
+    // (the remaining pixels are the first w-x of src)
+    w -= x, dst += x*pixSize;
+    switch (pixSize)
     {
-        for (int x = 0; x < w; x++, p1 += s1, p2 += s2)
-            for (int b = 0; b < s2; b++)
-                p2[b] = p1[b];
+    case 1:  ReverseRowP<1>(src, dst, w);  break;
+    case 3:  ReverseRowP<3>(src, dst, w);  break;
+    case 4:  ReverseRowP<4>(src, dst, w);  break;
+    case 12: ReverseRowP<12>(src, dst, w); break;
+    case 16: ReverseRowP<16>(src, dst, w); break;
+    default:
+        for (int i = 0; i < w; i++)
+            memcpy(&dst[i*pixSize], &src[(w-1-i)*pixSize], pixSize);
     }
 }
 
+static ptrdiff_t RowStride(CImage& img)
+{
+    return (char *) img.PixelAddress(0, 1, 0) - (char *) img.PixelAddress(0, 0, 0);
+}
+
 CImage Rotate90(CImage img1, int nTimesCCW)
 {
     // Allocate the result image
@@ -204,35 +426,105 @@ CImage Rotate90(CImage img1, int nTimesCCW)
     CShape s2((nTimesCCW & 1) ? s1.height : s1.width,
               (nTimesCCW & 1) ? s1.width : s1.height, s1.nBands);
     CImage img2(s2, img1.PixType(), img1.BandSize());
+    if (s2.width == 0 || s2.height == 0)
+        return img2;
+
+    int pixSize = s1.nBands * img1.BandSize();
+    uchar* p1 = (uchar *) img1.PixelAddress(0, 0, 0);
+    uchar* p2 = (uchar *) img2.PixelAddress(0, 0, 0);
+    ptrdiff_t r1 = RowStride(img1), r2 = RowStride(img2);
+    switch (nTimesCCW)
+    {
+    case 0:     // copy
+        for (int y = 0; y < s2.height; y++)
+            memcpy(&p2[y*r2], &p1[y*r1], s2.width*pixSize);
+        break;
+    case 1:     // img2(x, y) = img1(w1-1-y, x):  img2 rows bottom to top
+        TransposeRegion(p1, r1, &p2[(s2.height-1)*r2], -r2,
+                        s2.width, s2.height, pixSize);
+        break;
+    case 2:     // img2(x, y) = img1(w1-1-x, h1-1-y)
+        for (int y = 0; y < s2.height; y++)
+            ReverseRow(&p1[(s1.height-1-y)*r1], &p2[y*r2], s2.width, pixSize);
+        break;
+    case 3:     // img2(x, y) = img1(y, h1-1-x):  img1 rows bottom to top
+        TransposeRegion(&p1[(s1.height-1)*r1], -r1, p2, r2,
+                        s2.width, s2.height, pixSize);
+        break;
+    }
+    return img2;
+}
 
-    // Iterate over the output pixels
-    //  TODO:  blocking this into tiles could be more efficient...
-    for (int y = 0; y < s2.height; y++)
+void Rotate90InPlace(CImage& img, int nTimesCCW)
+{
+    nTimesCCW &= 0x3;   // 0, 1, 2, or 3
+    CShape sh = img.Shape();
+    if (nTimesCCW == 0 || sh.width == 0 || sh.height == 0)
+        return;
+    if ((nTimesCCW & 1) && sh.width != sh.height)
+        throw CError("Rotate90InPlace: image is not square");
+
+    int pixSize = sh.nBands * img.BandSize();
+    int rowBytes = sh.width * pixSize;
+    uchar* p = (uchar *) img.PixelAddress(0, 0, 0);
+    ptrdiff_t r = RowStride(img);
+    std::vector<uchar> row(rowBytes);
+
+    if (nTimesCCW == 2)
     {
-        // Determine the starting location and stride
-        int x0, y0, xd, yd;
-        switch (nTimesCCW)
+        // Swap each row with its mirror image, reversing both
+        for (int y0 = 0, y1 = sh.height-1; y0 <= y1; y0++, y1--)
         {
-        case 0: x0 = 0, y0 = y, xd = 1, yd = 0; break;
-        case 1: x0 = s2.height-1-y, y0 = 0, xd = 0, yd = 1; break;
-        case 2: x0 = s2.width-1, y0 = s2.height-1-y, xd = -1, yd = 0; break;
-        case 3: x0 = y, y0 = s2.width-1, xd = 0, yd = -1; break;
+            memcpy(&row[0], &p[y0*r], rowBytes);
+            if (y0 != y1)
+                ReverseRow(&p[y1*r], &p[y0*r], sh.width, pixSize);
+            ReverseRow(&row[0], &p[y1*r], sh.width, pixSize);
         }
-        void* p1a = img1.PixelAddress(x0,    y0,    0);
-        void* p1b = img1.PixelAddress(x0+xd, y0+yd, 0);
-        void* p2a = img2.PixelAddress(0,     y,     0);
-        void* p2b = img2.PixelAddress(1,     y,     0);
-        int stride1 = (char *) p1b - (char *) p1a;
-        int stride2 = (char *) p2b - (char *) p2a;
-
-        // Copy the pixels using the largest possible unit
-        if ((stride2 & -4) == stride2)
-            CopyPixels((int *) p1a, stride1, (int *) p2a, stride2, s2.width);
-        else if ((stride2 & -2) == stride2)
-            CopyPixels((short *) p1a, stride1, (short *) p2a, stride2, s2.width);
-        else
-            CopyPixels((char *) p1a, stride1, (char *) p2a, stride2, s2.width);
+        return;
     }
 
-    return img2;
+    // Transpose, one pair of tiles (mirrored across the diagonal) at a time
+    const int tile = (pixSize == 1) ? 128 : (pixSize <= 4) ? 64 : 32;
+    int n = sh.width;
+    std::vector<uchar> bufA(tile*tile*pixSize), bufB(tile*tile*pixSize);
+    for (int i0 = 0; i0 < n; i0 += tile)
+    {
+        for (int j0 = i0; j0 < n; j0 += tile)
+        {
+            // Tile A = rows i0.., columns j0..;  tile B = rows j0.., columns i0..
+            int hA = __min(tile, n - i0), wA = __min(tile, n - j0);
+            uchar* a = &p[i0*r + j0*pixSize];
+            uchar* b = &p[j0*r + i0*pixSize];
+            TransposeRegion(a, r, &bufA[0], hA*pixSize, hA, wA, pixSize);
+            if (i0 != j0)
+            {
+                TransposeRegion(b, r, &bufB[0], wA*pixSize, wA, hA, pixSize);
+                for (int i = 0; i < hA; i++)
+                    memcpy(&a[i*r], &bufB[i*wA*pixSize], wA*pixSize);
+            }
+            for (int i = 0; i < wA; i++)
+                memcpy(&b[i*r], &bufA[i*hA*pixSize], hA*pixSize);
+        }
+    }
+
+    // Then flip:  rows bottom to top (CCW), or each row left to right (CW)
+    for (int y0 = 0, y1 = n-1; y0 <= y1; y0++, y1--)
+    {
+        if (nTimesCCW == 1)
+        {
+            memcpy(&row[0], &p[y0*r], rowBytes);
+            memcpy(&p[y0*r], &p[y1*r], rowBytes);
+            memcpy(&p[y1*r], &row[0], rowBytes);
+        }
+        else
+        {
+            memcpy(&row[0], &p[y0*r], rowBytes);
+            ReverseRow(&row[0], &p[y0*r], n, pixSize);
+            if (y0 != y1)
+            {
+                memcpy(&row[0], &p[y1*r], rowBytes);
+                ReverseRow(&row[0], &p[y1*r], n, pixSize);
+            }
+        }
+    }
 }
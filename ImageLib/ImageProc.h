@@ -44,4 +44,9 @@ void NeighborhoodProcessSeparable(CImage& src, CImage& dst, void* dataPtr,
 // Miscellaneous utility routines
 //
 
+//  Rotate90 returns a copy rotated by nTimesCCW quarter turns (counter-
+//  clockwise);  Rotate90InPlace does the same without a second image, but
+//  only square images can be given an odd number of quarter turns.
+
 CImage Rotate90(CImage img, int nTimesCCW);
+void Rotate90InPlace(CImage& img, int nTimesCCW);
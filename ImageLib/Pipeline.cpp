@@ -0,0 +1,205 @@
+///////////////////////////////////////////////////////////////////////////
+//
+// NAME
+//  Pipeline.cpp -- bounded queues and pipelined stages for multi-stage batches
+//
+// SEE ALSO
+//  Pipeline.h          longer description
+//
+// DESIGN
+//  The queues only ever block in CQueueWaiter::Wait, after spinning.  A
+//  push or pop notifies the waiter, which costs a fence and a load of the
+//  sleeper count unless some thread is actually asleep, so the common
+//  case of a queue that is neither empty nor full takes no lock.
+//
+//  Each stage copies its body for every worker, so a functor's own state
+//  is private to the worker;  whatever it captures by reference is shared.
+//  The copy also holds the item a parked worker has in hand, so that the
+//  next activation picks up where the last one stopped.
+//
+//  A worker runs as a task of the run's group until it finishes or parks.
+//  Its resume callback is called by a push, pop or close on the queue,
+//  i.e., by another worker (so the group isn't yet done) or by a Cancel()
+//  from outside the pipeline.  Run() therefore waits for the group, and
+//  if some worker is still parked once the group is done, sleeps until a
+//  resubmit and waits again.
+//
+///////////////////////////////////////////////////////////////////////////
+
+#include "ThreadPool.h"
+#include "Pipeline.h"
+#include "Profile.h"
+
+CQueueWaiter::CQueueWaiter()
+    : m_sleepers(0), m_epoch(0)
+{
+}
+
+void CQueueWaiter::Notify()
+{
+    // (the fence orders the caller's push or pop before the count is read)
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    if (m_sleepers.load(std::memory_order_relaxed) > 0)
+    {
+        std::vector<std::function<void()> > parked;
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            m_epoch += 1;
+            parked.swap(m_parked);
+            m_sleepers -= (int) parked.size();
+            m_wake.notify_all();
+        }
+        for (int i = 0; i < (int) parked.size(); i++)
+            parked[i]();
+    }
+}
+
+CPipeline::CPipeline(CThreadPool* pool)
+    : m_pool(pool), m_cancelled(false), m_group(0), m_finished(0), m_resubmits(0)
+{
+}
+
+void CPipeline::Add(const char* name, int nWorkers, Body body,
+                    const void* out, std::function<void()> close,
+                    std::function<void()> cancel)
+{
+    std::unique_ptr<CStage> stage(new CStage);
+    stage->name = name;
+    stage->nWorkers = std::max(1, nWorkers);
+    stage->running = 0;
+    stage->body = body;
+    stage->out = out;
+    stage->close = close;
+    m_stages.push_back(std::move(stage));
+    m_cancel.push_back(cancel);
+    if (out != 0)
+        m_producers[out] += 1;
+}
+
+void CPipeline::Activate(CWorker* worker)
+{
+    CStage* stage = worker->stage;
+    CTraceScope trace(stage->name);
+    std::unique_ptr<CParallelScope> scope(m_pool ? new CParallelScope(*m_pool) : 0);
+    bool finished = true;
+    try
+    {
+        finished = worker->body(worker->resume);
+    }
+    catch (...)
+    {
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            if (! m_error)
+                m_error = std::current_exception();
+        }
+        Cancel();
+    }
+    if (! finished)
+        return;             // (parked:  it may already be running again)
+
+    // The last worker of the last stage feeding a queue closes it
+    if (--stage->running == 0 && stage->out != 0)
+    {
+        bool close;
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            close = (--m_producers[stage->out] == 0);
+        }
+        if (close)
+            stage->close();
+    }
+
+    // (notified under the lock, since Run() may return as soon as it sees
+    //  the count)
+    std::lock_guard<std::mutex> lock(m_mutex);
+    m_finished += 1;
+    m_done.notify_all();
+}
+
+void CPipeline::Resubmit(CWorker* worker)
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    m_resubmits += 1;
+    m_group->Run([this, worker]() { Activate(worker); });
+    m_done.notify_all();
+}
+
+void CPipeline::Run()
+{
+    // (all of the stages are declared before any starts, so a queue
+    //  can't be closed while a stage feeding it is yet to start)
+    for (int i = 0; i < (int) m_stages.size(); i++)
+    {
+        m_stages[i]->running = m_stages[i]->nWorkers;
+        for (int j = 0; j < m_stages[i]->nWorkers; j++)
+        {
+            std::unique_ptr<CWorker> worker(new CWorker);
+            CWorker* w = worker.get();
+            w->stage = m_stages[i].get();
+            w->body = m_stages[i]->body;
+            w->resume = [this, w]() { Resubmit(w); };
+            m_workers.push_back(std::move(worker));
+        }
+    }
+    int nWorkers = (int) m_workers.size();
+    {
+        CTaskGroup group(m_pool ? *m_pool : SharedPool());
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            m_group = &group;
+            m_finished = 0;
+            for (int i = 0; i < nWorkers; i++)
+            {
+                CWorker* w = m_workers[i].get();
+                group.Run([this, w]() { Activate(w); });
+            }
+        }
+
+        // Help with the workers' tasks until all of the workers finish
+        for (;;)
+        {
+            unsigned seen;
+            {
+                std::lock_guard<std::mutex> lock(m_mutex);
+                if (m_finished == nWorkers)
+                    break;
+                seen = m_resubmits;
+            }
+            group.Wait();
+            std::unique_lock<std::mutex> lock(m_mutex);
+            m_done.wait(lock, [&]()
+                { return m_finished == nWorkers || m_resubmits != seen; });
+        }
+    }
+    m_group = 0;
+    m_workers.clear();
+    m_stages.clear();
+    m_producers.clear();
+
+    std::exception_ptr error;
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        std::swap(error, m_error);
+        m_cancel.clear();
+    }
+    if (error)
+        std::rethrow_exception(error);
+}
+
+void CPipeline::Cancel()
+{
+    m_cancelled = true;
+    std::vector<std::function<void()> > cancel;
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        cancel = m_cancel;
+    }
+    for (int i = 0; i < (int) cancel.size(); i++)
+        cancel[i]();
+}
+
+bool CPipeline::Cancelled() const
+{
+    return m_cancelled;
+}
@@ -0,0 +1,587 @@
+///////////////////////////////////////////////////////////////////////////
+//
+// NAME
+//  Pipeline.h -- bounded queues and pipelined stages for multi-stage batches
+//
+// DESCRIPTION
+//  A batch that reads, transforms and consumes a stream of items (e.g.,
+//  decoding, warping and aligning the frames of a panorama) is split into
+//  stages connected by bounded queues, so that the stages overlap:
+//
+//      CPipeline pipeline(&pool);
+//      CRingQueueOf<CImageItem> decoded(4);
+//      CSharedQueueOf<CImageItem> warped(8);
+//      pipeline.Source("decode", 1, decoded, [&](CImageItem& item)
+//          { return ReadNext(item); });             // false:  no more
+//      pipeline.Stage("warp", 4, decoded, warped, [&](CImageItem& in, CImageItem& out)
+//          { out.index = in.index;  Warp(in.image, out.image); });
+//      pipeline.Sink("align", 1, warped, [&](CImageItem& item)
+//          { Align(item); });
+//      pipeline.Run();         // rethrows the first exception of a stage
+//
+//  Run() starts every stage that has been declared and waits for all of
+//  them to finish.  Each stage has nWorkers workers, which take items
+//  from the input queue and push their results onto the output queue as
+//  fast as the queues allow.  The workers are tasks of the pool given to
+//  the constructor (or else of the shared pool), so the stages and their
+//  parallel loops together use no more threads than the pool has, plus
+//  the thread that called Run(), which helps as in ParallelFor.  A worker
+//  that finds its input queue empty or its output queue full doesn't
+//  hold on to its thread:  it parks, and the queue resubmits it once
+//  there is an item or room, so even a pool of one thread runs every
+//  stage.  A full queue thus holds back its producers (so a fast stage
+//  can't run ahead of a slow one by more than the queue's capacity,
+//  which bounds the memory held in flight) and an empty one holds back
+//  its consumers.  Once the last worker of every stage that
+//  feeds a queue has finished, the queue is closed, and the workers of
+//  the stages it feeds stop when they have drained it.  With several
+//  workers (or several producers), items may come out of a stage in a
+//  different order than they went in;  give them an index if the order
+//  matters.
+//
+//  If a stage throws, the pipeline is cancelled:  every queue is closed
+//  and emptied, all of the workers stop at their next push or pop, and
+//  Run() rethrows the exception.
+//
+//  CRingQueueOf<T> is a ring buffer for one producer thread and one
+//  consumer thread;  CSharedQueueOf<T> allows any number of both.  Both
+//  hand items over without locks (the item slots are claimed with atomic
+//  counters), and only take a lock to sleep after spinning briefly on an
+//  empty or full queue.  PushOrPark and PopOrPark don't sleep:  they
+//  leave a callback with the queue instead, which the next push, pop or
+//  close calls (this is how the pipeline's workers wait).  Items should
+//  be cheap to move:  image handles
+//  (CImage shares its pixels), feature sets, indices.  Popped slots are
+//  reset to T(), so the queues don't keep images alive.  Capacities are
+//  rounded up to a power of 2.
+//
+//  The stages' parallel loops (see ParallelFor in ThreadPool.h) run on
+//  the pool given to the constructor, or else on the shared pool.
+//
+// SEE ALSO
+//  Pipeline.cpp        implementation
+//  ThreadPool.h        thread pool and parallel loops
+//
+///////////////////////////////////////////////////////////////////////////
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <exception>
+#include <functional>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+//
+//  Where producers and consumers of a queue sleep
+//
+
+enum EQueueResult
+{
+    eQueueDone,                     // item pushed or popped
+    eQueueClosed,                   // queue closed (and empty, for a pop)
+    eQueueParked                    // not yet:  the callback will be called
+};
+
+class CQueueWaiter
+{
+public:
+    CQueueWaiter();
+
+    template <class Ready>
+    void Wait(Ready ready);         // until ready() is true
+    template <class Ready>          // ready() now, or park resume
+    bool Poll(Ready ready, const std::function<void()>& resume);
+    void Notify(void);              // the queue has changed
+
+private:
+    std::atomic<int> m_sleepers;    // threads in (or entering) m_wake, and parked callbacks
+    std::atomic<unsigned> m_epoch;  // bumped by each notify that finds a sleeper
+    std::mutex m_mutex;             // guards m_parked
+    std::condition_variable m_wake;
+    std::vector<std::function<void()> > m_parked;   // called by the next notify
+};
+
+template <class Ready>
+void CQueueWaiter::Wait(Ready ready)
+{
+    // Spin (then yield) for a short while, then sleep.  ready() is never
+    //  called with m_mutex held, since it may push or pop (and notify);
+    //  a notify that lands between ready() and the sleep bumps m_epoch,
+    //  and the time-out is only a guard
+    for (int spin = 0; spin < 64; spin++)
+    {
+        if (ready())
+            return;
+        if (spin >= 16)
+            std::this_thread::yield();
+    }
+    m_sleepers += 1;
+    for (;;)
+    {
+        unsigned epoch = m_epoch.load();
+        if (ready())
+            break;
+        std::unique_lock<std::mutex> lock(m_mutex);
+        m_wake.wait_for(lock, std::chrono::milliseconds(10),
+                        [&]() { return m_epoch.load() != epoch; });
+    }
+    m_sleepers -= 1;
+}
+
+template <class Ready>
+bool CQueueWaiter::Poll(Ready ready, const std::function<void()>& resume)
+{
+    // As Wait, but instead of sleeping, park resume for the next notify
+    //  (which also takes it off m_sleepers)
+    for (int spin = 0; spin < 64; spin++)
+    {
+        if (ready())
+            return true;
+        if (spin >= 16)
+            std::this_thread::yield();
+    }
+    m_sleepers += 1;
+    for (;;)
+    {
+        unsigned epoch = m_epoch.load();
+        if (ready())
+            break;
+        std::lock_guard<std::mutex> lock(m_mutex);
+        if (m_epoch.load() == epoch)
+        {
+            m_parked.push_back(resume);
+            return false;
+        }
+    }
+    m_sleepers -= 1;
+    return true;
+}
+
+//
+//  Single-producer single-consumer ring buffer
+//
+
+template <class T>
+class CRingQueueOf
+{
+public:
+    typedef T Item;
+
+    CRingQueueOf(int capacity = 16);
+
+    bool Push(T item);              // wait for room;  false if closed
+    bool Pop(T& item);              // wait for an item;  false if closed and empty
+    bool TryPush(T& item);          // false if full (or closed)
+    bool TryPop(T& item);           // false if empty
+    EQueueResult PushOrPark(T& item, const std::function<void()>& resume);
+    EQueueResult PopOrPark(T& item, const std::function<void()>& resume);
+    void Close(void);               // no more pushes (pops drain the rest)
+    void Cancel(void);              // close and drop the remaining items
+    int Capacity(void) const;
+
+private:
+    std::vector<T> m_items;
+    size_t m_mask;                  // capacity - 1
+    alignas(64) std::atomic<size_t> m_head;     // next slot to pop
+    alignas(64) std::atomic<size_t> m_tail;     // next slot to push
+    std::atomic<bool> m_closed;
+    std::atomic<bool> m_cancelled;
+    CQueueWaiter m_waiter;
+};
+
+static inline size_t QueueCapacity(int capacity)
+{
+    size_t n = 2;
+    while ((int) n < capacity)
+        n *= 2;
+    return n;
+}
+
+template <class T>
+CRingQueueOf<T>::CRingQueueOf(int capacity)
+    : m_items(QueueCapacity(capacity)), m_mask(m_items.size() - 1),
+      m_head(0), m_tail(0), m_closed(false), m_cancelled(false)
+{
+}
+
+template <class T>
+bool CRingQueueOf<T>::TryPush(T& item)
+{
+    if (m_closed.load(std::memory_order_acquire))
+        return false;
+    size_t tail = m_tail.load(std::memory_order_relaxed);
+    if (tail - m_head.load(std::memory_order_acquire) > m_mask)
+        return false;
+    m_items[tail & m_mask] = std::move(item);
+    m_tail.store(tail + 1, std::memory_order_release);
+    m_waiter.Notify();
+    return true;
+}
+
+template <class T>
+bool CRingQueueOf<T>::TryPop(T& item)
+{
+    size_t head = m_head.load(std::memory_order_relaxed);
+    if (head == m_tail.load(std::memory_order_acquire))
+        return false;
+    item = std::move(m_items[head & m_mask]);
+    m_items[head & m_mask] = T();
+    m_head.store(head + 1, std::memory_order_release);
+    m_waiter.Notify();
+    return true;
+}
+
+template <class T>
+bool CRingQueueOf<T>::Push(T item)
+{
+    bool pushed = false;
+    m_waiter.Wait([&]() { return (pushed = TryPush(item)) || m_closed; });
+    return pushed;
+}
+
+template <class T>
+bool CRingQueueOf<T>::Pop(T& item)
+{
+    // (an item pushed before the close is still popped)
+    bool popped = false;
+    m_waiter.Wait([&]() { return (popped = TryPop(item)) || m_closed; });
+    return popped || (! m_cancelled && TryPop(item));
+}
+
+template <class T>
+EQueueResult CRingQueueOf<T>::PushOrPark(T& item, const std::function<void()>& resume)
+{
+    bool pushed = false;
+    if (! m_waiter.Poll([&]() { return (pushed = TryPush(item)) || m_closed; }, resume))
+        return eQueueParked;
+    return pushed ? eQueueDone : eQueueClosed;
+}
+
+template <class T>
+EQueueResult CRingQueueOf<T>::PopOrPark(T& item, const std::function<void()>& resume)
+{
+    bool popped = false;
+    if (! m_waiter.Poll([&]() { return (popped = TryPop(item)) || m_closed; }, resume))
+        return eQueueParked;
+    return (popped || (! m_cancelled && TryPop(item))) ? eQueueDone : eQueueClosed;
+}
+
+template <class T>
+void CRingQueueOf<T>::Close()
+{
+    m_closed = true;
+    m_waiter.Notify();
+}
+
+template <class T>
+void CRingQueueOf<T>::Cancel()
+{
+    // (the slots are released by the destructor)
+    m_cancelled = true;
+    Close();
+}
+
+template <class T>
+int CRingQueueOf<T>::Capacity() const
+{
+    return (int) m_items.size();
+}
+
+//
+//  Multi-producer multi-consumer bounded queue:  each slot has a sequence
+//  number that says whether it is free for the push of a given position
+//  or holds the item for the pop of that position
+//
+
+template <class T>
+class CSharedQueueOf
+{
+public:
+    typedef T Item;
+
+    CSharedQueueOf(int capacity = 16);
+
+    bool Push(T item);              // wait for room;  false if closed
+    bool Pop(T& item);              // wait for an item;  false if closed and empty
+    bool TryPush(T& item);          // false if full (or closed)
+    bool TryPop(T& item);           // false if empty
+    EQueueResult PushOrPark(T& item, const std::function<void()>& resume);
+    EQueueResult PopOrPark(T& item, const std::function<void()>& resume);
+    void Close(void);               // no more pushes (pops drain the rest)
+    void Cancel(void);              // close and drop the remaining items
+    int Capacity(void) const;
+
+private:
+    struct CSlot
+    {
+        CSlot() : sequence(0) {}
+        std::atomic<size_t> sequence;
+        T item;
+    };
+
+    std::vector<CSlot> m_slots;
+    size_t m_mask;                  // capacity - 1
+    alignas(64) std::atomic<size_t> m_head;     // next position to pop
+    alignas(64) std::atomic<size_t> m_tail;     // next position to push
+    std::atomic<bool> m_closed;
+    std::atomic<bool> m_cancelled;
+    CQueueWaiter m_waiter;
+};
+
+template <class T>
+CSharedQueueOf<T>::CSharedQueueOf(int capacity)
+    : m_slots(QueueCapacity(capacity)), m_mask(m_slots.size() - 1),
+      m_head(0), m_tail(0), m_closed(false), m_cancelled(false)
+{
+    for (size_t i = 0; i < m_slots.size(); i++)
+        m_slots[i].sequence.store(i, std::memory_order_relaxed);
+}
+
+template <class T>
+bool CSharedQueueOf<T>::TryPush(T& item)
+{
+    if (m_closed.load(std::memory_order_acquire))
+        return false;
+    size_t pos = m_tail.load(std::memory_order_relaxed);
+    CSlot* slot;
+    for (;;)
+    {
+        slot = &m_slots[pos & m_mask];
+        size_t seq = slot->sequence.load(std::memory_order_acquire);
+        ptrdiff_t diff = (ptrdiff_t) seq - (ptrdiff_t) pos;
+        if (diff == 0 && m_tail.compare_exchange_weak(pos, pos + 1,
+                                                      std::memory_order_relaxed))
+            break;                  // slot claimed
+        if (diff < 0)
+            return false;           // full
+        if (diff > 0)
+            pos = m_tail.load(std::memory_order_relaxed);
+    }
+    slot->item = std::move(item);
+    slot->sequence.store(pos + 1, std::memory_order_release);
+    m_waiter.Notify();
+    return true;
+}
+
+template <class T>
+bool CSharedQueueOf<T>::TryPop(T& item)
+{
+    size_t pos = m_head.load(std::memory_order_relaxed);
+    CSlot* slot;
+    for (;;)
+    {
+        slot = &m_slots[pos & m_mask];
+        size_t seq = slot->sequence.load(std::memory_order_acquire);
+        ptrdiff_t diff = (ptrdiff_t) seq - (ptrdiff_t) (pos + 1);
+        if (diff == 0 && m_head.compare_exchange_weak(pos, pos + 1,
+                                                      std::memory_order_relaxed))
+            break;                  // item claimed
+        if (diff < 0)
+            return false;           // empty
+        if (diff > 0)
+            pos = m_head.load(std::memory_order_relaxed);
+    }
+    item = std::move(slot->item);
+    slot->item = T();
+    slot->sequence.store(pos + m_mask + 1, std::memory_order_release);
+    m_waiter.Notify();
+    return true;
+}
+
+template <class T>
+bool CSharedQueueOf<T>::Push(T item)
+{
+    bool pushed = false;
+    m_waiter.Wait([&]() { return (pushed = TryPush(item)) || m_closed; });
+    return pushed;
+}
+
+template <class T>
+bool CSharedQueueOf<T>::Pop(T& item)
+{
+    // (an item pushed before the close is still popped)
+    bool popped = false;
+    m_waiter.Wait([&]() { return (popped = TryPop(item)) || m_closed; });
+    return popped || (! m_cancelled && TryPop(item));
+}
+
+template <class T>
+EQueueResult CSharedQueueOf<T>::PushOrPark(T& item, const std::function<void()>& resume)
+{
+    bool pushed = false;
+    if (! m_waiter.Poll([&]() { return (pushed = TryPush(item)) || m_closed; }, resume))
+        return eQueueParked;
+    return pushed ? eQueueDone : eQueueClosed;
+}
+
+template <class T>
+EQueueResult CSharedQueueOf<T>::PopOrPark(T& item, const std::function<void()>& resume)
+{
+    bool popped = false;
+    if (! m_waiter.Poll([&]() { return (popped = TryPop(item)) || m_closed; }, resume))
+        return eQueueParked;
+    return (popped || (! m_cancelled && TryPop(item))) ? eQueueDone : eQueueClosed;
+}
+
+template <class T>
+void CSharedQueueOf<T>::Close()
+{
+    m_closed = true;
+    m_waiter.Notify();
+}
+
+template <class T>
+void CSharedQueueOf<T>::Cancel()
+{
+    m_cancelled = true;
+    Close();
+}
+
+template <class T>
+int CSharedQueueOf<T>::Capacity() const
+{
+    return (int) m_slots.size();
+}
+
+//
+//  Stages and their workers
+//
+
+class CThreadPool;
+class CTaskGroup;
+
+class CPipeline
+{
+public:
+    CPipeline(CThreadPool* pool = 0);   // pool for the stages' parallel loops
+
+    template <class Out, class Fn>      // bool produce(Out::Item&)
+    void Source(const char* name, int nWorkers, Out& out, Fn produce);
+    template <class In, class Out, class Fn>    // void fn(In::Item&, Out::Item&)
+    void Stage(const char* name, int nWorkers, In& in, Out& out, Fn fn);
+    template <class In, class Fn>       // void consume(In::Item&)
+    void Sink(const char* name, int nWorkers, In& in, Fn consume);
+
+    void Run(void);                 // run all stages;  rethrows the first error
+    void Cancel(void);              // stop all stages as soon as possible
+    bool Cancelled(void) const;
+
+private:
+    CPipeline(const CPipeline&);
+    void operator=(const CPipeline&);
+
+    // A worker's body runs until the worker has finished (true) or has
+    //  parked its resume callback on a queue (false)
+    typedef std::function<void()> Resume;
+    typedef std::function<bool(const Resume&)> Body;
+
+    struct CStage
+    {
+        const char* name;
+        int nWorkers;
+        std::atomic<int> running;           // workers still running
+        Body body;                          // body of each worker
+        const void* out;                    // output queue (or 0)
+        std::function<void()> close;        // closes it
+    };
+    struct CWorker
+    {
+        CStage* stage;
+        Body body;                          // (a copy of its own)
+        Resume resume;                      // resubmits it
+    };
+    void Add(const char* name, int nWorkers, Body body,
+             const void* out, std::function<void()> close,
+             std::function<void()> cancel);
+    void Activate(CWorker* worker);
+    void Resubmit(CWorker* worker);
+
+    CThreadPool* m_pool;
+    std::vector<std::unique_ptr<CStage> > m_stages;
+    std::vector<std::unique_ptr<CWorker> > m_workers;
+    std::vector<std::function<void()> > m_cancel;  // cancel each queue
+    std::map<const void*, int> m_producers; // running stages feeding a queue
+    std::mutex m_mutex;                     // guards the above, m_error and the run's state
+    std::exception_ptr m_error;             // first exception of a stage
+    std::atomic<bool> m_cancelled;
+    CTaskGroup* m_group;                    // tasks of the running workers
+    int m_finished;                         // workers that have finished
+    unsigned m_resubmits;                   // parked workers resubmitted
+    std::condition_variable m_done;         // signals both of the above
+};
+
+template <class Out, class Fn>
+void CPipeline::Source(const char* name, int nWorkers, Out& out, Fn produce)
+{
+    typename Out::Item item;
+    bool pending = false;                   // item yet to be pushed
+    Add(name, nWorkers, [&out, produce, item, pending](const Resume& resume) mutable
+    {
+        for (;;)
+        {
+            if (! pending)
+            {
+                item = typename Out::Item();
+                if (! produce(item))
+                    return true;
+                pending = true;
+            }
+            EQueueResult pushed = out.PushOrPark(item, resume);
+            if (pushed != eQueueDone)
+                return pushed == eQueueClosed;
+            pending = false;
+        }
+    },
+    &out, [&out]() { out.Close(); }, [&out]() { out.Cancel(); });
+}
+
+template <class In, class Out, class Fn>
+void CPipeline::Stage(const char* name, int nWorkers, In& in, Out& out, Fn fn)
+{
+    typename In::Item item;
+    typename Out::Item result;
+    bool pending = false;                   // result yet to be pushed
+    Add(name, nWorkers, [&in, &out, fn, item, result, pending](const Resume& resume) mutable
+    {
+        for (;;)
+        {
+            if (! pending)
+            {
+                EQueueResult popped = in.PopOrPark(item, resume);
+                if (popped != eQueueDone)
+                    return popped == eQueueClosed;
+                result = typename Out::Item();
+                fn(item, result);
+                item = typename In::Item();
+                pending = true;
+            }
+            EQueueResult pushed = out.PushOrPark(result, resume);
+            if (pushed != eQueueDone)
+                return pushed == eQueueClosed;
+            pending = false;
+        }
+    },
+    &out, [&out]() { out.Close(); }, [&in, &out]() { in.Cancel(), out.Cancel(); });
+}
+
+template <class In, class Fn>
+void CPipeline::Sink(const char* name, int nWorkers, In& in, Fn consume)
+{
+    typename In::Item item;
+    Add(name, nWorkers, [&in, consume, item](const Resume& resume) mutable
+    {
+        for (;;)
+        {
+            EQueueResult popped = in.PopOrPark(item, resume);
+            if (popped != eQueueDone)
+                return popped == eQueueClosed;
+            consume(item);
+            item = typename In::Item();
+        }
+    },
+    0, []() {}, [&in]() { in.Cancel(); });
+}
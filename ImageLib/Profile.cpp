@@ -0,0 +1,573 @@
+///////////////////////////////////////////////////////////////////////////
+//
+// NAME
+//  Profile.cpp -- per-stage timers and counters, a timeline trace, and
+//              memory accounting
+//
+// DESCRIPTION
+//  Each thread adds to its own CThreadProfile, which is registered in a
+//  global list the first time the thread adds anything.  When the thread
+//  exits, its table is merged into the totals of the exited threads and
+//  freed, so that the work of threads that have gone is still reported
+//  but a long-running process that keeps starting threads (e.g., one
+//  pipeline per stitch) doesn't keep a table for each.  The fields are
+//  atomics only so that the report can read them while other threads
+//  are still running;  each has a single writer, which updates it with a
+//  plain (relaxed) load and store.  The list, the exited threads' totals
+//  and the reports are guarded by a mutex, so a table isn't freed while
+//  it is being read.
+//
+//  The trace ring buffer of a thread is allocated by its first event,
+//  small, and doubled (under the mutex, so that TraceWrite() never reads
+//  a buffer being replaced) each time it fills up, until it holds
+//  traceCapacity events, after which it wraps around.  The writer fills
+//  in the slot and then publishes it by advancing traceCount (with
+//  release ordering);  TraceWrite() reads the count (with acquire
+//  ordering) and then the last traceSize slots.  When the thread exits,
+//  its events are copied into a shared buffer holding the most recent
+//  exitedTraceCapacity events of all of the exited threads, and its ring
+//  is freed, so that short-lived threads (e.g., a pipeline's) don't each
+//  leave a full ring behind.
+//
+//  The memory figures are global atomics rather than per-thread tables,
+//  since a buffer is often freed on a different thread than the one that
+//  allocated it, and the high-water mark is only meaningful for all of
+//  the threads together.  Allocations are large and comparatively rare,
+//  so the contention doesn't matter.
+//
+// SEE ALSO
+//  Profile.h           longer description
+//
+///////////////////////////////////////////////////////////////////////////
+
+#include "Profile.h"
+#include <chrono>
+#include <deque>
+#include <mutex>
+#include <vector>
+
+std::atomic<int> profileMode(0);
+
+static const int traceCapacity = 1 << 16;       // events kept per thread
+static const int traceInitialSize = 256;        // first ring buffer size
+static const int exitedTraceCapacity = 1 << 18; // kept for exited threads
+static std::atomic<long long> traceStart(0);    // time of TraceEnable(true)
+
+static const char *stageNames[eProfNumStages] =
+{
+    "ReadFile",
+    "WriteFile",
+    "WarpSphericalField",
+    "WarpLocal",
+    "alignPair",
+    "countInliers",
+    "AccumulateBlend",
+    "NormalizeBlend"
+};
+
+static const char *memoryTagNames[eMemNumTags] =
+{
+    "untagged",
+    "image",
+    "uvField",
+    "mappedField",
+    "warped",
+    "accumulator",
+    "composite",
+    "mosaic",
+    "pyramid"
+};
+
+static const char *counterNames[eProfNumCounters] =
+{
+    "bytesRead",
+    "bytesWritten",
+    "warpPixels",
+    "RANSACIterations",
+    "inlierEvaluations",
+    "blendPixels"
+};
+
+struct CStageTotals
+{
+    std::atomic<long long> calls, ns, maxNs;
+    std::atomic<long long> threads;             // merged (0 = just this one)
+};
+
+struct CTraceEvent
+{
+    const char *name;
+    const char *argName;                        // 0 if no argument
+    long long arg;
+    long long start, end;                       // ProfileClock()
+};
+
+struct CThreadProfile
+{
+    int id;                                     // order of first use
+    CStageTotals stage[eProfNumStages];
+    std::atomic<long long> count[eProfNumCounters];
+    CTraceEvent *trace;                         // ring buffer (or 0)
+    int traceSize;                              // its size
+    std::atomic<long long> traceCount;          // events ever written
+};
+
+// An event of a thread that has exited
+struct CExitedEvent
+{
+    int id;
+    CTraceEvent event;
+};
+
+struct CProfiles
+{
+    std::mutex mutex;                           // guards all of these
+    std::vector<CThreadProfile *> threads;      // running threads
+    CThreadProfile exited;                      // exited threads' totals
+    int nExited;                                // number merged into it
+    std::deque<CExitedEvent> events;            // exited threads' events
+    long long eventsDropped;                    // (overwritten or evicted)
+    int nextId;
+};
+
+static CProfiles& Profiles(void)
+{
+    // (never destroyed, since pool threads may exit during the destruction
+    //  of other statics)
+    static CProfiles *profiles = 0;
+    static std::once_flag once;
+    std::call_once(once, []()
+    {
+        profiles = new CProfiles();             // value-initialized
+        profiles->exited.id = -1;
+    });
+    return *profiles;
+}
+
+static inline void Add(std::atomic<long long>& v, long long n)
+{
+    v.store(v.load(std::memory_order_relaxed) + n, std::memory_order_relaxed);
+}
+
+static void RetireThread(CThreadProfile *p)
+{
+    // Merge the table of an exiting thread into the exited threads' totals
+    CProfiles& all = Profiles();
+    std::lock_guard<std::mutex> lock(all.mutex);
+    CThreadProfile& e = all.exited;
+    for (int s = 0; s < eProfNumStages; s++)
+    {
+        const CStageTotals& t = p->stage[s];
+        long long calls = t.calls.load(std::memory_order_relaxed);
+        if (calls == 0)
+            continue;
+        Add(e.stage[s].calls, calls);
+        Add(e.stage[s].ns, t.ns.load(std::memory_order_relaxed));
+        long long maxNs = t.maxNs.load(std::memory_order_relaxed);
+        if (maxNs > e.stage[s].maxNs.load(std::memory_order_relaxed))
+            e.stage[s].maxNs.store(maxNs, std::memory_order_relaxed);
+        Add(e.stage[s].threads, 1);
+    }
+    for (int c = 0; c < eProfNumCounters; c++)
+        Add(e.count[c], p->count[c].load(std::memory_order_relaxed));
+    all.nExited++;
+    if (p->trace != 0)
+    {
+        // Keep its last events (and as many of the others' as fit)
+        long long n = p->traceCount.load(std::memory_order_relaxed);
+        long long first = (n > p->traceSize) ? n - p->traceSize : 0;
+        all.eventsDropped += first;
+        for (long long k = first; k < n; k++)
+        {
+            CExitedEvent e = {p->id, p->trace[k % p->traceSize]};
+            all.events.push_back(e);
+        }
+        while ((int) all.events.size() > exitedTraceCapacity)
+            all.events.pop_front(), all.eventsDropped++;
+        delete [] p->trace;
+    }
+    for (size_t i = 0; i < all.threads.size(); i++)
+        if (all.threads[i] == p)
+            all.threads.erase(all.threads.begin() + i);
+    delete p;
+}
+
+// Frees the calling thread's table when it exits
+struct CThreadProfileOwner
+{
+    CThreadProfileOwner() : profile(0) {}
+    ~CThreadProfileOwner()
+    {
+        if (profile)
+            RetireThread(profile);
+    }
+    CThreadProfile *profile;
+};
+
+static CThreadProfile& ThisThread(void)
+{
+    static thread_local CThreadProfileOwner owner;
+    if (owner.profile == 0)
+    {
+        CThreadProfile *p = new CThreadProfile();   // value-initialized
+        CProfiles& all = Profiles();
+        std::lock_guard<std::mutex> lock(all.mutex);
+        p->id = all.nextId++;
+        all.threads.push_back(p);
+        owner.profile = p;
+    }
+    return *owner.profile;
+}
+
+void ProfileEnable(bool enable)
+{
+    if (enable)
+        profileMode.fetch_or(eProfileTimes);
+    else
+        profileMode.fetch_and(~eProfileTimes);
+}
+
+void TraceEnable(bool enable)
+{
+    if (enable)
+    {
+        traceStart.store(ProfileClock());
+        profileMode.fetch_or(eProfileTrace);
+    }
+    else
+        profileMode.fetch_and(~eProfileTrace);
+}
+
+long long ProfileClock(void)
+{
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(
+        std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+void ProfileAddTime(EProfileStage stage, long long ns)
+{
+    CStageTotals& s = ThisThread().stage[stage];
+    Add(s.calls, 1);
+    Add(s.ns, ns);
+    if (ns > s.maxNs.load(std::memory_order_relaxed))
+        s.maxNs.store(ns, std::memory_order_relaxed);
+}
+
+void ProfileAddCount(EProfileCounter counter, long long n)
+{
+    Add(ThisThread().count[counter], n);
+}
+
+void ProfileEndScope(EProfileStage stage, long long start)
+{
+    long long end = ProfileClock();
+    if (ProfileEnabled())
+        ProfileAddTime(stage, end - start);
+    if (TraceEnabled())
+        TraceAddEvent(stageNames[stage], 0, 0, start, end);
+}
+
+void TraceAddEvent(const char *name, const char *argName, long long arg,
+                   long long start, long long end)
+{
+    CThreadProfile& p = ThisThread();
+    long long n = p.traceCount.load(std::memory_order_relaxed);
+    if (n == p.traceSize && n < traceCapacity)
+    {
+        // Allocate or grow the ring (which hasn't wrapped around yet)
+        int size = (p.traceSize == 0) ? traceInitialSize : 2 * p.traceSize;
+        CTraceEvent *trace = new CTraceEvent[size];
+        for (long long k = 0; k < n; k++)
+            trace[k] = p.trace[k];
+        CTraceEvent *old = p.trace;
+        {
+            std::lock_guard<std::mutex> lock(Profiles().mutex);
+            p.trace = trace, p.traceSize = size;
+        }
+        delete [] old;
+    }
+    CTraceEvent& e = p.trace[n % p.traceSize];
+    e.name = name, e.argName = argName, e.arg = arg;
+    e.start = start, e.end = end;
+    p.traceCount.store(n + 1, std::memory_order_release);
+}
+
+// Totals of a stage or counter over a set of threads
+
+struct CStageSum
+{
+    long long calls, ns, maxNs;
+    int threads;
+};
+
+static CStageSum SumStage(const std::vector<CThreadProfile *>& ps, int s)
+{
+    CStageSum sum = {0, 0, 0, 0};
+    for (size_t i = 0; i < ps.size(); i++)
+    {
+        const CStageTotals& t = ps[i]->stage[s];
+        long long calls = t.calls.load(std::memory_order_relaxed);
+        if (calls == 0)
+            continue;
+        sum.calls += calls;
+        sum.ns    += t.ns.load(std::memory_order_relaxed);
+        long long maxNs = t.maxNs.load(std::memory_order_relaxed);
+        if (maxNs > sum.maxNs)
+            sum.maxNs = maxNs;
+        long long threads = t.threads.load(std::memory_order_relaxed);
+        sum.threads += (threads > 0) ? (int) threads : 1;
+    }
+    return sum;
+}
+
+static long long SumCount(const std::vector<CThreadProfile *>& ps, int c)
+{
+    long long sum = 0;
+    for (size_t i = 0; i < ps.size(); i++)
+        sum += ps[i]->count[c].load(std::memory_order_relaxed);
+    return sum;
+}
+
+static std::vector<CThreadProfile *> AllThreads(CProfiles& all)
+{
+    // The tables of the running threads and (if any have exited) the
+    //  exited threads' totals;  the caller holds all.mutex
+    std::vector<CThreadProfile *> ps = all.threads;
+    if (all.nExited > 0)
+        ps.push_back(&all.exited);
+    return ps;
+}
+
+void ProfileReset(void)
+{
+    CProfiles& all = Profiles();
+    std::lock_guard<std::mutex> lock(all.mutex);
+    std::vector<CThreadProfile *> ps = AllThreads(all);
+    for (size_t i = 0; i < ps.size(); i++)
+    {
+        for (int s = 0; s < eProfNumStages; s++)
+        {
+            CStageTotals& t = ps[i]->stage[s];
+            t.calls.store(0), t.ns.store(0), t.maxNs.store(0), t.threads.store(0);
+        }
+        for (int c = 0; c < eProfNumCounters; c++)
+            ps[i]->count[c].store(0);
+    }
+}
+
+long long ProfileStageTime(EProfileStage stage)
+{
+    CProfiles& all = Profiles();
+    std::lock_guard<std::mutex> lock(all.mutex);
+    return SumStage(AllThreads(all), stage).ns;
+}
+
+const char *ProfileStageName(EProfileStage stage)
+{
+    return stageNames[stage];
+}
+
+// Memory accounting (index eMemNumTags holds the totals)
+
+thread_local int memoryTag = eMemUntagged;
+
+struct CMemoryTotals
+{
+    std::atomic<long long> current, peak, count;
+};
+
+static CMemoryTotals memoryTotals[eMemNumTags + 1];
+
+static void AddBytes(CMemoryTotals& m, long long nBytes)
+{
+    long long current = m.current.fetch_add(nBytes) + nBytes;
+    long long peak = m.peak.load();
+    while (current > peak && ! m.peak.compare_exchange_weak(peak, current))
+        ;
+}
+
+void MemoryAllocated(int tag, long long nBytes)
+{
+    AddBytes(memoryTotals[tag], nBytes);
+    AddBytes(memoryTotals[eMemNumTags], nBytes);
+    memoryTotals[tag].count++;
+    memoryTotals[eMemNumTags].count++;
+}
+
+void MemoryFreed(int tag, long long nBytes)
+{
+    memoryTotals[tag].current -= nBytes;
+    memoryTotals[eMemNumTags].current -= nBytes;
+}
+
+CMemoryStats MemoryStats(int tag)
+{
+    CMemoryTotals& m = memoryTotals[(tag < 0) ? eMemNumTags : tag];
+    CMemoryStats stats = {m.current.load(), m.peak.load(), m.count.load()};
+    return stats;
+}
+
+void MemoryResetPeak(void)
+{
+    for (int t = 0; t <= eMemNumTags; t++)
+        memoryTotals[t].peak.store(memoryTotals[t].current.load());
+}
+
+static void ReportTable(FILE *stream, const std::vector<CThreadProfile *>& ps)
+{
+    fprintf(stream, "%-20s %10s %12s %12s %12s %8s\n",
+            "stage", "calls", "total ms", "mean ms", "max ms", "threads");
+    for (int s = 0; s < eProfNumStages; s++)
+    {
+        CStageSum sum = SumStage(ps, s);
+        if (sum.calls == 0)
+            continue;
+        fprintf(stream, "%-20s %10lld %12.3f %12.3f %12.3f %8d\n",
+                stageNames[s], sum.calls, sum.ns * 1e-6,
+                sum.ns * 1e-6 / sum.calls, sum.maxNs * 1e-6, sum.threads);
+    }
+    fprintf(stream, "\n%-20s %14s\n", "counter", "total");
+    for (int c = 0; c < eProfNumCounters; c++)
+    {
+        long long sum = SumCount(ps, c);
+        if (sum != 0)
+            fprintf(stream, "%-20s %14lld\n", counterNames[c], sum);
+    }
+    fprintf(stream, "\n%-20s %12s %12s %12s\n", "memory", "current MB", "peak MB", "allocations");
+    for (int t = 0; t <= eMemNumTags; t++)
+    {
+        CMemoryStats m = MemoryStats((t < eMemNumTags) ? t : -1);
+        if (m.count != 0)
+            fprintf(stream, "%-20s %12.1f %12.1f %12lld\n",
+                    (t < eMemNumTags) ? memoryTagNames[t] : "total",
+                    m.current / 1048576.0, m.peak / 1048576.0, m.count);
+    }
+}
+
+static void ReportJSON(FILE *stream, const std::vector<CThreadProfile *>& ps)
+{
+    fprintf(stream, "{\n  \"stages\": {");
+    const char *sep = "\n";
+    for (int s = 0; s < eProfNumStages; s++)
+    {
+        CStageSum sum = SumStage(ps, s);
+        if (sum.calls == 0)
+            continue;
+        fprintf(stream, "%s    \"%s\": {\"calls\": %lld, \"totalMs\": %.3f, "
+                "\"maxMs\": %.3f, \"threads\": %d}", sep, stageNames[s],
+                sum.calls, sum.ns * 1e-6, sum.maxNs * 1e-6, sum.threads);
+        sep = ",\n";
+    }
+    fprintf(stream, "\n  },\n  \"counters\": {");
+    sep = "\n";
+    for (int c = 0; c < eProfNumCounters; c++)
+    {
+        fprintf(stream, "%s    \"%s\": %lld", sep, counterNames[c], SumCount(ps, c));
+        sep = ",\n";
+    }
+    fprintf(stream, "\n  },\n  \"memory\": {");
+    sep = "\n";
+    for (int t = 0; t <= eMemNumTags; t++)
+    {
+        CMemoryStats m = MemoryStats((t < eMemNumTags) ? t : -1);
+        fprintf(stream, "%s    \"%s\": {\"currentBytes\": %lld, \"peakBytes\": %lld, "
+                "\"allocations\": %lld}", sep, (t < eMemNumTags) ? memoryTagNames[t] : "total",
+                m.current, m.peak, m.count);
+        sep = ",\n";
+    }
+    fprintf(stream, "\n  },\n  \"threads\": [");
+    for (size_t i = 0; i < ps.size(); i++)
+    {
+        std::vector<CThreadProfile *> one(1, ps[i]);
+        fprintf(stream, "%s\n    {\"id\": %d, \"stages\": {", i ? "," : "", ps[i]->id);
+        sep = "";
+        for (int s = 0; s < eProfNumStages; s++)
+        {
+            CStageSum sum = SumStage(one, s);
+            if (sum.calls == 0)
+                continue;
+            fprintf(stream, "%s\"%s\": {\"calls\": %lld, \"totalMs\": %.3f}",
+                    sep, stageNames[s], sum.calls, sum.ns * 1e-6);
+            sep = ", ";
+        }
+        fprintf(stream, "}, \"counters\": {");
+        sep = "";
+        for (int c = 0; c < eProfNumCounters; c++)
+        {
+            long long sum = SumCount(one, c);
+            if (sum == 0)
+                continue;
+            fprintf(stream, "%s\"%s\": %lld", sep, counterNames[c], sum);
+            sep = ", ";
+        }
+        fprintf(stream, "}}");
+    }
+    fprintf(stream, "\n  ]\n}\n");
+}
+
+void ProfileReport(FILE *stream, bool json)
+{
+    CProfiles& all = Profiles();
+    std::lock_guard<std::mutex> lock(all.mutex);
+    std::vector<CThreadProfile *> ps = AllThreads(all);
+    if (json)
+        ReportJSON(stream, ps);
+    else
+        ReportTable(stream, ps);
+}
+
+static void WriteThreadName(FILE *stream, const char *&sep, int id)
+{
+    fprintf(stream, "%s{\"name\": \"thread_name\", \"ph\": \"M\", \"pid\": 1, "
+            "\"tid\": %d, \"args\": {\"name\": \"thread %d\"}}", sep, id, id);
+    sep = ",\n";
+}
+
+static void WriteEvent(FILE *stream, const char *sep, int id, const CTraceEvent& e,
+                       long long t0)
+{
+    fprintf(stream, "%s{\"name\": \"%s\", \"ph\": \"X\", \"pid\": 1, "
+            "\"tid\": %d, \"ts\": %.3f, \"dur\": %.3f", sep, e.name,
+            id, (e.start - t0) * 1e-3, (e.end - e.start) * 1e-3);
+    if (e.argName)
+        fprintf(stream, ", \"args\": {\"%s\": %lld}", e.argName, e.arg);
+    fprintf(stream, "}");
+}
+
+bool TraceWrite(const char *filename)
+{
+    CProfiles& all = Profiles();
+    std::lock_guard<std::mutex> lock(all.mutex);
+    FILE *stream = fopen(filename, "w");
+    if (stream == 0)
+        return false;
+
+    // One "complete" (X) event per span, in microseconds since
+    //  TraceEnable(true), for the running threads and those that have exited
+    long long t0 = traceStart.load();
+    long long dropped = all.eventsDropped;
+    fprintf(stream, "{\"displayTimeUnit\": \"ms\", \"traceEvents\": [");
+    const char *sep = "\n";
+    for (size_t i = 0; i < all.threads.size(); i++)
+    {
+        const CThreadProfile& p = *all.threads[i];
+        long long n = p.traceCount.load(std::memory_order_acquire);
+        if (n == 0)
+            continue;
+        WriteThreadName(stream, sep, p.id);
+        long long first = (n > p.traceSize) ? n - p.traceSize : 0;
+        dropped += first;
+        for (long long k = first; k < n; k++)
+            WriteEvent(stream, sep, p.id, p.trace[k % p.traceSize], t0);
+    }
+    for (size_t i = 0; i < all.events.size(); i++)
+    {
+        // (each exited thread's events are together)
+        const CExitedEvent& e = all.events[i];
+        if (i == 0 || all.events[i-1].id != e.id)
+            WriteThreadName(stream, sep, e.id);
+        WriteEvent(stream, sep, e.id, e.event, t0);
+    }
+    fprintf(stream, "\n], \"otherData\": {\"droppedEvents\": %lld}}\n", dropped);
+    return fclose(stream) == 0;
+}
@@ -0,0 +1,241 @@
+///////////////////////////////////////////////////////////////////////////
+//
+// NAME
+//  Profile.h -- per-stage timers and counters, a timeline trace, and
+//              memory accounting
+//
+// DESCRIPTION
+//  The main stages of the stitching pipeline time themselves with a
+//  scoped timer and count the work they do:
+//
+//      void WarpLocal(...)
+//      {
+//          CProfileScope scope(eProfWarpLocal);
+//          ProfileCount(eProfWarpPixels, sh.width * sh.height);
+//          ...
+//      }
+//
+//  Profiling is off unless ProfileEnable(true) has been called (Project2
+//  does this for --profile);  when it is off a scope or a count costs one
+//  test of a flag.  When it is on, the times and counts are added to
+//  tables private to the calling thread, so that threads never contend
+//  for them, and ProfileReport() adds the tables of all of the threads
+//  together (including those of threads that have since exited).
+//
+//  ProfileReport(stream, json) prints one line per stage (the number of
+//  calls, the total, mean and longest time and the number of threads the
+//  stage ran on) followed by the counters, or the same as a JSON object
+//  with the totals of each thread under "threads" (those of the threads
+//  that have exited are merged into one entry, with id -1, as a thread's
+//  table is freed when it exits).  It should be called
+//  once the work has finished;  tables still being added to are read
+//  without locking.
+//
+//  TraceEnable(true) also records each scope as an event on a timeline,
+//  along with finer-grained spans that are not stages of their own:
+//
+//      for (y0 = 0; y0 < height; y0 += bandHeight)
+//      {
+//          CTraceScope trace("blend band", "y", y0);
+//          ...
+//      }
+//
+//  Each thread writes its events into a ring buffer of its own (holding
+//  the last traceCapacity events, and growing to that size as needed),
+//  without locking.  When a thread exits, its events move to a buffer
+//  shared by the exited threads (holding their most recent events), and
+//  its ring is freed.  TraceWrite() writes
+//  the events of all of the threads as a Chrome trace-event JSON file,
+//  which can be opened in Perfetto (ui.perfetto.dev) or chrome://tracing
+//  to see which threads were busy, waiting or idle, and when.  Like
+//  ProfileReport(), it should be called once the work has finished.
+//  Events are recorded when the scope ends, as "complete" events holding
+//  both the start time and the duration, so that a ring buffer that has
+//  wrapped around never holds a begin without its end.  Span names (and
+//  argument names) must be string literals.
+//
+//  The pixel memory of every image (everything CRefCntMem allocates and
+//  frees itself) is accounted for all the time, whether or not profiling
+//  is on:  the bytes currently allocated, the most ever allocated at once
+//  (the high-water mark) and the number of allocations, in total and for
+//  each kind of buffer.  The kind is set for the allocations made by the
+//  calling thread (and the functions it calls) by a scoped tag:
+//
+//      CMemoryTag tag(eMemAccumulator);
+//      CFloatImage accumulator(bShape);
+//
+//  The innermost tag wins, and allocations made outside any tag are
+//  "untagged".  MemoryStats() returns the figures of one tag (or of all
+//  of them), and ProfileReport() includes them.
+//
+//  A benchmark that makes several runs in one process calls
+//  ProfileReset() and MemoryResetPeak() before each run, and reads the
+//  time of each stage with ProfileStageTime() and the high-water mark with
+//  MemoryStats() after it.  Like ProfileReport(), these should only be
+//  called while no other thread is working.
+//
+//  New stages, counters and memory tags are added to the enums below and
+//  given a name in Profile.cpp.
+//
+// SEE ALSO
+//  Profile.cpp         implementation
+//
+///////////////////////////////////////////////////////////////////////////
+
+#include <atomic>
+#include <stdio.h>
+
+enum EProfileStage
+{
+    eProfReadFile,
+    eProfWriteFile,
+    eProfWarpSphericalField,
+    eProfWarpLocal,
+    eProfAlignPair,
+    eProfCountInliers,
+    eProfAccumulateBlend,
+    eProfNormalizeBlend,
+    eProfNumStages
+};
+
+enum EProfileCounter
+{
+    eProfBytesRead,             // image bytes read by ReadFile
+    eProfBytesWritten,          // image bytes written by WriteFile
+    eProfWarpPixels,            // pixels resampled by WarpLocal
+    eProfRANSACIterations,      // RANSAC iterations requested of alignPair
+    eProfInlierEvaluations,     // matches tested by countInliers
+    eProfBlendPixels,           // accumulator pixels visited by AccumulateBlend
+    eProfNumCounters
+};
+
+enum EMemoryTag
+{
+    eMemUntagged,
+    eMemImage,                  // images read from files
+    eMemUVField,                // (u,v) warp fields
+    eMemMappedField,            // warp fields mapped from the warp store
+    eMemWarped,                 // images resampled by WarpLocal
+    eMemAccumulator,            // blend accumulator (one band)
+    eMemComposite,              // normalized composite (one band)
+    eMemMosaic,                 // output mosaic rows and sink buffers
+    eMemPyramid,                // pyramid levels and tile pyramid rows
+    eMemNumTags
+};
+
+enum EProfileMode
+{
+    eProfileTimes   = 1 << 0,   // stage totals and counters (ProfileEnable)
+    eProfileTrace   = 1 << 1    // timeline of events (TraceEnable)
+};
+
+void ProfileEnable(bool enable);
+void ProfileReport(FILE *stream, bool json = false);
+
+void ProfileReset(void);                        // zero the stage and counter totals
+long long ProfileStageTime(EProfileStage stage);    // ns, summed over threads
+const char *ProfileStageName(EProfileStage stage);
+
+void TraceEnable(bool enable);
+bool TraceWrite(const char *filename);          // false if it can't be written
+
+extern std::atomic<int> profileMode;
+
+inline bool ProfileEnabled(void)
+{
+    return (profileMode.load(std::memory_order_relaxed) & eProfileTimes) != 0;
+}
+
+inline bool TraceEnabled(void)
+{
+    return (profileMode.load(std::memory_order_relaxed) & eProfileTrace) != 0;
+}
+
+long long ProfileClock(void);                   // nanoseconds
+void ProfileAddTime(EProfileStage stage, long long ns);
+void ProfileAddCount(EProfileCounter counter, long long n);
+void ProfileEndScope(EProfileStage stage, long long start);
+void TraceAddEvent(const char *name, const char *argName, long long arg,
+                   long long start, long long end);
+
+inline void ProfileCount(EProfileCounter counter, long long n)
+{
+    if (ProfileEnabled())
+        ProfileAddCount(counter, n);
+}
+
+class CProfileScope
+{
+public:
+    CProfileScope(EProfileStage stage)
+        : m_stage(stage), m_start(profileMode.load(std::memory_order_relaxed) ?
+                                  ProfileClock() : -1) {}
+    ~CProfileScope()
+    {
+        if (m_start >= 0)
+            ProfileEndScope(m_stage, m_start);
+    }
+
+private:
+    CProfileScope(const CProfileScope&);
+    void operator=(const CProfileScope&);
+
+    EProfileStage m_stage;
+    long long m_start;
+};
+
+class CTraceScope
+{
+public:
+    CTraceScope(const char *name, const char *argName = 0, long long arg = 0)
+        : m_name(name), m_argName(argName), m_arg(arg),
+          m_start(TraceEnabled() ? ProfileClock() : -1) {}
+    ~CTraceScope()
+    {
+        if (m_start >= 0)
+            TraceAddEvent(m_name, m_argName, m_arg, m_start, ProfileClock());
+    }
+
+private:
+    CTraceScope(const CTraceScope&);
+    void operator=(const CTraceScope&);
+
+    const char *m_name;
+    const char *m_argName;
+    long long m_arg;
+    long long m_start;
+};
+
+// Memory accounting (see above)
+
+struct CMemoryStats
+{
+    long long current;          // bytes allocated now
+    long long peak;             // most bytes allocated at once
+    long long count;            // number of allocations
+};
+
+CMemoryStats MemoryStats(int tag = -1);         // -1 = all tags
+void MemoryResetPeak(void);                     // high-water marks = current
+void MemoryAllocated(int tag, long long nBytes);
+void MemoryFreed(int tag, long long nBytes);
+
+extern thread_local int memoryTag;
+
+inline int MemoryCurrentTag(void)
+{
+    return memoryTag;
+}
+
+class CMemoryTag
+{
+public:
+    CMemoryTag(EMemoryTag tag) : m_previous(memoryTag) { memoryTag = tag; }
+    ~CMemoryTag() { memoryTag = m_previous; }
+
+private:
+    CMemoryTag(const CMemoryTag&);
+    void operator=(const CMemoryTag&);
+
+    int m_previous;
+};
@@ -14,6 +14,7 @@
 #include <vector>
 #include "Pyramid.h"
 #include "Convolve.h"
+#include "Profile.h"
 
 template <class T>
 CPyramidOf<T>::CPyramidOf()
@@ -59,6 +60,7 @@ void CPyramidOf<T>::UpLevel(int l, int n_levels)
         m_image.resize(l+2);
     CImageOf<T>& src = m_image[l];
     CImageOf<T>& dst = m_image[l+1];
+    CMemoryTag tag(eMemPyramid);
     ConvolveSeparable(src, dst, decimateKernel, decimateKernel, 2);
 
     if (n_levels > 1)
@@ -98,6 +100,10 @@ void InstantiatePyramid(CPyramidOf<T> p)
 }
 
 
+template class CPyramidOf<uchar>;
+template class CPyramidOf<int>;
+template class CPyramidOf<float>;
+
 void InstantiatePyramids()
 {
     InstantiatePyramid(CBytePyramid());
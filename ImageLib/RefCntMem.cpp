@@ -11,6 +11,7 @@
 ///////////////////////////////////////////////////////////////////////////
 
 #include "RefCntMem.h"
+#include "Profile.h"
 
 CRefCntMem::CRefCntMem()
 {
@@ -30,11 +31,11 @@ void CRefCntMem::DecrementCount()
     // Decrement the reference count and delete if done
     if (m_ptr)
     {
-        m_ptr->m_refCnt -= 1;
-        if (m_ptr->m_refCnt == 0)
+        if (--m_ptr->m_refCnt == 0)
         {
             if (m_ptr->m_deleteWhenDone)
             {
+                MemoryFreed(m_ptr->m_tag, m_ptr->m_nBytes);
                 if (m_ptr->m_delFn)
                     m_ptr->m_delFn(m_ptr->m_memory);
                 else
@@ -64,9 +65,12 @@ CRefCntMem::CRefCntMem(const CRefCntMem& ref)
 CRefCntMem& CRefCntMem::operator=(const CRefCntMem& ref)
 {
     // Assignment
-    DecrementCount();   // if m_ptr exists, no longer pointing to it
-    m_ptr = ref.m_ptr;
-    IncrementCount();
+    if (m_ptr != ref.m_ptr)     // (self-assignment could delete the memory)
+    {
+        DecrementCount();   // if m_ptr exists, no longer pointing to it
+        m_ptr = ref.m_ptr;
+        IncrementCount();
+    }
     return *this;
 }
 
@@ -83,6 +87,9 @@ void CRefCntMem::ReAllocate(int nBytes, void *memory, bool deleteWhenDone,
         m_ptr->m_deleteWhenDone = deleteWhenDone;
         m_ptr->m_refCnt = 1;
         m_ptr->m_delFn = deleteFunction;
+        m_ptr->m_tag = MemoryCurrentTag();
+        if (deleteWhenDone)
+            MemoryAllocated(m_ptr->m_tag, nBytes);
     }
     else
         m_ptr = 0;  // don't bother storing pointer to null memory
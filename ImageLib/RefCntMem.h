@@ -13,6 +13,14 @@
 //  the including class to achieve a similar kind of memory sharing as
 //  is found in garbage collected languages such as Java and C#.
 //
+//  The reference count is atomic, so copies of an image (e.g., a shared
+//  warp field) can be made and dropped on several threads at once;  the
+//  pixels themselves are not protected.
+//
+//  Memory that the class deletes itself is counted in the global memory
+//  figures under the calling thread's current CMemoryTag (see Profile.h)
+//  from ReAllocate() until the last reference is dropped.
+//
 // SEE ALSO
 //  RefCntMem.cpp       implementation
 //  Image.h             class that uses a CRefCntMem object
@@ -24,13 +32,16 @@
 #ifndef REF_CNT_MEM_H
 #define REF_CNT_MEM_H
 
+#include <atomic>
+
 struct CRefCntMemPtr         // shared component of reference counted memory
 {
     void *m_memory;         // allocated memory
-    int m_refCnt;           // reference count
+    std::atomic<int> m_refCnt;  // reference count
     int m_nBytes;           // number of bytes
     bool m_deleteWhenDone;  // delete memory when ref-count drops to 0
     void (*m_delFn)(void *ptr); // optional delete function
+    int m_tag;              // memory accounting tag (see Profile.h)
 };
 
 class CRefCntMem            // reference-counted memory allocator
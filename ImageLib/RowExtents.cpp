@@ -0,0 +1,50 @@
+///////////////////////////////////////////////////////////////////////////
+//
+// NAME
+//  RowExtents.cpp -- the span of the valid pixels in each row of an image
+//
+// SEE ALSO
+//  RowExtents.h        longer description
+//
+///////////////////////////////////////////////////////////////////////////
+
+#include "Image.h"
+#include "RowExtents.h"
+
+void RowSpan(const CRowExtents& extents, int y, int width, int& x0, int& x1)
+{
+    if (extents.Empty())
+    {
+        x0 = 0, x1 = width;
+        return;
+    }
+    if (y < 0 || y >= (int) extents.x0.size())
+    {
+        x0 = x1 = 0;
+        return;
+    }
+    x0 = __max(0, extents.x0[y]);
+    x1 = __min(width, extents.x1[y]);
+    if (x1 < x0)
+        x1 = x0;
+}
+
+CRowExtents CropRowExtents(const CRowExtents& extents,
+                           int x0, int y0, int width, int height)
+{
+    CRowExtents crop;
+    if (extents.Empty())
+        return crop;
+    crop.x0.resize(height);
+    crop.x1.resize(height);
+    for (int y = 0; y < height; y++)
+    {
+        int s0, s1;
+        RowSpan(extents, y0 + y, x0 + width, s0, s1);
+        s0 = __max(s0, x0);
+        s1 = __max(s1, s0);
+        crop.x0[y] = (s0 < s1) ? s0 - x0 : 0;
+        crop.x1[y] = (s0 < s1) ? s1 - x0 : 0;
+    }
+    return crop;
+}
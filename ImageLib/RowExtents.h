@@ -0,0 +1,56 @@
+///////////////////////////////////////////////////////////////////////////
+//
+// NAME
+//  RowExtents.h -- the span of the valid pixels in each row of an image
+//
+// SPECIFICATION
+//  void RowSpan(const CRowExtents& extents, int y, int width,
+//               int& x0, int& x1);
+//  CRowExtents CropRowExtents(const CRowExtents& extents,
+//               int x0, int y0, int width, int height);
+//
+// PARAMETERS
+//  extents             spans of the rows of an image
+//  y                   row
+//  width               width of the image
+//  x0, x1              span [x0, x1) of the row (x0 == x1 if it is empty)
+//  x0, y0, width, height
+//                      sub-image whose extents are wanted
+//
+// DESCRIPTION
+//  The valid pixels of a warped image (those with a source) form a
+//  roughly convex region, and the rest are zero.  A CRowExtents, produced
+//  by the warp (see WarpSphericalField) and carried alongside the image
+//  (e.g., in a CImagePosition;  see BlendImages.h), gives the span of
+//  each row outside of which every pixel is zero, so that loops over the
+//  image (WarpLocal, AccumulateBlend, CompensateGains) visit only the
+//  spans instead of rediscovering validity pixel by pixel.
+//
+//  The spans are conservative:  a pixel inside a span may still be zero.
+//  An empty CRowExtents (one with no rows) says nothing about the image,
+//  i.e., every pixel of every row may be valid.
+//
+//  RowSpan returns the span of row y, clipped to [0, width) (all of it if
+//  extents is empty, and none of it if y is outside the rows of extents).
+//  CropRowExtents returns the extents of a sub-image (see SubImage in
+//  Image.h), with its spans relative to the sub-image.
+//
+// SEE ALSO
+//  RowExtents.cpp      implementation
+//  WarpImage.h         warping only the spans of a destination
+//
+///////////////////////////////////////////////////////////////////////////
+
+#include <vector>
+
+struct CRowExtents
+{
+    std::vector<int> x0, x1;        // span [x0[y], x1[y]) of row y
+
+    bool Empty(void) const  { return x0.empty(); }
+};
+
+void RowSpan(const CRowExtents& extents, int y, int width, int& x0, int& x1);
+
+CRowExtents CropRowExtents(const CRowExtents& extents,
+                           int x0, int y0, int width, int height);
@@ -0,0 +1,336 @@
+///////////////////////////////////////////////////////////////////////////
+//
+// NAME
+//  ThreadPool.cpp -- a work-stealing pool of worker threads
+//
+// SEE ALSO
+//  ThreadPool.h        longer description
+//
+// DESIGN
+//  Each worker queue has its own lock, so submitting and taking tasks
+//  on different workers do not contend.  The pool-wide m_mutex only
+//  guards the counts of queued tasks (in all, and of each group), which
+//  the idle workers (and the threads waiting for a group) sleep on.
+//  Each queued task records its group, so that a thread waiting for a
+//  group can pick out the group's own tasks.
+//
+//  ParallelFor splits its range recursively:  each piece queues its upper
+//  half on the running worker's own queue and carries on with the lower
+//  half, so an idle worker steals the largest remaining pieces first.
+//  The pieces depend only on the range, grain and thread count, never on
+//  the timing, and each index is visited exactly once.
+//
+///////////////////////////////////////////////////////////////////////////
+
+#include "ThreadPool.h"
+
+static thread_local CThreadPool* currentPool = 0;  // pool of this worker
+static thread_local int currentWorker = -1;         // its queue index
+
+CThreadPool::CThreadPool(int nThreads)
+    : m_nextQueue(0), m_queued(0), m_stop(false)
+{
+    if (nThreads <= 0)
+        nThreads = std::max(1, (int) std::thread::hardware_concurrency());
+    for (int i = 0; i < nThreads; i++)
+        m_queues.push_back(std::unique_ptr<CWorkerQueue>(new CWorkerQueue));
+    for (int i = 0; i < nThreads; i++)
+        m_threads.push_back(std::thread(&CThreadPool::Worker, this, i));
+}
+
+CThreadPool::~CThreadPool()
+{
+    // Let the workers empty the queues, then stop them
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_stop = true;
+    }
+    m_wake.notify_all();
+    for (int i = 0; i < (int) m_threads.size(); i++)
+        m_threads[i].join();
+}
+
+int CThreadPool::NThreads() const
+{
+    return (int) m_threads.size();
+}
+
+CThreadPool* CThreadPool::Current()
+{
+    return currentPool;
+}
+
+void CThreadPool::Submit(Task task)
+{
+    Push(task, 0);
+}
+
+void CThreadPool::Push(Task task, CTaskGroup* group)
+{
+    // Own queue for a worker of this pool, otherwise round robin
+    int n = (int) m_queues.size();
+    int q = (currentPool == this) ? currentWorker : (int) (m_nextQueue++ % n);
+    {
+        std::lock_guard<std::mutex> lock(m_queues[q]->mutex);
+        CQueuedTask queued = {task, group};
+        m_queues[q]->tasks.push_back(queued);
+    }
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_queued += 1;
+        if (group != 0)
+            group->m_queued += 1;
+    }
+    m_wake.notify_one();
+    m_done.notify_all();    // (its group's waiter may want to help)
+}
+
+bool CThreadPool::Take(int self, CTaskGroup* group, Task& task)
+{
+    // Newest task of our own queue first, then the oldest of the others'
+    //  (only the group's own tasks, if a group is given)
+    int n = (int) m_queues.size();
+    CTaskGroup* taken = 0;
+    bool found = false;
+    if (self >= 0)
+    {
+        std::deque<CQueuedTask>& tasks = m_queues[self]->tasks;
+        std::lock_guard<std::mutex> lock(m_queues[self]->mutex);
+        for (int j = (int) tasks.size() - 1; ! found && j >= 0; j--)
+        {
+            if (group != 0 && tasks[j].group != group)
+                continue;
+            task = tasks[j].task, taken = tasks[j].group;
+            tasks.erase(tasks.begin() + j);
+            found = true;
+        }
+    }
+    for (int i = 1; ! found && i <= n; i++)
+    {
+        CWorkerQueue& q = *m_queues[(self + i + n) % n];
+        std::lock_guard<std::mutex> lock(q.mutex);
+        for (int j = 0; ! found && j < (int) q.tasks.size(); j++)
+        {
+            if (group != 0 && q.tasks[j].group != group)
+                continue;
+            task = q.tasks[j].task, taken = q.tasks[j].group;
+            q.tasks.erase(q.tasks.begin() + j);
+            found = true;
+        }
+    }
+    if (found)
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_queued -= 1;
+        if (taken != 0)
+            taken->m_queued -= 1;
+    }
+    return found;
+}
+
+void CThreadPool::Finished()
+{
+    {
+        // (taking the lock orders the notification after a waiter's check)
+        std::lock_guard<std::mutex> lock(m_mutex);
+    }
+    m_done.notify_all();
+}
+
+bool CThreadPool::RunOne(CTaskGroup* group)
+{
+    Task task;
+    if (! Take(currentPool == this ? currentWorker : -1, group, task))
+        return false;
+    task();
+    Finished();
+    return true;
+}
+
+void CThreadPool::Worker(int self)
+{
+    currentPool = this, currentWorker = self;
+    for (;;)
+    {
+        Task task;
+        if (Take(self, 0, task))
+        {
+            task();
+            Finished();
+            continue;
+        }
+        std::unique_lock<std::mutex> lock(m_mutex);
+        m_wake.wait(lock, [this]() { return m_stop || m_queued > 0; });
+        if (m_stop && m_queued <= 0)
+            return;
+    }
+}
+
+CTaskGroup::CTaskGroup(CThreadPool& pool)
+    : m_pool(pool), m_pending(0), m_queued(0)
+{
+}
+
+CTaskGroup::~CTaskGroup()
+{
+    try
+    {
+        Wait();
+    }
+    catch (...)
+    {
+        // (the error is only reported by an explicit Wait)
+    }
+}
+
+void CTaskGroup::Run(CThreadPool::Task task)
+{
+    m_pending += 1;
+    m_pool.Push([this, task]()
+    {
+        try
+        {
+            task();
+        }
+        catch (...)
+        {
+            std::lock_guard<std::mutex> lock(m_errorMutex);
+            if (! m_error)
+                m_error = std::current_exception();
+        }
+        m_pending -= 1;
+    }, this);
+}
+
+void CTaskGroup::Wait()
+{
+    // Run the group's queued tasks, and sleep while the rest are running
+    while (m_pending > 0)
+    {
+        if (m_pool.RunOne(this))
+            continue;
+        std::unique_lock<std::mutex> lock(m_pool.m_mutex);
+        m_pool.m_done.wait(lock, [this]()
+            { return m_pending == 0 || m_queued > 0; });
+    }
+
+    std::exception_ptr error;
+    {
+        std::lock_guard<std::mutex> lock(m_errorMutex);
+        std::swap(error, m_error);
+    }
+    if (error)
+        std::rethrow_exception(error);
+}
+
+//
+//  Parallel loops
+//
+
+static std::atomic<int> parallelThreads(0);         // SetParallelThreads
+static std::atomic<int> sharedThreads(0);           // size of SharedPool (once made)
+static thread_local CThreadPool* scopePool = 0;     // CParallelScope
+
+static int PoolSize(int nThreads)
+{
+    return (nThreads > 0) ? nThreads : std::max(1, (int) std::thread::hardware_concurrency());
+}
+
+bool SetParallelThreads(int nThreads)
+{
+    // (the shared pool can't be resized once it has been created)
+    nThreads = std::max(0, nThreads);
+    int shared = sharedThreads;
+    if (shared > 0)
+        return PoolSize(nThreads) == shared;
+    parallelThreads = nThreads;
+    return true;
+}
+
+int ParallelThreads()
+{
+    int shared = sharedThreads;
+    return (shared > 0) ? shared : PoolSize(parallelThreads);
+}
+
+CThreadPool& SharedPool()
+{
+    // (its size is fixed first, so that SetParallelThreads sees it's too late)
+    static int nThreads = (sharedThreads = ParallelThreads());
+    static CThreadPool pool(nThreads);
+    return pool;
+}
+
+CParallelScope::CParallelScope(CThreadPool& pool)
+    : m_outer(scopePool)
+{
+    scopePool = &pool;
+}
+
+CParallelScope::~CParallelScope()
+{
+    scopePool = m_outer;
+}
+
+static CThreadPool* LoopPool()
+{
+    // Pool of the calling worker, else the scope's, else the shared one
+    //  (0:  run the loop on the calling thread)
+    if (currentPool != 0)
+        return currentPool;
+    if (scopePool != 0)
+        return scopePool;
+    return (ParallelThreads() > 1) ? &SharedPool() : 0;
+}
+
+static void SplitRange(CTaskGroup& group, int begin, int end, int grain,
+                       const std::function<void(int, int)>& body)
+{
+    while (end - begin > grain)
+    {
+        int mid = begin + (end - begin) / 2;
+        group.Run([&group, mid, end, grain, &body]()
+            { SplitRange(group, mid, end, grain, body); });
+        end = mid;
+    }
+    body(begin, end);
+}
+
+void ParallelFor(int begin, int end, int grain,
+                 const std::function<void(int, int)>& body)
+{
+    int n = end - begin;
+    if (n <= 0)
+        return;
+    CThreadPool* pool = LoopPool();
+    int nThreads = (pool != 0) ? pool->NThreads() : 1;
+    if (grain <= 0)
+        grain = std::max(1, n / (4 * nThreads));
+    if (nThreads <= 1 || n <= grain)
+    {
+        body(begin, end);
+        return;
+    }
+
+    CTaskGroup group(*pool);
+    SplitRange(group, begin, end, grain, body);
+    group.Wait();
+}
+
+void ParallelForTiles(int width, int height, int tileWidth, int tileHeight,
+                      const std::function<void(int, int, int, int)>& body)
+{
+    if (width <= 0 || height <= 0)
+        return;
+    int nX = (width + tileWidth - 1) / tileWidth;
+    int nY = (height + tileHeight - 1) / tileHeight;
+    ParallelFor(0, nX * nY, 1, [&](int t0, int t1)
+    {
+        for (int t = t0; t < t1; t++)
+        {
+            int x0 = (t % nX) * tileWidth, y0 = (t / nX) * tileHeight;
+            body(x0, y0, std::min(width, x0 + tileWidth),
+                 std::min(height, y0 + tileHeight));
+        }
+    });
+}
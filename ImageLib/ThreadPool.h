@@ -0,0 +1,157 @@
+///////////////////////////////////////////////////////////////////////////
+//
+// NAME
+//  ThreadPool.h -- a work-stealing pool of worker threads
+//
+// DESCRIPTION
+//  CThreadPool runs small tasks (std::function<void()>) on a fixed set of
+//  worker threads.  Each worker has its own double-ended queue:  tasks
+//  submitted from a worker go onto the back of its own queue and are
+//  taken from there (most recent first), while an idle worker steals the
+//  oldest task from the front of another worker's queue.  Tasks submitted
+//  from outside the pool are dealt out to the queues in turn.
+//
+//  Tasks are normally submitted and waited for through a CTaskGroup:
+//
+//      CThreadPool pool(4);
+//      {
+//          CTaskGroup group(pool);
+//          for (i = 0; i < n; i++)
+//              group.Run([&, i]() { Process(i); });
+//          group.Wait();       // rethrows the first exception of a task
+//      }
+//
+//  A thread that waits for a group runs the group's own queued tasks
+//  while it waits, and sleeps once the rest are running elsewhere, so
+//  tasks may themselves create groups and wait for them without
+//  deadlocking the pool, and a wait never runs unrelated work (e.g.,
+//  another command) on its stack.  Tasks may add more tasks to the group
+//  that is running them.
+//
+//  nThreads = 0 uses one thread per processor.  The destructor runs all
+//  of the remaining tasks before stopping the workers.
+//
+//  Loops over rows or tiles are run in parallel with ParallelFor:
+//
+//      ParallelFor(0, height, 0, [&](int y0, int y1)
+//      {
+//          for (int y = y0; y < y1; y++)
+//              ProcessRow(y);
+//      });
+//
+//  The range is split in halves until the pieces have at most grain
+//  indices (grain = 0 picks about four pieces per thread), and the halves
+//  are queued for idle workers to steal, so uneven rows even out.  Each
+//  piece gets a contiguous range and the call returns (rethrowing the
+//  first exception) once all of them are done.  ParallelForTiles does the
+//  same for the tiles of a width x height area, handing the body each
+//  tile's [x0, x1) x [y0, y1) rectangle.
+//
+//  The loops run on the pool of the calling worker, so loops nested in
+//  tasks (or in other loops) share its threads;  otherwise on the pool
+//  of an enclosing CParallelScope, if any;  otherwise on SharedPool(), a
+//  single process-wide pool with SetParallelThreads() threads (0 = one
+//  per processor), created on first use.  Once it exists, its size can't
+//  be changed:  SetParallelThreads() then returns false (and does
+//  nothing) if asked for a different size.  With one thread the body is
+//  simply called on the whole range.  As with CTaskGroup::Wait, the
+//  caller runs the loop's queued pieces while it waits, so it must not
+//  hold a lock that the body may take.
+//
+// SEE ALSO
+//  ThreadPool.cpp      implementation
+//
+///////////////////////////////////////////////////////////////////////////
+
+#include <atomic>
+#include <deque>
+#include <exception>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <condition_variable>
+#include <thread>
+#include <vector>
+
+class CTaskGroup;
+
+class CThreadPool
+{
+public:
+    typedef std::function<void()> Task;
+
+    CThreadPool(int nThreads = 0);
+    ~CThreadPool();
+
+    int NThreads(void) const;       // number of worker threads
+    void Submit(Task task);         // queue a task (prefer CTaskGroup::Run)
+
+    static CThreadPool* Current(void);  // pool of the calling worker, or 0
+
+private:
+    friend class CTaskGroup;
+    struct CQueuedTask
+    {
+        Task task;
+        CTaskGroup* group;          // group it belongs to (or 0)
+    };
+    struct CWorkerQueue
+    {
+        std::mutex mutex;
+        std::deque<CQueuedTask> tasks;
+    };
+
+    void Push(Task task, CTaskGroup* group);
+    bool Take(int self, CTaskGroup* group, Task& task);    // (group 0:  any task)
+    bool RunOne(CTaskGroup* group);     // run one queued task of the group
+    void Worker(int self);
+    void Finished(void);            // a task has finished running
+
+    std::vector<std::unique_ptr<CWorkerQueue> > m_queues;   // one per worker
+    std::vector<std::thread> m_threads;
+    std::atomic<unsigned> m_nextQueue;  // queue for the next outside task
+    std::mutex m_mutex;                 // guards the queued counts and m_stop
+    std::condition_variable m_wake;     // a task was queued (or stop)
+    std::condition_variable m_done;     // a task has finished (or queued)
+    int m_queued;                       // tasks waiting in the queues
+    bool m_stop;                        // shut the workers down
+};
+
+class CTaskGroup
+{
+public:
+    CTaskGroup(CThreadPool& pool);
+    ~CTaskGroup();                  // waits (but does not rethrow)
+
+    void Run(CThreadPool::Task task);   // queue a task in this group
+    void Wait(void);                // run tasks until the group is done
+
+private:
+    friend class CThreadPool;
+    CThreadPool& m_pool;
+    std::atomic<int> m_pending;     // tasks queued or running
+    int m_queued;                   // tasks still queued (guarded by the pool's m_mutex)
+    std::mutex m_errorMutex;
+    std::exception_ptr m_error;     // first exception thrown by a task
+};
+
+// Parallel loops
+bool SetParallelThreads(int nThreads);  // size of SharedPool() (0 = one per processor)
+int ParallelThreads(void);              // threads SharedPool() has (or will have)
+CThreadPool& SharedPool(void);          // the process-wide pool
+
+class CParallelScope
+{
+    // Run the parallel loops of this thread on pool while in scope
+public:
+    CParallelScope(CThreadPool& pool);
+    ~CParallelScope();
+
+private:
+    CThreadPool* m_outer;           // scope being hidden
+};
+
+void ParallelFor(int begin, int end, int grain,
+                 const std::function<void(int, int)>& body);
+void ParallelForTiles(int width, int height, int tileWidth, int tileHeight,
+                      const std::function<void(int, int, int, int)>& body);
@@ -0,0 +1,200 @@
+///////////////////////////////////////////////////////////////////////////
+//
+// NAME
+//  TilePyramid.cpp -- stream an image into a multi-resolution tile pyramid
+//
+// SEE ALSO
+//  TilePyramid.h       longer description
+//
+// DESIGN
+//  Each level keeps a buffer of its most recent rows.  When rows arrive
+//  at a level, every row of tiles that is now complete is written out, and
+//  every row of the next coarser level whose (vertical) kernel support is
+//  now available is decimated from a window of the buffered rows.  The
+//  window extends m_margin rows beyond the rows that are kept, so the
+//  decimated rows are identical to those of a full-image CPyramidOf.
+//  Rows that neither an unwritten tile nor a future window needs are then
+//  discarded.
+//
+///////////////////////////////////////////////////////////////////////////
+
+#include "Image.h"
+#include <vector>
+#include "FileIO.h"
+#include "Convolve.h"
+#include "Pyramid.h"
+#include "TilePyramid.h"
+#include "Profile.h"
+
+#ifdef WIN32
+#include <direct.h>
+#define MakeDir(dir)    _mkdir(dir)
+#else
+#include <sys/stat.h>
+#define MakeDir(dir)    mkdir(dir, 0777)
+#endif
+
+static std::string Subdirectory(const std::string& dir, int i)
+{
+    char name[32];
+    sprintf(name, "/%d", i);
+    return dir + name;
+}
+
+CTilePyramidSink::CTilePyramidSink(const char* dirname, int tileSize) :
+    m_dirname(dirname), m_tileSize(tileSize)
+{
+    if (tileSize <= 0)
+        throw CError("CTilePyramidSink(%s): invalid tile size", dirname);
+
+    // Number of rows on either side of a row that its decimation depends on
+    m_kernel = CBytePyramid().decimateKernel;
+    int w = m_kernel.Shape().width;
+    int o = m_kernel.origin[0];
+    m_margin = (__max(o, w - 1 - o) + 1) & ~1;
+}
+
+void CTilePyramidSink::Begin(CShape sh)
+{
+    // Halve the image until it fits in a single tile
+    m_level.clear();
+    for (CShape s = sh; ; s.width = (s.width+1)/2, s.height = (s.height+1)/2)
+    {
+        CLevel L;
+        L.shape = s;
+        L.row0 = L.nRows = 0;
+        L.nextTileRow = L.nDecimated = 0;
+        m_level.push_back(L);
+        if (s.width <= m_tileSize && s.height <= m_tileSize)
+            break;
+    }
+    int nLevels = m_level.size();
+
+    // Create the directory tree
+    MakeDir(m_dirname.c_str());
+    for (int l = 0; l < nLevels; l++)
+    {
+        std::string zDir = Subdirectory(m_dirname, nLevels-1 - l);
+        MakeDir(zDir.c_str());
+        for (int tx = 0; tx * m_tileSize < m_level[l].shape.width; tx++)
+            MakeDir(Subdirectory(zDir, tx).c_str());
+    }
+
+    // Describe the pyramid for the viewer
+    std::string info = m_dirname + "/pyramid.txt";
+    FILE *stream = fopen(info.c_str(), "w");
+    if (stream == 0)
+        throw CError("CTilePyramidSink: could not open %s", info.c_str());
+    fprintf(stream, "%d %d %d %d\n", sh.width, sh.height, m_tileSize, nLevels);
+    if (fclose(stream))
+        throw CError("CTilePyramidSink(%s): error closing file", info.c_str());
+}
+
+void CTilePyramidSink::Write(CImage& region, int x, int y)
+{
+    CMemoryTag tag(eMemPyramid);
+    CLevel& L = m_level[0];
+    CShape sh = region.Shape();
+    if (region.PixType() != typeid(uchar) || sh.nBands != L.shape.nBands)
+        throw CError("CTilePyramidSink(%s): region has the wrong pixel type", m_dirname.c_str());
+    if (x != 0 || sh.width != L.shape.width)
+        throw CError("CTilePyramidSink(%s): can only stream full-width row bands", m_dirname.c_str());
+    if (y != L.row0 + L.nRows || y + sh.height > L.shape.height)
+        throw CError("CTilePyramidSink(%s): row bands must be written in order", m_dirname.c_str());
+
+    AddRows(0, *(CByteImage *) &region, 0, sh.height);
+    Process(0);
+}
+
+void CTilePyramidSink::End(void)
+{
+    CMemoryTag tag(eMemPyramid);
+    for (unsigned int l = 0; l < m_level.size(); l++)
+        if (m_level[l].nextTileRow * m_tileSize < m_level[l].shape.height)
+            throw CError("CTilePyramidSink(%s): image is incomplete", m_dirname.c_str());
+    m_level.clear();
+}
+
+void CTilePyramidSink::AddRows(int l, CByteImage& src, int y0, int n)
+{
+    // Append rows y0 ... y0+n-1 of src to the level's buffer
+    CLevel& L = m_level[l];
+    CShape sh = L.shape;
+    int rowBytes = sh.width * sh.nBands;
+    if (L.rows.Shape().height < L.nRows + n)
+    {
+        CByteImage grown(CShape(sh.width, L.nRows + n, sh.nBands));
+        for (int r = 0; r < L.nRows; r++)
+            memcpy(grown.PixelAddress(0, r, 0), L.rows.PixelAddress(0, r, 0), rowBytes);
+        L.rows = grown;
+    }
+    for (int r = 0; r < n; r++)
+        memcpy(L.rows.PixelAddress(0, L.nRows + r, 0), src.PixelAddress(0, y0 + r, 0), rowBytes);
+    L.nRows += n;
+}
+
+void CTilePyramidSink::Process(int l)
+{
+    CLevel& L = m_level[l];
+    int T = m_tileSize;
+    int avail = L.row0 + L.nRows;   // rows [0, avail) have arrived
+
+    // Write out every row of tiles that is complete
+    while (L.nextTileRow * T < L.shape.height &&
+           __min((L.nextTileRow+1) * T, L.shape.height) <= avail)
+        WriteTileRow(l, L.nextTileRow++);
+
+    // Decimate the rows of the next level whose support has arrived
+    int keep = L.nextTileRow * T;
+    if (l+1 < (int) m_level.size())
+    {
+        CLevel& C = m_level[l+1];
+        int c1 = (avail == L.shape.height) ? C.shape.height :
+                 __min(C.shape.height, __max(0, (avail + 1 - m_margin) / 2));
+        if (c1 > C.nDecimated)
+        {
+            int w0 = __max(0, 2*C.nDecimated - m_margin);
+            int w1 = __min(L.shape.height, 2*(c1-1) + m_margin + 1);
+            CByteImage window = L.rows.SubImage(0, w0 - L.row0, L.shape.width, w1 - w0);
+            CBytePyramid pyramid(window);
+            pyramid.decimateKernel = m_kernel;
+            AddRows(l+1, pyramid[1], C.nDecimated - w0/2, c1 - C.nDecimated);
+            C.nDecimated = c1;
+            Process(l+1);
+        }
+        keep = __min(keep, __max(0, 2*C.nDecimated - m_margin));
+    }
+
+    // Discard the rows that are no longer needed
+    int drop = __min(keep - L.row0, L.nRows);
+    if (drop > 0)
+    {
+        int rowBytes = L.shape.width * L.shape.nBands;
+        for (int r = drop; r < L.nRows; r++)
+            memcpy(L.rows.PixelAddress(0, r - drop, 0), L.rows.PixelAddress(0, r, 0), rowBytes);
+        L.row0  += drop;
+        L.nRows -= drop;
+    }
+}
+
+void CTilePyramidSink::WriteTileRow(int l, int ty)
+{
+    // Write the tiles in row ty of level l (all of whose rows are buffered)
+    CLevel& L = m_level[l];
+    int T = m_tileSize;
+    int z = m_level.size()-1 - l;
+    int h = __min(T, L.shape.height - ty*T);
+    for (int tx = 0; tx * T < L.shape.width; tx++)
+    {
+        int w = __min(T, L.shape.width - tx*T);
+        CByteImage tile(CShape(w, h, L.shape.nBands));
+        for (int r = 0; r < h; r++)
+            memcpy(tile.PixelAddress(0, r, 0),
+                   L.rows.PixelAddress(tx*T, ty*T - L.row0 + r, 0), w * L.shape.nBands);
+
+        char name[32];
+        sprintf(name, "/%d.tga", ty);
+        std::string path = Subdirectory(Subdirectory(m_dirname, z), tx) + name;
+        WriteFile(tile, path.c_str());
+    }
+}
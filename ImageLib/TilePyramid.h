@@ -0,0 +1,61 @@
+///////////////////////////////////////////////////////////////////////////
+//
+// NAME
+//  TilePyramid.h -- stream an image into a multi-resolution tile pyramid
+//
+// DESCRIPTION
+//  CTilePyramidSink is a CImageSink (see FileIO.h) that writes the image
+//  it is given as a z/x/y pyramid of square tiles, of the kind used by
+//  Deep Zoom style web viewers:
+//
+//      dir/pyramid.txt         width height tileSize nLevels
+//      dir/z/x/y.tga           tile x, y of level z
+//
+//  Level z = nLevels-1 is the full-resolution image, and each coarser
+//  level is half the size of the one below it (rounded up), down to
+//  z = 0, which fits in a single tile.  Tile rows follow the image's row
+//  order (tile y = 0 holds rows 0 ... tileSize-1).
+//
+//  The image must be delivered as full-width row bands, top to bottom
+//  (which is what BlendImages produces).  Tiles are written as soon as
+//  all of their rows have arrived, and each coarser level is decimated
+//  incrementally from the rows of the finer one with the CPyramidOf
+//  decimation kernel, so only a few rows of tiles per level are ever
+//  held in memory and no second pass over the image is needed.
+//
+// SEE ALSO
+//  TilePyramid.cpp     implementation
+//  FileIO.h            CImageSink interface
+//  Pyramid.h           image pyramid (decimation)
+//
+///////////////////////////////////////////////////////////////////////////
+
+class CTilePyramidSink : public CImageSink
+{
+public:
+    CTilePyramidSink(const char* dirname, int tileSize = 256);
+    void Begin(CShape sh);
+    void Write(CImage& region, int x, int y);
+    void End(void);
+
+private:
+    struct CLevel
+    {
+        CShape shape;       // shape of the complete level
+        CByteImage rows;    // buffered rows
+        int row0;           // first buffered row
+        int nRows;          // number of buffered rows
+        int nextTileRow;    // next row of tiles to be written
+        int nDecimated;     // rows of the next level produced so far
+    };
+
+    void AddRows(int l, CByteImage& src, int y0, int n);
+    void Process(int l);
+    void WriteTileRow(int l, int ty);
+
+    std::string m_dirname;          // output directory
+    int m_tileSize;                 // width and height of a tile
+    int m_margin;                   // (even) support of the decimation kernel
+    CFloatImage m_kernel;           // decimation kernel
+    std::vector<CLevel> m_level;    // level 0 is the full-resolution image
+};
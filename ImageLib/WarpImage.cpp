@@ -27,9 +27,396 @@
 
 #include "Image.h"
 #include "Transform.h"
+#include "RowExtents.h"
 #include "WarpImage.h"
+#include "Pyramid.h"
+#include "ThreadPool.h"
+#include "Profile.h"
+#include "CpuFeatures.h"
+#include <float.h>
 #include <math.h>
+#include <string.h>
+#include <algorithm>
 #include <vector>
+#include <mutex>
+
+#ifdef IMAGELIB_X86
+#include <immintrin.h>
+#endif
+
+
+//
+//  SIMD bilinear resampling of RGBA pixels.
+//
+//  The four bands of a pixel are resampled at once, with the same float
+//  operations in the same order as ResampleBiLinear (and no fused
+//  multiply-adds), scaled by the pixel's gain (if any) like ScaleAndClip,
+//  and then truncated and clipped like the scalar code, so the results
+//  are bit-identical.  Pixels are located and checked against the bounds
+//  exactly as in WarpLine.
+//
+
+#ifdef IMAGELIB_X86
+
+static IMAGELIB_TARGET_SSE41 inline __m128 LoadPixel4(const uchar* p)
+{
+    int w;
+    memcpy(&w, p, 4);
+    return _mm_cvtepi32_ps(_mm_cvtepu8_epi32(_mm_cvtsi32_si128(w)));
+}
+
+static IMAGELIB_TARGET_SSE41 inline __m128 LoadPixel4(const float* p)
+{
+    return _mm_loadu_ps(p);
+}
+
+static IMAGELIB_TARGET_SSE41 inline void StorePixel4(uchar* p, __m128 v,
+                                                     uchar minVal, uchar maxVal)
+{
+    __m128i i = _mm_cvttps_epi32(v);
+    i = _mm_max_epi32(_mm_set1_epi32(minVal), _mm_min_epi32(_mm_set1_epi32(maxVal), i));
+    i = _mm_packus_epi16(_mm_packus_epi32(i, i), i);
+    int w = _mm_cvtsi128_si32(i);
+    memcpy(p, &w, 4);
+}
+
+static IMAGELIB_TARGET_SSE41 inline void StorePixel4(float* p, __m128 v,
+                                                     float minVal, float maxVal)
+{
+    v = _mm_max_ps(_mm_set1_ps(minVal), _mm_min_ps(_mm_set1_ps(maxVal), v));
+    _mm_storeu_ps(p, v);
+}
+
+template <class T>
+static IMAGELIB_TARGET_SSE41 int WarpLineLinear4SSE41(CImageOf<T>& src, T* dstP, float *xyP,
+                                                      int n, T minVal, T maxVal,
+                                                      const float *gainP)
+{
+    const int oV = &src.Pixel(0, 1, 0) - &src.Pixel(0, 0, 0);
+    CShape sh = src.Shape();
+    for (int i = 0; i < n; i++, dstP += 4, xyP += 2)
+    {
+        int x = int(floor(xyP[0]));
+        int y = int(floor(xyP[1]));
+        if (! (sh.InBounds(x, y) && sh.InBounds(x+1, y+1)))
+        {
+            memset(dstP, 0, 4 * sizeof(T));
+            continue;
+        }
+        const T* srcP = &src.Pixel(x, y, 0);
+        __m128 xf = _mm_set1_ps(xyP[0] - x);
+        __m128 yf = _mm_set1_ps(xyP[1] - y);
+        __m128 v00 = LoadPixel4(srcP),      v01 = LoadPixel4(srcP + 4);
+        __m128 v10 = LoadPixel4(srcP + oV), v11 = LoadPixel4(srcP + oV + 4);
+        __m128 h1 = _mm_add_ps(v00, _mm_mul_ps(xf, _mm_sub_ps(v01, v00)));
+        __m128 h2 = _mm_add_ps(v10, _mm_mul_ps(xf, _mm_sub_ps(v11, v10)));
+        __m128 v  = _mm_add_ps(h1,  _mm_mul_ps(yf, _mm_sub_ps(h2, h1)));
+        if (gainP != 0)             // (not the alpha band)
+            v = _mm_mul_ps(v, _mm_set_ps(1.0f, gainP[i], gainP[i], gainP[i]));
+        StorePixel4(dstP, v, minVal, maxVal);
+    }
+    return n;
+}
+
+template <class T>
+static int WarpLineSIMDOf(CImageOf<T>& src, T* dstP, float *xyP, int n, int nBands,
+                          EWarpInterpolationMode interp, T minVal, T maxVal,
+                          const float *gainP)
+{
+    if (nBands == 4 && interp == eWarpInterpLinear && CpuHas(eCpuSSE41))
+        return WarpLineLinear4SSE41(src, dstP, xyP, n, minVal, maxVal, gainP);
+    return 0;
+}
+
+#else
+
+template <class T>
+static int WarpLineSIMDOf(CImageOf<T>& src, T* dstP, float *xyP, int n, int nBands,
+                          EWarpInterpolationMode interp, T minVal, T maxVal,
+                          const float *gainP)
+{
+    return 0;
+}
+
+#endif
+
+int WarpLineSIMD(CImageOf<uchar>& src, uchar* dstP, float *xyP, int n, int nBands,
+                 EWarpInterpolationMode interp, uchar minVal, uchar maxVal,
+                 const float *gainP)
+{
+    return WarpLineSIMDOf(src, dstP, xyP, n, nBands, interp, minVal, maxVal, gainP);
+}
+
+int WarpLineSIMD(CImageOf<float>& src, float* dstP, float *xyP, int n, int nBands,
+                 EWarpInterpolationMode interp, float minVal, float maxVal,
+                 const float *gainP)
+{
+    return WarpLineSIMDOf(src, dstP, xyP, n, nBands, interp, minVal, maxVal, gainP);
+}
+
+
+//
+//  Antialiased resampling from an image pyramid (eWarpInterpTrilinear).
+//
+//  The footprint of a destination pixel in the source is the parallelogram
+//  spanned by the columns of the Jacobian of its source coordinates;  its
+//  size is taken as the longer of the two (as by graphics hardware), and a
+//  footprint of s pixels is sampled (bilinearly) from the levels log2 s
+//  lies between, blending the two.  Level l of the pyramid holds every
+//  2^l-th pixel of the source (see ConvolveSeparable), so the source
+//  point (x, y) is at (x, y) / 2^l there.  A pixel is covered exactly
+//  when its bilinear footprint at level 0 is inside the source, and a
+//  footprint of at most one pixel (give or take footprintTol, for the
+//  rounding of the derivatives) is sampled from level 0 alone, so where
+//  the warp doesn't shrink the image the result is the same as
+//  eWarpInterpLinear's.  (Coarser samples are clamped to their level.)
+//
+//  The levels are filtered as those of CPyramidOf, but each warp makes
+//  only the samples it keeps (not a full-size convolution that is then
+//  subsampled), and only where the footprints larger than a pixel and the
+//  coarser levels read them.  The derivatives of a coordinate field are
+//  taken only between pixels that have a source, so the out-of-range
+//  coordinates around a spherical warp don't make huge footprints (and
+//  build every level) along its edges.
+//
+
+static const float footprintTol = 1e-4f;    // (relative to one pixel)
+
+static inline float FootprintSize(float a, float b, float c, float d)
+{
+    // Longer side of the footprint with sides (a, b) and (c, d)
+    return sqrtf(__max(a*a + b*b, c*c + d*d));
+}
+
+template <class T>
+static void DecimateRow(CImageOf<T> &src, T* dstP, int y, int x0, int x1, int c0, int c1,
+                        const float *k, int kW, int kO, float *column,
+                        float minVal, float maxVal)
+{
+    // Row y, pixels [x0, x1), of the next coarser level of src, from its
+    //  columns [c0, c1), given a buffer of c1 - c0 pixels
+    CShape sh = src.Shape();
+    int nB = sh.nBands, m = (c1 - c0) * nB;
+
+    // The columns filtered vertically at row 2y
+    std::fill(column, column + m, 0.0f);
+    for (int t = 0; t < kW; t++)
+    {
+        int yt = 2*y - kO + t;
+        if (yt < 0 || yt >= sh.height)
+            continue;
+        const T* srcP = &src.Pixel(c0, yt, 0);
+        for (int e = 0; e < m; e++)
+            column[e] += k[t] * srcP[e];
+    }
+
+    // Filtered horizontally at the even columns (up to four bands summed
+    //  side by side, in registers)
+    for (int x = x0; x < x1; x++, dstP += nB)
+    {
+        int xs = 2*x - kO;
+        int ta = __max(0, -xs), tb = __min(kW, sh.width - xs);
+        for (int b0 = 0; b0 < nB; b0 += 4)
+        {
+            int nb = __min(4, nB - b0);
+            float sum[4] = {0.0f, 0.0f, 0.0f, 0.0f};
+            for (int t = ta; t < tb; t++)
+            {
+                const float* p = &column[(xs + t - c0) * nB + b0];
+                for (int b = 0; b < nb; b++)
+                    sum[b] += k[t] * p[b];
+            }
+            for (int b = 0; b < nb; b++)
+                dstP[b0 + b] = (T) __max(minVal, __min(maxVal, sum[b]));
+        }
+    }
+}
+
+template <class T>
+static void DecimateRegion(CImageOf<T> &src, CImageOf<T> &dst, CFloatImage &kernel,
+                           int x0, int y0, int x1, int y1)
+{
+    // Pixels [x0, x1) x [y0, y1) of the next coarser level of src:  the
+    //  filter of CPyramidOf (kernel, zero padding, then every other pixel
+    //  kept), but only the kept samples are computed, vertically (over
+    //  contiguous rows) and then horizontally, with no rounding in between
+    if (x0 >= x1 || y0 >= y1)
+        return;
+    CShape sh = src.Shape();
+    int kW = kernel.Shape().width, kO = kernel.origin[0];
+    int c0 = __max(0, 2*x0 - kO), c1 = __min(sh.width, 2*(x1-1) - kO + kW);
+    ParallelFor(y0, y1, 0, [&](int ya, int yb)
+    {
+        std::vector<float> column((c1 - c0) * sh.nBands);
+        for (int y = ya; y < yb; y++)
+            DecimateRow(src, &dst.Pixel(x0, y, 0), y, x0, x1, c0, c1,
+                        &kernel.Pixel(0, 0, 0), kW, kO, &column[0],
+                        (float) src.MinVal(), (float) src.MaxVal());
+    });
+}
+
+template <class T>
+static void PyramidLevels(CImageOf<T> src, float maxSize,
+                          float xMin, float yMin, float xMax, float yMax,
+                          std::vector<CImageOf<T> > &levels)
+{
+    // The levels needed for footprints of up to maxSize pixels (but none
+    //  smaller than a pixel), each made only where the source points in
+    //  [xMin, xMax] x [yMin, yMax] (and the coarser levels) read it
+    CShape sh = src.Shape();
+    if (maxSize <= 1.0f + footprintTol)
+        maxSize = 1.0f;
+    int nLevels = 1;
+    while (nLevels < 24 && (float) (1 << (nLevels-1)) < maxSize &&
+           ((sh.width - 1) >> (nLevels-1)) + ((sh.height - 1) >> (nLevels-1)) > 0)
+        nLevels++;
+    std::vector<CShape> shapes(1, sh);
+    for (int l = 1; l < nLevels; l++)
+        shapes.push_back(CShape((shapes[l-1].width + 1) / 2, (shapes[l-1].height + 1) / 2,
+                                sh.nBands));
+
+    // The region of each level, from the coarsest one down
+    CFloatImage kernel = CPyramidOf<T>().decimateKernel;
+    int kW = kernel.Shape().width, kO = kernel.origin[0];
+    std::vector<int> x0(nLevels), y0(nLevels), x1(nLevels), y1(nLevels);
+    for (int l = nLevels - 1; l > 0; l--)
+    {
+        // (the pixels the bilinear samples read, clamped to the level)
+        CShape s = shapes[l];
+        float scale = 1.0f / (1 << l);
+        x0[l] = __max(0, (int) floor(xMin * scale));
+        y0[l] = __max(0, (int) floor(yMin * scale));
+        x1[l] = __min(s.width,  (int) floor(xMax * scale) + 2);
+        y1[l] = __min(s.height, (int) floor(yMax * scale) + 2);
+        if (x0[l] >= x1[l] || y0[l] >= y1[l])
+            x0[l] = y0[l] = x1[l] = y1[l] = 0;
+
+        // (and those the next coarser level's taps read)
+        if (l + 1 < nLevels && x0[l+1] < x1[l+1])
+        {
+            int xa = __max(0, 2*x0[l+1] - kO), xb = __min(s.width,  2*(x1[l+1]-1) - kO + kW);
+            int ya = __max(0, 2*y0[l+1] - kO), yb = __min(s.height, 2*(y1[l+1]-1) - kO + kW);
+            bool empty = (x0[l] >= x1[l]);
+            x0[l] = (empty) ? xa : __min(x0[l], xa);
+            y0[l] = (empty) ? ya : __min(y0[l], ya);
+            x1[l] = (empty) ? xb : __max(x1[l], xb);
+            y1[l] = (empty) ? yb : __max(y1[l], yb);
+        }
+    }
+
+    CMemoryTag tag(eMemPyramid);
+    levels.assign(1, src);
+    for (int l = 1; l < nLevels; l++)
+    {
+        levels.push_back(CImageOf<T>(shapes[l]));
+        DecimateRegion(levels[l-1], levels[l], kernel, x0[l], y0[l], x1[l], y1[l]);
+    }
+}
+
+template <class T>
+static inline const T* LevelSample(CImageOf<T> &img, float x, float y,
+                                   int &oH, int &oV, float &xf, float &yf)
+{
+    // Top-left pixel, offsets and fractions of a bilinear sample (clamped)
+    CShape sh = img.Shape();
+    x = __max(0.0f, __min(x, sh.width  - 1.0f));
+    y = __max(0.0f, __min(y, sh.height - 1.0f));
+    int xi = __min(int(x), __max(sh.width  - 2, 0));
+    int yi = __min(int(y), __max(sh.height - 2, 0));
+    xf = x - xi, yf = y - yi;
+    const T* p = &img.Pixel(xi, yi, 0);
+    oH = (xi + 1 < sh.width)  ? sh.nBands : 0;
+    oV = (yi + 1 < sh.height) ? int(&img.Pixel(xi, yi + 1, 0) - p) : 0;
+    return p;
+}
+
+template <class T>
+static void WarpLinePyramid(std::vector<CImageOf<T> > &levels, T* dstP, const float *xyP,
+                            const float *sizeP, int n, int nBands, T minVal, T maxVal,
+                            const float *gainP)
+{
+    // Resample a line, given the source coordinates and footprint size of each pixel
+    CShape sh = levels[0].Shape();
+    float maxLevel = (float) (levels.size() - 1);
+    for (int i = 0; i < n; i++, dstP += nBands, xyP += 2)
+    {
+        int x = int(floor(xyP[0]));
+        int y = int(floor(xyP[1]));
+        if (! (sh.InBounds(x, y) && sh.InBounds(x+1, y+1)))
+        {
+            for (int j = 0; j < nBands; j++)
+                dstP[j] = 0;
+            continue;
+        }
+
+        // The two levels the footprint lies between
+        float lambda = (sizeP[i] > 1.0f + footprintTol) ?
+            __min((float) (log(sizeP[i]) * 1.4426950408889634), maxLevel) : 0.0f;
+        int l = int(lambda);
+        float f = lambda - l;
+        float s = 1.0f / (1 << l);
+        int oH0, oV0, oH1 = 0, oV1 = 0;
+        float xf0, yf0, xf1 = 0.0f, yf1 = 0.0f;
+        const T* p0 = LevelSample(levels[l], xyP[0] * s, xyP[1] * s, oH0, oV0, xf0, yf0);
+        const T* p1 = (f > 0.0f) ?
+            LevelSample(levels[l+1], xyP[0] * s * 0.5f, xyP[1] * s * 0.5f,
+                        oH1, oV1, xf1, yf1) : 0;
+        for (int j = 0; j < nBands; j++)
+        {
+            float v = ResampleBiLinearF(&p0[j], oH0, oV0, xf0, yf0);
+            if (p1 != 0)
+                v = ResampleLinear(v, ResampleBiLinearF(&p1[j], oH1, oV1, xf1, yf1), f);
+            dstP[j] = (gainP != 0) ? ScaleAndClip(v, (j == 3) ? 1.0f : gainP[i], minVal, maxVal) :
+                      __max(minVal, __min(maxVal, (T) v));
+        }
+    }
+}
+
+static inline bool FieldPoint(CFloatImage &uv, bool relativeCoords, CShape srcSh,
+                              int x, int y, float &xs, float &ys)
+{
+    // Source point of a pixel of a coordinate field, and whether it has one
+    //  (pixels outside the field or mapped outside the source, e.g., the
+    //  corners of a spherical warp, don't)
+    if (! uv.Shape().InBounds(x, y))
+        return false;
+    xs = uv.Pixel(x, y, 0) + ((relativeCoords) ? x : 0);
+    ys = uv.Pixel(x, y, 1) + ((relativeCoords) ? y : 0);
+    return xs >= 0.0f && xs < srcSh.width && ys >= 0.0f && ys < srcSh.height;
+}
+
+static void FieldDerivative(CFloatImage &uv, bool relativeCoords, CShape srcSh,
+                            int x, int y, int dx, int dy, float xs, float ys,
+                            float &du, float &dv)
+{
+    // Derivative of the source point along (dx, dy):  a central difference
+    //  if both neighbours have a source, one-sided if only one has, and 0
+    //  if neither has (so invalid coordinates never make a footprint)
+    float xa, ya, xb, yb;
+    bool a = FieldPoint(uv, relativeCoords, srcSh, x - dx, y - dy, xa, ya);
+    bool b = FieldPoint(uv, relativeCoords, srcSh, x + dx, y + dy, xb, yb);
+    if (a && b)
+        du = (xb - xa) * 0.5f, dv = (yb - ya) * 0.5f;
+    else if (b)
+        du = xb - xs, dv = yb - ys;
+    else if (a)
+        du = xs - xa, dv = ys - ya;
+    else
+        du = dv = 0.0f;
+}
+
+static float FieldFootprint(CFloatImage &uv, bool relativeCoords, CShape srcSh,
+                            int x, int y, float &xs, float &ys)
+{
+    // Footprint size at a pixel of a coordinate field, and its source point
+    //  (a pixel without a source, which isn't sampled, has a size of 1)
+    if (! FieldPoint(uv, relativeCoords, srcSh, x, y, xs, ys))
+        return 1.0f;
+    float a, b, c, d;
+    FieldDerivative(uv, relativeCoords, srcSh, x, y, 1, 0, xs, ys, a, b);
+    FieldDerivative(uv, relativeCoords, srcSh, x, y, 0, 1, xs, ys, c, d);
+    return FootprintSize(a, b, c, d);
+}
 
 
 //
@@ -39,50 +426,362 @@
 template <class T>
 void WarpLocal(CImageOf<T> src, CImageOf<T>& dst,
                CFloatImage uv, bool relativeCoords,
-               EWarpInterpolationMode interp, float cubicA)
+               EWarpInterpolationMode interp, float cubicA,
+               const CRowExtents *extents)
 {
+    CProfileScope scope(eProfWarpLocal);
+    CMemoryTag tag(eMemWarped);
+
     // Check that dst is of the right shape
     CShape sh(uv.Shape().width, uv.Shape().height, src.Shape().nBands);
     dst.ReAllocate(sh);
-
-    // Allocate a row buffer for coordinates
+    dst.origin[0] = uv.origin[0];
+    dst.origin[1] = uv.origin[1];
+    ProfileCount(eProfWarpPixels, (long long) sh.width * sh.height);
     int n = sh.width;
-    std::vector<float> rowBuf;
-    rowBuf.resize(n*2);
 
     // Precompute the cubic interpolant
     if (interp == eWarpInterpCubic)
         InitializeCubicLUT(cubicA);
 
-    // Process each row
-    for (int y = 0; y < sh.height; y++)
+    // A third band of uv holds the gains
+    bool gains = (uv.Shape().nBands == 3);
+
+    // Antialiasing needs the footprint of each pixel and enough levels
+    CFloatImage footprint;
+    std::vector<CImageOf<T> > levels;
+    if (interp == eWarpInterpTrilinear)
     {
-        float *uvP  = &uv .Pixel(0, y, 0);
-        float *xyP  = (relativeCoords) ? &rowBuf[0] : uvP;
-        T *dstP     = &dst.Pixel(0, y, 0);
+        // (and the box of the source points sampled from coarser levels)
+        footprint.ReAllocate(CShape(sh.width, sh.height, 1));
+        std::mutex maxMutex;
+        float maxSize = 1.0f;
+        float xMin = FLT_MAX, yMin = FLT_MAX, xMax = -FLT_MAX, yMax = -FLT_MAX;
+        ParallelFor(0, sh.height, 0, [&](int y0, int y1)
+        {
+            float rangeMax = 1.0f;
+            float bx0 = FLT_MAX, by0 = FLT_MAX, bx1 = -FLT_MAX, by1 = -FLT_MAX;
+            for (int y = y0; y < y1; y++)
+            {
+                for (int x = 0; x < n; x++)
+                {
+                    float xs = 0.0f, ys = 0.0f;
+                    float s = FieldFootprint(uv, relativeCoords, src.Shape(), x, y, xs, ys);
+                    footprint.Pixel(x, y, 0) = s;
+                    if (s > 1.0f + footprintTol)
+                    {
+                        rangeMax = __max(rangeMax, s);
+                        bx0 = __min(bx0, xs), by0 = __min(by0, ys);
+                        bx1 = __max(bx1, xs), by1 = __max(by1, ys);
+                    }
+                }
+            }
+            std::lock_guard<std::mutex> lock(maxMutex);
+            maxSize = __max(maxSize, rangeMax);
+            xMin = __min(xMin, bx0), yMin = __min(yMin, by0);
+            xMax = __max(xMax, bx1), yMax = __max(yMax, by1);
+        });
+        PyramidLevels(src, maxSize, xMin, yMin, xMax, yMax, levels);
+    }
 
-        // Convert to absolute coordinates if necessary
-        if (relativeCoords)
+    // Process the rows in parallel, with a coordinate buffer per range
+    ParallelFor(0, sh.height, 0, [&](int y0, int y1)
+    {
+        std::vector<float> rowBuf, gainBuf;
+        rowBuf.resize(n*2);
+        if (gains)
+            gainBuf.resize(n);
+        for (int y = y0; y < y1; y++)
         {
-            for (int x = 0; x < n; x++)
+            float *uvP  = &uv .Pixel(0, y, 0);
+            float *xyP  = (relativeCoords || gains) ? &rowBuf[0] : uvP;
+            float *gainP = (gains) ? &gainBuf[0] : 0;
+            T *dstP     = &dst.Pixel(0, y, 0);
+
+            // Only the row's span has a source:  clear the rest
+            int xs = 0, xe = n;
+            if (extents != 0)
+            {
+                RowSpan(*extents, y, n, xs, xe);
+                memset(dstP, 0, xs * sh.nBands * sizeof(T));
+                memset(dstP + xe * sh.nBands, 0, (n - xe) * sh.nBands * sizeof(T));
+                if (xs == xe)
+                    continue;
+            }
+
+            // Convert to absolute coordinates if necessary
+            if (relativeCoords && ! gains)
             {
-                xyP[2*x+0] = x + uvP[2*x+0];
-                xyP[2*x+1] = y + uvP[2*x+1];
+                for (int x = xs; x < xe; x++)
+                {
+                    xyP[2*x+0] = x + uvP[2*x+0];
+                    xyP[2*x+1] = y + uvP[2*x+1];
+                }
             }
+
+            // Split the coordinates from the gains
+            if (gains)
+            {
+                for (int x = xs; x < xe; x++)
+                {
+                    xyP[2*x+0] = uvP[3*x+0] + (relativeCoords ? x : 0);
+                    xyP[2*x+1] = uvP[3*x+1] + (relativeCoords ? y : 0);
+                    gainP[x]   = uvP[3*x+2];
+                }
+            }
+
+            // Resample the line
+            if (interp == eWarpInterpTrilinear)
+                WarpLinePyramid(levels, dstP + xs * sh.nBands, xyP + 2 * xs,
+                                &footprint.Pixel(xs, y, 0), xe - xs, sh.nBands,
+                                src.MinVal(), src.MaxVal(), (gainP) ? gainP + xs : 0);
+            else
+                WarpLine(src, dstP + xs * sh.nBands, xyP + 2 * xs, xe - xs, sh.nBands, interp,
+                         src.MinVal(), src.MaxVal(), (gainP) ? gainP + xs : 0);
+        }
+    });
+}
+
+//
+//  Coordinates of the pixels of a row of a projective warp.
+//
+//  The source coordinates x(t) = (X0 + dX t) / (Z0 + dZ t) (and likewise
+//  y(t)) are computed exactly only at knots every step pixels, and
+//  linearly in between, so a homography costs little more per pixel than
+//  an affine warp.  The numerator of x'(t) is the constant
+//  C = dX Z0 - X0 dZ, so |x''(t)| = 2 |C dZ| / |Z(t)|^3, and the error of
+//  the linear interpolation over step pixels is at most step^2/8 times
+//  that.  ProjectiveStep picks the longest step (a power of two, up to
+//  warpChunk) that keeps the error within warpCoordTol, and 1 (a division
+//  for every pixel) if Z changes sign along the row.
+//
+//  The pixels between knots are filled four at a time with SSE2, using
+//  the same float operations in the same order as the scalar code (and
+//  no fused multiply-adds), so the results are bit-identical.
+//
+
+static const int warpChunk = 64;            // pixels whose coordinates are made at a time
+static const double warpCoordTol = 1.0 / 256;   // maximum error of the coordinates (pixels)
+
+static int ProjectiveStep(float X0, float dX, float Y0, float dY, float Z0, float dZ, int n)
+{
+    double za = Z0, zb = Z0 + (double) dZ * (n + warpChunk);
+    if (za * zb <= 0.0)
+        return 1;
+    double zMin = __min(fabs(za), fabs(zb));
+    double C = __max(fabs((double) dX * Z0 - (double) X0 * dZ),
+                     fabs((double) dY * Z0 - (double) Y0 * dZ));
+    double e1 = C * fabs(dZ) / (4.0 * zMin * zMin * zMin);   // (error of a step of 1)
+    int step = warpChunk;
+    while (step > 1 && step * step * e1 > warpCoordTol)
+        step /= 2;
+    return step;
+}
+
+static inline void FillSpan(float *xyP, int n, float xa, float sx, float ya, float sy,
+                            float yOffset)
+{
+    for (int j = 0; j < n; j++)
+    {
+        xyP[2*j+0] = xa + (float) j * sx;
+        xyP[2*j+1] = ya + (float) j * sy - yOffset;
+    }
+}
+
+#ifdef IMAGELIB_X86
+
+static IMAGELIB_TARGET_SSE2 void FillSpanSSE2(float *xyP, int n, float xa, float sx,
+                                              float ya, float sy, float yOffset)
+{
+    __m128 j4 = _mm_set_ps(3.0f, 2.0f, 1.0f, 0.0f);
+    __m128 xa4 = _mm_set1_ps(xa), sx4 = _mm_set1_ps(sx);
+    __m128 ya4 = _mm_set1_ps(ya), sy4 = _mm_set1_ps(sy), yo4 = _mm_set1_ps(yOffset);
+    int j = 0;
+    for (; j + 4 <= n; j += 4)
+    {
+        __m128 jj = _mm_add_ps(_mm_set1_ps((float) j), j4);
+        __m128 x = _mm_add_ps(xa4, _mm_mul_ps(jj, sx4));
+        __m128 y = _mm_sub_ps(_mm_add_ps(ya4, _mm_mul_ps(jj, sy4)), yo4);
+        _mm_storeu_ps(xyP + 2*j,     _mm_unpacklo_ps(x, y));
+        _mm_storeu_ps(xyP + 2*j + 4, _mm_unpackhi_ps(x, y));
+    }
+    for (; j < n; j++)
+    {
+        xyP[2*j+0] = xa + (float) j * sx;
+        xyP[2*j+1] = ya + (float) j * sy - yOffset;
+    }
+}
+
+#endif
+
+static void ProjectiveCoords(float *xyP, int t0, int n, int step,
+                             float X0, float dX, float Y0, float dY, float Z0, float dZ,
+                             float yOffset)
+{
+    // Coordinates of pixels t0 .. t0+n-1 (t0 a multiple of step)
+#ifdef IMAGELIB_X86
+    bool sse2 = CpuHas(eCpuSSE2);
+#endif
+    float scale = 1.0f / step;
+    for (int k = 0; k < n; k += step)
+    {
+        float ta = (float) (t0 + k), tb = (float) (t0 + k + step);
+        float za = 1.0f / (Z0 + dZ * ta), zb = 1.0f / (Z0 + dZ * tb);
+        float xa = (X0 + dX * ta) * za, ya = (Y0 + dY * ta) * za;
+        float sx = ((X0 + dX * tb) * zb - xa) * scale;
+        float sy = ((Y0 + dY * tb) * zb - ya) * scale;
+        int m = __min(step, n - k);
+#ifdef IMAGELIB_X86
+        if (sse2)
+        {
+            FillSpanSSE2(xyP + 2*k, m, xa, sx, ya, sy, yOffset);
+            continue;
         }
+#endif
+        FillSpan(xyP + 2*k, m, xa, sx, ya, sy, yOffset);
+    }
+}
+
+static inline float GlobalFootprint(CTransform3x3 &M, float xs, float ys, float z)
+{
+    // Footprint size at a pixel with source point (xs, ys) and depth z
+    float zi = 1.0f / z;
+    return FootprintSize((float) (M[0][0] - xs * M[2][0]) * zi,
+                         (float) (M[1][0] - ys * M[2][0]) * zi,
+                         (float) (M[0][1] - xs * M[2][1]) * zi,
+                         (float) (M[1][1] - ys * M[2][1]) * zi);
+}
+
+template <class T>
+void WarpGlobal(CImageOf<T> src, CImageOf<T>& dst,
+                CTransform3x3 M,
+                EWarpInterpolationMode interp, float cubicA,
+                int dstRow0, int srcRow0)
 
-        // Resample the line
-        WarpLine(src, dstP, xyP, n, sh.nBands, interp, src.MinVal(), src.MaxVal());
+{
+    // Not implemented yet, since haven't decided on semantics of M yet...
+
+    // Check that dst is of a valid shape
+    if (dst.Shape().width == 0)
+        dst.ReAllocate(src.Shape());
+    CShape sh = dst.Shape();
+    int n = sh.width;
+
+    // Precompute the cubic interpolant
+    if (interp == eWarpInterpCubic)
+        InitializeCubicLUT(cubicA);
+
+    // Antialiasing needs the levels for the largest footprint (taken at the
+    //  corners, as it varies smoothly;  larger ones use the coarsest level)
+    //  (the levels are only made within the box of the corners' source
+    //  points, widened by a pixel for the rounding of the coordinates, and
+    //  over all of src if the warp doesn't keep them in front)
+    std::vector<CImageOf<T> > levels;
+    if (interp == eWarpInterpTrilinear)
+    {
+        float maxSize = 1.0f;
+        CShape srcSh = src.Shape();
+        float xMin = FLT_MAX, yMin = FLT_MAX, xMax = -FLT_MAX, yMax = -FLT_MAX;
+        for (int k = 0; k < 4; k++)
+        {
+            CVector3 p, q;
+            p[0] = (k & 1) ? n - 1 : 0;
+            p[1] = dstRow0 + ((k & 2) ? sh.height - 1 : 0);
+            p[2] = 1.0;
+            q = M * p;
+            maxSize = __max(maxSize, GlobalFootprint(M, (float) (q[0] / q[2]),
+                                                     (float) (q[1] / q[2]), (float) q[2]));
+            if (q[2] <= 0.0)
+                xMin = yMin = -FLT_MAX, xMax = yMax = FLT_MAX;
+            xMin = __min(xMin, (float) (q[0] / q[2]) - 1.0f);
+            yMin = __min(yMin, (float) (q[1] / q[2]) - srcRow0 - 1.0f);
+            xMax = __max(xMax, (float) (q[0] / q[2]) + 1.0f);
+            yMax = __max(yMax, (float) (q[1] / q[2]) - srcRow0 + 1.0f);
+        }
+        PyramidLevels(src, maxSize, __max(xMin, 0.0f), __max(yMin, 0.0f),
+                      __min(xMax, srcSh.width - 1.0f), __min(yMax, srcSh.height - 1.0f),
+                      levels);
     }
+
+    // Process the rows in parallel, making the coordinates of a chunk of
+    //  pixels at a time (so they stay in the cache) just before resampling
+    ParallelFor(0, sh.height, 0, [&](int y0, int y1)
+    {
+        float xyP[2*warpChunk], sizeP[warpChunk];
+        for (int y = y0; y < y1; y++)
+        {
+            T *dstP     = &dst.Pixel(0, y, 0);
+
+            // Compute pixel coordinates
+            int yM = y + dstRow0;
+            float X0 = (float) (M[0][1]*yM + M[0][2]);
+            float dX = (float) M[0][0];
+            float Y0 = (float) (M[1][1]*yM + M[1][2]);
+            float dY = (float) M[1][0];
+            float Z0 = (float) (M[2][1]*yM + M[2][2]);
+            float dZ = (float) M[2][0];
+            bool affine = (dZ == 0.0);
+            float Zi = 1.0f / Z0;           // TODO:  doesn't guard against divide by 0
+            int step = 1;
+            if (affine)
+            {
+                X0 *= Zi, dX *= Zi, Y0 *= Zi, dY *= Zi;
+            }
+            else
+                step = ProjectiveStep(X0, dX, Y0, dY, Z0, dZ, n);
+            for (int x0 = 0; x0 < n; x0 += warpChunk)
+            {
+                int m = __min(warpChunk, n - x0);
+                if (affine)
+                {
+                    for (int x = 0; x < m; x++)
+                    {
+                        xyP[2*x+0] = X0 * Zi;
+                        xyP[2*x+1] = Y0 * Zi - srcRow0;
+                        X0 += dX;
+                        Y0 += dY;
+                    }
+                }
+                else
+                    ProjectiveCoords(xyP, x0, m, step, X0, dX, Y0, dY, Z0, dZ,
+                                     (float) srcRow0);
+
+                // Resample the chunk
+                if (interp == eWarpInterpTrilinear)
+                {
+                    for (int x = 0; x < m; x++)
+                        sizeP[x] = GlobalFootprint(M, xyP[2*x+0], xyP[2*x+1] + srcRow0,
+                                                   Z0 + dZ * (x0 + x));
+                    WarpLinePyramid(levels, dstP + x0 * sh.nBands, xyP, sizeP, m,
+                                    sh.nBands, src.MinVal(), src.MaxVal(), (const float *) 0);
+                }
+                else
+                    WarpLine(src, dstP + x0 * sh.nBands, xyP, m, sh.nBands, interp,
+                             src.MinVal(), src.MaxVal());
+            }
+        }
+    });
 }
 
 template void WarpLocal(CImageOf<float> src, CImageOf<float>& dst,
                         CFloatImage uv, bool relativeCoords,
-                        EWarpInterpolationMode interp, float cubicA);
+                        EWarpInterpolationMode interp, float cubicA,
+                        const CRowExtents *extents);
 
 template void WarpLocal(CImageOf<uchar> src, CImageOf<uchar>& dst,
                         CFloatImage uv, bool relativeCoords,
-                        EWarpInterpolationMode interp, float cubicA);
+                        EWarpInterpolationMode interp, float cubicA,
+                        const CRowExtents *extents);
+
+template void WarpGlobal(CImageOf<float> src, CImageOf<float>& dst,
+                         CTransform3x3 M,
+                         EWarpInterpolationMode interp, float cubicA,
+                         int dstRow0, int srcRow0);
+
+template void WarpGlobal(CImageOf<uchar> src, CImageOf<uchar>& dst,
+                         CTransform3x3 M,
+                         EWarpInterpolationMode interp, float cubicA,
+                         int dstRow0, int srcRow0);
 
 // Instantiate the code
 
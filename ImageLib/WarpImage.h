@@ -7,20 +7,28 @@
 // SPECIFICATION
 //  void WarpLocal(CImageOf<T> src, CImageOf<T>& dst,
 //                 CFloatImage uv, bool relativeCoords,
-//                 WarpInterpolationMode interp);
+//                 WarpInterpolationMode interp, float cubicA,
+//                 const CRowExtents *extents);
 //
 //  void WarpGlobal(CImageOf<T> src, CImageOf<T>& dst,
 //                  CTransform3x3 M,
-//                  WarpInterpolationMode interp);
+//                  WarpInterpolationMode interp,
+//                  float cubicA, int dstRow0, int srcRow0);
 //
 // PARAMETERS
 //  src                 source image
 //  dst                 destination image
-//  uv                  source pixel coordinates array/image
+//  uv                  source pixel coordinates array/image, with an
+//                      optional third band of gains
 //  relativeCoords      source coordinates are relative (offsets = "flow")
-//  interp              interpolation mode (nearest neighbor, bilinear, bicubic)
+//  interp              interpolation mode (nearest neighbor, bilinear, bicubic,
+//                      trilinear)
 //  cubicA              parameter controlling cubic interpolation
+//  extents             span of the pixels of each row of dst that have a
+//                      source (0 = all of them)
 //  M                   global 3x3 transformation matrix
+//  dstRow0, srcRow0    row of the complete dst/src image that the first row
+//                      of dst/src holds (for warping one band at a time)
 //
 // DESCRIPTION
 //  WarpLocal preforms an inverse sampling of the source image into the
@@ -33,14 +41,53 @@
 //  of pixels near the edges.  (Even for linear sampling with an integer
 //  shift, the rightmost column will be lost.)
 //
+//  If uv has three bands, the third is a gain by which each resampled
+//  pixel is multiplied (before it is clipped to the range of T), so that
+//  a photometric correction such as undoing lens vignetting (see
+//  WarpSphericalField) is made in the same pass as the warp.  The alpha
+//  band (the fourth) is not scaled.
+//
+//  dst takes the origin of uv, so warping through a field cropped to the
+//  pixels that have a source (see CropWarpField in WarpSpherical.h)
+//  gives a cropped dst that records where it lies in the full warp.
+//  Given the extents of the field's rows (see RowExtents.h), only the
+//  pixels inside each row's span are resampled and the rest are zeroed,
+//  which gives the same dst for less work.
+//
 //  WarpGlobal performs a similar resampling, except that the transformation
 //  is specified by a simple matrix that can be used to represent rigid,
-//  affine, or perspective transforms.
+//  affine, or perspective transforms.  When dst and src are horizontal bands
+//  of larger images, passing their row offsets (rather than folding them
+//  into M) produces exactly the same pixels as warping the complete image.
+//  For a perspective M, the source coordinates are computed exactly only
+//  every few pixels and interpolated linearly in between, to within
+//  1/256 of a pixel (see WarpImage.cpp), so a homography is resampled
+//  about as fast as an affine transform.
+//
+//  Point sampling aliases when the warp shrinks the image (e.g., for a
+//  preview or thumbnail of a mosaic).  With eWarpInterpTrilinear, each
+//  pixel is instead sampled from the levels of a pyramid of src (see
+//  Pyramid.h) that match the size of its footprint in src, given by the
+//  Jacobian of the warp (of M, or of uv by finite differences between
+//  the pixels that have a source), and blended between them, so a
+//  downscaled dst is antialiased in the one warp, without a full-size
+//  intermediate.  Only the levels the largest footprint needs are built,
+//  and only over the part of src that the pixels sampled from them
+//  cover.  Pixels are covered as for bilinear interpolation, and where
+//  the warp doesn't shrink the image, the result is that of bilinear
+//  interpolation.  (The pyramid of a band of rows isn't that band of the
+//  full pyramid, so, in this mode only, warping by bands approximates
+//  warping the complete image.)
+//
+//  Both resample ranges of rows in parallel (see ParallelFor in
+//  ThreadPool.h);  every row is computed exactly as on one thread.
 //
 //
 // SEE ALSO
 //  WarpImage.cpp       implementation
 //  Image.h             image class definition
+//  ThreadPool.h        parallel loops
+//  Pyramid.h           image pyramids (for eWarpInterpTrilinear)
 //
 // Copyright  Richard Szeliski, 2001.  See Copyright.h for more details
 //
@@ -53,7 +100,9 @@ enum EWarpInterpolationMode
 {
     eWarpInterpNearest   = 0,    // nearest neighbor
     eWarpInterpLinear    = 1,    // bi-linear interpolation
-    eWarpInterpCubic     = 3     // bi-cubic interpolation
+    eWarpInterpCubic     = 3,    // bi-cubic interpolation
+    eWarpInterpTrilinear = 4     // bi-linear from the pyramid levels matching
+                                 //  the local scale (antialiased downscaling)
 };
 
 static const int cubicLUTsize = 256;
@@ -74,7 +123,7 @@ static inline float ResampleCubic(float v0, float v1, float v2, float v3, float
 //
 
 template <class T>
-static T ResampleBiCubic(T src[], int oH, int oV, float xf, float yf)
+static float ResampleBiCubicF(T src[], int oH, int oV, float xf, float yf)
 {
     // Resample a pixel using bilinear interpolation
     float h[4];
@@ -84,7 +133,13 @@ static T ResampleBiCubic(T src[], int oH, int oV, float xf, float yf)
         h[i] = ResampleCubic(src[j-oH], src[j], src[j+oH], src[j+2*oH], xf);
     }
     float  v = ResampleCubic(h[0], h[1], h[2], h[3], yf);
-    return (T) v;
+    return v;
+}
+
+template <class T>
+static T ResampleBiCubic(T src[], int oH, int oV, float xf, float yf)
+{
+    return (T) ResampleBiCubicF(src, oH, oV, xf, yf);
 }
 
 static inline float ResampleLinear(float v0, float v1, float f)
@@ -98,16 +153,34 @@ static inline float ResampleLinear(float v0, float v1, float f)
 //
 
 template <class T>
-static inline T ResampleBiLinear(T src[], int oH, int oV, float xf, float yf)
+static inline float ResampleBiLinearF(T src[], int oH, int oV, float xf, float yf)
 {
     // Resample a pixel using bilinear interpolation
     float h1 = ResampleLinear(src[0 ], src[   oH], xf);
     float h2 = ResampleLinear(src[oV], src[oV+oH], xf);
     float  v = ResampleLinear(h1, h2, yf);
-    return (T) v;
+    return v;
 }
 
-static void InitializeCubicLUT(float a)
+template <class T>
+static inline T ResampleBiLinear(T src[], int oH, int oV, float xf, float yf)
+{
+    return (T) ResampleBiLinearF(src, oH, oV, xf, yf);
+}
+
+//
+//  Scale a resampled value by a gain and clip it (in float, so that the
+//  product can't overflow T)
+//
+
+template <class T>
+static inline T ScaleAndClip(float v, float gain, T minVal, T maxVal)
+{
+    v *= gain;
+    return (T) __max((float) minVal, __min((float) maxVal, v));
+}
+
+static inline void InitializeCubicLUT(float a)
 {
     float zero = 0.0;      // not implemented yet
     float error = 1.0f / zero;
@@ -116,7 +189,8 @@ static void InitializeCubicLUT(float a)
 template <class T>
 void WarpLocal(CImageOf<T> src, CImageOf<T>& dst,
                CFloatImage uv, bool relativeCoords,
-               EWarpInterpolationMode interp, float cubicA = 1.0);
+               EWarpInterpolationMode interp, float cubicA = 1.0,
+               const CRowExtents *extents = 0);
 
 
 
@@ -127,14 +201,37 @@ void WarpLocal(CImageOf<T> src, CImageOf<T>& dst,
 template <class T>
 void WarpGlobal(CImageOf<T> src, CImageOf<T>& dst,
                 CTransform3x3 M,
-                EWarpInterpolationMode interp, float cubicA = 1.0);
+                EWarpInterpolationMode interp, float cubicA = 1.0,
+                int dstRow0 = 0, int srcRow0 = 0);
 
 //
-//  Resample a complete line, given the source pixel addresses
+//  SIMD bilinear resampling of a line of RGBA pixels (WarpImage.cpp):
+//  returns the number of leading pixels resampled (0 if there is no SIMD
+//  version for the type, bands, interpolation or processor)
+//
+int WarpLineSIMD(CImageOf<uchar>& src, uchar* dstP, float *xyP, int n, int nBands,
+                 EWarpInterpolationMode interp, uchar minVal, uchar maxVal,
+                 const float *gainP = 0);
+int WarpLineSIMD(CImageOf<float>& src, float* dstP, float *xyP, int n, int nBands,
+                 EWarpInterpolationMode interp, float minVal, float maxVal,
+                 const float *gainP = 0);
+
+template <class T>
+inline int WarpLineSIMD(CImageOf<T>& src, T* dstP, float *xyP, int n, int nBands,
+                        EWarpInterpolationMode interp, T minVal, T maxVal,
+                        const float *gainP = 0)
+{
+    return 0;
+}
+
+//
+//  Resample a complete line, given the source pixel addresses (and,
+//  optionally, a gain for each pixel)
 //
 template <class T>
 void WarpLine(CImageOf<T> src, T* dstP, float *xyP, int n, int nBands,
-              EWarpInterpolationMode interp, T minVal, T maxVal)
+              EWarpInterpolationMode interp, T minVal, T maxVal,
+              const float *gainP = 0)
 {
     // Determine the interpolator's "footprint"
     const int o0 = int(interp)/2;       // negative extent
@@ -144,8 +241,10 @@ void WarpLine(CImageOf<T> src, T* dstP, float *xyP, int n, int nBands,
                    &src.Pixel(0, 0, 0); // vertical  offset between pixels
     CShape sh = src.Shape();
 
-    // Resample a single output scanline
-    for (int i = 0; i < n; i++, dstP += nBands, xyP += 2)
+    // Resample a single output scanline (with SIMD code, if possible)
+    int done = WarpLineSIMD(src, dstP, xyP, n, nBands, interp, minVal, maxVal, gainP);
+    dstP += done * nBands, xyP += 2 * done;
+    for (int i = done; i < n; i++, dstP += nBands, xyP += 2)
     {
         // Round down pixel coordinates
         int x = int(floor(xyP[0]));
@@ -159,6 +258,22 @@ void WarpLine(CImageOf<T> src, T* dstP, float *xyP, int n, int nBands,
             continue;
         }
         T* srcP = &src.Pixel(x, y, 0);
+        float xf = xyP[0] - x;
+        float yf = xyP[1] - y;
+
+        // With a gain, resample in float and scale all but the alpha band
+        if (gainP != 0)
+        {
+            for (int j = 0; j < nBands; j++)
+            {
+                float v = (interp == eWarpInterpNearest) ? (float) srcP[j] :
+                          (interp == eWarpInterpLinear) ?
+                            ResampleBiLinearF(&srcP[j], oH, oV, xf, yf) :
+                            ResampleBiCubicF(&srcP[j], oH, oV, xf, yf);
+                dstP[j] = ScaleAndClip(v, (j == 3) ? 1.0f : gainP[i], minVal, maxVal);
+            }
+            continue;
+        }
 
         // Nearest-neighbor: just copy pixels
         if (interp == eWarpInterpNearest)
@@ -168,9 +283,6 @@ void WarpLine(CImageOf<T> src, T* dstP, float *xyP, int n, int nBands,
             continue;
         }
 
-        float xf = xyP[0] - x;
-        float yf = xyP[1] - y;
-
         // Bilinear and bi-cubic
         if (interp == eWarpInterpLinear)
         {
@@ -188,63 +300,3 @@ void WarpLine(CImageOf<T> src, T* dstP, float *xyP, int n, int nBands,
 }
 
 
-template <class T>
-void WarpGlobal(CImageOf<T> src, CImageOf<T>& dst,
-                CTransform3x3 M,
-                EWarpInterpolationMode interp, float cubicA)
-
-{
-    // Not implemented yet, since haven't decided on semantics of M yet...
-
-    // Check that dst is of a valid shape
-    if (dst.Shape().width == 0)
-        dst.ReAllocate(src.Shape());
-    CShape sh = dst.Shape();
-
-    // Allocate a row buffer for coordinates
-    int n = sh.width;
-    std::vector<float> rowBuf;
-    rowBuf.resize(n*2);
-
-    // Precompute the cubic interpolant
-    if (interp == eWarpInterpCubic)
-        InitializeCubicLUT(cubicA);
-
-    // Process each row
-    for (int y = 0; y < sh.height; y++)
-    {
-        float *xyP  = &rowBuf[0];
-        T *dstP     = &dst.Pixel(0, y, 0);
-
-        // Compute pixel coordinates
-        float X0 = (float) (M[0][1]*y + M[0][2]);
-        float dX = (float) M[0][0];
-        float Y0 = (float) (M[1][1]*y + M[1][2]);
-        float dY = (float) M[1][0];
-        float Z0 = (float) (M[2][1]*y + M[2][2]);
-        float dZ = (float) M[2][0];
-        bool affine = (dZ == 0.0);
-        float Zi = 1.0f / Z0;           // TODO:  doesn't guard against divide by 0
-        if (affine)
-        {
-            X0 *= Zi, dX *= Zi, Y0 *= Zi, dY *= Zi;
-        }
-        for (int x = 0; x < n; x++)
-        {
-            xyP[2*x+0] = X0 * Zi;
-            xyP[2*x+1] = Y0 * Zi;
-            X0 += dX;
-            Y0 += dY;
-            if (! affine)
-            {
-                Z0 += dZ;
-                Zi = 1.0f / Z0;
-            }
-        }
-
-        // Resample the line
-        WarpLine(src, dstP, xyP, n, sh.nBands, interp, src.MinVal(), src.MaxVal());
-    }
-}
-
-
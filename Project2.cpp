@@ -4,10 +4,15 @@
 //  Project2.cpp -- command-line (shell) interface to project 2 code
 //
 // SYNOPSIS
+//  Project2 [options] command ...
 //  Project2 sphrWarp input.tga output.tga f [k1 k2]
 //  Project2 alignPair input1.f input2.f nRANSAC RANSACthresh [sift]
 //  Project2 blendPairs pairlist.txt outfile.tga blendWidth
+//  Project2 stitch imagelist.txt outfile.tga f k1 k2 nRANSAC RANSACthresh blendWidth [sift]
 //  Project2 script script.cmd
+//  Project2 serve socket
+//  Project2 client socket command ...
+//  Project2 synth outdir nFrames width height f k1 k2 [name=value ...]
 //
 // PARAMTERS
 //  input.tga       input image
@@ -25,10 +30,91 @@
 //  pairlist.txt    file of image pair names and relative translations
 //                  this is usually the concatenation of outputs from alignPair
 //
+//  outfile.tga     output mosaic; use a .ptl extension to write a tiled
+//                  container instead (for mosaics too large for Targa),
+//                  or a .tiles extension to write a z/x/y tile pyramid
+//                  directory for a web viewer
+//
 //  blendWidth		width of the horizontal blending function
 //
+//  imagelist.txt   one line per image, in panorama order:
+//                      image.tga features.f [matchfile]
+//                  where matchfile relates the image's features to those
+//                  of the next image (they are matched in memory if omitted)
+//
 //  script.cmd      script file (command line file)
 //
+//  outdir          directory for a synthetic data set (see Synth.h)
+//  nFrames         number of frames
+//  width, height   frame size
+//  name=value      overlap=0.5 (fraction of a frame shared with the next),
+//                  features=200 (per frame), outliers=0.2 (fraction of
+//                  wrong matches), noise=0.02 (descriptor noise), seed=1,
+//                  source=pano.tga (equirectangular panorama to render
+//                  instead of a procedural one)
+//
+//  socket          name of the server's local socket
+//  command ...     command for the server to run (e.g., sphrWarp ...)
+//
+// OPTIONS
+//  --io-threads n  number of background threads used to read images and
+//                  feature files ahead of their use (default 2, 0 = off)
+//  --threads n     number of worker threads shared by the parallel loops
+//                  of the warps, convolutions and blends and by the
+//                  commands of script, stitch and serve (default one per
+//                  processor, 1 = everything on the calling thread)
+//  --jobs n        number of script commands run at once (default as
+//                  many as there are threads, 1 = one after the other)
+//  --profile       print the time spent in each stage of the pipeline
+//                  and the work it did to stderr on exit (see Profile.h)
+//  --profile-json file
+//                  write the same report (with per-thread totals) to a
+//                  JSON file on exit
+//  --trace file    write a timeline of the work done by each thread to
+//                  a Chrome trace-event JSON file on exit, for viewing in
+//                  Perfetto (ui.perfetto.dev);  the PANORAMA_TRACE
+//                  environment variable does the same
+//  --estimate-memory
+//                  make blendPairs print an estimate of the memory it
+//                  would need (reading only the image headers) instead
+//                  of blending
+//  --gain          balance the exposures of the images (a gain for each
+//                  image and colour channel, solved from the mean
+//                  intensities of their overlaps) before blendPairs and
+//                  stitch blend them, so that a narrow blendWidth leaves
+//                  no visible seams (see GainCompensation.h)
+//  --vignetting v1 v2
+//                  undo lens vignetting, a fall-off in brightness of
+//                  1 + v1 r^2 + v2 r^4 at a distance r (in units of f)
+//                  from the image centre, in the warps of sphrWarp and
+//                  stitch, as they resample (see WarpSpherical.h)
+//  --crop          make sphrWarp and stitch warp each image only over the
+//                  bounding box of the pixels that have a source, rather
+//                  than over the whole frame;  sphrWarp records the offset
+//                  of the box in the origin of the Targa header
+//  --warp-store dir
+//                  keep the warp fields of sphrWarp and stitch in dir,
+//                  where later runs with the same lens parameters and
+//                  image size map them rather than computing them again
+//                  (see WarpStore.h);  the PANORAMA_WARP_STORE
+//                  environment variable does the same
+//  --warp-store-mb n
+//                  size of the files kept in the warp store, in MB
+//                  (default 1024;  the least recently used go first)
+//  --isa name      use the SIMD kernels of at most the given instruction
+//                  set (scalar, sse2, ssse3, sse4.1, avx2 or avx512),
+//                  rather than the best one the processor supports, for
+//                  A/B comparisons;  the PANORAMA_ISA environment
+//                  variable does the same (see CpuFeatures.h)
+//
+//  The options before a command apply to that command alone.  The
+//  commands of a script start from the script's options (and those a
+//  client sends, from the server's), and may add their own.  --io-threads,
+//  --threads, --profile, --profile-json, --trace, --warp-store,
+//  --warp-store-mb and --isa set up the whole process, so they are only
+//  accepted on the command line itself, not in a script or a client's
+//  command.
+//
 // DESCRIPTION
 //  This file contains a set of simple command line processes from which
 //  you can build a simple automatic cylindrical stitching application.
@@ -39,6 +125,42 @@
 //  3. read in all of the images and perform pairwise blends
 //     to obtain a final (rectified and trimmed) mosaic
 //
+//  stitch does all three in one process without intermediate files
+//  (see Stitch.h), and prints the pairwise translations in the
+//  pairlist format used by blendPairs.
+//
+//  Input files are read ahead on background threads (see AsyncLoader.h)
+//  so that disk I/O and decoding overlap with computation:  blendPairs
+//  reads all of its images ahead, and script reads the inputs of the
+//  next few commands while the current one runs (skipping any file that
+//  an earlier command in the script has yet to write).
+//
+//  The warps, convolutions and blends split their rows among the worker
+//  threads (see ParallelFor in ThreadPool.h), and script, stitch (its
+//  pipeline stages included) and serve run their commands and tasks on
+//  the same threads, so nested work never starts more threads than
+//  --threads;  a thread that waits for such work helps with it.
+//
+//  script runs independent commands in parallel.  A command waits for
+//  the earlier commands that write its input files (including the images
+//  named in a pair list or image list) or that read or write its output
+//  files.  Dependencies that can't be seen from the command line can be
+//  given in a trailing annotation,
+//      Panorama sphrWarp a.tga b.tga 600    // reads c.tga writes d.tga
+//  and a "//barrier" line makes the next command wait for all of the
+//  commands before it (and all of the later ones wait for it), as do
+//  commands whose files are unknown.  The output of each command is
+//  printed in script order, as if the commands had run one at a time,
+//  and the script stops at (and returns the code of) the first command
+//  that fails.
+//
+//  serve keeps the process running and executes the commands that
+//  client sends it (see Service.h), several at a time, so that process
+//  startup is paid once and the thread pool, warp fields and feature
+//  sets stay warm from one command to the next.  File names are taken
+//  relative to the directory the server was started in.  "client socket
+//  quit" stops the server.
+//
 // TIPS
 //  To become familiar with this code, single-step through a couple of
 //  examples.  Also, if you are running inside the debugger, place
@@ -53,9 +175,13 @@
 
 #include <math.h>
 #include <assert.h>
+#include <stdarg.h>
 #include <cstring>
 
 #include <fstream>
+#include <functional>
+#include <map>
+#include <set>
 #include <FL/Fl.H>
 #include <FL/Fl_Shared_Image.H>
 
@@ -64,20 +190,157 @@
 //#include "FeatureMatch.h"
 #include "FeatureAlign.h"
 #include "BlendImages.h"
+#include "GainCompensation.h"
+#include "Stitch.h"
+#include "WarpStore.h"
+#include "Service.h"
+#include "Synth.h"
+#include <mutex>
+#include <memory>
+
+// Options of one command (see Command)
+struct CCommandOptions
+{
+    CCommandOptions() : scriptJobs(0), estimateMemory(false), gainCompensation(false),
+                        cropWarps(false)
+    {
+        vignetting[0] = vignetting[1] = 0.0f;
+    }
+
+    // Script commands run in parallel (see Script)
+    int scriptJobs;             // --jobs n (0 = no limit)
+
+    // Memory estimate instead of a blend (see EstimateMemory)
+    bool estimateMemory;        // --estimate-memory
+
+    // Exposure compensation of blendPairs and stitch (see GainCompensation.h)
+    bool gainCompensation;      // --gain
 
-int main(int argc, const char *argv[]);     // forward declaration
+    // Vignetting undone by the warps of sphrWarp and stitch (see WarpSpherical.h)
+    float vignetting[2];        // --vignetting v1 v2
+    bool cropWarps;             // --crop
+};
+
+static int Command(int argc, const char *argv[], CCommandOptions options,
+                   bool topLevel);  // forward declaration
 bool LoadImageFile(const char *filename, CByteImage &image);
+static bool ReadImageQuietly(const char *filename, CByteImage &image);
+static bool ReadAnyImage(const char *filename, CByteImage &image, bool verbose);
 void convertToByteImage(CFloatImage &floatImage, CByteImage &byteImage);
 void convertToFloatImage(CByteImage &byteImage, CFloatImage &floatImage);
 bool convertImage(const Fl_Image *image, CByteImage &convertedImage);
 
+// Read-ahead of input files (see AsyncLoader.h)
+static int ioThreads = 2;               // --io-threads n
+static const int scriptLookahead = 4;   // commands read ahead by Script
+
+// Stage timing report (see Profile.h)
+static const char *profileJSONFile = 0;  // --profile-json file
+static const char *traceFile = 0;        // --trace file or $PANORAMA_TRACE
+
+// Warp fields shared with other runs (see WarpStore.h)
+static const char *warpStoreDir = 0;    // --warp-store dir or $PANORAMA_WARP_STORE
+static long long warpStoreMB = 1024;    // --warp-store-mb n
+
+static bool LimitISA(const char *name)
+{
+    // --isa name or $PANORAMA_ISA (false if the name is unknown)
+    int features = CpuISAFeatures(name);
+    if (features < 0)
+        return false;
+    CpuLimitFeatures(features);
+    return true;
+}
+
+// Command output:  stdout, or the command's buffer while a script runs
+//  its commands in parallel (or the server runs a client's command)
+static thread_local string *commandOutput = 0;
+
+static void Print(const char *fmt, ...)
+{
+    va_list args;
+    va_start(args, fmt);
+    int n = vsnprintf(0, 0, fmt, args);
+    va_end(args);
+    string text(max(n, 0) + 1, 0);
+    va_start(args, fmt);
+    vsnprintf(&text[0], text.size(), fmt, args);
+    va_end(args);
+    text.resize(max(n, 0));
+    if (commandOutput)
+        *commandOutput += text;
+    else
+        fputs(text.c_str(), stdout);
+}
+
+static int CapturedCommand(int argc, const char *argv[], string &output,
+                           const CCommandOptions &options)
+{
+    // Run a command, appending its output to output
+    string *outer = commandOutput;
+    commandOutput = &output;
+    int code = Command(argc, argv, options, false);
+    commandOutput = outer;
+    return code;
+}
+
+static void LoadFeatures(FeatureSet &f, const char *filename)
+{
+    f.load(filename);
+}
+
+static void LoadSiftFeatures(FeatureSet &f, const char *filename)
+{
+    f.load_sift(filename);
+}
+
+static CImageLoader &ImageLoader()
+{
+    static CImageLoader loader(ReadImageFile, ioThreads, 2*ioThreads + 2);
+    return loader;
+}
+
+static CAsyncLoaderOf<FeatureSet> &FeatureLoader(bool sift)
+{
+    static CAsyncLoaderOf<FeatureSet> loader(LoadFeatures, ioThreads, 2*ioThreads + 2);
+    static CAsyncLoaderOf<FeatureSet> siftLoader(LoadSiftFeatures, ioThreads, 2*ioThreads + 2);
+    return sift ? siftLoader : loader;
+}
+
+// The read-aheads of one command, withdrawn when it returns (so that the
+//  ones it never takes, e.g. after a failure, don't linger in the loaders)
+class CReadAheads
+{
+public:
+    ~CReadAheads()
+    {
+        for (int i = 0; i < (int) m_images.size(); i++)
+            ImageLoader().Cancel(m_images[i].c_str());
+        for (int k = 0; k < 2; k++)
+            for (int i = 0; i < (int) m_features[k].size(); i++)
+                FeatureLoader(k == 1).Cancel(m_features[k][i].c_str());
+    }
+    void Image(const char *name)
+    {
+        ImageLoader().Prefetch(name);
+        m_images.push_back(name);
+    }
+    void Features(const char *name, bool sift)
+    {
+        FeatureLoader(sift).Prefetch(name);
+        m_features[sift ? 1 : 0].push_back(name);
+    }
+private:
+    vector<string> m_images, m_features[2];
+};
+
 
-int SphrWarp(int argc, const char *argv[])
+int SphrWarp(int argc, const char *argv[], const CCommandOptions &options)
 {
     // Warp the input image to correct for radial distortion and/or map to spherical coordinates
     if (argc < 5)
     {
-        printf("usage: %s input.tga output.tga f [k1 k2]\n", argv[1]);
+        Print("usage: %s input.tga output.tga f [k1 k2]\n", argv[1]);
         return -1;
     }
     const char *infile  = argv[2];
@@ -92,12 +355,12 @@ int SphrWarp(int argc, const char *argv[])
 	{
 		bool success = LoadImageFile(infile, src);
 		if (!success) {
-			printf("couldn't load image 1\n");
+			Print("couldn't load image 1\n");
 			return -1;
 		}
 		else
 		{
-			printf("Done loading file\n");
+			Print("Done loading file\n");
 		}
 	}
 
@@ -111,47 +374,21 @@ int SphrWarp(int argc, const char *argv[])
     R[2][0] = 0.0; R[2][1] = sin(THETA);  R[2][2] = cos(THETA);
 
     // CFloatImage uv = WarpSphericalField(sh, sh, f, k1, k2, CTransform3x3());
-    CFloatImage uv = WarpSphericalField(sh, sh, f, k1, k2, R);
-    WarpLocal(src, dst, uv, false, eWarpInterpLinear);
+    CRowExtents extents;
+    CFloatImage uv = CachedWarpField(sh, f, k1, k2, R, options.vignetting[0],
+                                     options.vignetting[1], options.cropWarps, &extents);
+    WarpLocal(src, dst, uv, false, eWarpInterpLinear, 1.0f, &extents);
     WriteFile(dst, outfile);
     return 0;
 }
 
 
-bool ReadFeatureMatches(const char *filename, vector<FeatureMatch> &matches)
-{
-    FILE *f = fopen(filename, "r");
-
-    if (f == NULL)
-        return false;
-
-    int num_matches;
-    fscanf(f, "%d\n", &num_matches);
-
-    matches.resize(num_matches);
-
-    for (int i = 0; i < num_matches; i++) {
-        FeatureMatch match;
-
-        int id1, id2;
-        double score;
-        fscanf(f, "%d %d %lf\n", &id1, &id2, &score);
-
-        match.id1 = id1;
-        match.id2 = id2;
-        match.score = score;
-        matches[i] = match;
-    }
-
-    return true;
-}
-
 int AlignPair(int argc, const char *argv[])
 {
     // Align two images using feature matching
     if (argc < 7)
         {
-            printf("usage: %s input1.f input2.f matchfile nRANSAC RANSACthresh [sift]\n", argv[1]);
+            Print("usage: %s input1.f input2.f matchfile nRANSAC RANSACthresh [sift]\n", argv[1]);
             return -1;
         }
     const char *infile1 = argv[2];
@@ -162,15 +399,12 @@ int AlignPair(int argc, const char *argv[])
 
     FeatureSet f1, f2;
 
-    // Read in the feature sets
-    if ((argc >= 8) && (strcmp(argv[7], "sift") == 0)) {
-        f1.load_sift(infile1);
-        f2.load_sift(infile2);
-    }
-    else {
-        f1.load(infile1);
-        f2.load(infile2);
-    }
+    // Read in the feature sets (unless they were read ahead or cached)
+    bool sift = (argc >= 8) && (strcmp(argv[7], "sift") == 0);
+    if (! FeatureLoader(sift).Take(infile1, f1))
+        LoadFeatureSet(f1, infile1, sift);
+    if (! FeatureLoader(sift).Take(infile2, f2))
+        LoadFeatureSet(f2, infile2, sift);
 
     CTransform3x3 M;
 
@@ -179,7 +413,7 @@ int AlignPair(int argc, const char *argv[])
     bool success = ReadFeatureMatches(matchfile, matches);
 
     if (!success) {
-        printf("Error opening match file %s for reading\n", matchfile);
+        Print("Error opening match file %s for reading\n", matchfile);
         return -1;
     }
 
@@ -225,9 +459,9 @@ int AlignPair(int argc, const char *argv[])
 
     // Print out the result
     if ((argc >= 7) && (strcmp(argv[6], "sift") == 0)) {
-        printf("%.2f %.2f\n", M[0][2], -M[1][2]);
+        Print("%.2f %.2f\n", M[0][2], -M[1][2]);
     } else {
-        printf("%.2f %.2f\n", M[0][2], M[1][2]);
+        Print("%.2f %.2f\n", M[0][2], M[1][2]);
         // printf("%0.3f %0.3f %0.3f %0.3f %0.3f %0.3f %0.3f %0.3f %0.3f\n",
         //         M[0][0], M[0][1], M[0][2],
         //         M[1][0], M[1][1], M[1][2],
@@ -237,12 +471,38 @@ int AlignPair(int argc, const char *argv[])
     return 0;
 }
 
-int BlendPairs(int argc, const char *argv[])
+static int EstimateMemory(const vector<string> &imageNames,
+                          const CImagePositionV &ipList, const char *outfile)
+{
+    // Print the memory blendPairs would need, from the image headers alone
+    vector<CShape> shapes;
+    vector<CTransform3x3> positions;
+    for (int i = 0; i < (int) ipList.size(); i++)
+    {
+        shapes.push_back(ReadFileShape(imageNames[i].c_str()));
+        positions.push_back(ipList[i].position);
+    }
+    CBlendMemory mem = EstimateBlendMemory(shapes, positions);
+    long long sink = ImageSinkMemory(outfile, mem.mosaic);
+    long long peak = mem.images + mem.accumulator + mem.composite + mem.band + sink;
+
+    const double MB = 1048576.0;
+    Print("mosaic %d x %d x %d\n", mem.mosaic.width, mem.mosaic.height, mem.mosaic.nBands);
+    Print("%-14s %10.1f MB\n", "images", mem.images / MB);
+    Print("%-14s %10.1f MB\n", "accumulator", mem.accumulator / MB);
+    Print("%-14s %10.1f MB\n", "composite", mem.composite / MB);
+    Print("%-14s %10.1f MB\n", "mosaic band", mem.band / MB);
+    Print("%-14s %10.1f MB\n", "output sink", sink / MB);
+    Print("%-14s %10.1f MB\n", "peak", peak / MB);
+    return 0;
+}
+
+int BlendPairs(int argc, const char *argv[], const CCommandOptions &options)
 {
     // Blend a sequence of images given the pairwise transformations
     if (argc < 5)
     {
-        printf("usage: %s pairlist.txt outimg.tga blendWidth\n", argv[1]);
+        Print("usage: %s pairlist.txt outimg.tga blendWidth\n", argv[1]);
         return -1;
     }
     const char *pairlist= argv[2];
@@ -256,6 +516,7 @@ int BlendPairs(int argc, const char *argv[])
 
     // Construct the list of images and translations
     CImagePositionV ipList;
+    vector<string> imageNames;
     char line[1024], infile1[1024], infile2[1024];
     // float rel_t[2];
     CTransform3x3 M;
@@ -287,7 +548,7 @@ int BlendPairs(int argc, const char *argv[])
 
 		M[1][2] = -M[1][2];
 
-		ReadFile(ip.img, infile1);
+		imageNames.push_back(infile1);
 		ipList.push_back(ip);
 	}
 
@@ -298,105 +559,779 @@ int BlendPairs(int argc, const char *argv[])
 	//     ip.position[k] = ipList[n-1].position[k] - rel_t[k];
 	ip.position = ipList[n-1].position * M;
 
-	ReadFile(ip.img, infile2);
+	imageNames.push_back(infile2);
 	ipList.push_back(ip);
 	fclose(stream);
 
-	CByteImage result = BlendImages(ipList, blendWidth);
-	WriteFile(result, outfile);
+	if (options.estimateMemory)
+		return EstimateMemory(imageNames, ipList, outfile);
+
+	// Read the images, decoding the later ones in the background
+	CReadAheads readAheads;
+	for (int i = 0; i < (int) ipList.size(); i++)
+		readAheads.Image(imageNames[i].c_str());
+	for (int i = 0; i < (int) ipList.size(); i++)
+		if (! ImageLoader().Take(imageNames[i].c_str(), ipList[i].img))
+			ReadFile(ipList[i].img, imageNames[i].c_str());
+
+	if (options.gainCompensation)
+		CompensateGains(ipList);
+
+	// Stream the mosaic straight to disk (.tga strips or .ptl tiles)
+	std::unique_ptr<CImageSink> sink(NewImageSink(outfile));
+	BlendImages(ipList, blendWidth, *sink);
 	return 0;
 }
 
-int Script(int argc, const char *argv[])
+static bool IsTargaFile(const char *filename)
+{
+    const char *dot = strrchr(filename, '.');
+    return dot != 0 && (strcmp(dot, ".tga") == 0 || strcmp(dot, ".TGA") == 0);
+}
+
+int StitchImages(int argc, const char *argv[], const CCommandOptions &options)
+{
+    // Warp, align and blend a list of images without intermediate files
+    if (argc < 10)
+    {
+        Print("usage: %s imagelist.txt outimg.tga f k1 k2 nRANSAC RANSACthresh blendWidth [sift]\n", argv[1]);
+        return -1;
+    }
+    const char *imagelist = argv[2];
+    const char *outfile   = argv[3];
+    CStitchParams params;
+    params.f            = (float) atof(argv[4]);
+    params.k1           = (float) atof(argv[5]);
+    params.k2           = (float) atof(argv[6]);
+    params.v1           = options.vignetting[0];
+    params.v2           = options.vignetting[1];
+    params.cropWarps    = options.cropWarps;
+    params.nRANSAC      = atoi(argv[7]);
+    params.RANSACthresh = atof(argv[8]);
+    params.blendWidth   = (float) atof(argv[9]);
+    params.sift         = (argc >= 11) && (strcmp(argv[10], "sift") == 0);
+    params.gainCompensation = options.gainCompensation;
+    params.loadImage    = ReadImageQuietly;
+
+    // Read the list of images, feature files and (optional) match files
+    FILE *stream = fopen(imagelist, "r");
+    if (stream == 0)
+        throw CError("%s: could not open the file %s", argv[1], imagelist);
+    vector<CStitchImage> images;
+    char line[1024], name[3][1024];
+    while (fgets(line, 1024, stream))
+    {
+        int n = sscanf(line, "%s %s %s", name[0], name[1], name[2]);
+        if (n <= 0 || (name[0][0] == '/' && name[0][1] == '/'))
+            continue;   // skip blank and comment lines
+        if (n < 2)
+            throw CError("%s: error reading %s\n", argv[1], imagelist);
+        CStitchImage in;
+        in.imageFile = name[0], in.featureFile = name[1];
+        if (n > 2)
+            in.matchFile = name[2];
+        images.push_back(in);
+    }
+    fclose(stream);
+
+    std::unique_ptr<CImageSink> sink(NewImageSink(outfile));
+    vector<CTransform3x3> translations = Stitch(images, params, *sink, SharedPool());
+    sink.reset();
+
+    // Print the pairwise translations as a pair list (see blendPairs)
+    for (int i = 0; i < (int) translations.size(); i++)
+        Print("%s %s %.2f %.2f\n", images[i].imageFile.c_str(),
+              images[i+1].imageFile.c_str(),
+              translations[i][0][2], -translations[i][1][2]);
+    return 0;
+}
+
+int Synth(int argc, const char *argv[])
+{
+    // Write a synthetic data set with known camera parameters
+    if (argc < 9)
+    {
+        Print("usage: %s outdir nFrames width height f k1 k2 [name=value ...]\n", argv[1]);
+        return -1;
+    }
+    const char *outdir = argv[2];
+    CSynthParams params;
+    params.nFrames = atoi(argv[3]);
+    params.width   = atoi(argv[4]);
+    params.height  = atoi(argv[5]);
+    params.f  = (float) atof(argv[6]);
+    params.k1 = (float) atof(argv[7]);
+    params.k2 = (float) atof(argv[8]);
+    for (int i = 9; i < argc; i++)
+    {
+        const char *eq = strchr(argv[i], '=');
+        string name(argv[i], eq ? eq - argv[i] : strlen(argv[i]));
+        const char *value = eq ? eq + 1 : "";
+        if (name == "overlap")
+            params.overlap = (float) atof(value);
+        else if (name == "features")
+            params.nFeatures = atoi(value);
+        else if (name == "outliers")
+            params.outlierRate = (float) atof(value);
+        else if (name == "noise")
+            params.noise = (float) atof(value);
+        else if (name == "seed")
+            params.seed = (unsigned int) atoi(value);
+        else if (name == "source")
+            params.source = value;
+        else
+            throw CError("%s: unknown parameter %s\n", argv[1], argv[i]);
+    }
+    Synthesize(outdir, params, SharedPool());
+    return 0;
+}
+
+// The options of serve, which its clients' commands start from
+static CCommandOptions serverOptions;
+
+static int ServedCommand(int argc, const char *argv[], string &output)
+{
+    return CapturedCommand(argc, argv, output, serverOptions);
+}
+
+int Serve(int argc, const char *argv[], const CCommandOptions &options)
+{
+    // Run the commands sent by clients, keeping the threads and caches warm
+    if (argc < 3)
+    {
+        Print("usage: %s socket\n", argv[1]);
+        return -1;
+    }
+    if (CThreadPool::Current() != 0)
+        throw CError("%s: can't be run from another command\n", argv[1]);
+    SetCacheLimits((size_t) 1024 << 20, (size_t) 512 << 20);
+    serverOptions = options;
+    ServeCommands(argv[2], ServedCommand, SharedPool());
+    return 0;
+}
+
+int Client(int argc, const char *argv[])
+{
+    // Send a command to the server, and print its output
+    if (argc < 4)
+    {
+        Print("usage: %s socket command ...\n", argv[1]);
+        return -1;
+    }
+    string output;
+    int code = SendCommand(argv[2], argc - 3, argv + 3, output);
+    Print("%s", output.c_str());
+    return code;
+}
+
+static int SplitLine(char *line, const char *argv[], int maxArgs)
+{
+    // Split a command line into (null terminated) arguments, in place
+    char *ptr = line;
+    int argc;
+    for (argc = 0; argc < maxArgs && *ptr; argc++)
+    {
+        while (*ptr && isspace(*ptr)) ptr++;
+        argv[argc] = ptr;
+        while (*ptr && !isspace(*ptr)) ptr++;
+        if (*ptr)
+            *ptr++ = 0;     // null terminate the argument
+    }
+    return argc;
+}
+
+// Files read and written by a script command (used for read-ahead and
+//  for the dependencies between commands)
+
+enum EFileKind
+{
+    eOtherFile,         // not read ahead
+    eImageFile,         // Targa image (ReadFile)
+    eFeatureFile,       // FeatureSet::load
+    eSiftFeatureFile,   // FeatureSet::load_sift
+    ePairListFile,      // blendPairs list of images
+    eImageListFile      // stitch list of images, features and matches
+};
+
+struct CCommandFile
+{
+    string name;
+    EFileKind kind;
+};
+
+static bool CommandFiles(int argc, const char *argv[],
+                         vector<CCommandFile> &inputs, vector<string> &outputs)
+{
+    // Returns false for commands whose files are unknown
+    CCommandFile in;
+    if (argc >= 5 && strcmp(argv[1], "sphrWarp") == 0)
+    {
+        // Only Targa files:  the other formats are read with FLTK
+        in.name = argv[2], in.kind = IsTargaFile(argv[2]) ? eImageFile : eOtherFile;
+        inputs.push_back(in);
+        outputs.push_back(argv[3]);
+    }
+    else if (argc >= 7 && strcmp(argv[1], "alignPair") == 0)
+    {
+        bool sift = (argc >= 8) && (strcmp(argv[7], "sift") == 0);
+        for (int i = 2; i <= 3; i++)
+        {
+            in.name = argv[i], in.kind = sift ? eSiftFeatureFile : eFeatureFile;
+            inputs.push_back(in);
+        }
+        in.name = argv[4], in.kind = eOtherFile;
+        inputs.push_back(in);
+    }
+    else if (argc >= 5 && strcmp(argv[1], "blendPairs") == 0)
+    {
+        in.name = argv[2], in.kind = ePairListFile;
+        inputs.push_back(in);
+        outputs.push_back(argv[3]);
+    }
+    else if (argc >= 10 && strcmp(argv[1], "stitch") == 0)
+    {
+        in.name = argv[2], in.kind = eImageListFile;
+        inputs.push_back(in);
+        outputs.push_back(argv[3]);
+    }
+    else
+        return false;
+    return true;
+}
+
+static bool ListedFiles(const CCommandFile &list, vector<string> &names)
+{
+    // The files named in a pair list or image list (false if unreadable)
+    FILE *stream = fopen(list.name.c_str(), "r");
+    if (stream == 0)
+        return false;
+    char line[1024], name[3][1024];
+    while (fgets(line, 1024, stream))
+    {
+        int n = sscanf(line, "%s %s %s", name[0], name[1], name[2]);
+        if (n <= 0 || (name[0][0] == '/' && name[0][1] == '/'))
+            continue;
+        if (list.kind == ePairListFile)
+            n = min(n, 2);  // (the rest of the line is the translation)
+        for (int i = 0; i < n; i++)
+            names.push_back(name[i]);
+    }
+    fclose(stream);
+    return true;
+}
+
+static void ReadAhead(vector<string> &lines, int current, CReadAheads &readAheads)
+{
+    // Prefetch the inputs of the commands following the current one,
+    //  except for files that a command before them has yet to write
+    int end = min((int) lines.size(), current + 1 + scriptLookahead);
+    set<string> unwritten;
+    for (int i = current; i < end; i++)
+    {
+        if (lines[i][0] == '/' && lines[i][1] == '/')
+            continue;
+        char line[1024];
+        const char *argv2[256];
+        strncpy(line, lines[i].c_str(), 1023), line[1023] = 0;
+        int argc2 = SplitLine(line, argv2, 256);
+
+        vector<CCommandFile> inputs;
+        vector<string> outputs;
+        CommandFiles(argc2, argv2, inputs, outputs);
+        for (int j = 0; i > current && j < (int) inputs.size(); j++)
+        {
+            const char *name = inputs[j].name.c_str();
+            if (unwritten.count(inputs[j].name))
+                continue;
+            if (inputs[j].kind == eImageFile)
+                readAheads.Image(name);
+            else if (inputs[j].kind == eFeatureFile || inputs[j].kind == eSiftFeatureFile)
+                readAheads.Features(name, inputs[j].kind == eSiftFeatureFile);
+            else if (inputs[j].kind == ePairListFile)
+            {
+                vector<string> images;
+                ListedFiles(inputs[j], images);
+                for (int k = 0; k < (int) images.size(); k++)
+                    if (! unwritten.count(images[k]))
+                        readAheads.Image(images[k].c_str());
+            }
+        }
+        unwritten.insert(outputs.begin(), outputs.end());
+    }
+}
+
+// A script command, and its place in the dependency graph
+struct CScriptCommand
+{
+    string echo;            // its line, and the comment lines before it
+    string line;            // the command itself (without annotations)
+    vector<int> dependents; // later commands waiting for this one
+    int nWaiting;           // earlier commands it is waiting for
+    bool done;              // has finished
+    int code;               // return code
+    string output;          // buffered output
+};
+
+static void AddDependency(vector<CScriptCommand> &commands, int before, int after)
+{
+    if (before < 0 || before >= after)
+        return;
+    vector<int> &d = commands[before].dependents;
+    if (d.empty() || d.back() != after)     // (not already added)
+    {
+        d.push_back(after);
+        commands[after].nWaiting += 1;
+    }
+}
+
+static void ParseScript(vector<string> &lines, vector<CScriptCommand> &commands,
+                        string &trailer)
+{
+    // Split the script into commands, and make each command wait for the
+    //  earlier ones that write its inputs, or read or write its outputs
+    map<string, int> writer;            // last command to write each file
+    map<string, vector<int> > readers;  // commands reading it since then
+    int barrier = -1;                   // last command everything waits for
+    bool barrierNext = false;           // the next command is a barrier
+    string echo;
+    for (int l = 0; l < (int) lines.size(); l++)
+    {
+        echo += lines[l];
+        if (lines[l][0] == '/' && lines[l][1] == '/')
+        {
+            if (strncmp(lines[l].c_str(), "//barrier", 9) == 0)
+                barrierNext = true;
+            continue;   // skip the comment line
+        }
+
+        // Split off any "// reads f1 f2 ... writes f3 ..." annotation
+        string text = lines[l], note;
+        for (size_t p = text.find("//"); p != string::npos; p = text.find("//", p+2))
+        {
+            if (p > 0 && isspace(text[p-1]))
+            {
+                note = text.substr(p+2), text.erase(p);
+                break;
+            }
+        }
+        char line[1024];
+        const char *argv2[256];
+        strncpy(line, text.c_str(), 1023), line[1023] = 0;
+        int argc2 = SplitLine(line, argv2, 256);
+        if (argc2 < 2)
+            continue;
+
+        int i = (int) commands.size();
+        CScriptCommand c;
+        c.echo = echo, c.line = text;
+        c.nWaiting = 0, c.done = false, c.code = 0;
+        commands.push_back(c);
+        echo.clear();
+
+        vector<CCommandFile> inputs;
+        vector<string> outputs, reads;
+        bool known = CommandFiles(argc2, argv2, inputs, outputs);
+        for (int j = 0; j < (int) inputs.size(); j++)
+        {
+            reads.push_back(inputs[j].name);
+            if (inputs[j].kind == ePairListFile || inputs[j].kind == eImageListFile)
+            {
+                // (a list written by the script can't be read yet)
+                if (writer.count(inputs[j].name) || ! ListedFiles(inputs[j], reads))
+                    known = false;
+            }
+        }
+        char noteLine[1024];
+        const char *words[256];
+        strncpy(noteLine, note.c_str(), 1023), noteLine[1023] = 0;
+        int nWords = SplitLine(noteLine, words, 256);
+        vector<string> *annotated = 0;
+        for (int j = 0; j < nWords; j++)
+        {
+            if (strcmp(words[j], "reads") == 0)
+                annotated = &reads;
+            else if (strcmp(words[j], "writes") == 0)
+                annotated = &outputs;
+            else if (annotated)
+                annotated->push_back(words[j]);
+        }
+
+        // Commands that can't be analyzed (and //barrier) wait for, and
+        //  are waited for by, everything else
+        if (! known || barrierNext)
+        {
+            for (int j = max(barrier, 0); j < i; j++)
+                AddDependency(commands, j, i);
+            barrier = i, barrierNext = false;
+            writer.clear(), readers.clear();
+            continue;
+        }
+        AddDependency(commands, barrier, i);
+        for (int j = 0; j < (int) reads.size(); j++)
+            if (writer.count(reads[j]))
+                AddDependency(commands, writer[reads[j]], i);
+        for (int j = 0; j < (int) outputs.size(); j++)
+        {
+            if (writer.count(outputs[j]))
+                AddDependency(commands, writer[outputs[j]], i);
+            vector<int> &r = readers[outputs[j]];
+            for (int k = 0; k < (int) r.size(); k++)
+                AddDependency(commands, r[k], i);
+        }
+        for (int j = 0; j < (int) reads.size(); j++)
+            readers[reads[j]].push_back(i);
+        for (int j = 0; j < (int) outputs.size(); j++)
+            writer[outputs[j]] = i, readers[outputs[j]].clear();
+    }
+    trailer = echo;
+}
+
+static int RunScript(vector<CScriptCommand> &commands, const string &trailer,
+                     const CCommandOptions &options)
+{
+    // Run the commands on a pool of threads as their dependencies finish.
+    //  Each command's output is buffered, and printed (after its echoed
+    //  line) once all of the commands before it have been printed, so the
+    //  output is the same as running them one after the other.  After a
+    //  failure, the commands before the failing one still run but later
+    //  ones that have not started are skipped (and none of their output is
+    //  printed), and the script returns the code of the first failure.
+    //  At most --jobs commands run at once;  the others wait their turn in
+    //  script order.
+    int n = (int) commands.size();
+    int failed = n;         // first command that failed
+    int printed = 0;        // commands printed so far
+    int running = 0;        // commands started and not yet finished
+    set<int> ready;         // commands waiting only for a free job
+    mutex scriptMutex;
+    CTaskGroup group(SharedPool());
+
+    function<void(int)> run;
+    auto startReady = [&]()
+    {
+        vector<int> next;
+        {
+            lock_guard<mutex> lock(scriptMutex);
+            while (! ready.empty() && (options.scriptJobs <= 0 ||
+                                        running < options.scriptJobs))
+            {
+                int i = *ready.begin();
+                ready.erase(ready.begin());
+                if (i < failed)
+                    next.push_back(i), running++;
+            }
+        }
+        for (int j = 0; j < (int) next.size(); j++)
+            run(next[j]);
+    };
+    run = [&](int i)
+    {
+        group.Run([&, i]()
+        {
+            char line[1024];
+            const char *argv2[256];
+            strncpy(line, commands[i].line.c_str(), 1023), line[1023] = 0;
+            int argc2 = SplitLine(line, argv2, 256);
+
+            string output;
+            int code;
+            {
+                CTraceScope trace("script command", "command", i);
+                code = CapturedCommand(argc2, argv2, output, options);
+            }
+
+            {
+                lock_guard<mutex> lock(scriptMutex);
+                CScriptCommand &c = commands[i];
+                c.output.swap(output), c.code = code, c.done = true;
+                running--;
+                if (code != 0 && i < failed)
+                    failed = i;
+                for (int j = 0; j < (int) c.dependents.size(); j++)
+                {
+                    int d = c.dependents[j];
+                    if (--commands[d].nWaiting == 0 && d < failed)
+                        ready.insert(d);
+                }
+                for (; printed < n && printed <= failed && commands[printed].done; printed++)
+                {
+                    fputs(commands[printed].echo.c_str(), stderr);
+                    fputs(commands[printed].output.c_str(), stdout);
+                    fflush(stdout);
+                }
+            }
+            startReady();
+        });
+    };
+    for (int i = 0; i < n; i++)
+        if (commands[i].nWaiting == 0)
+            ready.insert(i);
+    startReady();
+    group.Wait();
+
+    if (failed < n)
+        return commands[failed].code;
+    fputs(trailer.c_str(), stderr);
+    return 0;
+}
+
+int Script(int argc, const char *argv[], const CCommandOptions &options)
 {
     // Read a series of commands from a script file
     //  (an alternative to a shell-level command file)
     if (argc < 3)
     {
-        printf("usage: %s script.cmd\n", argv[1]);
+        Print("usage: %s script.cmd\n", argv[1]);
         return -1;
     }
     FILE *stream = fopen(argv[2], "r");
     if (stream == 0)
         throw CError("Could not open %s", argv[2]);
 
-    // Process each command line
+    // Read the whole script first, so that the inputs of the upcoming
+    //  commands can be read ahead while the current one runs
+    vector<string> lines;
     char line[1024];
     while (fgets(line, 1024, stream))
+        lines.push_back(line);
+    fclose(stream);
+
+    // Run independent commands in parallel (but not in a script that is
+    //  itself one of the commands of a parallel script)
+    if (options.scriptJobs != 1 && CThreadPool::Current() == 0)
     {
-        fprintf(stderr, line);
+        vector<CScriptCommand> commands;
+        string trailer;
+        ParseScript(lines, commands, trailer);
+        return RunScript(commands, trailer, options);
+    }
+
+    // Process each command line
+    CReadAheads readAheads;
+    for (int i = 0; i < (int) lines.size(); i++)
+    {
+        strcpy(line, lines[i].c_str());
+        fputs(line, stderr);
         if (line[0] == '/' && line[1] == '/')
             continue;   // skip the comment line
-        char *ptr = line;
-        char *argv2[256];
-        int argc2;
-        for (argc2 = 0; argc2 < 256 && *ptr; argc2++)
-        {
-            while (*ptr && isspace(*ptr)) ptr++;
-            argv2[argc2] = ptr;
-            while (*ptr && !isspace(*ptr)) ptr++;
-            if (*ptr)
-                *ptr++ = 0;     // null terminate the argument
-        }
+        char *note = strstr(line, " //");
+        if (note)
+            *note = 0;  // (dependency annotations)
+        const char *argv2[256];
+        int argc2 = SplitLine(line, argv2, 256);
         if (argc2 < 2)
             continue;
 
+        ReadAhead(lines, i, readAheads);
+
         // Call the dispatch routine
-        int code = main(argc2, (const char **) argv2);
+        int code = Command(argc2, argv2, options, false);
         if (code)
             return code;
     }
-    fclose(stream);
     return 0;
 }
 
-int main(int argc, const char *argv[])
+static void ProcessWideOption(const char *option, bool topLevel)
 {
-	// This lets us load various image formats.
-	fl_register_images();
+    // Options that set up the whole process can't be changed by the
+    //  commands running in it
+    if (! topLevel)
+        throw CError("%s is only allowed on the command line, not in a script or client command\n",
+                     option);
+}
+
+static int ParseOptions(int argc, const char *argv[], CCommandOptions &options,
+                        bool topLevel)
+{
+    // Strip off the options that precede the command name
+    int i = 1;
+    while (i < argc && strncmp(argv[i], "--", 2) == 0)
+    {
+        if (strcmp(argv[i], "--io-threads") == 0 && i+1 < argc)
+            ProcessWideOption(argv[i], topLevel), ioThreads = max(0, atoi(argv[i+1])), i += 2;
+        else if (strcmp(argv[i], "--threads") == 0 && i+1 < argc)
+        {
+            ProcessWideOption(argv[i], topLevel);
+            if (! SetParallelThreads(atoi(argv[i+1])))
+                throw CError("--threads: the worker pool already has %d threads\n",
+                             ParallelThreads());
+            i += 2;
+        }
+        else if (strcmp(argv[i], "--jobs") == 0 && i+1 < argc)
+            options.scriptJobs = max(0, atoi(argv[i+1])), i += 2;
+        else if (strcmp(argv[i], "--profile") == 0)
+            ProcessWideOption(argv[i], topLevel), ProfileEnable(true), i += 1;
+        else if (strcmp(argv[i], "--profile-json") == 0 && i+1 < argc)
+        {
+            ProcessWideOption(argv[i], topLevel);
+            ProfileEnable(true), profileJSONFile = argv[i+1], i += 2;
+        }
+        else if (strcmp(argv[i], "--trace") == 0 && i+1 < argc)
+            ProcessWideOption(argv[i], topLevel), TraceEnable(true), traceFile = argv[i+1], i += 2;
+        else if (strcmp(argv[i], "--estimate-memory") == 0)
+            options.estimateMemory = true, i += 1;
+        else if (strcmp(argv[i], "--gain") == 0)
+            options.gainCompensation = true, i += 1;
+        else if (strcmp(argv[i], "--crop") == 0)
+            options.cropWarps = true, i += 1;
+        else if (strcmp(argv[i], "--warp-store") == 0 && i+1 < argc)
+            ProcessWideOption(argv[i], topLevel), warpStoreDir = argv[i+1], i += 2;
+        else if (strcmp(argv[i], "--warp-store-mb") == 0 && i+1 < argc)
+            ProcessWideOption(argv[i], topLevel), warpStoreMB = max(0, atoi(argv[i+1])), i += 2;
+        else if (strcmp(argv[i], "--vignetting") == 0 && i+2 < argc)
+        {
+            options.vignetting[0] = (float) atof(argv[i+1]);
+            options.vignetting[1] = (float) atof(argv[i+2]);
+            i += 3;
+        }
+        else if (strcmp(argv[i], "--isa") == 0 && i+1 < argc)
+        {
+            ProcessWideOption(argv[i], topLevel);
+            if (! LimitISA(argv[i+1]))
+                throw CError("unknown instruction set %s\n", argv[i+1]);
+            i += 2;
+        }
+        else
+            throw CError("unknown option %s\n", argv[i]);
+    }
+    for (int j = i; j < argc; j++)
+        argv[j-i+1] = argv[j];
+    return argc - (i-1);
+}
+
+static void ReportProfile(void)
+{
+    if (profileJSONFile == 0)
+    {
+        ProfileReport(stderr);
+        return;
+    }
+    FILE *stream = fopen(profileJSONFile, "w");
+    if (stream == 0)
+    {
+        fprintf(stderr, "ReportProfile: could not open %s\n", profileJSONFile);
+        return;
+    }
+    ProfileReport(stream, true);
+    fclose(stream);
+}
+
+static int Command(int argc, const char *argv[], CCommandOptions options,
+                   bool topLevel)
+{
+	// Run a command, with the options it inherits (from its script or
+	//  server) and those before its name (topLevel:  the process's own)
 	try
 	{
+		argc = ParseOptions(argc, argv, options, topLevel);
+		if (topLevel)
+			SetWarpStore(warpStoreDir, warpStoreMB << 20);
+
 		// Branch to processing code based on first argument
 		if (argc > 1 && strcmp(argv[1], "sphrWarp") == 0)
-			return SphrWarp(argc, argv);
+			return SphrWarp(argc, argv, options);
 		else if (argc > 1 && strcmp(argv[1], "alignPair") == 0)
 			return AlignPair(argc, argv);
 		else if (argc > 1 && strcmp(argv[1], "blendPairs") == 0)
-			return BlendPairs(argc, argv);
+			return BlendPairs(argc, argv, options);
+		else if (argc > 1 && strcmp(argv[1], "stitch") == 0)
+			return StitchImages(argc, argv, options);
 		else if (argc > 1 && strcmp(argv[1], "script") == 0)
-			return Script(argc, argv);
+			return Script(argc, argv, options);
+		else if (argc > 1 && strcmp(argv[1], "synth") == 0)
+			return Synth(argc, argv);
+		else if (argc > 1 && strcmp(argv[1], "serve") == 0)
+			return Serve(argc, argv, options);
+		else if (argc > 1 && strcmp(argv[1], "client") == 0)
+			return Client(argc, argv);
 		else {
-			printf("usage: \n");
-	        printf("	%s sphrWarp input.tga output.tga f [k1 k2]\n", argv[0]);
-			printf("	%s alignPair input1.f input2.f matchfile nRANSAC RANSACthresh [sift]\n", argv[0]);
-			printf("	%s blendPairs pairlist.txt outimg.tga blendWidth\n", argv[0]);
-			printf("	%s script script.cmd\n", argv[0]);
+			Print("usage: \n");
+			Print("	%s [--io-threads n] [--threads n] [--jobs n] [--profile] [--profile-json file] [--trace file] [--estimate-memory] [--isa name] command ...\n", argv[0]);
+	        Print("	%s sphrWarp input.tga output.tga f [k1 k2]\n", argv[0]);
+			Print("	%s alignPair input1.f input2.f matchfile nRANSAC RANSACthresh [sift]\n", argv[0]);
+			Print("	%s blendPairs pairlist.txt outimg.tga blendWidth\n", argv[0]);
+			Print("	%s stitch imagelist.txt outimg.tga f k1 k2 nRANSAC RANSACthresh blendWidth [sift]\n", argv[0]);
+			Print("	%s script script.cmd\n", argv[0]);
+			Print("	%s serve socket\n", argv[0]);
+			Print("	%s client socket command ...\n", argv[0]);
+			Print("	%s synth outdir nFrames width height f k1 k2 [name=value ...]\n", argv[0]);
 		}
     }
     catch (CError &err) {
-        printf(err.message);
+        Print("%s", err.message);
         return -1;
     }
     return 0;
 }
+
+int main(int argc, const char *argv[])
+{
+	// This lets us load various image formats.
+	fl_register_images();
+	if (getenv("PANORAMA_TRACE") && *getenv("PANORAMA_TRACE"))
+		TraceEnable(true), traceFile = getenv("PANORAMA_TRACE");
+	if (getenv("PANORAMA_WARP_STORE") && *getenv("PANORAMA_WARP_STORE"))
+		warpStoreDir = getenv("PANORAMA_WARP_STORE");
+	if (getenv("PANORAMA_ISA") && *getenv("PANORAMA_ISA") && ! LimitISA(getenv("PANORAMA_ISA")))
+	{
+		fprintf(stderr, "unknown instruction set %s in PANORAMA_ISA\n", getenv("PANORAMA_ISA"));
+		return -1;
+	}
+	int code = Command(argc, argv, CCommandOptions(), true);
+
+	// Report the time spent in each stage
+	if (ProfileEnabled())
+		ReportProfile();
+	if (TraceEnabled() && ! TraceWrite(traceFile))
+		fprintf(stderr, "could not write trace %s\n", traceFile);
+	return code;
+}
 bool LoadImageFile(const char *filename, CByteImage &image)
 {
 	// Load the query image.
-	printf("%s\n", filename);
+	Print("%s\n", filename);
+	return ReadAnyImage(filename, image, true);
+}
+
+static bool ReadImageQuietly(const char *filename, CByteImage &image)
+{
+	// (for stitch, whose pipeline threads don't capture the command's output)
+	return ReadAnyImage(filename, image, false);
+}
+
+static bool ReadAnyImage(const char *filename, CByteImage &image, bool verbose)
+{
+	if (ImageLoader().Take(filename, image))
+		return true;    // already read ahead by Script
+
+	// (FLTK is not thread-safe, and images are read from several threads
+	//  by stitch and by parallel scripts)
+	static mutex flMutex;
+	unique_lock<mutex> lock(flMutex, defer_lock);
+	{
+		CTraceScope trace("wait for FLTK");
+		lock.lock();
+	}
 	Fl_Shared_Image *fl_image = Fl_Shared_Image::get(filename);
 
 	if (fl_image == NULL) {
-		printf("TGA\n");
+		lock.unlock();
+		if (verbose)
+			Print("TGA\n");
 		ReadFile(image, filename);
 		return true;
 	} else {
-		printf("Not TGA\n");
+		if (verbose)
+			Print("Not TGA\n");
 		CShape sh(fl_image->w(), fl_image->h(), 4);
+		CMemoryTag tag(eMemImage);
 		image = CByteImage(sh);
 
 	    // Convert the image to the CImage format.
 	    if (!convertImage(fl_image, image)) {
-		    printf("couldn't convert image to RGB format\n");
+		    if (verbose)
+			    Print("couldn't convert image to RGB format\n");
 		    return false;
 	    }
 
@@ -425,22 +1360,12 @@ void convertToByteImage(CFloatImage &floatImage, CByteImage &byteImage) {
 
     assert(floatImage.Shape().nBands == min(byteImage.Shape().nBands, 3));
 	for (int y=0; y<sh.height; y++) {
-		for (int x=0; x<sh.width; x++) {
-			for (int c=0; c<sh.nBands; c++) {
-				float value = floor(255*floatImage.Pixel(x,y,c) + 0.5f);
-
-				if (value < byteImage.MinVal()) {
-					value = byteImage.MinVal();
-				}
-				else if (value > byteImage.MaxVal()) {
-					value = byteImage.MaxVal();
-				}
-
-				// We have to flip the image and reverse the color
-				// channels to get it to come out right.  How silly!
-				byteImage.Pixel(x,sh.height-y-1,sh.nBands-c-1) = (uchar) value;
-			}
-		}
+		// We have to flip the image and reverse the color
+		// channels to get it to come out right.  How silly!
+		// (rounds 255*value and clips to [0, 255], see Convert.h)
+		FloatToByteLine(&floatImage.Pixel(0,y,0), sh.nBands,
+						&byteImage.Pixel(0,sh.height-y-1,0), byteImage.Shape().nBands,
+						sh.width, true);
 	}
 }
 
@@ -451,22 +1376,11 @@ void convertToFloatImage(CByteImage &byteImage, CFloatImage &floatImage) {
 
     assert(floatImage.Shape().nBands == min(byteImage.Shape().nBands, 3));
 	for (int y=0; y<sh.height; y++) {
-		for (int x=0; x<sh.width; x++) {
-			for (int c=0; c<min(3,sh.nBands); c++) {
-				float value = byteImage.Pixel(x,y,c) / 255.0f;
-
-				if (value < floatImage.MinVal()) {
-					value = floatImage.MinVal();
-				}
-				else if (value > floatImage.MaxVal()) {
-					value = floatImage.MaxVal();
-				}
-
-				// We have to flip the image and reverse the color
-				// channels to get it to come out right.  How silly!
-				floatImage.Pixel(x,sh.height-y-1,min(3,sh.nBands)-c-1) = value;
-			}
-		}
+		// We have to flip the image and reverse the color
+		// channels to get it to come out right.  How silly!
+		ByteToFloatLine(&byteImage.Pixel(0,y,0), sh.nBands,
+						&floatImage.Pixel(0,sh.height-y-1,0), floatImage.Shape().nBands,
+						sh.width, true);
 	}
 }
 
@@ -490,6 +1404,17 @@ bool convertImage(const Fl_Image *image, CByteImage &convertedImage) {
 
 	int index = 0;
 
+	if (d == 3) {
+		// Otherwise, use the first 3:  flip the image and reverse
+		// the color channels (RGB -> BGRA)
+		int nBands = convertedImage.Shape().nBands;
+		for (int y=0; y<h; y++) {
+			uchar *src = (uchar *) data[0] + y*w*d;
+			SwapRBLine(src, d, &convertedImage.Pixel(0,h-y-1,0), nBands, w, 255);
+		}
+		return true;
+	}
+
 	for (int y=0; y<h; y++) {
 		for (int x=0; x<w; x++) {
 			if (d < 3) {
@@ -499,12 +1424,6 @@ bool convertImage(const Fl_Image *image, CByteImage &convertedImage) {
 				convertedImage.Pixel(x,y,1) = data[0][index];
 				convertedImage.Pixel(x,y,2) = data[0][index];
 			}
-			else if (d == 3) {
-				// Otherwise, use the first 3.
-				convertedImage.Pixel(x,h-y-1,2) = data[0][index];
-				convertedImage.Pixel(x,h-y-1,1) = data[0][index+1];
-				convertedImage.Pixel(x,h-y-1,0) = data[0][index+2];
-			}
 
 			index += d;
 		}
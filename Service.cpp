@@ -0,0 +1,245 @@
+///////////////////////////////////////////////////////////////////////////
+//
+// NAME
+//  Service.cpp -- run commands on behalf of clients in a long-running process
+//
+// SEE ALSO
+//  Service.h           longer description
+//
+///////////////////////////////////////////////////////////////////////////
+
+#include "ImageLib/ImageLib.h"
+#include "Service.h"
+
+#ifndef WIN32
+#include <poll.h>
+#include <signal.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <time.h>
+#include <unistd.h>
+#endif
+
+using namespace std;
+
+#ifdef WIN32
+
+void ServeCommands(const char *socketPath, CommandFn run, CThreadPool &pool)
+{
+    throw CError("serve: local sockets are not supported on this platform\n");
+}
+
+int SendCommand(const char *socketPath, int argc, const char *argv[],
+                string &output)
+{
+    throw CError("client: local sockets are not supported on this platform\n");
+}
+
+#else
+
+static const int maxRequest = 64 * 1024;    // longest command line
+static const int requestTimeout = 30;       // seconds to send the command in
+
+static int OpenSocket(const char *socketPath, sockaddr_un &address)
+{
+    if (strlen(socketPath) >= sizeof(address.sun_path))
+        throw CError("socket name %s is too long\n", socketPath);
+    memset(&address, 0, sizeof(address));
+    address.sun_family = AF_UNIX;
+    strcpy(address.sun_path, socketPath);
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0)
+        throw CError("could not create a socket for %s\n", socketPath);
+    return fd;
+}
+
+static void WriteAll(int fd, const string &text)
+{
+    // (a client that has gone away is not an error for the server)
+    for (size_t done = 0; done < text.size(); )
+    {
+        ssize_t n = write(fd, text.data() + done, text.size() - done);
+        if (n <= 0)
+            return;
+        done += n;
+    }
+}
+
+static string ReadAll(int fd, size_t limit, bool toNewline)
+{
+    string text;
+    char buffer[4096];
+    while (text.size() < limit)
+    {
+        ssize_t n = read(fd, buffer, sizeof(buffer));
+        if (n <= 0)
+            break;
+        text.append(buffer, n);
+        if (toNewline && text.find('\n') != string::npos)
+            break;
+    }
+    return text;
+}
+
+static vector<string> RequestWords(string request)
+{
+    // Split the command line (up to its newline) into words
+    vector<string> words;
+    size_t end = request.find('\n');
+    if (end != string::npos)
+        request.erase(end);
+    for (size_t p = 0; (p = request.find_first_not_of(" \t\r", p)) != string::npos; )
+    {
+        size_t q = request.find_first_of(" \t\r", p);
+        words.push_back(request.substr(p, q == string::npos ? string::npos : q - p));
+        p = q;
+    }
+    return words;
+}
+
+static void RunRequest(int fd, const vector<string> &words, CommandFn run)
+{
+    // Run the command, and answer the client
+    vector<const char *> argv(1, "Panorama");
+    for (int i = 0; i < (int) words.size(); i++)
+        argv.push_back(words[i].c_str());
+
+    string output;
+    int code;
+    try
+    {
+        code = run((int) argv.size(), &argv[0], output);
+    }
+    catch (std::exception &err)
+    {
+        output += string(err.what()) + "\n";
+        code = -1;
+    }
+    char status[32];
+    sprintf(status, "%d\n", code);
+    WriteAll(fd, status + output);
+    close(fd);
+}
+
+struct CClientRequest
+{
+    int fd;                     // client's connection
+    string text;                // what it has sent so far
+    time_t deadline;            // when it is dropped if still incomplete
+};
+
+static bool ReadRequest(CClientRequest &client)
+{
+    // Read what the client has sent (poll says there is something);  true
+    //  once the request is complete (a newline, the end, or too long)
+    char buffer[4096];
+    ssize_t n = read(client.fd, buffer, sizeof(buffer));
+    if (n <= 0)
+        return true;
+    client.text.append(buffer, n);
+    return client.text.find('\n') != string::npos || client.text.size() >= (size_t) maxRequest;
+}
+
+void ServeCommands(const char *socketPath, CommandFn run, CThreadPool &pool)
+{
+    // Replace only a socket left behind by a server that was killed
+    struct stat status;
+    if (lstat(socketPath, &status) == 0 && ! S_ISSOCK(status.st_mode))
+        throw CError("serve: %s exists and is not a socket\n", socketPath);
+    sockaddr_un address;
+    int server = OpenSocket(socketPath, address);
+    unlink(socketPath);
+    if (bind(server, (sockaddr *) &address, sizeof(address)) != 0 ||
+        listen(server, 64) != 0)
+    {
+        close(server);
+        throw CError("serve: could not listen on %s\n", socketPath);
+    }
+    signal(SIGPIPE, SIG_IGN);   // (clients that disconnect early)
+
+    // Accept connections and read their requests here, waiting for all of
+    //  them at once, so that a client that is slow to send its request
+    //  holds up no one else;  only complete requests are run on the pool
+    CTaskGroup group(pool);
+    vector<CClientRequest> clients;
+    int quitClient = -1;        // the client that sent "quit"
+    while (quitClient < 0)
+    {
+        vector<pollfd> fds(1 + clients.size());
+        fds[0].fd = server, fds[0].events = POLLIN, fds[0].revents = 0;
+        for (int i = 0; i < (int) clients.size(); i++)
+            fds[i+1].fd = clients[i].fd, fds[i+1].events = POLLIN, fds[i+1].revents = 0;
+        poll(&fds[0], fds.size(), 1000);    // (a second, to drop the slow ones)
+
+        // Run the requests that are complete, and drop the clients whose
+        //  time is up
+        time_t now = time(0);
+        for (int i = (int) clients.size() - 1; i >= 0; i--)
+        {
+            CClientRequest &client = clients[i];
+            bool complete = (fds[i+1].revents != 0) && ReadRequest(client);
+            if (! complete && now < client.deadline)
+                continue;
+            vector<string> words = RequestWords((complete) ? client.text : "");
+            int fd = client.fd;
+            clients.erase(clients.begin() + i);
+            if (words.empty())
+                close(fd);      // (gone, sent nothing, or timed out)
+            else if (words[0] == "quit" && quitClient < 0)
+                quitClient = fd;
+            else if (words[0] == "quit")
+                WriteAll(fd, "0\n"), close(fd);
+            else
+                group.Run([fd, words, run]() { RunRequest(fd, words, run); });
+        }
+
+        if (fds[0].revents & POLLIN)
+        {
+            int fd = accept(server, 0, 0);
+            if (fd >= 0)
+            {
+                CClientRequest client = {fd, string(), now + requestTimeout};
+                clients.push_back(client);
+            }
+        }
+    }
+
+    // Stop listening, let the commands in progress finish, and answer
+    //  the client that asked to quit
+    for (int i = 0; i < (int) clients.size(); i++)
+        close(clients[i].fd);
+    close(server);
+    group.Wait();
+    WriteAll(quitClient, "0\n");
+    close(quitClient);
+    unlink(socketPath);
+}
+
+int SendCommand(const char *socketPath, int argc, const char *argv[],
+                string &output)
+{
+    sockaddr_un address;
+    int fd = OpenSocket(socketPath, address);
+    if (connect(fd, (sockaddr *) &address, sizeof(address)) != 0)
+    {
+        close(fd);
+        throw CError("client: could not connect to %s (is the server running?)\n", socketPath);
+    }
+
+    string request;
+    for (int i = 0; i < argc; i++)
+        request += string(i ? " " : "") + argv[i];
+    WriteAll(fd, request + "\n");
+    shutdown(fd, SHUT_WR);
+
+    string reply = ReadAll(fd, string::npos, false);
+    close(fd);
+    size_t end = reply.find('\n');
+    if (end == string::npos)
+        throw CError("client: no reply from %s\n", socketPath);
+    output = reply.substr(end + 1);
+    return atoi(reply.c_str());
+}
+
+#endif
@@ -0,0 +1,57 @@
+///////////////////////////////////////////////////////////////////////////
+//
+// NAME
+//  Service.h -- run commands on behalf of clients in a long-running process
+//
+// SPECIFICATION
+//  void ServeCommands(const char *socketPath, CommandFn run, CThreadPool &pool);
+//  int SendCommand(const char *socketPath, int argc, const char *argv[],
+//                  string &output);
+//
+// PARAMETERS
+//  socketPath          name of the local (Unix domain) socket
+//  run                 runs one command, returning its exit code and
+//                      appending what it prints to output
+//  pool                threads the commands are run on
+//  argc, argv          command to run (argv[0] is the command name)
+//  output              the command's output (returned)
+//
+// DESCRIPTION
+//  ServeCommands listens on socketPath and runs the command sent by each
+//  client on the pool, so that several commands can be in progress at
+//  once.  Everything the process has set up (the thread pool and the
+//  caches of warp fields and feature sets, see Stitch.h) stays warm
+//  between commands.  It returns when a client sends "quit", once the
+//  commands in progress have finished.  The commands are read by the
+//  thread that accepts the connections, which waits for all of the
+//  clients at once, and only complete commands are handed to the pool,
+//  so a client that is slow to send its command holds up no one else;
+//  one that hasn't sent it within 30 seconds is dropped.  A socket left
+//  behind at socketPath by a server that was killed is replaced, but any
+//  other file there is an error.
+//
+//  SendCommand connects to the socket, sends one command and waits for
+//  its output;  it returns the command's exit code.
+//
+//  The protocol is one line of whitespace separated words from the
+//  client, answered by a line holding the exit code followed by the
+//  command's output.  File names are taken relative to the directory
+//  the server was started in.
+//
+//  Local sockets are not available on Windows, where both routines
+//  throw a CError.
+//
+// SEE ALSO
+//  Service.cpp         implementation
+//  ThreadPool.h        thread pool
+//
+///////////////////////////////////////////////////////////////////////////
+
+#include <string>
+
+typedef int (*CommandFn)(int argc, const char *argv[], std::string &output);
+
+void ServeCommands(const char *socketPath, CommandFn run, CThreadPool &pool);
+
+int SendCommand(const char *socketPath, int argc, const char *argv[],
+                std::string &output);
@@ -0,0 +1,517 @@
+///////////////////////////////////////////////////////////////////////////
+//
+// NAME
+//  Stitch.cpp -- warp, align and blend a sequence of images in memory
+//
+// DESCRIPTION
+//  The images go through a pipeline (see Pipeline.h) of four stages:
+//  one thread reads the feature sets in order and hands them to the
+//  aligner, which aligns each pair as soon as its second feature set is
+//  in and chains the pairwise translations into mosaic positions, while
+//  two readers decode the images and hand them to one warper per pool
+//  thread.  Alignment thus overlaps the reading and warping of the
+//  remaining images, and decoding overlaps warping;  the bounded queue
+//  between the readers and the warpers keeps the readers from running
+//  far ahead.  The mosaic is blended once the pipeline has finished.
+//
+//  Warp fields and feature sets are kept in small least-recently-used
+//  caches bounded by their size in bytes, so that the commands of a
+//  long-running process (see Service.h) don't recompute or reread them.
+//
+// SEE ALSO
+//  Stitch.h            longer description of parameters
+//
+///////////////////////////////////////////////////////////////////////////
+
+#include "ImageLib/ImageLib.h"
+#include "WarpSpherical.h"
+#include "FeatureAlign.h"
+#include "BlendImages.h"
+#include "GainCompensation.h"
+#include "WarpStore.h"
+#include "Stitch.h"
+#include <float.h>
+#include <math.h>
+#include <sys/stat.h>
+#include <atomic>
+#include <list>
+#include <mutex>
+
+#ifdef IMAGELIB_X86
+#include <immintrin.h>
+#endif
+
+bool ReadFeatureMatches(const char *filename, vector<FeatureMatch> &matches)
+{
+    FILE *f = fopen(filename, "r");
+
+    if (f == NULL)
+        return false;
+
+    int num_matches;
+    fscanf(f, "%d\n", &num_matches);
+
+    matches.resize(num_matches);
+
+    for (int i = 0; i < num_matches; i++) {
+        FeatureMatch match;
+
+        int id1, id2;
+        double score;
+        fscanf(f, "%d %d %lf\n", &id1, &id2, &score);
+
+        match.id1 = id1;
+        match.id2 = id2;
+        match.score = score;
+        matches[i] = match;
+    }
+
+    fclose(f);
+    return true;
+}
+
+//
+//  SIMD descriptor matching.
+//
+//  The descriptors of f2 are packed in blocks of eight, transposed so
+//  that element k of the eight descriptors is contiguous, and each
+//  descriptor of f1 is compared with the eight of a block at once.  Each
+//  lane adds up its squared differences in the same order as the scalar
+//  loop, so the distances are bit-identical;  a block is abandoned once
+//  every lane is out of the running (checked every eight elements), and
+//  the lanes are then ranked in order, so the matches are the same too.
+//  All of the descriptors must be of the same length.
+//
+
+#ifdef IMAGELIB_X86
+
+static const int matchBlock = 8;        // descriptors compared at once
+
+static IMAGELIB_TARGET_AVX2 void BlockDistancesAVX2(const double *d1, const double *block,
+                                                    int dim, double second, double dist[])
+{
+    __m256d s0 = _mm256_setzero_pd(), s1 = _mm256_setzero_pd();
+    __m256d limit = _mm256_set1_pd(second);
+    for (int k = 0; k < dim; k++, block += matchBlock)
+    {
+        __m256d v = _mm256_set1_pd(d1[k]);
+        __m256d d0 = _mm256_sub_pd(v, _mm256_loadu_pd(block));
+        __m256d d1 = _mm256_sub_pd(v, _mm256_loadu_pd(block + 4));
+        s0 = _mm256_add_pd(s0, _mm256_mul_pd(d0, d0));
+        s1 = _mm256_add_pd(s1, _mm256_mul_pd(d1, d1));
+        if ((k & 7) == 7 &&
+            _mm256_movemask_pd(_mm256_or_pd(_mm256_cmp_pd(s0, limit, _CMP_LT_OQ),
+                                            _mm256_cmp_pd(s1, limit, _CMP_LT_OQ))) == 0)
+            break;
+    }
+    _mm256_storeu_pd(dist, s0);
+    _mm256_storeu_pd(dist + 4, s1);
+}
+
+IMAGELIB_AVX512_BEGIN
+
+static IMAGELIB_TARGET_AVX512 void BlockDistancesAVX512(const double *d1, const double *block,
+                                                        int dim, double second, double dist[])
+{
+    __m512d s = _mm512_setzero_pd();
+    __m512d limit = _mm512_set1_pd(second);
+    for (int k = 0; k < dim; k++, block += matchBlock)
+    {
+        // (the _round forms stop the compiler fusing the multiply and add)
+        __m512d d = _mm512_sub_pd(_mm512_set1_pd(d1[k]), _mm512_loadu_pd(block));
+        s = _mm512_add_round_pd(s, _mm512_mul_round_pd(d, d, _MM_FROUND_CUR_DIRECTION),
+                                _MM_FROUND_CUR_DIRECTION);
+        if ((k & 7) == 7 && _mm512_cmp_pd_mask(s, limit, _CMP_LT_OQ) == 0)
+            break;
+    }
+    _mm512_storeu_pd(dist, s);
+}
+
+IMAGELIB_AVX512_END
+
+static bool MatchFeaturesSIMD(const FeatureSet &f1, const FeatureSet &f2,
+                              vector<FeatureMatch> &matches, double ratio)
+{
+    bool avx512 = CpuHas(eCpuAVX512);
+    if (! (avx512 || CpuHas(eCpuAVX2)) || f1.empty() || f2.empty())
+        return false;
+    int dim = (int) f1[0].data.size();
+    for (int i = 0; i < (int) f1.size(); i++)
+        if ((int) f1[i].data.size() != dim)
+            return false;
+    for (int j = 0; j < (int) f2.size(); j++)
+        if ((int) f2[j].data.size() != dim)
+            return false;
+
+    // Pack f2 (the unused lanes of the last block are never ranked)
+    int n2 = (int) f2.size(), nBlocks = (n2 + matchBlock - 1) / matchBlock;
+    vector<double> packed((size_t) nBlocks * dim * matchBlock, 0.0);
+    for (int j = 0; j < n2; j++)
+        for (int k = 0; k < dim; k++)
+            packed[((size_t) (j / matchBlock) * dim + k) * matchBlock + j % matchBlock] =
+                f2[j].data[k];
+
+    for (int i = 0; i < (int) f1.size(); i++)
+    {
+        const double *d1 = (dim > 0) ? &f1[i].data[0] : 0;
+        double best = DBL_MAX, second = DBL_MAX;
+        int bestIndex = -1;
+        for (int b = 0; b < nBlocks; b++)
+        {
+            double dist[matchBlock];
+            const double *block = &packed[(size_t) b * dim * matchBlock];
+            if (avx512)
+                BlockDistancesAVX512(d1, block, dim, second, dist);
+            else
+                BlockDistancesAVX2(d1, block, dim, second, dist);
+            for (int l = 0; l < matchBlock && b * matchBlock + l < n2; l++)
+            {
+                if (dist[l] < best)
+                    second = best, best = dist[l], bestIndex = b * matchBlock + l;
+                else if (dist[l] < second)
+                    second = dist[l];
+            }
+        }
+        if (bestIndex >= 0 && best <= ratio * ratio * second)
+        {
+            FeatureMatch match;
+            match.id1 = i + 1;
+            match.id2 = bestIndex + 1;
+            match.score = sqrt(best);
+            matches.push_back(match);
+        }
+    }
+    return true;
+}
+
+#else
+
+static bool MatchFeaturesSIMD(const FeatureSet &f1, const FeatureSet &f2,
+                              vector<FeatureMatch> &matches, double ratio)
+{
+    return false;
+}
+
+#endif
+
+void MatchFeatures(const FeatureSet &f1, const FeatureSet &f2,
+                   vector<FeatureMatch> &matches, double ratio)
+{
+    // For each feature in f1, find the two closest descriptors in f2
+    //  (squared distances, abandoning a candidate once it is out of the running)
+    matches.clear();
+    if (MatchFeaturesSIMD(f1, f2, matches, ratio))
+        return;
+    for (int i = 0; i < (int) f1.size(); i++)
+    {
+        const vector<double> &d1 = f1[i].data;
+        double best = DBL_MAX, second = DBL_MAX;
+        int bestIndex = -1;
+        for (int j = 0; j < (int) f2.size(); j++)
+        {
+            const vector<double> &d2 = f2[j].data;
+            if (d2.size() != d1.size())
+                continue;
+            double dist = 0.0;
+            for (int k = 0; k < (int) d1.size() && dist < second; k++)
+            {
+                double d = d1[k] - d2[k];
+                dist += d * d;
+            }
+            if (dist < best)
+                second = best, best = dist, bestIndex = j;
+            else if (dist < second)
+                second = dist;
+        }
+
+        // Keep the match if it is clearly better than the runner up
+        if (bestIndex >= 0 && best <= ratio * ratio * second)
+        {
+            FeatureMatch match;
+            match.id1 = i + 1;      // (ids are 1-based, see FeatureSet.h)
+            match.id2 = bestIndex + 1;
+            match.score = sqrt(best);
+            matches.push_back(match);
+        }
+    }
+}
+
+template <class T>
+class CCacheOf
+{
+    // The most recently used items, up to a total size in bytes
+public:
+    CCacheOf(size_t limit) : m_limit(limit), m_size(0) {}
+    void SetLimit(size_t limit)
+    {
+        lock_guard<mutex> lock(m_mutex);
+        m_limit = limit;
+        Trim();
+    }
+    bool Find(const string &key, T &item)
+    {
+        lock_guard<mutex> lock(m_mutex);
+        for (typename list<CEntry>::iterator e = m_entries.begin(); e != m_entries.end(); e++)
+        {
+            if (e->key == key)
+            {
+                m_entries.splice(m_entries.begin(), m_entries, e);
+                item = e->item;
+                return true;
+            }
+        }
+        return false;
+    }
+    void Insert(const string &key, const T &item, size_t size)
+    {
+        lock_guard<mutex> lock(m_mutex);
+        if (size > m_limit)
+            return;
+        CEntry entry = {key, item, size};
+        m_entries.push_front(entry);
+        m_size += size;
+        Trim();
+    }
+private:
+    struct CEntry
+    {
+        string key;
+        T item;
+        size_t size;
+    };
+    void Trim()
+    {
+        while (m_size > m_limit && ! m_entries.empty())
+        {
+            m_size -= m_entries.back().size;
+            m_entries.pop_back();
+        }
+    }
+    mutex m_mutex;
+    list<CEntry> m_entries;     // most recently used first
+    size_t m_limit;             // limit on the total size
+    size_t m_size;              // total size of the entries
+};
+
+// Version of the warp fields CachedWarpField computes, part of the key
+//  of each field so that fields kept in the warp store by an older build
+//  are misses;  bump it whenever WarpSphericalField, CropWarpField or
+//  the row extents change what they compute.
+static const int warpFieldVersion = 1;
+
+struct CCachedField
+{
+    CFloatImage uv;             // warp field
+    CRowExtents extents;        // spans of its rows
+};
+
+static CCacheOf<CCachedField> warpFields(256 << 20);
+static CCacheOf<FeatureSet> featureSets(0);
+
+void SetCacheLimits(size_t warpFieldBytes, size_t featureBytes)
+{
+    warpFields.SetLimit(warpFieldBytes);
+    featureSets.SetLimit(featureBytes);
+}
+
+CFloatImage CachedWarpField(CShape sh, float f, float k1, float k2,
+                            const CTransform3x3 &r, float v1, float v2, bool crop,
+                            CRowExtents *extents)
+{
+    char key[512];
+    sprintf(key, "spherical v%d %d %d %.9g %.9g %.9g %.9g %.9g %d", warpFieldVersion,
+            sh.width, sh.height, f, k1, k2, v1, v2, (int) crop);
+    for (int i = 0; i < 3; i++)
+        for (int j = 0; j < 3; j++)
+            sprintf(key + strlen(key), " %.17g", r[i][j]);
+
+    CCachedField field;
+    if (! warpFields.Find(key, field))
+    {
+        // (one field at a time, so that threads warping images of the same
+        //  size wait for the field rather than all computing it)
+        static mutex computeMutex;
+        lock_guard<mutex> lock(computeMutex);
+        if (! warpFields.Find(key, field))
+        {
+            // (fields computed by other runs are in the store, if any)
+            if (! LoadWarpMap(key, field.uv, field.extents))
+            {
+                CWarpBounds bounds;
+                field.uv = WarpSphericalField(sh, sh, f, k1, k2, r, v1, v2, &bounds);
+                field.extents = bounds.rows;
+                if (crop)
+                {
+                    field.uv = CropWarpField(field.uv, bounds);
+                    CShape cropShape = field.uv.Shape();
+                    field.extents = CropRowExtents(bounds.rows, field.uv.origin[0],
+                                                   field.uv.origin[1],
+                                                   cropShape.width, cropShape.height);
+                }
+                SaveWarpMap(key, field.uv, field.extents);
+            }
+            CShape uvShape = field.uv.Shape();
+            warpFields.Insert(key, field,
+                              (size_t) uvShape.width * uvShape.height * uvShape.nBands * sizeof(float) +
+                              field.extents.x0.size() * 2 * sizeof(int));
+        }
+    }
+    if (extents != 0)
+        *extents = field.extents;
+    return field.uv;
+}
+
+static long ModificationNanoseconds(const struct stat &info)
+{
+    // (to tell apart versions of a file written within the same second)
+#if defined(WIN32)
+    return 0;
+#elif defined(__APPLE__)
+    return info.st_mtimespec.tv_nsec;
+#else
+    return info.st_mtim.tv_nsec;
+#endif
+}
+
+bool LoadFeatureSet(FeatureSet &features, const char *filename, bool sift)
+{
+    // The key includes the modification time and size, so edited files
+    //  are reread
+    struct stat info;
+    if (stat(filename, &info) != 0)
+        return false;
+    char stamp[96];
+    sprintf(stamp, "%s %lld.%09ld %lld:", sift ? "sift" : "f", (long long) info.st_mtime,
+            ModificationNanoseconds(info), (long long) info.st_size);
+    string key = string(stamp) + filename;
+    if (featureSets.Find(key, features))
+        return true;
+
+    bool ok = sift ? features.load_sift(filename) : features.load(filename);
+    if (ok)
+    {
+        size_t size = 0;
+        for (int i = 0; i < (int) features.size(); i++)
+            size += sizeof(Feature) + features[i].data.size() * sizeof(double);
+        featureSets.Insert(key, features, size);
+    }
+    return ok;
+}
+
+// Items handed from stage to stage
+struct CFeatureItem
+{
+    int index;
+    FeatureSet features;
+};
+
+struct CImageItem
+{
+    int index;
+    CByteImage image;
+};
+
+vector<CTransform3x3> Stitch(const vector<CStitchImage> &images,
+                             const CStitchParams &params,
+                             CImageSink &sink, CThreadPool &pool)
+{
+    int n = (int) images.size();
+    if (n < 2)
+        throw CError("stitch: at least two images are needed");
+    CParallelScope parallelScope(pool);
+
+    CPipeline pipeline(&pool);
+    int nWorkers = pool.NThreads();
+    CRingQueueOf<CFeatureItem> features(4);
+    CSharedQueueOf<CImageItem> decoded(2 * nWorkers);
+    CImagePositionV ipList(n);
+    vector<CTransform3x3> translations;
+
+    // Read the feature sets in order
+    int nextFeatures = 0;
+    pipeline.Source("read features", 1, features, [&](CFeatureItem &item)
+    {
+        if (nextFeatures >= n)
+            return false;
+        item.index = nextFeatures++;
+        const CStitchImage &in = images[item.index];
+        CTraceScope trace("read features", "image", item.index);
+        if (! LoadFeatureSet(item.features, in.featureFile.c_str(), params.sift))
+            throw CError("stitch: could not read %s\n", in.featureFile.c_str());
+        return true;
+    });
+
+    // Align each pair as soon as its features are in, chaining the
+    //  pairwise translations into mosaic positions
+    FeatureSet previous;
+    pipeline.Sink("align", 1, features, [&](CFeatureItem &item)
+    {
+        int i = item.index - 1;
+        if (i < 0)
+        {
+            ipList[0].position = CTransform3x3::Translation(0.0, 0.0);
+            previous.swap(item.features);
+            return;
+        }
+        CTraceScope trace("align", "image", i);
+        vector<FeatureMatch> matches;
+        if (images[i].matchFile.empty())
+            MatchFeatures(previous, item.features, matches);
+        else if (! ReadFeatureMatches(images[i].matchFile.c_str(), matches))
+            throw CError("stitch: could not read %s\n", images[i].matchFile.c_str());
+
+        CTransform3x3 M;
+        alignPair(previous, item.features, matches,
+                  eTranslate, 0.0f, params.nRANSAC, params.RANSACthresh, M);
+
+        // Same convention as alignPair's output read back by blendPairs
+        //  (SIFT keypoints have y pointing up)
+        CTransform3x3 T = CTransform3x3::Translation(
+            (float) M[0][2], (float) (params.sift ? M[1][2] : -M[1][2]));
+        ipList[i+1].position = ipList[i].position * T;
+        translations.push_back(T);
+        previous.swap(item.features);
+    });
+
+    // Read the images (in order, by whichever reader is free) ...
+    std::atomic<int> nextImage(0);
+    pipeline.Source("read images", min(2, nWorkers), decoded, [&](CImageItem &item)
+    {
+        item.index = nextImage++;
+        if (item.index >= n)
+            return false;
+        const CStitchImage &in = images[item.index];
+        CTraceScope trace("read image", "image", item.index);
+        if (params.loadImage == 0)
+            ReadFile(item.image, in.imageFile.c_str());
+        else if (! params.loadImage(in.imageFile.c_str(), item.image))
+            throw CError("stitch: could not read %s\n", in.imageFile.c_str());
+        return true;
+    });
+
+    // ... and warp them into spherical coordinates
+    pipeline.Sink("warp", nWorkers, decoded, [&](CImageItem &item)
+    {
+        CTraceScope trace("warp", "image", item.index);
+        CImagePosition &ip = ipList[item.index];
+        CFloatImage uv = CachedWarpField(item.image.Shape(), params.f,
+                                         params.k1, params.k2, CTransform3x3(),
+                                         params.v1, params.v2, params.cropWarps,
+                                         &ip.extents);
+        WarpLocal(item.image, ip.img, uv, false, eWarpInterpLinear, 1.0f, &ip.extents);
+    });
+
+    pipeline.Run();
+
+    // A cropped image starts at its origin in the full warp
+    for (int i = 0; i < n; i++)
+        if (ipList[i].img.origin[0] != 0 || ipList[i].img.origin[1] != 0)
+            ipList[i].position = ipList[i].position *
+                CTransform3x3::Translation((float) ipList[i].img.origin[0],
+                                           (float) ipList[i].img.origin[1]);
+
+    if (params.gainCompensation)
+        CompensateGains(ipList);
+    BlendImages(ipList, params.blendWidth, sink);
+    return translations;
+}
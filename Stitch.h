@@ -0,0 +1,125 @@
+///////////////////////////////////////////////////////////////////////////
+//
+// NAME
+//  Stitch.h -- warp, align and blend a sequence of images in memory
+//
+// SPECIFICATION
+//  vector<CTransform3x3> Stitch(const vector<CStitchImage> &images,
+//              const CStitchParams &params, CImageSink &sink, CThreadPool &pool);
+//  bool ReadFeatureMatches(const char *filename, vector<FeatureMatch> &matches);
+//  void MatchFeatures(const FeatureSet &f1, const FeatureSet &f2,
+//                     vector<FeatureMatch> &matches, double ratio);
+//  CFloatImage CachedWarpField(CShape sh, float f, float k1, float k2,
+//                              const CTransform3x3 &r, float v1, float v2,
+//                              bool crop, CRowExtents *extents);
+//  bool LoadFeatureSet(FeatureSet &features, const char *filename, bool sift);
+//  void SetCacheLimits(size_t warpFieldBytes, size_t featureBytes);
+//
+// PARAMETERS
+//  images              input images, in panorama order, each with its
+//                      feature file and (optionally) a match file relating
+//                      its features to those of the next image
+//  params              camera, alignment and blending parameters
+//  sink                destination for the rows of the mosaic
+//  pool                threads of the parallel loops of the kernels that
+//                      Stitch calls;  its size is also the number of
+//                      warper threads
+//  matches             correspondences between f1 and f2
+//  ratio               maximum ratio of the best to the second best
+//                      descriptor distance for a match to be kept
+//  crop                crop the field to the pixels that have a source
+//  extents             returns the span of the pixels of each row of the
+//                      field that have a source (0 = not wanted)
+//  warpFieldBytes      memory kept for warp fields (default 256MB)
+//  featureBytes        memory kept for feature sets (default 0)
+//
+// DESCRIPTION
+//  Stitch runs the whole sphrWarp / alignPair / blendPairs sequence
+//  without any intermediate files, as a pipeline of stages (see
+//  Pipeline.h):  image readers hand the images to warpers, which warp
+//  them into spherical coordinates (the warp field is computed once for
+//  each image size and shared), while a feature reader hands the feature
+//  sets to an aligner, which aligns each pair as soon as its two feature
+//  sets are available.  The warped images stay in memory and are blended
+//  into sink once everything has been aligned (after their exposures are
+//  balanced, if params.gainCompensation is set;  see GainCompensation.h).
+//  The translation of each image
+//  relative to the previous one is returned (in the same convention as
+//  the positions that blendPairs builds from a pair list).
+//
+//  Pairs without a match file are matched with MatchFeatures, a brute-
+//  force nearest neighbour search over the feature descriptors using the
+//  ratio test (comparing eight descriptors at once with AVX2 or AVX-512,
+//  if the processor has them, with the same results).
+//
+//  If params.cropWarps is set, each image is warped only over the
+//  bounding box of the pixels that have a source (see CropWarpField in
+//  WarpSpherical.h), and placed in the mosaic by its origin, so the
+//  empty corners of the warps are neither stored nor blended.  Either
+//  way, the spans of the rows of each warp (see RowExtents.h) are kept
+//  with the warped image, so warping, gain compensation and blending
+//  skip the empty parts of each row.
+//
+//  CachedWarpField and LoadFeatureSet are WarpSphericalField and
+//  FeatureSet::load (or load_sift) with a cache of the most recently used
+//  results in front.  CachedWarpField also looks the field up in the
+//  on-disk store of fields shared across runs, if there is one (see
+//  WarpStore.h), follows it by CropWarpField if crop is set, and returns
+//  the row spans relative to the field.  The key of a field includes a
+//  version of the warp computation, so that fields stored by a build
+//  that computed them differently are never reused.  A feature file is reread if its
+//  size or modification time (to the nanosecond, where the file system
+//  records it) has changed since it was cached.  Both are safe to call
+//  from several threads.
+//
+// SEE ALSO
+//  Stitch.cpp          implementation
+//  WarpSpherical.h     spherical warp field
+//  FeatureAlign.h      pairwise alignment
+//  BlendImages.h       mosaic blending
+//  GainCompensation.h  exposure compensation
+//  WarpStore.h         warp fields shared across runs
+//
+///////////////////////////////////////////////////////////////////////////
+
+#include <string>
+#include "FeatureSet.h"
+
+struct CStitchImage
+{
+    string imageFile;       // input image
+    string featureFile;     // its features (in warped image coordinates)
+    string matchFile;       // matches to the next image's features ("" = compute)
+};
+
+struct CStitchParams
+{
+    float f, k1, k2;        // focal length and radial distortion
+    float v1, v2;           // vignetting (0 = none;  see WarpSpherical.h)
+    bool cropWarps;         // warp only the bounding box of each image
+    int nRANSAC;            // number of RANSAC iterations
+    double RANSACthresh;    // RANSAC distance threshold for inliers
+    float blendWidth;       // width of the horizontal blending function
+    bool gainCompensation;  // balance the images' exposures before blending
+    bool sift;              // features are SIFT keypoints
+    bool (*loadImage)(const char *filename, CByteImage &image);
+                            // image reader (0 = ReadFile;  it runs on the
+                            //  pipeline's own threads, so it mustn't print)
+};
+
+vector<CTransform3x3> Stitch(const vector<CStitchImage> &images,
+                             const CStitchParams &params,
+                             CImageSink &sink, CThreadPool &pool);
+
+bool ReadFeatureMatches(const char *filename, vector<FeatureMatch> &matches);
+
+void MatchFeatures(const FeatureSet &f1, const FeatureSet &f2,
+                   vector<FeatureMatch> &matches, double ratio = 0.8);
+
+CFloatImage CachedWarpField(CShape sh, float f, float k1, float k2,
+                            const CTransform3x3 &r, float v1 = 0.0f, float v2 = 0.0f,
+                            bool crop = false, CRowExtents *extents = 0);
+
+bool LoadFeatureSet(FeatureSet &features, const char *filename, bool sift);
+
+void SetCacheLimits(size_t warpFieldBytes, size_t featureBytes);
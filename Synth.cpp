@@ -0,0 +1,401 @@
+///////////////////////////////////////////////////////////////////////////
+//
+// NAME
+//  Synth.cpp -- synthetic panoramas with known camera parameters
+//
+// SEE ALSO
+//  Synth.h             longer description
+//
+///////////////////////////////////////////////////////////////////////////
+
+#include "ImageLib/ImageLib.h"
+#include "FeatureSet.h"
+#include "Synth.h"
+#include <math.h>
+#include <stdio.h>
+#include <string.h>
+#include <vector>
+
+#ifdef WIN32
+#include <direct.h>
+#define MakeDir(dir)    _mkdir(dir)
+#define RemoveDir(dir)  _rmdir(dir)
+#else
+#include <sys/stat.h>
+#include <unistd.h>
+#define MakeDir(dir)    mkdir(dir, 0777)
+#define RemoveDir(dir)  rmdir(dir)
+#endif
+
+using namespace std;
+
+static const double PI = 3.14159265358979323846;
+
+// Random numbers that are the same on every platform (the standard
+//  library's distributions are not)
+
+class CSynthRandom
+{
+public:
+    CSynthRandom(unsigned int seed) : m_state(seed * 2654435761u + 1) {}
+    unsigned int Next(void)
+    {
+        m_state = m_state * 1664525u + 1013904223u;
+        unsigned int x = m_state;
+        x ^= x >> 16, x *= 0x7feb352d, x ^= x >> 15;
+        return x;
+    }
+    double Uniform(void)                // [0, 1)
+    {
+        return (Next() >> 8) * (1.0 / 16777216.0);
+    }
+    double Normal(void)
+    {
+        double u = Uniform() + 1e-12, v = Uniform();
+        return sqrt(-2 * log(u)) * cos(2 * PI * v);
+    }
+
+private:
+    unsigned int m_state;
+};
+
+//
+//  Frame geometry:  a level camera at yaw 0, with radial distortion
+//
+
+static bool Project(double lon, double lat, const CSynthParams &p,
+                    double &x, double &y)
+{
+    // Frame pixel of the direction (lon, lat) (relative to the camera's
+    //  yaw), or false if it is behind the camera or outside the frame
+    double X = sin(lon) * cos(lat), Y = sin(lat), Z = cos(lon) * cos(lat);
+    if (Z <= 0.01)
+        return false;
+    double xu = X / Z, yu = Y / Z;
+    double r2 = xu*xu + yu*yu;
+    double d = 1 + p.k1 * r2 + p.k2 * r2 * r2;
+    x = 0.5 * p.width  + p.f * xu * d;
+    y = 0.5 * p.height + p.f * yu * d;
+    return x >= 0 && x < p.width && y >= 0 && y < p.height;
+}
+
+static CFloatImage RayField(const CSynthParams &p)
+{
+    // (lon, lat) seen by each pixel of a frame at yaw 0
+    CFloatImage rays(CShape(p.width, p.height, 2));
+    for (int y = 0; y < p.height; y++)
+    {
+        float *r = &rays.Pixel(0, y, 0);
+        for (int x = 0; x < p.width; x++, r += 2)
+        {
+            // Undo the radial distortion by fixed-point iteration
+            double xd = (x - 0.5 * p.width) / p.f, yd = (y - 0.5 * p.height) / p.f;
+            double xu = xd, yu = yd;
+            for (int k = 0; k < 20; k++)
+            {
+                double r2 = xu*xu + yu*yu;
+                double d = 1 + p.k1 * r2 + p.k2 * r2 * r2;
+                xu = xd / d, yu = yd / d;
+            }
+            r[0] = (float) atan2(xu, 1.0);
+            r[1] = (float) atan2(yu, sqrt(xu*xu + 1));
+        }
+    }
+    return rays;
+}
+
+//
+//  Procedural panorama:  value noise at several scales, in the pixel
+//  units of the warped frames, wrapping around in longitude
+//
+
+static inline double Lattice(int i, int j, int c, unsigned int seed)
+{
+    unsigned int h = (unsigned int) i * 73856093u ^ (unsigned int) j * 19349663u ^
+                     (unsigned int) c * 83492791u ^ seed * 2654435761u;
+    h ^= h >> 13, h *= 0x5bd1e995, h ^= h >> 15;
+    return (h & 0xffff) / 65535.0;
+}
+
+static double Noise(double u, double v, int period, int c, unsigned int seed)
+{
+    int i = (int) floor(u), j = (int) floor(v);
+    double fu = u - i, fv = v - j;
+    fu = fu * fu * (3 - 2 * fu), fv = fv * fv * (3 - 2 * fv);
+    int i0 = ((i % period) + period) % period, i1 = (i0 + 1) % period;
+    double a = Lattice(i0, j, c, seed),   b = Lattice(i1, j, c, seed);
+    double e = Lattice(i0, j+1, c, seed), d = Lattice(i1, j+1, c, seed);
+    return (a + (b - a) * fu) * (1 - fv) + (e + (d - e) * fu) * fv;
+}
+
+static void ProceduralColor(double lon, double lat, const CSynthParams &p, uchar rgb[3])
+{
+    static const double scales[3] = {96, 24, 6};      // lattice spacing (pixels)
+    static const double weights[3] = {0.55, 0.3, 0.15};
+    double circumference = 2 * PI * p.f;
+    for (int c = 0; c < 3; c++)
+    {
+        double v = 0;
+        for (int s = 0; s < 3; s++)
+        {
+            int period = __max(1, (int) floor(circumference / scales[s] + 0.5));
+            double cell = circumference / period;
+            v += weights[s] * Noise(lon * p.f / cell, lat * p.f / cell, period,
+                                    3*s + c, p.seed);
+        }
+        rgb[c] = (uchar) __max(1, __min(255, (int) (v * 255 + 0.5)));
+    }
+}
+
+static void RenderFrame(double yaw, CFloatImage &rays, CByteImage &source,
+                        const CSynthParams &p, CByteImage &frame)
+{
+    frame.ReAllocate(CShape(p.width, p.height, 4));
+    if (source.Shape().width == 0)
+    {
+        for (int y = 0; y < p.height; y++)
+        {
+            const float *r = &rays.Pixel(0, y, 0);
+            uchar *q = &frame.Pixel(0, y, 0);
+            for (int x = 0; x < p.width; x++, r += 2, q += 4)
+            {
+                ProceduralColor(yaw + r[0], r[1], p, q);
+                q[3] = 255;
+            }
+        }
+        return;
+    }
+
+    // Sample the equirectangular source (which has an extra column that
+    //  repeats its first, so that longitudes wrap around)
+    CShape sh = source.Shape();
+    int W = sh.width - 1, H = sh.height;
+    CFloatImage uv(CShape(p.width, p.height, 2));
+    for (int y = 0; y < p.height; y++)
+    {
+        const float *r = &rays.Pixel(0, y, 0);
+        float *q = &uv.Pixel(0, y, 0);
+        for (int x = 0; x < p.width; x++, r += 2, q += 2)
+        {
+            double u = (yaw + r[0]) / (2 * PI) + 0.5;
+            u -= floor(u);
+            q[0] = (float) (u * W);
+            q[1] = (float) __min((r[1] / PI + 0.5) * H, H - 1.001);
+        }
+    }
+    WarpLocal(source, frame, uv, false, eWarpInterpLinear);
+}
+
+//
+//  Features and matches
+//
+
+struct CSynthPoint
+{
+    double lon, lat;        // direction
+    float descriptor[16];   // descriptor (before the noise of each frame)
+};
+
+struct CSynthFeature
+{
+    int point;              // index of the point
+    int x, y;               // position in the warped frame
+    float descriptor[16];
+};
+
+static void WriteFeatures(const string &name, const vector<CSynthFeature> &features)
+{
+    // The format read by FeatureSet::load
+    FILE *stream = fopen(name.c_str(), "w");
+    if (stream == 0)
+        throw CError("synth: could not write %s\n", name.c_str());
+    fprintf(stream, "%d\n", (int) features.size());
+    for (int i = 0; i < (int) features.size(); i++)
+    {
+        const CSynthFeature &s = features[i];
+        fprintf(stream, "1\n%d\n%d %d\n0\n16\n", i+1, s.x, s.y);
+        for (int k = 0; k < 16; k++)
+            fprintf(stream, "%.4f\n", s.descriptor[k]);
+    }
+    fclose(stream);
+}
+
+static string FileName(const char *dir, const char *base, int i, const char *ext)
+{
+    char name[64];
+    sprintf(name, "/%s%03d.%s", base, i, ext);
+    return dir + string(name);
+}
+
+void Synthesize(const char *dir, const CSynthParams &p, CThreadPool &pool)
+{
+    if (p.nFrames < 2 || p.width < 8 || p.height < 8 || p.f <= 0 ||
+        p.overlap < 0 || p.overlap >= 1)
+        throw CError("synth: invalid parameters\n");
+    MakeDir(dir);
+
+    // Yaw between frames
+    double fov  = 2 * atan(0.5 * p.width / p.f);
+    double vfov = 2 * atan(0.5 * p.height / p.f);
+    double step = fov * (1 - p.overlap);
+    if (step * (p.nFrames - 1) + fov > 2 * PI)
+        throw CError("synth: the frames go more than once around (%d frames)\n", p.nFrames);
+
+    // Source panorama, with the first column repeated at the end
+    CByteImage source;
+    if (! p.source.empty())
+    {
+        CByteImage src;
+        ReadFile(src, p.source.c_str());
+        CShape sh = src.Shape();
+        source.ReAllocate(CShape(sh.width + 1, sh.height, sh.nBands));
+        for (int y = 0; y < sh.height; y++)
+        {
+            memcpy(&source.Pixel(0, y, 0), &src.Pixel(0, y, 0), sh.width * sh.nBands);
+            memcpy(&source.Pixel(sh.width, y, 0), &src.Pixel(0, y, 0), sh.nBands);
+        }
+    }
+
+    // Render the frames in parallel
+    CFloatImage rays = RayField(p);
+    {
+        CTaskGroup group(pool);
+        for (int i = 0; i < p.nFrames; i++)
+            group.Run([&, i]()
+            {
+                CByteImage frame;
+                RenderFrame(i * step, rays, source, p, frame);
+                WriteFile(frame, FileName(dir, "frame", i, "tga").c_str());
+            });
+        group.Wait();
+    }
+
+    // Scatter points over the part of the sphere the frames see
+    CSynthRandom random(p.seed);
+    double lon0 = -0.5 * fov, lon1 = step * (p.nFrames - 1) + 0.5 * fov;
+    int nPoints = (int) (p.nFeatures * (lon1 - lon0) / fov + 0.5);
+    vector<CSynthPoint> points(nPoints);
+    for (int j = 0; j < nPoints; j++)
+    {
+        points[j].lon = lon0 + (lon1 - lon0) * random.Uniform();
+        points[j].lat = asin((2 * random.Uniform() - 1) * sin(0.5 * vfov));
+        for (int k = 0; k < 16; k++)
+            points[j].descriptor[k] = (float) random.Uniform();
+    }
+
+    // Features of each frame:  the points inside it, at their position
+    //  in the warped frame (see WarpSphericalField)
+    vector< vector<CSynthFeature> > features(p.nFrames);
+    vector< vector<int> > featureOf(p.nFrames, vector<int>(nPoints, -1));
+    for (int i = 0; i < p.nFrames; i++)
+    {
+        for (int j = 0; j < nPoints; j++)
+        {
+            double lon = points[j].lon - i * step, lat = points[j].lat, x, y;
+            if (! Project(lon, lat, p, x, y))
+                continue;
+            CSynthFeature s;
+            s.point = j;
+            s.x = (int) floor(0.5 * p.width  + p.f * lon + 0.5);
+            s.y = (int) floor(0.5 * p.height + p.f * lat + 0.5);
+            for (int k = 0; k < 16; k++)
+                s.descriptor[k] = points[j].descriptor[k] + (float) (p.noise * random.Normal());
+            featureOf[i][j] = (int) features[i].size();
+            features[i].push_back(s);
+        }
+        WriteFeatures(FileName(dir, "frame", i, "f"), features[i]);
+    }
+
+    // Matches of each frame to the next, some of them wrong
+    vector<int> nInliers(p.nFrames), nOutliers(p.nFrames);
+    for (int i = 0; i+1 < p.nFrames; i++)
+    {
+        vector<FeatureMatch> matches;
+        for (int a = 0; a < (int) features[i].size(); a++)
+        {
+            int b = featureOf[i+1][features[i][a].point];
+            if (b < 0)
+                continue;
+            int n2 = (int) features[i+1].size();
+            if (n2 > 1 && random.Uniform() < p.outlierRate)
+            {
+                b = (b + 1 + (int) (random.Uniform() * (n2 - 1))) % n2;
+                nOutliers[i]++;
+            }
+            else
+                nInliers[i]++;
+            FeatureMatch m;
+            m.id1 = a + 1, m.id2 = b + 1, m.score = 0;
+            for (int k = 0; k < 16; k++)
+            {
+                double d = features[i][a].descriptor[k] - features[i+1][b].descriptor[k];
+                m.score += d * d;
+            }
+            matches.push_back(m);
+        }
+        string name = FileName(dir, "match", i, "txt");
+        FILE *stream = fopen(name.c_str(), "w");
+        if (stream == 0)
+            throw CError("synth: could not write %s\n", name.c_str());
+        fprintf(stream, "%d\n", (int) matches.size());
+        for (int m = 0; m < (int) matches.size(); m++)
+            fprintf(stream, "%d %d %.4f\n", matches[m].id1, matches[m].id2, matches[m].score);
+        fclose(stream);
+    }
+
+    // Image list, ground-truth pair list, script and camera parameters
+    //  (in the warped frames, each frame is f * step pixels to the right
+    //  of the previous one)
+    string list = dir + string("/images.txt"), pairs = dir + string("/pairs.txt");
+    string script = dir + string("/script.cmd"), truth = dir + string("/truth.txt");
+    FILE *listStream   = fopen(list.c_str(), "w");
+    FILE *pairsStream  = fopen(pairs.c_str(), "w");
+    FILE *scriptStream = fopen(script.c_str(), "w");
+    FILE *truthStream  = fopen(truth.c_str(), "w");
+    if (! listStream || ! pairsStream || ! scriptStream || ! truthStream)
+    {
+        FILE *streams[4] = {listStream, pairsStream, scriptStream, truthStream};
+        for (int k = 0; k < 4; k++)
+            if (streams[k])
+                fclose(streams[k]);
+        throw CError("synth: could not write the lists in %s\n", dir);
+    }
+    fprintf(truthStream, "// f k1 k2 width height\n%g %g %g %d %d\n",
+            p.f, p.k1, p.k2, p.width, p.height);
+    fprintf(truthStream, "// frame yaw pitch roll (degrees)\n");
+    for (int i = 0; i < p.nFrames; i++)
+    {
+        string frame = FileName(dir, "frame", i, "tga");
+        string warp  = FileName(dir, "warp", i, "tga");
+        fprintf(listStream, "%s %s", frame.c_str(), FileName(dir, "frame", i, "f").c_str());
+        if (i+1 < p.nFrames)
+            fprintf(listStream, " %s", FileName(dir, "match", i, "txt").c_str());
+        fprintf(listStream, "\n");
+        if (i+1 < p.nFrames)
+            fprintf(pairsStream, "%s %s %.2f 0.00\n", warp.c_str(),
+                    FileName(dir, "warp", i+1, "tga").c_str(), p.f * step);
+        fprintf(scriptStream, "Panorama sphrWarp %s %s %g %g %g\n",
+                frame.c_str(), warp.c_str(), p.f, p.k1, p.k2);
+        fprintf(truthStream, "%s %.6f 0 0\n", frame.c_str(), i * step * 180 / PI);
+    }
+    fprintf(scriptStream, "Panorama blendPairs %s %s/mosaic.tga %d\n",
+            pairs.c_str(), dir, (int) (0.25 * p.width * p.overlap) + 1);
+    fprintf(truthStream, "// pair inliers outliers\n");
+    for (int i = 0; i+1 < p.nFrames; i++)
+        fprintf(truthStream, "%d %d %d %d\n", i, i+1, nInliers[i], nOutliers[i]);
+    fclose(listStream), fclose(pairsStream), fclose(scriptStream), fclose(truthStream);
+}
+
+void RemoveSynthesized(const char *dir, int nFrames)
+{
+    static const char *lists[] = {"images.txt", "pairs.txt", "script.cmd", "truth.txt"};
+    for (int i = 0; i < nFrames; i++)
+    {
+        remove(FileName(dir, "frame", i, "tga").c_str());
+        remove(FileName(dir, "frame", i, "f").c_str());
+        remove(FileName(dir, "match", i, "txt").c_str());
+    }
+    for (int k = 0; k < 4; k++)
+        remove((dir + string("/") + lists[k]).c_str());
+    RemoveDir(dir);
+}
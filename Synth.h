@@ -0,0 +1,86 @@
+///////////////////////////////////////////////////////////////////////////
+//
+// NAME
+//  Synth.h -- synthetic panoramas with known camera parameters
+//
+// SPECIFICATION
+//  void Synthesize(const char *dir, const CSynthParams &params,
+//                  CThreadPool &pool);
+//  void RemoveSynthesized(const char *dir, int nFrames);
+//
+// PARAMETERS
+//  dir                 directory the data set is written to (created if
+//                      necessary)
+//  params              camera, overlap, feature and outlier parameters
+//  pool                threads used to render the frames
+//
+// DESCRIPTION
+//  Synthesize renders a sequence of overlapping perspective frames, as
+//  taken by a camera of focal length f (in pixels) and radial distortion
+//  k1, k2 turning about its vertical axis, from a panorama given as an
+//  equirectangular (longitude / latitude) image.  The panorama is either
+//  read from params.source or, if that is empty, generated procedurally
+//  (smooth colours with detail at several scales), evaluated directly
+//  for each ray so that no panorama image is ever held in memory.
+//  Successive frames are rotated by the angle that leaves the requested
+//  fraction of a frame's width overlapping.  The frames are level (no
+//  pitch or roll), since the pipeline aligns warped images by a pure
+//  translation.
+//
+//  It also writes the feature sets that a perfect detector would find in
+//  the frames after sphrWarp (points scattered over the panorama, with a
+//  random 16-value descriptor each, plus descriptor noise in every frame)
+//  and the matches between each frame and the next, a given fraction of
+//  which are replaced by wrong matches.  Everything depends only on the
+//  parameters (including the seed), so the data set can be regenerated
+//  exactly.  The files written are
+//
+//      frameNNN.tga        the frames
+//      frameNNN.f          features, in the coordinates of the warped frame
+//      matchNNN.txt        matches of frame NNN to frame NNN+1
+//      images.txt          image list for stitch
+//      pairs.txt           ground-truth pair list for blendPairs (of the
+//                          warped frames, warpNNN.tga)
+//      script.cmd          sphrWarp of each frame followed by blendPairs
+//      truth.txt           f, k1, k2, the yaw, pitch and roll of each
+//                          frame, and the number of inlier and outlier
+//                          matches of each pair
+//
+//  The names in images.txt, pairs.txt and script.cmd include dir, so the
+//  commands can be run from the current directory.  Feature coordinates
+//  are integers (as in the .f format), so they are within half a pixel
+//  of the true positions.
+//
+//  RemoveSynthesized deletes the files Synthesize wrote (and dir, if
+//  nothing else is left in it).
+//
+// SEE ALSO
+//  Synth.cpp           implementation
+//  Stitch.h            stitching a data set in one command
+//
+///////////////////////////////////////////////////////////////////////////
+
+#include <string>
+
+struct CSynthParams
+{
+    int nFrames;            // number of frames
+    int width, height;      // frame size
+    float f, k1, k2;        // focal length and radial distortion
+    float overlap;          // fraction of a frame shared with the next
+    int nFeatures;          // average number of features per frame
+    float outlierRate;      // fraction of the matches that are wrong
+    float noise;            // standard deviation of the descriptor noise
+    unsigned int seed;      // random number seed
+    std::string source;     // equirectangular image (empty = procedural)
+
+    CSynthParams() : nFrames(8), width(640), height(480), f(600), k1(0), k2(0),
+        overlap(0.5f), nFeatures(200), outlierRate(0.2f), noise(0.02f),
+        seed(1) {}
+};
+
+class CThreadPool;
+
+void Synthesize(const char *dir, const CSynthParams &params, CThreadPool &pool);
+
+void RemoveSynthesized(const char *dir, int nFrames);
@@ -38,17 +38,29 @@
  *
  */
 CFloatImage WarpSphericalField(CShape srcSh, CShape dstSh, float f,
-                                 float k1, float k2, const CTransform3x3 &r)
+                                 float k1, float k2, const CTransform3x3 &r,
+                                 float v1, float v2, CWarpBounds *bounds)
 {
-    // Set up the pixel coordinate image
-    dstSh.nBands = 2;
+    CProfileScope scope(eProfWarpSphericalField);
+    CMemoryTag tag(eMemUVField);
+
+    // Set up the pixel coordinate image (and vignetting gains, if any)
+    bool vignetting = (v1 != 0.0f || v2 != 0.0f);
+    dstSh.nBands = (vignetting) ? 3 : 2;
     CFloatImage uvImg(dstSh);   // (u,v) coordinates
 
+    // Spans of the pixels with a source, if wanted (empty to start with)
+    if (bounds != 0)
+    {
+        bounds->rows.x0.assign(dstSh.height, dstSh.width);
+        bounds->rows.x1.assign(dstSh.height, 0);
+    }
+
     // Fill in the values
     for (int y = 0; y < dstSh.height; y++)
     {
         float *uv = &uvImg.Pixel(0, y, 0);
-        for (int x = 0; x < dstSh.width; x++, uv += 2)
+        for (int x = 0; x < dstSh.width; x++, uv += dstSh.nBands)
         {
 			// (x,y) is the spherical image coordinates. 
             // (xf,yf) is the spherical coordinates, e.g., xf is the angle theta
@@ -77,7 +89,53 @@ CFloatImage WarpSphericalField(CShape srcSh, CShape dstSh, float f,
             float yn = 0.5f*srcSh.height + yt*f;
             uv[0] = xn;
             uv[1] = yn;
+
+            // Gain that undoes the fall-off at the (distorted) source radius
+            if (vignetting)
+            {
+                float r2 = xt*xt + yt*yt;
+                float V  = 1.0f + r2 * (v1 + r2 * v2);
+                uv[2] = 1.0f / __max(V, 0.001f);
+            }
+
+            // Widen the row's span if the source pixel is in the image
+            if (bounds != 0 && xn >= 0.0f && xn < srcSh.width &&
+                yn >= 0.0f && yn < srcSh.height)
+            {
+                bounds->rows.x0[y] = __min(bounds->rows.x0[y], x);
+                bounds->rows.x1[y] = __max(bounds->rows.x1[y], x + 1);
+            }
+        }
+    }
+
+    // Bounding box of the rows' spans
+    if (bounds != 0)
+    {
+        bounds->x0 = dstSh.width, bounds->x1 = 0;
+        bounds->y0 = dstSh.height, bounds->y1 = 0;
+        for (int y = 0; y < dstSh.height; y++)
+        {
+            if (bounds->rows.x0[y] >= bounds->rows.x1[y])
+            {
+                bounds->rows.x0[y] = bounds->rows.x1[y] = 0;    // (no pixels)
+                continue;
+            }
+            bounds->x0 = __min(bounds->x0, bounds->rows.x0[y]);
+            bounds->x1 = __max(bounds->x1, bounds->rows.x1[y]);
+            bounds->y0 = __min(bounds->y0, y);
+            bounds->y1 = y + 1;
         }
+        if (bounds->x0 >= bounds->x1)
+            bounds->x0 = bounds->y0 = bounds->x1 = bounds->y1 = 0;
     }
     return uvImg;
 }
+
+CFloatImage CropWarpField(CFloatImage uv, const CWarpBounds &bounds)
+{
+    // (an empty box leaves the field as it is)
+    if (bounds.x0 >= bounds.x1 || bounds.y0 >= bounds.y1)
+        return uv;
+    return uv.SubImage(uv.origin[0] + bounds.x0, uv.origin[1] + bounds.y0,
+                       bounds.x1 - bounds.x0, bounds.y1 - bounds.y0);
+}
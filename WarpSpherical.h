@@ -5,12 +5,18 @@
 //      coordinates and/or undo radial lens distortion
 //
 // SPECIFICATION
-//  CFloatImage WarpSphericalField(CShape sh, float f, float k1, float k2, const CTransform3x3 &r)
+//  CFloatImage WarpSphericalField(CShape srcSh, CShape dstSh, float f,
+//                                 float k1, float k2, const CTransform3x3 &r,
+//                                 float v1 = 0, float v2 = 0, CWarpBounds *bounds = 0)
+//  CFloatImage CropWarpField(CFloatImage uv, const CWarpBounds &bounds)
 // PARAMETERS
-//  sh                  shape of destination image
+//  srcSh               shape of source image
+//  dstSh               shape of destination image
 //  f                   focal length, in pixels
 //  k1, k2              radial distortion parameters
 //  r                   rotation matrix
+//  v1, v2              vignetting parameters (0 = no correction)
+//  bounds              where the destination pixels with a source lie
 //
 // DESCRIPTION
 //  WarpSphericalField produces a pixel coordinate image suitable
@@ -21,6 +27,29 @@
 //  WarpLocal, along with a source and destination image, to actually
 //  perform the warp.
 //
+//  If v1 or v2 is non-zero, the field also undoes lens vignetting:  the
+//  brightness of the source image is taken to fall off as
+//      V(r) = 1 + v1 r^2 + v2 r^4
+//  (v1 < 0 darkens the corners), where r is the distance from the image
+//  centre in units of f (as for k1 and k2), and a third band holding the
+//  gain 1 / V(r) of each destination pixel is added, evaluated with its
+//  source coordinates.  WarpLocal applies the gain as it resamples, so
+//  the photometric correction takes no pass of its own.
+//
+//  The spherical image of a perspective frame is narrower at the top and
+//  bottom than in the middle, so much of a destination the size of the
+//  source is left empty (zero).  If bounds is given, WarpSphericalField
+//  also records, as it computes the coordinates, the bounding box of the
+//  destination pixels whose source lies inside the source image, and the
+//  span [x0, x1) of such pixels in each row (see RowExtents.h;  the spans
+//  travel with the warped image so that later passes skip its empty
+//  parts).  CropWarpField returns the
+//  part of the field inside the bounding box (sharing its memory), with
+//  its origin set to the top-left corner of the box;  WarpLocal passes
+//  the origin on to the warped image, so it holds only the pixels that
+//  have a source and records where they belong in the full warp (an
+//  image placed at M is placed at M * Translation(origin) once cropped).
+//
 // SEE ALSO
 //  WarpSpherical.cpp implementation
 //  WarpImage.h         image warping code
@@ -31,5 +60,15 @@
 //
 ///////////////////////////////////////////////////////////////////////////
 
+struct CWarpBounds
+{
+    int x0, y0, x1, y1;             // bounding box [x0, x1) x [y0, y1)
+    CRowExtents rows;               // span of each row
+};
+
 CFloatImage WarpSphericalField(CShape srcSh, CShape dstSh, float f,
-                                 float k1, float k2, const CTransform3x3 &r);
+                                 float k1, float k2, const CTransform3x3 &r,
+                                 float v1 = 0.0f, float v2 = 0.0f,
+                                 CWarpBounds *bounds = 0);
+
+CFloatImage CropWarpField(CFloatImage uv, const CWarpBounds &bounds);
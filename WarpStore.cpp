@@ -0,0 +1,350 @@
+///////////////////////////////////////////////////////////////////////////
+//
+// NAME
+//  WarpStore.cpp -- an on-disk store of warp fields shared across runs
+//
+// SEE ALSO
+//  WarpStore.h         longer description
+//
+///////////////////////////////////////////////////////////////////////////
+
+#include "ImageLib/ImageLib.h"
+#include "WarpStore.h"
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <algorithm>
+#include <atomic>
+#include <map>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#ifdef WIN32
+#include <windows.h>
+#include <io.h>
+#include <process.h>
+#include <sys/utime.h>
+#define GetPid      _getpid
+#define TouchFile(f) _utime(f, 0)
+#else
+#include <dirent.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#include <utime.h>
+#define GetPid      getpid
+#define TouchFile(f) utime(f, 0)
+#endif
+
+using namespace std;
+
+// Layout of a file:  the header, the key, the row extents (x0 then x1),
+//  and, from dataOffset (a multiple of the page size), the rows of the
+//  field.
+
+// (bump the digit whenever the layout changes)
+static const char warpMapMagic[8] = {'W', 'A', 'R', 'P', 'M', 'A', 'P', '1'};
+static const int warpMapAlign = 1 << 16;    // (Windows' mapping granularity)
+
+struct CWarpMapHeader
+{
+    char magic[8];              // warpMapMagic
+    int width, height, nBands;  // shape of the field
+    int origin[2];              // origin of the field
+    int nRows;                  // rows of the extents (0 = none)
+    int keyLength;              // characters in the key
+    long long dataOffset;       // offset of the field
+    long long fileBytes;        // size of the file
+};
+
+struct CWarpMapping
+{
+    char *base;                 // start of the mapping
+    long long bytes;            // size of the mapping
+};
+
+struct CWarpMappings
+{
+    mutex lock;
+    map<void *, CWarpMapping> fields;   // mapping of each loaded field
+};
+
+static CWarpMappings &Mappings(void)
+{
+    // (never destroyed, since the fields held by static caches, e.g.,
+    //  the one in Stitch.cpp, are only released at exit)
+    static CWarpMappings *mappings = new CWarpMappings;
+    return *mappings;
+}
+
+static mutex storeMutex;
+static string storeDir;             // (empty = no store)
+static long long storeLimit = 0;    // total size of the files kept
+
+void SetWarpStore(const char *dirname, long long maxBytes)
+{
+    lock_guard<mutex> lock(storeMutex);
+    storeDir = (dirname) ? dirname : "";
+    storeLimit = maxBytes;
+}
+
+static long long PrefixBytes(int keyLength, int nRows)
+{
+    // Bytes before the field:  header, key and extents
+    return (long long) sizeof(CWarpMapHeader) + keyLength +
+        2 * (long long) nRows * (long long) sizeof(int);
+}
+
+static string WarpMapFile(const string &dir, const char *key)
+{
+    // Files are named after the (64-bit FNV-1a) hash of their key
+    unsigned long long h = 14695981039346656037ull;
+    for (const char *c = key; *c; c++)
+        h = (h ^ (unsigned char) *c) * 1099511628211ull;
+    char name[32];
+    sprintf(name, "/%016llx.warp", h);
+    return dir + name;
+}
+
+static void UnmapFile(char *base, long long bytes)
+{
+#ifdef WIN32
+    UnmapViewOfFile(base);
+#else
+    munmap(base, (size_t) bytes);
+#endif
+}
+
+static void UnmapWarpMap(void *field)
+{
+    // Release the mapping that holds a field (when its last image goes)
+    CWarpMappings &mappings = Mappings();
+    CWarpMapping mapping;
+    {
+        lock_guard<mutex> lock(mappings.lock);
+        map<void *, CWarpMapping>::iterator m = mappings.fields.find(field);
+        if (m == mappings.fields.end())
+            return;
+        mapping = m->second;
+        mappings.fields.erase(m);
+    }
+    UnmapFile(mapping.base, mapping.bytes);
+}
+
+static char *MapFile(const char *filename, long long &bytes)
+{
+    // Map a whole file, copy-on-write (0 if it can't be)
+    char *base = 0;
+#ifdef WIN32
+    HANDLE file = CreateFileA(filename, GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_DELETE,
+                              0, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, 0);
+    if (file == INVALID_HANDLE_VALUE)
+        return 0;
+    LARGE_INTEGER size;
+    if (GetFileSizeEx(file, &size) && size.QuadPart > 0)
+    {
+        HANDLE mapping = CreateFileMappingA(file, 0, PAGE_WRITECOPY, 0, 0, 0);
+        if (mapping != 0)
+        {
+            base = (char *) MapViewOfFile(mapping, FILE_MAP_COPY, 0, 0, 0);
+            CloseHandle(mapping);   // (the view keeps the mapping alive)
+        }
+        bytes = size.QuadPart;
+    }
+    CloseHandle(file);
+#else
+    int fd = open(filename, O_RDONLY);
+    if (fd < 0)
+        return 0;
+    struct stat info;
+    if (fstat(fd, &info) == 0 && info.st_size > 0)
+    {
+        void *p = mmap(0, (size_t) info.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+        if (p != MAP_FAILED)
+            base = (char *) p;
+        bytes = info.st_size;
+    }
+    close(fd);
+#endif
+    return base;
+}
+
+bool LoadWarpMap(const char *key, CFloatImage &uv, CRowExtents &extents)
+{
+    string filename;
+    {
+        lock_guard<mutex> lock(storeMutex);
+        if (storeDir.empty())
+            return false;
+        filename = WarpMapFile(storeDir, key);
+    }
+    long long bytes = 0;
+    char *base = MapFile(filename.c_str(), bytes);
+    if (base == 0)
+        return false;
+
+    // Check that the file is complete and holds this key
+    CWarpMapHeader header;
+    bool valid = bytes >= (long long) sizeof(header);
+    if (valid)
+    {
+        memcpy(&header, base, sizeof(header));
+        long long fieldBytes = (long long) header.width * header.height *
+            header.nBands * sizeof(float);
+        valid = memcmp(header.magic, warpMapMagic, sizeof(warpMapMagic)) == 0 &&
+            header.fileBytes == bytes && header.width > 0 && header.height > 0 &&
+            header.nBands > 0 && header.nRows >= 0 && header.keyLength >= 0 &&
+            header.dataOffset % warpMapAlign == 0 &&
+            PrefixBytes(header.keyLength, header.nRows) <= header.dataOffset &&
+            header.dataOffset + fieldBytes <= bytes &&
+            header.keyLength == (int) strlen(key) &&
+            memcmp(base + sizeof(header), key, header.keyLength) == 0;
+    }
+    if (! valid)
+    {
+        UnmapFile(base, bytes);
+        return false;
+    }
+
+    // The field is the mapped rows;  the mapping goes with its last image
+    int *rows = (int *) (base + sizeof(header) + header.keyLength);
+    extents.x0.assign(rows, rows + header.nRows);
+    extents.x1.assign(rows + header.nRows, rows + 2 * header.nRows);
+    char *field = base + header.dataOffset;
+    {
+        CWarpMappings &mappings = Mappings();
+        lock_guard<mutex> lock(mappings.lock);
+        CWarpMapping mapping = {base, bytes};
+        mappings.fields[field] = mapping;
+    }
+    CMemoryTag tag(eMemMappedField);
+    uv.ReAllocate(CShape(header.width, header.height, header.nBands), (float *) field,
+                  true, header.width, UnmapWarpMap);
+    uv.origin[0] = header.origin[0];
+    uv.origin[1] = header.origin[1];
+
+    // (the modification time is the time of last use, for eviction)
+    TouchFile(filename.c_str());
+    return true;
+}
+
+struct CStoreFile
+{
+    string name;            // file name
+    long long bytes;        // size
+    long long used;         // time of last use
+    bool operator<(const CStoreFile &f) const { return used < f.used; }
+};
+
+static void ListStore(const string &dir, vector<CStoreFile> &files)
+{
+    // The fields in the store (not the temporary files being written)
+#ifdef WIN32
+    struct _finddata_t found;
+    intptr_t handle = _findfirst((dir + "/*.warp").c_str(), &found);
+    if (handle == -1)
+        return;
+    do
+    {
+        CStoreFile f = {dir + "/" + found.name, (long long) found.size,
+                        (long long) found.time_write};
+        files.push_back(f);
+    } while (_findnext(handle, &found) == 0);
+    _findclose(handle);
+#else
+    DIR *d = opendir(dir.c_str());
+    if (d == 0)
+        return;
+    while (struct dirent *e = readdir(d))
+    {
+        size_t n = strlen(e->d_name);
+        if (n < 5 || strcmp(e->d_name + n - 5, ".warp") != 0)
+            continue;
+        CStoreFile f = {dir + "/" + e->d_name, 0, 0};
+        struct stat info;
+        if (stat(f.name.c_str(), &info) != 0)
+            continue;
+        f.bytes = info.st_size;
+        f.used = info.st_mtime;
+        files.push_back(f);
+    }
+    closedir(d);
+#endif
+}
+
+void SaveWarpMap(const char *key, CFloatImage uv, const CRowExtents &extents)
+{
+    string dir;
+    long long limit;
+    {
+        lock_guard<mutex> lock(storeMutex);
+        dir = storeDir;
+        limit = storeLimit;
+    }
+    CShape sh = uv.Shape();
+    if (dir.empty() || sh.width == 0)
+        return;
+
+    // Lay out the file
+    CWarpMapHeader header;
+    memcpy(header.magic, warpMapMagic, sizeof(warpMapMagic));
+    header.width  = sh.width;
+    header.height = sh.height;
+    header.nBands = sh.nBands;
+    header.origin[0] = uv.origin[0];
+    header.origin[1] = uv.origin[1];
+    header.nRows = (int) extents.x0.size();
+    header.keyLength = (int) strlen(key);
+    long long prefix = PrefixBytes(header.keyLength, header.nRows);
+    header.dataOffset = (prefix + warpMapAlign - 1) / warpMapAlign * warpMapAlign;
+    long long rowBytes = (long long) sh.width * sh.nBands * sizeof(float);
+    header.fileBytes = header.dataOffset + rowBytes * sh.height;
+    if (header.fileBytes > limit)
+        return;
+
+    // Write it under a temporary name (unique to this call, since other
+    //  threads may be saving the same key), then rename it into place
+    static std::atomic<unsigned> nextTemp(0);
+    string filename = WarpMapFile(dir, key);
+    char suffix[64];
+    sprintf(suffix, ".%d.%u.tmp", (int) GetPid(), nextTemp++);
+    string temp = filename + suffix;
+    FILE *stream = fopen(temp.c_str(), "wb");
+    if (stream == 0)
+        return;
+    vector<char> prefixBytes((size_t) header.dataOffset, 0);
+    char *p = &prefixBytes[0];
+    memcpy(p, &header, sizeof(header));
+    memcpy(p + sizeof(header), key, header.keyLength);
+    if (header.nRows > 0)
+    {
+        memcpy(p + sizeof(header) + header.keyLength, &extents.x0[0],
+               header.nRows * sizeof(int));
+        memcpy(p + sizeof(header) + header.keyLength + header.nRows * sizeof(int),
+               &extents.x1[0], header.nRows * sizeof(int));
+    }
+    bool ok = fwrite(p, 1, prefixBytes.size(), stream) == prefixBytes.size();
+    for (int y = 0; y < sh.height && ok; y++)
+        ok = fwrite(&uv.Pixel(0, y, 0), 1, (size_t) rowBytes, stream) == (size_t) rowBytes;
+    ok = (fclose(stream) == 0) && ok;
+    if (! ok || rename(temp.c_str(), filename.c_str()) != 0)
+    {
+        remove(temp.c_str());
+        return;
+    }
+
+    // Remove the least recently used fields beyond the limit
+    vector<CStoreFile> files;
+    ListStore(dir, files);
+    sort(files.begin(), files.end());
+    long long total = 0;
+    for (size_t i = 0; i < files.size(); i++)
+        total += files[i].bytes;
+    for (size_t i = 0; i < files.size() && total > limit; i++)
+    {
+        if (files[i].name == filename)
+            continue;
+        if (remove(files[i].name.c_str()) == 0)
+            total -= files[i].bytes;
+    }
+}
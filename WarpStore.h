@@ -0,0 +1,60 @@
+///////////////////////////////////////////////////////////////////////////
+//
+// NAME
+//  WarpStore.h -- an on-disk store of warp fields shared across runs
+//
+// SPECIFICATION
+//  void SetWarpStore(const char *dirname, long long maxBytes);
+//  bool LoadWarpMap(const char *key, CFloatImage &uv, CRowExtents &extents);
+//  void SaveWarpMap(const char *key, CFloatImage uv,
+//                   const CRowExtents &extents);
+//
+// PARAMETERS
+//  dirname             directory of the store (0 or "" = no store)
+//  maxBytes            total size of the store's files kept
+//  key                 description of the field:  the projection, the
+//                      version of its computation, the image shape and
+//                      the lens parameters (see CachedWarpField in
+//                      Stitch.h)
+//  uv                  warp field (see WarpSphericalField)
+//  extents             span of the pixels of each row of uv that have a
+//                      source (see RowExtents.h)
+//
+// DESCRIPTION
+//  A rig uses only a few lens and camera combinations, so the same warp
+//  fields are computed over and over by separate runs.  The store keeps
+//  them in a directory, one file per field, named after a hash of its
+//  key (so any run asking for the same field finds the same file), and
+//  holding the key itself, so that a hash collision is a miss.
+//
+//  LoadWarpMap maps the file into memory rather than reading it:  the
+//  field shares the operating system's page cache with every other run
+//  using it, and only the pages a warp touches are read.  The mapping is
+//  private, so the field can't be changed on disk through uv, and it is
+//  released when the last image sharing it goes.  The field keeps its
+//  origin (see CropWarpField in WarpSpherical.h), and its row extents
+//  come back with it.  A missing, truncated or foreign file is a miss,
+//  and so is a file of an older layout (the digit of the magic number is
+//  bumped whenever the layout changes).  A mapped field is accounted as
+//  mappedField rather than uvField memory (see Profile.h):  its pages
+//  belong to the page cache, not to the heap.
+//
+//  SaveWarpMap writes a field under a temporary name and then renames
+//  it, so that other runs never see half a file.  Loading a field
+//  updates its file's modification time, and once the files of the
+//  store add up to more than maxBytes, the least recently used ones are
+//  removed.  Both are safe to call from several threads (and processes);
+//  neither throws:  a store that can't be written only costs the time to
+//  compute the field again.
+//
+// SEE ALSO
+//  WarpStore.cpp       implementation
+//  Stitch.h            the in-memory cache of warp fields in front of it
+//
+///////////////////////////////////////////////////////////////////////////
+
+void SetWarpStore(const char *dirname, long long maxBytes);
+
+bool LoadWarpMap(const char *key, CFloatImage &uv, CRowExtents &extents);
+
+void SaveWarpMap(const char *key, CFloatImage uv, const CRowExtents &extents);